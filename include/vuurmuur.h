@@ -156,6 +156,37 @@
 
 #define VRMR_DEFAULT_RULE_NFLOG TRUE
 #define VRMR_DEFAULT_NFGRP 8
+/* the log rules are spread over NFGRP and the groups following it */
+#define VRMR_DEFAULT_NFLOG_GROUPS (unsigned int)1
+#define VRMR_MAX_NFLOG_GROUPS (unsigned int)16
+/* batch up to 16 log messages in the kernel, for at most 0.1 second */
+#define VRMR_DEFAULT_NFLOG_THRESHOLD (unsigned int)16
+#define VRMR_DEFAULT_NFLOG_TIMEOUT (unsigned int)10 /* in 1/100th second */
+#define VRMR_DEFAULT_NFLOG_BUFSIZE (unsigned int)65536
+#define VRMR_MAX_NFLOG_BUFSIZE (unsigned int)131072 /* kernel maximum */
+/* enough for IPv4 with options or IPv6 plus a TCP header */
+#define VRMR_DEFAULT_NFLOG_SNAPLEN (unsigned int)128
+#define VRMR_MIN_NFLOG_SNAPLEN (unsigned int)64
+#define VRMR_MAX_NFLOG_SNAPLEN (unsigned int)65535
+/* vuurmuur_log writes its logs at least this often (milliseconds) */
+#define VRMR_DEFAULT_LOG_FLUSH_INTERVAL (unsigned int)250
+#define VRMR_MAX_LOG_FLUSH_INTERVAL (unsigned int)10000
+/* vuurmuur_log keeps a searchable archive of the traffic log */
+#define VRMR_DEFAULT_LOG_ARCHIVE TRUE
+/* days the archive is kept, 0 for forever */
+#define VRMR_DEFAULT_LOG_ARCHIVE_DAYS (unsigned int)14
+#define VRMR_MAX_LOG_ARCHIVE_DAYS (unsigned int)3650
+/* seconds vuurmuur_log folds repeated log lines into one, 0 disables */
+#define VRMR_DEFAULT_LOG_AGGREGATE_WINDOW (unsigned int)0
+#define VRMR_MAX_LOG_AGGREGATE_WINDOW (unsigned int)3600
+/* conntrack events vuurmuur_log asks the kernel for */
+#define VRMR_DEFAULT_CONNLOG_EVENTS "new,destroy"
+#define VRMR_DEFAULT_CONNLOG_PROTO ""
+#define VRMR_DEFAULT_CONNLOG_IGNORE "127.0.0.0/8,::1"
+#define VRMR_DEFAULT_CONNLOG_MARK ""
+#define VRMR_DEFAULT_CONNLOG_CTEVENTS FALSE
+/* vuurmuur and vuurmuur_log export metrics on a UNIX socket */
+#define VRMR_DEFAULT_METRICS FALSE
 
 #define VRMR_DEFAULT_LOG_POLICY TRUE /* default we log the default policy */
 #define VRMR_DEFAULT_LOG_POLICY_LIMIT                                          \
@@ -291,13 +322,43 @@ struct vrmr_list {
     void (*remove)(void *data);
 };
 
+/*
+    open addressing hash table (htable.c)
+*/
+struct vrmr_htable_slot {
+    uint32_t hash; /* mixed hash of the data */
+    void *data;    /* NULL if the slot is empty */
+};
+
+struct vrmr_htable {
+    /* number of slots, always a power of 2 */
+    uint32_t size;
+    /* number of used slots */
+    uint32_t used;
+    /* longest distance of an entry from its home slot */
+    uint32_t max_probe;
+    /* number of times the table was grown */
+    uint32_t grows;
+
+    struct vrmr_htable_slot *slots;
+};
+
+struct vrmr_htable_stats {
+    uint32_t size;
+    uint32_t used;
+    uint32_t load_permille;
+    uint32_t max_probe;
+    uint32_t avg_probe_x100; /* average probe length * 100 */
+    uint32_t grows;
+};
+
 /*
     hash function
 */
 struct vrmr_hash_table {
-    /*  the number of rows in the hash table
+    /*  the number of rows the table was set up with
 
-        This is fixed on setup of the table.
+        This is only a sizing hint, the table grows when needed.
     */
     unsigned int rows;
 
@@ -309,8 +370,116 @@ struct vrmr_hash_table {
     /* the number of cells in the table */
     unsigned int cells;
 
-    /* the table itself. its an array of vrmr_lists */
-    struct vrmr_list *table;
+    /* the table itself */
+    struct vrmr_htable ht;
+};
+
+/*
+    service classifier (servclass.c)
+*/
+struct vrmr_sc_ports;
+struct vrmr_sc_icmp;
+
+struct vrmr_service_classifier {
+    /* tcp and udp: destination port segments */
+    struct vrmr_sc_ports *tcp;
+    struct vrmr_sc_ports *udp;
+
+    /* icmp: sorted by type and code */
+    struct vrmr_sc_icmp *icmp;
+    uint32_t icmp_cnt;
+
+    /* other protocols: first service for the protocol number */
+    struct vrmr_service *proto[256];
+
+    /* statistics */
+    uint32_t services;
+    uint32_t portranges;
+
+    /* changes every time it is built, see namecache.c */
+    uint32_t generation;
+};
+
+/*
+    longest prefix match trie (iptrie.c)
+*/
+#define VRMR_IPTRIE_KEY_LEN 16
+
+struct vrmr_iptrie_node {
+    /* the prefix in network byte order, bits beyond plen are zero */
+    uint8_t key[VRMR_IPTRIE_KEY_LEN];
+    uint8_t plen;
+    /* node index of the children, 0 if there is none */
+    uint32_t child[2];
+    /* NULL for nodes that only branch */
+    void *data;
+};
+
+struct vrmr_iptrie {
+    /* key length in bits: 32 or 128 */
+    uint8_t bits;
+    /* number of prefixes with data */
+    uint32_t prefixes;
+
+    /* node 0 is the root */
+    struct vrmr_iptrie_node *nodes;
+    uint32_t used;
+    uint32_t size;
+};
+
+/* maps addresses to hosts, firewall entries and networks */
+struct vrmr_zone_index {
+    struct vrmr_iptrie ipv4;
+    struct vrmr_iptrie ipv6;
+
+    /* changes every time it is built, see namecache.c */
+    uint32_t generation;
+};
+
+/*
+    name resolution cache (namecache.c)
+*/
+#define VRMR_NAME_CACHE_SIZE 4096
+
+struct vrmr_name_cache_key {
+    uint8_t src[16];
+    uint8_t dst[16];
+    uint16_t sport;
+    uint16_t dport;
+    uint8_t protocol;
+    uint8_t family;
+};
+
+struct vrmr_name_cache_entry {
+    struct vrmr_name_cache_key key;
+    uint32_t hash;
+    uint8_t used;
+    uint8_t referenced; /* CLOCK bit */
+
+    /* zone index lookups, NULL if not found */
+    struct vrmr_zone *from;
+    struct vrmr_zone *to;
+
+    /* classifier lookups for (sport, dport) and (dport, sport) */
+    struct vrmr_service *service;
+    struct vrmr_service *rservice;
+};
+
+struct vrmr_name_cache {
+    struct vrmr_name_cache_entry *entries;
+    uint32_t size;
+    uint32_t hand; /* CLOCK hand */
+    struct vrmr_htable index;
+
+    /* generations of the zone index and classifier the entries are from */
+    uint32_t zone_generation;
+    uint32_t service_generation;
+
+    /* statistics */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t flushes;
 };
 
 /*
@@ -382,6 +551,10 @@ struct vrmr_shm_table {
 
     int reload_result;
     int reload_progress; /* in per cent */
+
+    /* shm id of the live event ring, -1 if there is none. Only set by
+     * vuurmuur_log. */
+    int event_ring_shm_id;
 };
 
 /*  RR is Reload Result
@@ -504,11 +677,54 @@ struct vrmr_config {
     char check_ipv6;
 
     char tc_location[128];
+    char ipset_location[128];
 
     char nfgrp;
+    /* number of NFLOG groups, starting at nfgrp, the log rules are spread
+       over. vuurmuur_log reads each of them from its own socket. */
+    unsigned int nflog_groups;
+
+    /* NFLOG batching: number of packets the kernel queues before it sends
+       them up, how long (1/100th sec) it may hold them and the size of the
+       netlink messages it builds (bytes). */
+    unsigned int nflog_threshold;
+    unsigned int nflog_timeout;
+    unsigned int nflog_bufsize;
+    /* number of bytes of each logged packet copied to vuurmuur_log */
+    unsigned int nflog_snaplen;
+
+    /* max time in ms vuurmuur_log buffers log lines, 0 to write them
+       right away */
+    unsigned int log_flush_interval;
 
     char log_blocklist;
 
+    /* traffic archive in <logdir>/archive, see lib/archive.c */
+    char log_archive;
+    unsigned int log_archive_days;
+
+    /* seconds repeated lines are suppressed and summarized, 0 for off */
+    unsigned int log_aggregate_window;
+
+    /* kernel side filter of the connection logs, see
+       vrmr_conntrack_filter_parse() */
+    char connlog_events[32];
+    char connlog_proto[64];
+    char connlog_ignore[128];
+    char connlog_mark[32];
+    /* limit the events of new connections in the raw table */
+    char connlog_ctevents;
+    /* the --ctevents option for the CT rules, empty if not limited. Set
+       with the filter above, so the ruleset doesn't parse it again */
+    char connlog_ctevents_opts[32];
+
+    /* metrics socket of the daemons, see lib/metrics.c */
+    char metrics;
+
+    /* directory with threat feeds: files with an address or prefix per
+       line that are merged into the blocklist */
+    char blocklist_feeds[128];
+
     /* logfile locations */
     char vuurmuur_logdir_location[64];
 
@@ -617,11 +833,49 @@ struct vrmr_rules {
     struct vrmr_list helpers;
 };
 
+/* kernel ipsets the blocklist is loaded into. Addresses go into the hash:ip
+   sets, entries with a prefix into the hash:net sets. */
+#define VRMR_BLOCKLIST_SET_IP4 "vrmr-block-ip4"
+#define VRMR_BLOCKLIST_SET_NET4 "vrmr-block-net4"
+#define VRMR_BLOCKLIST_SET_IP6 "vrmr-block-ip6"
+#define VRMR_BLOCKLIST_SET_NET6 "vrmr-block-net6"
+#define VRMR_BLOCKLIST_SET_MAXELEM 1048576
+
+/* what vrmr_blocklist_import did, for reporting */
+struct vrmr_blocklist_import_stats {
+    /* feed files and lines read */
+    unsigned int feeds;
+    unsigned int lines;
+    /* lines that are not an address or prefix, or are a /0 prefix */
+    unsigned int invalid;
+    /* addresses and prefixes from the feeds */
+    unsigned int entries;
+    /* entries that were already in, or covered by another entry */
+    unsigned int duplicates;
+    /* prefixes left after merging */
+    unsigned int result;
+};
+
 struct vrmr_blocklist {
     /* the list with blocked ips/hosts/groups */
     struct vrmr_list list;
 
     char old_blocklistfile_used;
+
+    /* the list nodes by the hash of their string, for lookups and
+       removals. Only set up by vrmr_blocklist_init_list. */
+    struct vrmr_htable index;
+
+    /* set when the list is loaded into the ipsets. Entries added or
+       removed with vrmr_blocklist_add_one/rem_one are then pushed to the
+       sets right away, using the ipset command from 'ipset_cnf'. */
+    char ipset;
+    struct vrmr_config *ipset_cnf;
+
+    /* between vrmr_blocklist_ipset_begin and _commit the changes to the
+       sets are collected in this file, and loaded with one ipset call. */
+    FILE *ipset_batch;
+    char ipset_batch_path[32];
 };
 
 struct vrmr_ipv4_data {
@@ -637,6 +891,13 @@ struct vrmr_ipv6_data {
     int cidr6; /* CIDR: -1 unitialized, 0-128 are valid masks */
 };
 
+/* binary address in network byte order, used as lookup key */
+union vrmr_ipaddr {
+    struct in_addr ipv4;
+    struct in6_addr ipv6;
+    uint8_t bytes[16];
+};
+
 /* rule options */
 struct vrmr_rule_options {
     char rule_log; /* 0 = don't log rule, 1 = log this rule */
@@ -864,8 +1125,6 @@ struct vrmr_service {
 
     char helper[32];
 
-    int vrmr_hash_port;
-
     struct vrmr_list PortrangeList;
 
     char broadcast; /* 1: broadcasting service, 0: not */
@@ -1053,6 +1312,9 @@ struct vrmr_conntrack_entry {
     uint64_t to_dst_bytes;
 
     char helper[30];
+
+    /* name of a service that is not in the services list */
+    char unknown_service[VRMR_MAX_SERVICE];
 };
 
 struct vrmr_conntrack_stats {
@@ -1081,6 +1343,75 @@ struct vrmr_conntrack_stats {
     int accounting;
 };
 
+/* a connection as decoded from a ctnetlink message by
+ * vrmr_conntrack_parse(). Addresses are in network byte order, ports in
+ * host byte order. */
+struct vrmr_conntrack_info {
+    uint8_t family;
+    uint8_t protocol;
+    uint8_t tcp_state;
+    uint8_t tcp_flags_orig;
+    uint8_t tcp_flags_repl;
+    uint8_t icmp_type;
+    uint8_t icmp_code;
+
+    /* original and reply direction */
+    union vrmr_ipaddr orig_src;
+    union vrmr_ipaddr orig_dst;
+    union vrmr_ipaddr repl_src;
+    union vrmr_ipaddr repl_dst;
+    uint16_t orig_sport;
+    uint16_t orig_dport;
+    uint16_t repl_sport;
+    uint16_t repl_dport;
+
+    uint32_t id;
+    uint32_t status; /* IPS_* */
+    uint32_t mark;
+    uint32_t timeout; /* seconds left */
+
+    uint64_t orig_packets;
+    uint64_t orig_bytes;
+    uint64_t repl_packets;
+    uint64_t repl_bytes;
+
+    /* ns, 0 without nf_conntrack_timestamp */
+    uint64_t ts_start;
+    uint64_t ts_stop;
+
+    char helper[16];
+};
+
+/* conntrack events of vrmr_conntrack_filter */
+#define VRMR_CT_EVENT_NEW 0x01
+#define VRMR_CT_EVENT_DESTROY 0x02
+
+/* the kernel filter is limited to 127 IPv4 and 20 IPv6 addresses */
+#define VRMR_CT_FILTER_MAX_PROTO 16
+#define VRMR_CT_FILTER_MAX_ADDR 16
+
+/* which conntrack events vuurmuur_log receives */
+struct vrmr_conntrack_filter {
+    unsigned int events; /* VRMR_CT_EVENT_* */
+
+    /* L4 protocols, all if proto_cnt is 0 */
+    uint8_t proto[VRMR_CT_FILTER_MAX_PROTO];
+    unsigned int proto_cnt;
+
+    /* connections from or to these networks are ignored */
+    struct {
+        int family;
+        union vrmr_ipaddr addr;
+        unsigned int prefix;
+    } ignore[VRMR_CT_FILTER_MAX_ADDR];
+    unsigned int ignore_cnt;
+
+    /* only connections with (mark & mark_mask) == mark */
+    int have_mark;
+    uint32_t mark;
+    uint32_t mark_mask;
+};
+
 struct vrmr_conntrack_request {
     struct vrmr_filter filter;
     char use_filter;
@@ -1419,6 +1750,7 @@ struct vrmr_log_conn_record {
 };
 
 struct vrmr_log_record {
+    time_t timestamp;
     char month[4];
     int day;
 
@@ -1440,6 +1772,11 @@ struct vrmr_log_record {
     char dst_ip[46];
     int ipv6;
 
+    /* binary versions of src_ip and dst_ip, only set if have_addr is 1 */
+    union vrmr_ipaddr src_addr;
+    union vrmr_ipaddr dst_addr;
+    int have_addr;
+
     int protocol;
     int src_port;
     int dst_port;
@@ -1448,6 +1785,10 @@ struct vrmr_log_record {
 
     char src_mac[20]; /* 17 for mac addr, 2 for brackets, 1 for \0 */
     char dst_mac[20];
+    /* binary versions of src_mac and dst_mac, only set if have_hwaddr is 1 */
+    uint8_t src_hwaddr[6];
+    uint8_t dst_hwaddr[6];
+    int have_hwaddr;
 
     unsigned int packet_len; /* length of the logged packet */
 
@@ -1477,6 +1818,115 @@ struct vrmr_log_record {
 };
 #define conn_rec lu.conn_r
 
+/* live event ring: vuurmuur_log publishes every record it logs into a shared
+ * memory ring, so vuurmuur_conf can show them without reading the logfiles.
+ * See lib/eventring.c. */
+#define VRMR_EVENT_RING_ENTRIES 4096 /* must be a power of 2 */
+
+enum vrmr_event_type {
+    VRMR_EVENT_TRAFFIC = 1,
+    VRMR_EVENT_CONN_NEW,
+    VRMR_EVENT_CONN_COMPLETED,
+};
+
+/* tcp_flags bits, in the order of the tcp header */
+#define VRMR_EVENT_TCP_FIN 0x01
+#define VRMR_EVENT_TCP_SYN 0x02
+#define VRMR_EVENT_TCP_RST 0x04
+#define VRMR_EVENT_TCP_PSH 0x08
+#define VRMR_EVENT_TCP_ACK 0x10
+#define VRMR_EVENT_TCP_URG 0x20
+
+struct vrmr_event {
+    int64_t timestamp;
+
+    uint8_t type; /* enum vrmr_event_type */
+    uint8_t ipv6;
+    uint8_t protocol;
+    uint8_t tcp_flags;
+    uint8_t icmp_type;
+    uint8_t icmp_code;
+    uint8_t ttl;
+    uint8_t have_hwaddr;
+
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint32_t packet_len;
+
+    union vrmr_ipaddr src_addr;
+    union vrmr_ipaddr dst_addr;
+    uint8_t src_hwaddr[6];
+    uint8_t dst_hwaddr[6];
+
+    /* connection events */
+    uint32_t age_s;
+    uint32_t mark;
+    uint64_t toserver_bytes;
+    uint64_t toclient_bytes;
+
+    char action[16];
+    char prefix[32];
+    char interface_in[16];
+    char interface_out[16];
+    char helper[32];
+
+    char from_name[VRMR_VRMR_MAX_HOST_NET_ZONE];
+    char to_name[VRMR_VRMR_MAX_HOST_NET_ZONE];
+    char ser_name[VRMR_MAX_SERVICE];
+};
+
+/* the layout of the ring is private to lib/eventring.c */
+struct vrmr_event_ring;
+
+struct vrmr_event_reader {
+    const struct vrmr_event_ring *ring;
+    uint64_t next; /* sequence number of the next event to read */
+    uint64_t lost; /* events overwritten before we could read them */
+};
+
+/* the archive writer is private to lib/archive.c */
+struct vrmr_archive;
+
+/* what to look for in the archive. Unset fields match everything. */
+struct vrmr_archive_filter {
+    time_t since; /* 0: from the start */
+    time_t until; /* 0: to the end */
+    char zone[VRMR_VRMR_MAX_HOST_NET_ZONE];
+    char service[VRMR_MAX_SERVICE];
+    char action[16];
+    int have_ip;
+    int ipv6;
+    union vrmr_ipaddr ip; /* source or destination */
+};
+
+/* histogram in the Prometheus style, see lib/metrics.c */
+#define VRMR_HISTOGRAM_MAX_BOUNDS 16
+
+struct vrmr_histogram {
+    const double *bounds; /* upper bounds, ascending */
+    unsigned int nbounds;
+    /* not cumulative, the last one is the +Inf bucket */
+    uint64_t buckets[VRMR_HISTOGRAM_MAX_BOUNDS + 1];
+    uint64_t count;
+    double sum;
+};
+
+/* the text of one metrics scrape */
+struct vrmr_metrics {
+    char *buf;
+    size_t len;
+    size_t size;
+    int failed; /* out of memory */
+};
+
+typedef void (*vrmr_metrics_fill_func)(struct vrmr_metrics *m, void *data);
+
+struct vrmr_metrics_server {
+    int fd; /* -1 if we're not listening */
+    char path[108];
+    uint64_t scrapes;
+};
+
 /*
     libvuurmuur.c
 */
@@ -1500,6 +1950,25 @@ int range_strcpy(char *dest, const char *src, const size_t start,
 size_t strlcat(char *dst, const char *src, size_t size);
 size_t strlcpy(char *dst, const char *src, size_t size);
 
+/*
+    htable.c
+*/
+uint32_t vrmr_hash_mix32(uint32_t h);
+uint32_t vrmr_hash_bytes(const void *data, size_t len);
+int vrmr_htable_init(struct vrmr_htable *ht, uint32_t hint);
+void vrmr_htable_cleanup(
+        struct vrmr_htable *ht, void (*free_func)(void *data));
+int vrmr_htable_insert(struct vrmr_htable *ht, uint32_t hash, const void *data);
+void *vrmr_htable_search(const struct vrmr_htable *ht, uint32_t hash,
+        int (*compare_func)(const void *table_data, const void *search_data),
+        const void *search_data);
+void *vrmr_htable_remove(struct vrmr_htable *ht, uint32_t hash,
+        int (*compare_func)(const void *table_data, const void *search_data),
+        const void *search_data);
+void *vrmr_htable_next(const struct vrmr_htable *ht, uint32_t *iter);
+void vrmr_htable_get_stats(
+        const struct vrmr_htable *ht, struct vrmr_htable_stats *stats);
+
 /*
     hash table
 */
@@ -1511,27 +1980,53 @@ int vrmr_hash_cleanup(struct vrmr_hash_table *hash_table);
 int vrmr_hash_insert(struct vrmr_hash_table *hash_table, const void *data);
 int vrmr_hash_remove(struct vrmr_hash_table *hash_table, void *data);
 void *vrmr_hash_search(const struct vrmr_hash_table *hash_table, void *data);
+void vrmr_hash_get_stats(const struct vrmr_hash_table *hash_table,
+        struct vrmr_htable_stats *stats);
 
-int vrmr_compare_ports(const void *string1, const void *string2);
-int vrmr_compare_ipaddress(const void *string1, const void *string2);
 int vrmr_compare_string(const void *string1, const void *string2);
-unsigned int vrmr_hash_port(const void *key);
-unsigned int vrmr_hash_ipaddress(const void *key);
 unsigned int vrmr_hash_string(const void *key);
 
 void vrmr_print_table_service(const struct vrmr_hash_table *hash_table);
-int vrmr_init_zonedata_hashtable(unsigned int n_rows, struct vrmr_list *,
-        unsigned int (*hash)(const void *key),
-        int (*match)(const void *string1, const void *string2),
-        struct vrmr_hash_table *hash_table);
-int vrmr_init_services_hashtable(unsigned int n_rows, struct vrmr_list *,
-        unsigned int (*hash)(const void *key),
-        int (*match)(const void *string1, const void *string2),
-        struct vrmr_hash_table *hash_table);
-void *vrmr_search_service_in_hash(const int src, const int dst,
-        const int protocol, const struct vrmr_hash_table *serhash);
-void *vrmr_search_zone_in_hash_with_ipv4(
-        const char *ipaddress, const struct vrmr_hash_table *zonehash);
+
+/*
+    servclass.c
+*/
+int vrmr_service_classifier_build(
+        struct vrmr_service_classifier *sc, struct vrmr_list *services_list);
+void vrmr_service_classifier_cleanup(struct vrmr_service_classifier *sc);
+struct vrmr_service *vrmr_service_classify(
+        const struct vrmr_service_classifier *sc, int protocol, int src,
+        int dst);
+
+/*
+    iptrie.c
+*/
+int vrmr_iptrie_init(struct vrmr_iptrie *t, uint8_t bits);
+void vrmr_iptrie_cleanup(struct vrmr_iptrie *t);
+int vrmr_iptrie_insert(struct vrmr_iptrie *t, const void *key, uint8_t plen,
+        const void *data);
+void *vrmr_iptrie_lookup(
+        const struct vrmr_iptrie *t, const void *addr, uint8_t *plen);
+int vrmr_zone_index_build(
+        struct vrmr_zone_index *zi, struct vrmr_list *zonelist);
+void vrmr_zone_index_cleanup(struct vrmr_zone_index *zi);
+struct vrmr_zone *vrmr_zone_index_lookup(
+        const struct vrmr_zone_index *zi, int family, const void *addr);
+struct vrmr_zone *vrmr_zone_index_lookup_ipstr(
+        const struct vrmr_zone_index *zi, const char *ipaddress);
+
+/*
+    namecache.c
+*/
+uint32_t vrmr_name_cache_next_generation(void);
+int vrmr_name_cache_init(struct vrmr_name_cache *c, uint32_t size);
+void vrmr_name_cache_cleanup(struct vrmr_name_cache *c);
+int vrmr_name_cache_flush(struct vrmr_name_cache *c);
+const struct vrmr_name_cache_entry *vrmr_name_cache_lookup(
+        struct vrmr_name_cache *c, const struct vrmr_zone_index *zi,
+        const struct vrmr_service_classifier *sc, int family, int protocol,
+        const union vrmr_ipaddr *src, const union vrmr_ipaddr *dst, int sport,
+        int dport);
 
 /*
     query.c
@@ -1643,6 +2138,12 @@ int vrmr_set_proc_entry(struct vrmr_config *, const char *proc_entry,
 /*
     rules.c
 */
+unsigned int vrmr_rules_nflog_group(
+        const struct vrmr_config *cfg, const char *key);
+void vrmr_rules_nflog_options(const struct vrmr_config *cfg, const char *key,
+        char *opts, size_t size);
+void vrmr_rules_ctevents_options(const struct vrmr_config *cfg,
+        const struct vrmr_conntrack_filter *f, char *opts, size_t size);
 int vrmr_rules_analyze_rule(struct vrmr_rule *, struct vrmr_rule_cache *,
         struct vrmr_services *, struct vrmr_zones *, struct vrmr_interfaces *,
         struct vrmr_config *);
@@ -1687,6 +2188,14 @@ int vrmr_blocklist_init_list(struct vrmr_ctx *, struct vrmr_config *cfg,
         struct vrmr_zones *, struct vrmr_blocklist *, char, char);
 int vrmr_blocklist_save_list(
         struct vrmr_ctx *, struct vrmr_config *cfg, struct vrmr_blocklist *);
+int vrmr_blocklist_addr_family(const char *, char *);
+int vrmr_blocklist_contains(const struct vrmr_blocklist *, const char *);
+int vrmr_blocklist_import(struct vrmr_config *, struct vrmr_blocklist *,
+        struct vrmr_blocklist_import_stats *);
+void vrmr_blocklist_cleanup(struct vrmr_blocklist *);
+int vrmr_blocklist_ipset_load(struct vrmr_config *, struct vrmr_blocklist *);
+int vrmr_blocklist_ipset_begin(struct vrmr_blocklist *);
+int vrmr_blocklist_ipset_commit(struct vrmr_blocklist *, char);
 
 /*
     log.c
@@ -1711,10 +2220,62 @@ int vrmr_logstdoutprint_error(int errorlevel, const char *head, char *fmt, ...);
 int vrmr_log_record_build_line(
         struct vrmr_log_record *log_record, char *outline, size_t size);
 int vrmr_log_record_get_names(struct vrmr_log_record *log_record,
-        struct vrmr_hash_table *zone_hash,
-        struct vrmr_hash_table *service_hash);
+        struct vrmr_zone_index *zone_idx,
+        struct vrmr_service_classifier *service_sc,
+        struct vrmr_name_cache *cache);
+void vrmr_log_record_reset(struct vrmr_log_record *log_record);
 void vrmr_log_record_parse_prefix(
         struct vrmr_log_record *log_record, const char *prefix);
+void vrmr_log_bytes2str(const uint64_t bytes, char *str, size_t size);
+
+/*
+    eventring.c
+*/
+int vrmr_event_ring_create(int *shm_id, struct vrmr_event_ring **ring);
+void vrmr_event_ring_publish(
+        struct vrmr_event_ring *ring, const struct vrmr_event *ev);
+void vrmr_event_ring_close(struct vrmr_event_ring *ring);
+int vrmr_event_ring_destroy(int shm_id, struct vrmr_event_ring *ring);
+int vrmr_event_ring_attach(int shm_id, struct vrmr_event_reader *reader);
+int vrmr_event_ring_read(
+        struct vrmr_event_reader *reader, struct vrmr_event *ev);
+void vrmr_event_ring_detach(struct vrmr_event_reader *reader);
+void vrmr_event_from_log_record(const struct vrmr_log_record *lr,
+        enum vrmr_event_type type, struct vrmr_event *ev);
+void vrmr_event_details(const struct vrmr_event *ev, char *str, size_t size);
+
+/*
+    archive.c
+*/
+int vrmr_archive_open(
+        struct vrmr_archive **archive, const char *dir, unsigned int keep_days);
+int vrmr_archive_append(struct vrmr_archive *a, const struct vrmr_event *ev);
+void vrmr_archive_close(struct vrmr_archive *a);
+long vrmr_archive_query(const char *dir, const struct vrmr_archive_filter *f,
+        int (*cb)(const struct vrmr_event *ev, void *data), void *data);
+int vrmr_archive_filter_parse(const char *str, struct vrmr_archive_filter *f);
+
+/*
+    metrics.c
+*/
+double vrmr_metrics_now(void);
+void vrmr_histogram_init(
+        struct vrmr_histogram *h, const double *bounds, unsigned int nbounds);
+void vrmr_histogram_observe(struct vrmr_histogram *h, double value);
+void vrmr_metrics_help(struct vrmr_metrics *m, const char *name,
+        const char *type, const char *help);
+void vrmr_metrics_u64(struct vrmr_metrics *m, const char *name,
+        const char *labels, uint64_t value);
+void vrmr_metrics_double(struct vrmr_metrics *m, const char *name,
+        const char *labels, double value);
+void vrmr_metrics_histogram(struct vrmr_metrics *m, const char *name,
+        const char *labels, const struct vrmr_histogram *h);
+int vrmr_metrics_listen(struct vrmr_metrics_server *s, const char *path);
+void vrmr_metrics_close(struct vrmr_metrics_server *s);
+void vrmr_metrics_serve(struct vrmr_metrics_server *s,
+        vrmr_metrics_fill_func fill, void *data);
+void vrmr_metrics_wait(struct vrmr_metrics_server *s, unsigned int timeout_ms,
+        vrmr_metrics_fill_func fill, void *data);
 
 /*
     io.c
@@ -1750,6 +2311,7 @@ int vrmr_check_iptablesrestore_command(struct vrmr_config *, char *, char);
 int vrmr_check_ip6tables_command(struct vrmr_config *, char *, char);
 int vrmr_check_ip6tablesrestore_command(struct vrmr_config *, char *, char);
 int vrmr_check_tc_command(struct vrmr_config *, char *, char);
+int vrmr_check_ipset_command(struct vrmr_config *, char *, char);
 int vrmr_init_config(struct vrmr_config *cnf);
 int vrmr_reload_config(struct vrmr_config *);
 int vrmr_ask_configfile(const struct vrmr_config *, char *question,
@@ -1760,8 +2322,8 @@ int vrmr_init(struct vrmr_ctx *, const char *toolname);
 void vrmr_deinit(struct vrmr_ctx *);
 void vrmr_enable_logprint(struct vrmr_config *cnf);
 int vrmr_load(struct vrmr_ctx *vctx);
-int vrmr_create_log_hash(
-        struct vrmr_ctx *, struct vrmr_hash_table *, struct vrmr_hash_table *);
+int vrmr_create_log_hash(struct vrmr_ctx *, struct vrmr_service_classifier *,
+        struct vrmr_zone_index *);
 
 /*
     backendapi.c
@@ -1822,20 +2384,32 @@ unsigned int vrmr_conn_hash_name(const void *key);
 int vrmr_conn_match_name(const void *ser1, const void *ser2);
 void vrmr_conn_list_print(const struct vrmr_list *conn_list);
 int vrmr_conn_get_connections(struct vrmr_config *, unsigned int,
-        struct vrmr_hash_table *, struct vrmr_hash_table *, struct vrmr_list *,
-        struct vrmr_list *, struct vrmr_conntrack_request *,
-        struct vrmr_conntrack_stats *);
+        struct vrmr_service_classifier *, struct vrmr_zone_index *,
+        struct vrmr_name_cache *, struct vrmr_list *,
+        struct vrmr_conntrack_request *, struct vrmr_conntrack_stats *);
 void vrmr_conn_list_cleanup(struct vrmr_list *conn_dlist);
 void vrmr_connreq_setup(struct vrmr_conntrack_request *connreq);
 void vrmr_connreq_cleanup(struct vrmr_conntrack_request *connreq);
-int vrmr_conntrack_ct2lr(
-        uint32_t type, struct nf_conntrack *ct, struct vrmr_log_record *lr);
+int vrmr_conntrack_ct2lr(unsigned int event,
+        const struct vrmr_conntrack_info *ct, struct vrmr_log_record *lr);
+int vrmr_conntrack_filter_parse(
+        const struct vrmr_config *cnf, struct vrmr_conntrack_filter *f);
+int vrmr_conntrack_filter_match(const struct vrmr_conntrack_filter *f,
+        const struct vrmr_log_record *lr);
 int vrmr_conn_kill_connection_api(const int family, const char *src_ip,
         const char *dst_ip, uint16_t sp, uint16_t dp, uint8_t protocol);
 bool vrmr_conn_check_api(void);
 int vrmr_conn_count_connections_api(
         uint32_t *tcp, uint32_t *udp, uint32_t *other);
 
+/*
+    ctnetlink.c
+*/
+int vrmr_conntrack_parse(
+        const struct nlmsghdr *nlh, struct vrmr_conntrack_info *ct);
+int vrmr_conntrack_dump(
+        int (*cb)(const struct vrmr_conntrack_info *, void *), void *data);
+
 /*
     linked list
 */
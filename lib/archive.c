@@ -0,0 +1,1294 @@
+/***************************************************************************
+ *   Copyright (C) 2003-2019 by Victor Julien                              *
+ *   victor@vuurmuur.org                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*  Columnar archive of the traffic log.
+
+    vuurmuur_log writes every traffic record to an hourly segment file in
+    the archive directory, next to the plain text traffic.log. Searching
+    the archive is a lot faster than grepping the text logs, because most
+    of the data can be skipped without looking at it.
+
+    A segment is a file header followed by blocks of up to
+    ARCHIVE_BLOCK_ROWS records. Each block stores its records per column:
+
+    - names (zones, service, action, prefix, interfaces) as ids into a
+      dictionary. The dictionary is per segment, every block carries the
+      entries that were added since the previous block.
+    - addresses in binary form.
+    - timestamps as zigzag encoded deltas to the previous record. The
+      first record of a block has the full timestamp.
+    - small numbers as varints.
+
+    Every block header holds the time range and a bloom filter of the
+    addresses and names in the block. When a segment is closed, a footer
+    with the same for the whole segment is added. A segment that was not
+    closed properly (crash, power loss) has no footer, but its blocks are
+    still readable.
+
+    MAC addresses are not archived. The files are in host byte order and
+    not meant to be copied to other architectures.
+*/
+
+#include "config.h"
+#include "vuurmuur.h"
+
+#include <dirent.h>
+
+#define ARCHIVE_MAGIC 0x31415256U         /* "VRA1" */
+#define ARCHIVE_BLOCK_MAGIC 0x4b4c4256U   /* "VBLK" */
+#define ARCHIVE_FOOTER_MAGIC 0x544f4656U  /* "VFOT" */
+#define ARCHIVE_TRAILER_MAGIC 0x444e4556U /* "VEND" */
+#define ARCHIVE_VERSION 1U
+
+#define ARCHIVE_BLOCK_ROWS 4096
+/* max seconds of records a block collects before it is written */
+#define ARCHIVE_BLOCK_AGE 60
+/* records that are older than the hour of the open segment, but by no more
+ * than this, are still added to it. Readers take this into account. */
+#define ARCHIVE_SLACK 300
+
+/* bloom filter sizes in bits, powers of 2 */
+#define ARCHIVE_BLOCK_BLOOM_BITS (16U * 1024U)
+#define ARCHIVE_SEGMENT_BLOOM_BITS (64U * 1024U)
+#define ARCHIVE_BLOOM_HASHES 3
+
+/* bloom key tags */
+#define ARCHIVE_KEY_IP 'I'
+#define ARCHIVE_KEY_ZONE 'Z'
+#define ARCHIVE_KEY_SERVICE 'S'
+#define ARCHIVE_KEY_ACTION 'A'
+
+enum archive_column {
+    COL_TS = 0,
+    COL_ACTION,
+    COL_SERVICE,
+    COL_FROM,
+    COL_TO,
+    COL_PREFIX,
+    COL_IFIN,
+    COL_IFOUT,
+    COL_PROTO,
+    COL_FAMILY,
+    COL_SRC,
+    COL_DST,
+    COL_SPORT,
+    COL_DPORT,
+    COL_LEN,
+    COL_TTL,
+    COL_TCPFLAGS,
+    COL_ICMP,
+
+    ARCHIVE_COLUMNS,
+};
+
+struct archive_file_hdr {
+    uint32_t magic;
+    uint32_t version;
+    int64_t hour; /* start of the hour the segment is for */
+};
+
+struct archive_block_hdr {
+    uint32_t magic;
+    uint32_t rows;
+    uint32_t dict_entries; /* new dictionary entries in this block */
+    uint32_t size;         /* bytes following this header */
+    int64_t min_ts;
+    int64_t max_ts;
+    uint8_t bloom[ARCHIVE_BLOCK_BLOOM_BITS / 8];
+};
+
+struct archive_footer {
+    uint32_t magic;
+    uint32_t blocks;
+    uint64_t rows;
+    int64_t min_ts;
+    int64_t max_ts;
+    uint8_t bloom[ARCHIVE_SEGMENT_BLOOM_BITS / 8];
+};
+
+struct archive_trailer {
+    uint64_t footer_offset;
+    uint32_t magic;
+    uint32_t pad;
+};
+
+struct archive_buf {
+    uint8_t *data;
+    size_t len;
+    size_t size;
+};
+
+struct archive_key {
+    uint32_t h1;
+    uint32_t h2;
+};
+
+struct archive_dict_entry {
+    uint32_t id;
+    uint32_t block_gen; /* block in which 'tags' were added to the bloom */
+    uint8_t tags;
+    char name[];
+};
+
+struct vrmr_archive {
+    char dir[PATH_MAX];
+    unsigned int keep_days;
+
+    FILE *fp;
+    int64_t hour; /* hour of the open segment */
+
+    /* dictionary of the open segment */
+    struct vrmr_htable dict;
+    struct archive_dict_entry **dict_by_id;
+    uint32_t dict_size;
+    uint32_t dict_alloc;
+    uint32_t dict_written;
+
+    /* the block being collected */
+    struct archive_buf cols[ARCHIVE_COLUMNS];
+    struct archive_buf scratch;
+    uint32_t rows;
+    uint32_t block_gen;
+    int64_t min_ts;
+    int64_t max_ts;
+    int64_t prev_ts;
+    int64_t first_ts;
+    uint8_t bloom[ARCHIVE_BLOCK_BLOOM_BITS / 8];
+
+    /* for the footer */
+    struct archive_footer footer;
+
+    /* set after a write error, until the next segment is opened */
+    int failed;
+};
+
+/*
+    encoding helpers
+*/
+
+static int buf_reserve(struct archive_buf *b, size_t extra)
+{
+    if (b->len + extra <= b->size)
+        return (0);
+
+    size_t size = b->size ? b->size : 1024;
+    while (size < b->len + extra)
+        size *= 2;
+
+    uint8_t *data = realloc(b->data, size);
+    if (data == NULL) {
+        vrmr_error(-1, "Error", "realloc failed: %s", strerror(errno));
+        return (-1);
+    }
+    b->data = data;
+    b->size = size;
+    return (0);
+}
+
+static int buf_put(struct archive_buf *b, const void *data, size_t len)
+{
+    if (buf_reserve(b, len) < 0)
+        return (-1);
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return (0);
+}
+
+static int buf_put_u8(struct archive_buf *b, uint8_t v)
+{
+    return (buf_put(b, &v, 1));
+}
+
+static int buf_put_varint(struct archive_buf *b, uint64_t v)
+{
+    uint8_t tmp[10];
+    size_t n = 0;
+
+    do {
+        tmp[n] = (uint8_t)(v & 0x7f);
+        v >>= 7;
+        if (v)
+            tmp[n] |= 0x80;
+        n++;
+    } while (v);
+
+    return (buf_put(b, tmp, n));
+}
+
+static int get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+    uint64_t r = 0;
+
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (*p >= end)
+            return (-1);
+        uint8_t c = *(*p)++;
+        r |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            *v = r;
+            return (0);
+        }
+    }
+    return (-1);
+}
+
+static uint64_t zigzag(int64_t v)
+{
+    return (((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+static int64_t unzigzag(uint64_t v)
+{
+    return ((int64_t)(v >> 1) ^ -(int64_t)(v & 1));
+}
+
+/*
+    bloom filters
+*/
+
+static struct archive_key archive_key(uint8_t tag, const void *data, size_t len)
+{
+    uint8_t buf[1 + VRMR_VRMR_MAX_HOST_NET_ZONE];
+    struct archive_key k;
+
+    if (len > sizeof(buf) - 1)
+        len = sizeof(buf) - 1;
+    buf[0] = tag;
+    memcpy(buf + 1, data, len);
+
+    k.h1 = vrmr_hash_bytes(buf, len + 1);
+    k.h2 = vrmr_hash_mix32(k.h1 ^ 0x9e3779b9U) | 1;
+    return (k);
+}
+
+static void bloom_add(uint8_t *bloom, uint32_t bits, struct archive_key k)
+{
+    for (uint32_t i = 0; i < ARCHIVE_BLOOM_HASHES; i++) {
+        uint32_t bit = (k.h1 + i * k.h2) & (bits - 1);
+        bloom[bit / 8] |= (uint8_t)(1U << (bit % 8));
+    }
+}
+
+static int bloom_test(const uint8_t *bloom, uint32_t bits, struct archive_key k)
+{
+    for (uint32_t i = 0; i < ARCHIVE_BLOOM_HASHES; i++) {
+        uint32_t bit = (k.h1 + i * k.h2) & (bits - 1);
+        if (!(bloom[bit / 8] & (1U << (bit % 8))))
+            return (0);
+    }
+    return (1);
+}
+
+/*
+    segment files
+*/
+
+/* parse "traffic-YYYYMMDD-HH[.N].vra". Returns 0 if 'name' is a segment. */
+static int segment_parse_name(const char *name, int64_t *hour, int *seq)
+{
+    int y, mo, d, h, n = 0;
+    char tail[8] = "";
+
+    if (sscanf(name, "traffic-%4d%2d%2d-%2d%7s", &y, &mo, &d, &h, tail) != 5)
+        return (-1);
+    if (strcmp(tail, ".vra") != 0 && (sscanf(tail, ".%d.vra", &n) != 1 ||
+                                             n <= 0))
+        return (-1);
+
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = y - 1900;
+    tm.tm_mon = mo - 1;
+    tm.tm_mday = d;
+    tm.tm_hour = h;
+    *hour = (int64_t)timegm(&tm);
+    *seq = n;
+    return (0);
+}
+
+struct segment {
+    int64_t hour;
+    int seq;
+    char name[64];
+};
+
+static int segment_compare(const void *a, const void *b)
+{
+    const struct segment *sa = a, *sb = b;
+
+    if (sa->hour != sb->hour)
+        return (sa->hour < sb->hour ? -1 : 1);
+    return (sa->seq - sb->seq);
+}
+
+/* list the segments in 'dir', oldest first. Returns the number of segments
+ * or -1 on error. */
+static int segment_list(const char *dir, struct segment **list)
+{
+    DIR *dp = opendir(dir);
+    if (dp == NULL) {
+        vrmr_error(-1, "Error", "opening '%s' failed: %s", dir,
+                strerror(errno));
+        return (-1);
+    }
+
+    struct segment *segs = NULL;
+    int n = 0, alloc = 0;
+    struct dirent *de;
+    while ((de = readdir(dp)) != NULL) {
+        struct segment s;
+        if (segment_parse_name(de->d_name, &s.hour, &s.seq) < 0)
+            continue;
+        if (strlcpy(s.name, de->d_name, sizeof(s.name)) >= sizeof(s.name))
+            continue;
+
+        if (n == alloc) {
+            alloc = alloc ? alloc * 2 : 64;
+            struct segment *p = realloc(segs, (size_t)alloc * sizeof(*p));
+            if (p == NULL) {
+                vrmr_error(-1, "Error", "realloc failed: %s", strerror(errno));
+                free(segs);
+                closedir(dp);
+                return (-1);
+            }
+            segs = p;
+        }
+        segs[n++] = s;
+    }
+    closedir(dp);
+
+    if (n > 0)
+        qsort(segs, (size_t)n, sizeof(*segs), segment_compare);
+    *list = segs;
+    return (n);
+}
+
+/* remove segments that are more than keep_days old */
+static void segment_prune(const char *dir, unsigned int keep_days, time_t now)
+{
+    struct segment *segs = NULL;
+    int n = segment_list(dir, &segs);
+
+    for (int i = 0; i < n; i++) {
+        if (segs[i].hour + 3600 >= (int64_t)now - (int64_t)keep_days * 86400)
+            break;
+
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/%s", dir, segs[i].name) >=
+                (int)sizeof(path))
+            continue;
+        if (unlink(path) == 0)
+            vrmr_debug(LOW, "removed archive segment %s", path);
+    }
+    free(segs);
+}
+
+/*
+    writer
+*/
+
+static int dict_compare(const void *table_data, const void *search_data)
+{
+    const struct archive_dict_entry *e = table_data;
+    return (strcmp(e->name, search_data) == 0);
+}
+
+static void archive_dict_clear(struct vrmr_archive *a)
+{
+    vrmr_htable_cleanup(&a->dict, NULL);
+    for (uint32_t i = 0; i < a->dict_size; i++)
+        free(a->dict_by_id[i]);
+    a->dict_size = 0;
+    a->dict_written = 0;
+}
+
+/* returns the dictionary entry for 'name', adding it if needed */
+static struct archive_dict_entry *archive_dict_get(
+        struct vrmr_archive *a, const char *name)
+{
+    uint32_t hash = vrmr_hash_bytes(name, strlen(name));
+
+    struct archive_dict_entry *e =
+            vrmr_htable_search(&a->dict, hash, dict_compare, name);
+    if (e != NULL)
+        return (e);
+
+    if (a->dict_size == a->dict_alloc) {
+        uint32_t alloc = a->dict_alloc ? a->dict_alloc * 2 : 256;
+        struct archive_dict_entry **p =
+                realloc(a->dict_by_id, alloc * sizeof(*p));
+        if (p == NULL) {
+            vrmr_error(-1, "Error", "realloc failed: %s", strerror(errno));
+            return (NULL);
+        }
+        a->dict_by_id = p;
+        a->dict_alloc = alloc;
+    }
+
+    size_t len = strlen(name);
+    e = malloc(sizeof(*e) + len + 1);
+    if (e == NULL) {
+        vrmr_error(-1, "Error", "malloc failed: %s", strerror(errno));
+        return (NULL);
+    }
+    e->id = a->dict_size;
+    e->block_gen = 0;
+    e->tags = 0;
+    memcpy(e->name, name, len + 1);
+
+    if (vrmr_htable_insert(&a->dict, hash, e) < 0) {
+        free(e);
+        return (NULL);
+    }
+    a->dict_by_id[a->dict_size++] = e;
+    return (e);
+}
+
+static void archive_bloom_add(struct vrmr_archive *a, struct archive_key k)
+{
+    bloom_add(a->bloom, ARCHIVE_BLOCK_BLOOM_BITS, k);
+    bloom_add(a->footer.bloom, ARCHIVE_SEGMENT_BLOOM_BITS, k);
+}
+
+/* add a name to the bloom filters, once per block. Zone names are added
+ * with all their parents: "host.network.zone", "network.zone", "zone". */
+static void archive_bloom_add_name(
+        struct vrmr_archive *a, struct archive_dict_entry *e, uint8_t tag)
+{
+    uint8_t bit = tag == ARCHIVE_KEY_ZONE
+                          ? 1
+                          : (tag == ARCHIVE_KEY_SERVICE ? 2 : 4);
+
+    if (e->block_gen != a->block_gen) {
+        e->block_gen = a->block_gen;
+        e->tags = 0;
+    }
+    if (e->tags & bit)
+        return;
+    e->tags |= bit;
+
+    const char *s = e->name;
+    while (s != NULL) {
+        archive_bloom_add(a, archive_key(tag, s, strlen(s)));
+        if (tag != ARCHIVE_KEY_ZONE)
+            break;
+        s = strchr(s, '.');
+        if (s != NULL)
+            s++;
+    }
+}
+
+static int archive_put_name(struct vrmr_archive *a, enum archive_column col,
+        const char *name, uint8_t tag)
+{
+    struct archive_dict_entry *e = archive_dict_get(a, name);
+    if (e == NULL)
+        return (-1);
+    if (tag != 0)
+        archive_bloom_add_name(a, e, tag);
+    return (buf_put_varint(&a->cols[col], e->id));
+}
+
+static int archive_write(struct vrmr_archive *a, const void *data, size_t len)
+{
+    if (fwrite(data, 1, len, a->fp) != len) {
+        vrmr_error(-1, "Error", "writing to the traffic archive failed: %s",
+                strerror(errno));
+        a->failed = 1;
+        return (-1);
+    }
+    return (0);
+}
+
+/* write the collected block to the segment */
+static int archive_flush_block(struct vrmr_archive *a)
+{
+    if (a->rows == 0 || a->fp == NULL)
+        return (0);
+
+    /* the dictionary entries added since the last block */
+    a->scratch.len = 0;
+    for (uint32_t i = a->dict_written; i < a->dict_size; i++) {
+        const char *name = a->dict_by_id[i]->name;
+        size_t len = strlen(name);
+        if (buf_put_varint(&a->scratch, len) < 0 ||
+                buf_put(&a->scratch, name, len) < 0)
+            return (-1);
+    }
+
+    struct archive_block_hdr hdr;
+    hdr.magic = ARCHIVE_BLOCK_MAGIC;
+    hdr.rows = a->rows;
+    hdr.dict_entries = a->dict_size - a->dict_written;
+    hdr.min_ts = a->min_ts;
+    hdr.max_ts = a->max_ts;
+    memcpy(hdr.bloom, a->bloom, sizeof(hdr.bloom));
+
+    size_t size = a->scratch.len;
+    for (int c = 0; c < ARCHIVE_COLUMNS; c++)
+        size += sizeof(uint32_t) + a->cols[c].len;
+    hdr.size = (uint32_t)size;
+
+    if (!a->failed) {
+        if (archive_write(a, &hdr, sizeof(hdr)) < 0 ||
+                archive_write(a, a->scratch.data, a->scratch.len) < 0)
+            goto reset;
+        for (int c = 0; c < ARCHIVE_COLUMNS; c++) {
+            uint32_t len = (uint32_t)a->cols[c].len;
+            if (archive_write(a, &len, sizeof(len)) < 0 ||
+                    archive_write(a, a->cols[c].data, len) < 0)
+                goto reset;
+        }
+        if (fflush(a->fp) != 0) {
+            vrmr_error(-1, "Error", "writing to the traffic archive failed: %s",
+                    strerror(errno));
+            a->failed = 1;
+        }
+    }
+
+    if (a->footer.blocks == 0 || a->min_ts < a->footer.min_ts)
+        a->footer.min_ts = a->min_ts;
+    if (a->footer.blocks == 0 || a->max_ts > a->footer.max_ts)
+        a->footer.max_ts = a->max_ts;
+    a->footer.blocks++;
+    a->footer.rows += a->rows;
+
+reset:
+    a->dict_written = a->dict_size;
+    for (int c = 0; c < ARCHIVE_COLUMNS; c++)
+        a->cols[c].len = 0;
+    a->rows = 0;
+    a->block_gen++;
+    memset(a->bloom, 0, sizeof(a->bloom));
+    return (a->failed ? -1 : 0);
+}
+
+/* finish the open segment with the footer and close it */
+static void archive_close_segment(struct vrmr_archive *a)
+{
+    if (a->fp == NULL)
+        return;
+
+    (void)archive_flush_block(a);
+
+    if (!a->failed) {
+        long offset = ftell(a->fp);
+        if (offset >= 0) {
+            struct archive_trailer trailer;
+            memset(&trailer, 0, sizeof(trailer));
+            trailer.footer_offset = (uint64_t)offset;
+            trailer.magic = ARCHIVE_TRAILER_MAGIC;
+
+            a->footer.magic = ARCHIVE_FOOTER_MAGIC;
+            if (archive_write(a, &a->footer, sizeof(a->footer)) == 0)
+                (void)archive_write(a, &trailer, sizeof(trailer));
+        }
+    }
+
+    if (fclose(a->fp) != 0)
+        vrmr_error(-1, "Error", "closing the traffic archive failed: %s",
+                strerror(errno));
+    a->fp = NULL;
+}
+
+/* open a new segment for 'hour'. If vuurmuur_log was restarted in this
+ * hour the segment exists already, then a numbered one is created. */
+static int archive_open_segment(struct vrmr_archive *a, int64_t hour)
+{
+    struct tm tm;
+    time_t t = (time_t)hour;
+    if (gmtime_r(&t, &tm) == NULL)
+        return (-1);
+
+    if (a->keep_days > 0)
+        segment_prune(a->dir, a->keep_days, time(NULL));
+
+    archive_dict_clear(a);
+    if (vrmr_htable_init(&a->dict, 1024) < 0)
+        return (-1);
+    memset(&a->footer, 0, sizeof(a->footer));
+    a->failed = 0;
+    a->hour = hour;
+
+    for (int seq = 0; seq < 100; seq++) {
+        char path[PATH_MAX];
+        char suffix[8] = "";
+        if (seq > 0)
+            snprintf(suffix, sizeof(suffix), ".%d", seq);
+        if (snprintf(path, sizeof(path), "%s/traffic-%04d%02d%02d-%02d%s.vra",
+                    a->dir, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                    tm.tm_hour, suffix) >= (int)sizeof(path)) {
+            vrmr_error(-1, "Error", "archive path too long");
+            break;
+        }
+
+        int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+        if (fd == -1) {
+            if (errno == EEXIST)
+                continue;
+            vrmr_error(-1, "Error", "creating '%s' failed: %s", path,
+                    strerror(errno));
+            break;
+        }
+
+        a->fp = fdopen(fd, "w");
+        if (a->fp == NULL) {
+            vrmr_error(-1, "Error", "fdopen failed: %s", strerror(errno));
+            close(fd);
+            break;
+        }
+
+        struct archive_file_hdr hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = ARCHIVE_MAGIC;
+        hdr.version = ARCHIVE_VERSION;
+        hdr.hour = hour;
+        if (archive_write(a, &hdr, sizeof(hdr)) < 0)
+            return (-1);
+
+        vrmr_debug(LOW, "opened archive segment %s", path);
+        return (0);
+    }
+
+    /* don't retry for every record of this hour */
+    a->failed = 1;
+    return (-1);
+}
+
+/*  vrmr_archive_open
+
+    Setup a writer for the archive in 'dir'. Segments older than
+    'keep_days' days are removed when a new one is started, 0 keeps them
+    forever. The first segment is opened by the first record.
+
+    Returncodes:
+         0: ok
+        -1: error
+*/
+int vrmr_archive_open(
+        struct vrmr_archive **archive, const char *dir, unsigned int keep_days)
+{
+    assert(archive && dir);
+
+    struct vrmr_archive *a = calloc(1, sizeof(*a));
+    if (a == NULL) {
+        vrmr_error(-1, "Error", "calloc failed: %s", strerror(errno));
+        return (-1);
+    }
+
+    if (strlcpy(a->dir, dir, sizeof(a->dir)) >= sizeof(a->dir)) {
+        vrmr_error(-1, "Error", "archive directory name too long");
+        free(a);
+        return (-1);
+    }
+    a->keep_days = keep_days;
+    a->hour = -1;
+
+    *archive = a;
+    return (0);
+}
+
+/*  vrmr_archive_append
+
+    Adds a traffic event to the archive. Other events are ignored.
+
+    Returncodes:
+         0: ok
+        -1: error
+*/
+int vrmr_archive_append(struct vrmr_archive *a, const struct vrmr_event *ev)
+{
+    assert(a && ev);
+
+    if (ev->type != VRMR_EVENT_TRAFFIC)
+        return (0);
+
+    int64_t ts = ev->timestamp;
+    if (a->fp == NULL || ts >= a->hour + 3600 || ts < a->hour - ARCHIVE_SLACK) {
+        int64_t hour = ts - (((ts % 3600) + 3600) % 3600);
+        if (a->fp == NULL && a->failed && hour == a->hour)
+            return (-1);
+
+        archive_close_segment(a);
+        if (archive_open_segment(a, hour) < 0)
+            return (-1);
+    }
+    if (a->failed)
+        return (-1);
+
+    if (a->rows == 0) {
+        a->min_ts = a->max_ts = a->first_ts = ts;
+        a->prev_ts = 0;
+    } else {
+        if (ts < a->min_ts)
+            a->min_ts = ts;
+        if (ts > a->max_ts)
+            a->max_ts = ts;
+    }
+
+    size_t alen = ev->ipv6 ? 16 : 4;
+    if (buf_put_varint(&a->cols[COL_TS], zigzag(ts - a->prev_ts)) < 0 ||
+            archive_put_name(a, COL_ACTION, ev->action, ARCHIVE_KEY_ACTION) <
+                    0 ||
+            archive_put_name(a, COL_SERVICE, ev->ser_name,
+                    ARCHIVE_KEY_SERVICE) < 0 ||
+            archive_put_name(a, COL_FROM, ev->from_name, ARCHIVE_KEY_ZONE) <
+                    0 ||
+            archive_put_name(a, COL_TO, ev->to_name, ARCHIVE_KEY_ZONE) < 0 ||
+            archive_put_name(a, COL_PREFIX, ev->prefix, 0) < 0 ||
+            archive_put_name(a, COL_IFIN, ev->interface_in, 0) < 0 ||
+            archive_put_name(a, COL_IFOUT, ev->interface_out, 0) < 0 ||
+            buf_put_u8(&a->cols[COL_PROTO], ev->protocol) < 0 ||
+            buf_put_u8(&a->cols[COL_FAMILY], ev->ipv6) < 0 ||
+            buf_put(&a->cols[COL_SRC], &ev->src_addr, alen) < 0 ||
+            buf_put(&a->cols[COL_DST], &ev->dst_addr, alen) < 0 ||
+            buf_put_varint(&a->cols[COL_SPORT], ev->src_port) < 0 ||
+            buf_put_varint(&a->cols[COL_DPORT], ev->dst_port) < 0 ||
+            buf_put_varint(&a->cols[COL_LEN], ev->packet_len) < 0 ||
+            buf_put_u8(&a->cols[COL_TTL], ev->ttl) < 0 ||
+            buf_put_u8(&a->cols[COL_TCPFLAGS], ev->tcp_flags) < 0 ||
+            buf_put_u8(&a->cols[COL_ICMP], ev->icmp_type) < 0 ||
+            buf_put_u8(&a->cols[COL_ICMP], ev->icmp_code) < 0) {
+        /* the columns are out of step now, drop the block */
+        for (int c = 0; c < ARCHIVE_COLUMNS; c++)
+            a->cols[c].len = 0;
+        a->rows = 0;
+        return (-1);
+    }
+    archive_bloom_add(a, archive_key(ARCHIVE_KEY_IP, &ev->src_addr, alen));
+    archive_bloom_add(a, archive_key(ARCHIVE_KEY_IP, &ev->dst_addr, alen));
+
+    a->prev_ts = ts;
+    a->rows++;
+
+    if (a->rows == ARCHIVE_BLOCK_ROWS || ts - a->first_ts >= ARCHIVE_BLOCK_AGE)
+        return (archive_flush_block(a));
+    return (0);
+}
+
+/*  vrmr_archive_close
+
+    Finishes the open segment and frees the writer.
+*/
+void vrmr_archive_close(struct vrmr_archive *a)
+{
+    if (a == NULL)
+        return;
+
+    archive_close_segment(a);
+    archive_dict_clear(a);
+    free(a->dict_by_id);
+    for (int c = 0; c < ARCHIVE_COLUMNS; c++)
+        free(a->cols[c].data);
+    free(a->scratch.data);
+    free(a);
+}
+
+/*
+    reader
+*/
+
+/* what a dictionary entry matches in the filter */
+#define DICT_MATCH_ZONE 0x01
+#define DICT_MATCH_SERVICE 0x02
+#define DICT_MATCH_ACTION 0x04
+
+struct archive_reader {
+    const struct vrmr_archive_filter *f;
+    struct archive_key ip_key, zone_key, service_key, action_key;
+
+    char **names;
+    uint8_t *match;
+    uint32_t dict_size;
+    uint32_t dict_alloc;
+
+    struct archive_buf block;
+
+    int (*cb)(const struct vrmr_event *ev, void *data);
+    void *data;
+    long matches;
+    int stop;
+};
+
+static void reader_dict_clear(struct archive_reader *r)
+{
+    for (uint32_t i = 0; i < r->dict_size; i++)
+        free(r->names[i]);
+    r->dict_size = 0;
+}
+
+static int zone_matches(const char *name, const char *zone)
+{
+    size_t nlen = strlen(name), zlen = strlen(zone);
+
+    if (nlen == zlen)
+        return (strcmp(name, zone) == 0);
+    return (nlen > zlen && name[nlen - zlen - 1] == '.' &&
+            strcmp(name + nlen - zlen, zone) == 0);
+}
+
+static int reader_dict_add(
+        struct archive_reader *r, const char *name, size_t len)
+{
+    if (r->dict_size == r->dict_alloc) {
+        uint32_t alloc = r->dict_alloc ? r->dict_alloc * 2 : 256;
+        char **names = realloc(r->names, alloc * sizeof(*names));
+        if (names == NULL) {
+            vrmr_error(-1, "Error", "realloc failed: %s", strerror(errno));
+            return (-1);
+        }
+        r->names = names;
+        uint8_t *match = realloc(r->match, alloc);
+        if (match == NULL) {
+            vrmr_error(-1, "Error", "realloc failed: %s", strerror(errno));
+            return (-1);
+        }
+        r->match = match;
+        r->dict_alloc = alloc;
+    }
+
+    char *s = malloc(len + 1);
+    if (s == NULL) {
+        vrmr_error(-1, "Error", "malloc failed: %s", strerror(errno));
+        return (-1);
+    }
+    memcpy(s, name, len);
+    s[len] = '\0';
+
+    const struct vrmr_archive_filter *f = r->f;
+    uint8_t m = 0;
+    if (f->zone[0] != '\0' && zone_matches(s, f->zone))
+        m |= DICT_MATCH_ZONE;
+    if (f->service[0] != '\0' && strcmp(s, f->service) == 0)
+        m |= DICT_MATCH_SERVICE;
+    if (f->action[0] != '\0' && strcmp(s, f->action) == 0)
+        m |= DICT_MATCH_ACTION;
+
+    r->names[r->dict_size] = s;
+    r->match[r->dict_size] = m;
+    r->dict_size++;
+    return (0);
+}
+
+/* can a block or segment with this time range and bloom filter contain a
+ * match? */
+static int reader_may_match(const struct archive_reader *r, int64_t min_ts,
+        int64_t max_ts, const uint8_t *bloom, uint32_t bits)
+{
+    const struct vrmr_archive_filter *f = r->f;
+
+    if (f->since != 0 && max_ts < (int64_t)f->since)
+        return (0);
+    if (f->until != 0 && min_ts > (int64_t)f->until)
+        return (0);
+    if (f->have_ip && !bloom_test(bloom, bits, r->ip_key))
+        return (0);
+    if (f->zone[0] != '\0' && !bloom_test(bloom, bits, r->zone_key))
+        return (0);
+    if (f->service[0] != '\0' && !bloom_test(bloom, bits, r->service_key))
+        return (0);
+    if (f->action[0] != '\0' && !bloom_test(bloom, bits, r->action_key))
+        return (0);
+    return (1);
+}
+
+/* a cursor per column */
+struct column {
+    const uint8_t *p;
+    const uint8_t *end;
+};
+
+static int col_name(struct archive_reader *r, struct column *c, uint32_t *id)
+{
+    uint64_t v;
+    if (get_varint(&c->p, c->end, &v) < 0 || v >= r->dict_size)
+        return (-1);
+    *id = (uint32_t)v;
+    return (0);
+}
+
+static int col_u8(struct column *c, uint8_t *v)
+{
+    if (c->p >= c->end)
+        return (-1);
+    *v = *c->p++;
+    return (0);
+}
+
+static int col_bytes(struct column *c, void *v, size_t len)
+{
+    if ((size_t)(c->end - c->p) < len)
+        return (-1);
+    memcpy(v, c->p, len);
+    c->p += len;
+    return (0);
+}
+
+/* decode the rows of a block and hand the matches to the callback */
+static int reader_scan_block(struct archive_reader *r,
+        const struct archive_block_hdr *hdr, const uint8_t *p,
+        const uint8_t *end)
+{
+    const struct vrmr_archive_filter *f = r->f;
+    struct column cols[ARCHIVE_COLUMNS];
+
+    for (int c = 0; c < ARCHIVE_COLUMNS; c++) {
+        uint32_t len;
+        if ((size_t)(end - p) < sizeof(len))
+            return (-1);
+        memcpy(&len, p, sizeof(len));
+        p += sizeof(len);
+        if ((size_t)(end - p) < len)
+            return (-1);
+        cols[c].p = p;
+        cols[c].end = p + len;
+        p += len;
+    }
+
+    int64_t ts = 0;
+    for (uint32_t row = 0; row < hdr->rows && !r->stop; row++) {
+        uint64_t delta, sport, dport, len;
+        uint32_t action, service, from, to, prefix, ifin, ifout;
+        uint8_t proto, family, ttl, tcpflags, icmp_type, icmp_code;
+        union vrmr_ipaddr src, dst;
+
+        if (get_varint(&cols[COL_TS].p, cols[COL_TS].end, &delta) < 0 ||
+                col_name(r, &cols[COL_ACTION], &action) < 0 ||
+                col_name(r, &cols[COL_SERVICE], &service) < 0 ||
+                col_name(r, &cols[COL_FROM], &from) < 0 ||
+                col_name(r, &cols[COL_TO], &to) < 0 ||
+                col_name(r, &cols[COL_PREFIX], &prefix) < 0 ||
+                col_name(r, &cols[COL_IFIN], &ifin) < 0 ||
+                col_name(r, &cols[COL_IFOUT], &ifout) < 0 ||
+                col_u8(&cols[COL_PROTO], &proto) < 0 ||
+                col_u8(&cols[COL_FAMILY], &family) < 0)
+            return (-1);
+
+        size_t alen = family ? 16 : 4;
+        memset(&src, 0, sizeof(src));
+        memset(&dst, 0, sizeof(dst));
+        if (col_bytes(&cols[COL_SRC], &src, alen) < 0 ||
+                col_bytes(&cols[COL_DST], &dst, alen) < 0 ||
+                get_varint(&cols[COL_SPORT].p, cols[COL_SPORT].end, &sport) <
+                        0 ||
+                get_varint(&cols[COL_DPORT].p, cols[COL_DPORT].end, &dport) <
+                        0 ||
+                get_varint(&cols[COL_LEN].p, cols[COL_LEN].end, &len) < 0 ||
+                col_u8(&cols[COL_TTL], &ttl) < 0 ||
+                col_u8(&cols[COL_TCPFLAGS], &tcpflags) < 0 ||
+                col_u8(&cols[COL_ICMP], &icmp_type) < 0 ||
+                col_u8(&cols[COL_ICMP], &icmp_code) < 0)
+            return (-1);
+
+        ts += unzigzag(delta);
+
+        if (f->since != 0 && ts < (int64_t)f->since)
+            continue;
+        if (f->until != 0 && ts > (int64_t)f->until)
+            continue;
+        if (f->action[0] != '\0' && !(r->match[action] & DICT_MATCH_ACTION))
+            continue;
+        if (f->service[0] != '\0' &&
+                !(r->match[service] & DICT_MATCH_SERVICE))
+            continue;
+        if (f->zone[0] != '\0' && !(r->match[from] & DICT_MATCH_ZONE) &&
+                !(r->match[to] & DICT_MATCH_ZONE))
+            continue;
+        if (f->have_ip &&
+                (family != f->ipv6 || (memcmp(&src, &f->ip, alen) != 0 &&
+                                              memcmp(&dst, &f->ip, alen) != 0)))
+            continue;
+
+        struct vrmr_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.timestamp = ts;
+        ev.type = VRMR_EVENT_TRAFFIC;
+        ev.ipv6 = family;
+        ev.protocol = proto;
+        ev.tcp_flags = tcpflags;
+        ev.icmp_type = icmp_type;
+        ev.icmp_code = icmp_code;
+        ev.ttl = ttl;
+        ev.src_port = (uint16_t)sport;
+        ev.dst_port = (uint16_t)dport;
+        ev.packet_len = (uint32_t)len;
+        ev.src_addr = src;
+        ev.dst_addr = dst;
+        strlcpy(ev.action, r->names[action], sizeof(ev.action));
+        strlcpy(ev.ser_name, r->names[service], sizeof(ev.ser_name));
+        strlcpy(ev.from_name, r->names[from], sizeof(ev.from_name));
+        strlcpy(ev.to_name, r->names[to], sizeof(ev.to_name));
+        strlcpy(ev.prefix, r->names[prefix], sizeof(ev.prefix));
+        strlcpy(ev.interface_in, r->names[ifin], sizeof(ev.interface_in));
+        strlcpy(ev.interface_out, r->names[ifout], sizeof(ev.interface_out));
+
+        r->matches++;
+        if (r->cb(&ev, r->data) < 0)
+            r->stop = 1;
+    }
+    return (0);
+}
+
+/* go through one segment file */
+static void reader_scan_segment(struct archive_reader *r, const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        vrmr_error(-1, "Error", "opening '%s' failed: %s", path,
+                strerror(errno));
+        return;
+    }
+
+    /* the block sizes are checked against this, so a damaged header can't
+     * make us allocate more than the file holds */
+    struct stat st;
+    if (fstat(fileno(fp), &st) < 0) {
+        vrmr_error(-1, "Error", "fstat '%s' failed: %s", path,
+                strerror(errno));
+        fclose(fp);
+        return;
+    }
+
+    struct archive_file_hdr fhdr;
+    if (fread(&fhdr, sizeof(fhdr), 1, fp) != 1 ||
+            fhdr.magic != ARCHIVE_MAGIC || fhdr.version != ARCHIVE_VERSION) {
+        vrmr_warning("Warning", "'%s' is not a traffic archive segment", path);
+        fclose(fp);
+        return;
+    }
+
+    /* a closed segment has a footer: maybe we can skip it as a whole */
+    struct archive_trailer trailer;
+    if (fseeko(fp, -(off_t)sizeof(trailer), SEEK_END) == 0 &&
+            fread(&trailer, sizeof(trailer), 1, fp) == 1 &&
+            trailer.magic == ARCHIVE_TRAILER_MAGIC) {
+        struct archive_footer *footer = malloc(sizeof(*footer));
+        if (footer != NULL &&
+                fseeko(fp, (off_t)trailer.footer_offset, SEEK_SET) == 0 &&
+                fread(footer, sizeof(*footer), 1, fp) == 1 &&
+                footer->magic == ARCHIVE_FOOTER_MAGIC &&
+                !reader_may_match(r, footer->min_ts, footer->max_ts,
+                        footer->bloom, ARCHIVE_SEGMENT_BLOOM_BITS)) {
+            free(footer);
+            fclose(fp);
+            return;
+        }
+        free(footer);
+    }
+
+    if (fseeko(fp, (off_t)sizeof(fhdr), SEEK_SET) != 0) {
+        fclose(fp);
+        return;
+    }
+
+    reader_dict_clear(r);
+
+    struct archive_block_hdr hdr;
+    while (!r->stop && fread(&hdr, sizeof(hdr), 1, fp) == 1 &&
+            hdr.magic == ARCHIVE_BLOCK_MAGIC) {
+        off_t offset = ftello(fp);
+        /* a block that was being written, or a damaged size: the file
+         * doesn't hold it */
+        if (offset < 0 || (off_t)hdr.size > st.st_size - offset)
+            break;
+
+        r->block.len = 0;
+        if (buf_reserve(&r->block, hdr.size) < 0)
+            break;
+        /* a short read is a block that was being written */
+        if (fread(r->block.data, 1, hdr.size, fp) != hdr.size)
+            break;
+
+        /* the dictionary entries are needed by the blocks that follow, so
+         * they are read even if this block is skipped */
+        const uint8_t *p = r->block.data;
+        const uint8_t *end = p + hdr.size;
+        uint32_t i;
+        for (i = 0; i < hdr.dict_entries; i++) {
+            uint64_t len;
+            if (get_varint(&p, end, &len) < 0 || (uint64_t)(end - p) < len ||
+                    reader_dict_add(r, (const char *)p, (size_t)len) < 0)
+                break;
+            p += len;
+        }
+        if (i != hdr.dict_entries)
+            break;
+
+        if (!reader_may_match(r, hdr.min_ts, hdr.max_ts, hdr.bloom,
+                    ARCHIVE_BLOCK_BLOOM_BITS))
+            continue;
+
+        if (reader_scan_block(r, &hdr, p, end) < 0) {
+            vrmr_warning("Warning", "'%s' is damaged, skipping the rest",
+                    path);
+            break;
+        }
+    }
+    fclose(fp);
+}
+
+/*  vrmr_archive_query
+
+    Calls 'cb' for every record in the archive in 'dir' that matches
+    'filter', oldest first. If 'cb' returns a negative value the query
+    stops.
+
+    Returns the number of matches, or -1 on error.
+*/
+long vrmr_archive_query(const char *dir, const struct vrmr_archive_filter *f,
+        int (*cb)(const struct vrmr_event *ev, void *data), void *data)
+{
+    assert(dir && f && cb);
+
+    struct segment *segs = NULL;
+    int n = segment_list(dir, &segs);
+    if (n < 0)
+        return (-1);
+
+    struct archive_reader r;
+    memset(&r, 0, sizeof(r));
+    r.f = f;
+    r.cb = cb;
+    r.data = data;
+    if (f->have_ip)
+        r.ip_key = archive_key(
+                ARCHIVE_KEY_IP, &f->ip, f->ipv6 ? (size_t)16 : (size_t)4);
+    r.zone_key = archive_key(ARCHIVE_KEY_ZONE, f->zone, strlen(f->zone));
+    r.service_key =
+            archive_key(ARCHIVE_KEY_SERVICE, f->service, strlen(f->service));
+    r.action_key =
+            archive_key(ARCHIVE_KEY_ACTION, f->action, strlen(f->action));
+
+    for (int i = 0; i < n && !r.stop; i++) {
+        /* all records in a segment are from its hour, or a little before */
+        if (f->since != 0 && segs[i].hour + 3600 <= (int64_t)f->since)
+            continue;
+        if (f->until != 0 && segs[i].hour - ARCHIVE_SLACK > (int64_t)f->until)
+            continue;
+
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/%s", dir, segs[i].name) >=
+                (int)sizeof(path))
+            continue;
+        reader_scan_segment(&r, path);
+    }
+
+    reader_dict_clear(&r);
+    free(r.names);
+    free(r.match);
+    free(r.block.data);
+    free(segs);
+    return (r.matches);
+}
+
+/* parse a time for the filter: "YYYY-MM-DD[THH[:MM[:SS]]]" in local time,
+ * or "<n>d", "<n>h" or "<n>m" for that long ago. */
+static int archive_parse_time(const char *str, time_t *t)
+{
+    char unit = 0;
+    unsigned int n = 0;
+    int consumed = 0;
+
+    if (sscanf(str, "%u%c%n", &n, &unit, &consumed) == 2 &&
+            str[consumed] == '\0' && (unit == 'd' || unit == 'h' ||
+                                             unit == 'm')) {
+        time_t ago = (time_t)n * (unit == 'd' ? 86400 : (unit == 'h' ? 3600
+                                                                     : 60));
+        *t = time(NULL) - ago;
+        return (0);
+    }
+
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    int r = sscanf(str, "%4d-%2d-%2dT%2d:%2d:%2d", &tm.tm_year, &tm.tm_mon,
+            &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+    if (r < 3)
+        return (-1);
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    tm.tm_isdst = -1;
+
+    *t = mktime(&tm);
+    return (*t == (time_t)-1 ? -1 : 0);
+}
+
+/*  vrmr_archive_filter_parse
+
+    Parse a query like "ip:192.168.1.1 zone:lan.internal since:2d" into
+    'f'. Terms are 'key:value' separated by spaces, keys are since, until,
+    zone, service, ip and action. A zone matches a host or network in it
+    as well.
+
+    Returncodes:
+         0: ok
+        -1: invalid query
+*/
+int vrmr_archive_filter_parse(const char *str, struct vrmr_archive_filter *f)
+{
+    assert(str && f);
+
+    memset(f, 0, sizeof(*f));
+
+    char copy[512];
+    if (strlcpy(copy, str, sizeof(copy)) >= sizeof(copy))
+        return (-1);
+
+    char *save = NULL;
+    for (char *term = strtok_r(copy, " \t", &save); term != NULL;
+            term = strtok_r(NULL, " \t", &save)) {
+        char *value = strchr(term, ':');
+        if (value == NULL || value[1] == '\0')
+            return (-1);
+        *value++ = '\0';
+
+        if (strcmp(term, "since") == 0) {
+            if (archive_parse_time(value, &f->since) < 0)
+                return (-1);
+        } else if (strcmp(term, "until") == 0) {
+            if (archive_parse_time(value, &f->until) < 0)
+                return (-1);
+        } else if (strcmp(term, "zone") == 0) {
+            if (strlcpy(f->zone, value, sizeof(f->zone)) >= sizeof(f->zone))
+                return (-1);
+        } else if (strcmp(term, "service") == 0) {
+            if (strlcpy(f->service, value, sizeof(f->service)) >=
+                    sizeof(f->service))
+                return (-1);
+        } else if (strcmp(term, "action") == 0) {
+            if (strlcpy(f->action, value, sizeof(f->action)) >=
+                    sizeof(f->action))
+                return (-1);
+            for (char *c = f->action; *c; c++)
+                *c = (char)toupper((unsigned char)*c);
+        } else if (strcmp(term, "ip") == 0) {
+            if (inet_pton(AF_INET, value, &f->ip) == 1) {
+                f->ipv6 = 0;
+            } else if (inet_pton(AF_INET6, value, &f->ip) == 1) {
+                f->ipv6 = 1;
+            } else {
+                return (-1);
+            }
+            f->have_ip = 1;
+        } else {
+            return (-1);
+        }
+    }
+    return (0);
+}
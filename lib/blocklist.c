@@ -20,6 +20,216 @@
 #include "config.h"
 #include "vuurmuur.h"
 
+/* an address or prefix in binary form, used to merge the blocklist */
+struct blocklist_prefix {
+    /* network byte order, bits beyond plen are zero. IPv4 uses the first
+       4 bytes. */
+    uint8_t key[16];
+    uint8_t ipv;
+    uint8_t plen;
+};
+
+/*  blocklist_parse_prefix
+
+    Parses an IPv4 or IPv6 address, optionally followed by '/prefix', into
+    'p'. 'net' is set if there was a prefix.
+
+    Returncodes:
+         0: ok
+        -1: not an address
+        -2: a /0 prefix, which the hash:net sets can't hold
+*/
+static int blocklist_parse_prefix(
+        const char *entry, struct blocklist_prefix *p, char *net)
+{
+    char addr[VRMR_MAX_IPV6_ADDR_LEN] = "";
+    int max = 0;
+
+    const char *slash = strchr(entry, '/');
+    size_t len = slash ? (size_t)(slash - entry) : strlen(entry);
+    if (len == 0 || len >= sizeof(addr))
+        return (-1);
+    memcpy(addr, entry, len);
+    addr[len] = '\0';
+
+    memset(p->key, 0, sizeof(p->key));
+    if (inet_pton(AF_INET, addr, p->key) == 1) {
+        p->ipv = VRMR_IPV4;
+        max = 32;
+    } else if (inet_pton(AF_INET6, addr, p->key) == 1) {
+        p->ipv = VRMR_IPV6;
+        max = 128;
+    } else {
+        return (-1);
+    }
+    p->plen = (uint8_t)max;
+
+    if (slash != NULL) {
+        char *end = NULL;
+
+        if (!isdigit((unsigned char)slash[1]))
+            return (-1);
+        long prefix = strtol(slash + 1, &end, 10);
+        if (*end != '\0' || prefix > max)
+            return (-1);
+        if (prefix == 0)
+            return (-2);
+        p->plen = (uint8_t)prefix;
+
+        /* clear the host bits, so 10.1.2.3/8 is 10.0.0.0/8 */
+        for (int bit = p->plen; bit < max; bit++)
+            p->key[bit >> 3] &= (uint8_t) ~(0x80 >> (bit & 7));
+    }
+
+    *net = (slash != NULL);
+    return (0);
+}
+
+/*  vrmr_blocklist_addr_family
+
+    Checks if 'entry' is an IPv4 or IPv6 address, optionally followed by
+    '/prefix'. If 'net' is not NULL it is set when there is a prefix.
+
+    Returncodes:
+        VRMR_IPV4 or VRMR_IPV6: the family of the address
+         0: not an address
+*/
+int vrmr_blocklist_addr_family(const char *entry, char *net)
+{
+    struct blocklist_prefix p;
+    char is_net = 0;
+
+    assert(entry);
+
+    if (blocklist_parse_prefix(entry, &p, &is_net) < 0)
+        return (0);
+
+    if (net != NULL)
+        *net = is_net;
+    return (p.ipv);
+}
+
+static inline uint32_t blocklist_hash(const char *str)
+{
+    return (vrmr_hash_bytes(str, strlen(str)));
+}
+
+static int blocklist_node_compare(
+        const void *table_data, const void *search_data)
+{
+    const struct vrmr_list_node *node = table_data;
+    return (strcmp(node->data, search_data) == 0);
+}
+
+/*  vrmr_blocklist_contains
+
+    Returns 1 if 'entry' is in the blocklist, 0 if not.
+*/
+int vrmr_blocklist_contains(
+        const struct vrmr_blocklist *blocklist, const char *entry)
+{
+    struct vrmr_list_node *d_node = NULL;
+
+    assert(blocklist && entry);
+
+    if (blocklist->index.slots != NULL)
+        return (vrmr_htable_search(&blocklist->index, blocklist_hash(entry),
+                        blocklist_node_compare, entry) != NULL);
+
+    for (d_node = blocklist->list.top; d_node; d_node = d_node->next) {
+        if (d_node->data != NULL && strcmp(d_node->data, entry) == 0)
+            return (1);
+    }
+    return (0);
+}
+
+/* appends 'str' to the list and the index. 'str' is freed on error. */
+static int blocklist_append(struct vrmr_blocklist *blocklist, char *str)
+{
+    struct vrmr_list_node *d_node = NULL;
+
+    if ((d_node = vrmr_list_append(&blocklist->list, str)) == NULL) {
+        vrmr_error(-1, "Internal Error", "appending into the list failed");
+        free(str);
+        return (-1);
+    }
+
+    if (blocklist->index.slots != NULL &&
+            vrmr_htable_insert(&blocklist->index, blocklist_hash(str),
+                    d_node) < 0) {
+        (void)vrmr_list_remove_node(&blocklist->list, d_node);
+        return (-1);
+    }
+    return (0);
+}
+
+/*  vrmr_blocklist_cleanup
+
+    Frees the list and the index.
+*/
+void vrmr_blocklist_cleanup(struct vrmr_blocklist *blocklist)
+{
+    assert(blocklist);
+
+    vrmr_htable_cleanup(&blocklist->index, NULL);
+    vrmr_list_cleanup(&blocklist->list);
+}
+
+/* name of the set an entry of family 'ipv' goes into */
+static const char *blocklist_set_name(int ipv, char net)
+{
+    if (ipv == VRMR_IPV4)
+        return (net ? VRMR_BLOCKLIST_SET_NET4 : VRMR_BLOCKLIST_SET_IP4);
+    return (net ? VRMR_BLOCKLIST_SET_NET6 : VRMR_BLOCKLIST_SET_IP6);
+}
+
+/*  blocklist_ipset_push
+
+    Adds ('add') or removes ('del') one entry to/from the set it belongs
+    in. '-exist' makes adding an entry that is already in the set and
+    removing one that isn't a no-op. In a batch the change is only written
+    to the batch file, see vrmr_blocklist_ipset_begin.
+
+    Returncodes:
+         0: ok
+        -1: error
+*/
+static int blocklist_ipset_push(
+        struct vrmr_blocklist *blocklist, const char *cmd, const char *entry)
+{
+    char net = 0;
+
+    assert(blocklist && blocklist->ipset_cnf && cmd && entry);
+
+    int ipv = vrmr_blocklist_addr_family(entry, &net);
+    if (ipv == 0)
+        return (0);
+
+    if (blocklist->ipset_batch != NULL) {
+        if (fprintf(blocklist->ipset_batch, "%s %s %s\n", cmd,
+                    blocklist_set_name(ipv, net), entry) < 0) {
+            vrmr_error(-1, "Error", "writing '%s' failed: %s",
+                    blocklist->ipset_batch_path, strerror(errno));
+            return (-1);
+        }
+        return (0);
+    }
+
+    struct vrmr_config *cnf = blocklist->ipset_cnf;
+    const char *args[] = {cnf->ipset_location, "-exist", cmd,
+            blocklist_set_name(ipv, net), entry, NULL};
+    int r = libvuurmuur_exec_command(cnf, cnf->ipset_location, args, NULL);
+    if (r != 0) {
+        vrmr_error(-1, "Error", "ipset %s %s %s failed: %d", cmd,
+                blocklist_set_name(ipv, net), entry, r);
+        return (-1);
+    }
+
+    vrmr_debug(MEDIUM, "ipset %s %s %s", cmd, blocklist_set_name(ipv, net),
+            entry);
+    return (0);
+}
+
 /*  adds an ipaddress to the blocklist
 
     returns:
@@ -33,11 +243,8 @@ static int blocklist_add_ip_to_list(
 
     assert(blocklist && ip);
 
-    /* get the length */
-    size_t len = strlen(ip);
-    if (len <= 0 || len > 15) {
-        vrmr_error(-1, "Internal Error", "weird ipaddress size %u",
-                (unsigned int)len);
+    if (vrmr_blocklist_addr_family(ip, NULL) == 0) {
+        vrmr_error(-1, "Internal Error", "weird ipaddress '%s'", ip);
         return (-1);
     }
 
@@ -47,13 +254,28 @@ static int blocklist_add_ip_to_list(
         return (-1);
     }
 
-    /* append to list */
-    if (vrmr_list_append(&blocklist->list, ipaddress) == NULL) {
-        vrmr_error(-1, "Internal Error", "appending into the list failed");
+    /* update the kernel set first, so the list never has entries that are
+       not in the set */
+    if (blocklist->ipset && blocklist_ipset_push(blocklist, "add", ip) < 0) {
         free(ipaddress);
         return (-1);
     }
 
+    return (blocklist_append(blocklist, ipaddress));
+}
+
+/* adds the IPv4 and, if it has one, the IPv6 address of a host */
+static int blocklist_add_host_to_list(
+        struct vrmr_blocklist *blocklist, struct vrmr_zone *host)
+{
+    assert(blocklist && host);
+
+    if (host->ipv4.ipaddress[0] != '\0' &&
+            blocklist_add_ip_to_list(blocklist, host->ipv4.ipaddress) < 0)
+        return (-1);
+    if (host->ipv6.ip6[0] != '\0' &&
+            blocklist_add_ip_to_list(blocklist, host->ipv6.ip6) < 0)
+        return (-1);
     return (0);
 }
 
@@ -69,13 +291,7 @@ static int blocklist_add_string_to_list(
         return (-1);
     }
 
-    if (vrmr_list_append(&blocklist->list, string) == NULL) {
-        vrmr_error(-1, "Internal Error", "appending into the list failed");
-        free(string);
-        return (-1);
-    }
-
-    return (0);
+    return (blocklist_append(blocklist, string));
 }
 
 /*  the no_refcnt flag is for disabling the 'added more than once' warning,
@@ -91,8 +307,7 @@ int vrmr_blocklist_add_one(struct vrmr_zones *zones,
 
     assert(zones && blocklist && line);
 
-    /* call vrmr_check_ipv4address with the quiet flag */
-    if (vrmr_check_ipv4address(NULL, NULL, line, 1) != 1) {
+    if (vrmr_blocklist_addr_family(line, NULL) == 0) {
         /* search for the name in the zones list */
         if ((zone_ptr = vrmr_search_zonedata(zones, line))) {
             if (zone_ptr->type != VRMR_TYPE_HOST &&
@@ -150,9 +365,9 @@ int vrmr_blocklist_add_one(struct vrmr_zones *zones,
                                 return (-1);
                             }
                         } else {
-                            /* add the hosts ipaddress */
-                            if (blocklist_add_ip_to_list(blocklist,
-                                        zone_ptr->ipv4.ipaddress) < 0) {
+                            /* add the hosts ipaddresses */
+                            if (blocklist_add_host_to_list(
+                                        blocklist, zone_ptr) < 0) {
                                 vrmr_error(-1, "Internal Error",
                                         "adding ipaddress to blocklist failed");
                                 return (-1);
@@ -185,10 +400,9 @@ int vrmr_blocklist_add_one(struct vrmr_zones *zones,
                                             "blocklist.",
                                             member_ptr->name, zone_ptr->name);
                                 } else {
-                                    /* add the groupmembers ipaddress */
-                                    if (blocklist_add_ip_to_list(blocklist,
-                                                member_ptr->ipv4.ipaddress) <
-                                            0) {
+                                    /* add the groupmembers ipaddresses */
+                                    if (blocklist_add_host_to_list(
+                                                blocklist, member_ptr) < 0) {
                                         vrmr_error(-1, "Internal Error",
                                                 "adding ipaddress to blocklist "
                                                 "failed");
@@ -239,54 +453,401 @@ int vrmr_blocklist_add_one(struct vrmr_zones *zones,
 int vrmr_blocklist_rem_one(struct vrmr_zones *zones,
         struct vrmr_blocklist *blocklist, char *itemname)
 {
-    char *listitemname = NULL;
     struct vrmr_list_node *d_node = NULL;
     struct vrmr_zone *zone_ptr = NULL;
 
     assert(zones && blocklist && itemname);
 
-    for (d_node = blocklist->list.top; d_node; d_node = d_node->next) {
-        if (!(listitemname = d_node->data)) {
-            vrmr_error(-1, "Internal Error", "NULL pointer");
-            return (-1);
+    if (blocklist->index.slots != NULL) {
+        d_node = vrmr_htable_remove(&blocklist->index,
+                blocklist_hash(itemname), blocklist_node_compare, itemname);
+    } else {
+        for (d_node = blocklist->list.top; d_node; d_node = d_node->next) {
+            if (d_node->data == NULL) {
+                vrmr_error(-1, "Internal Error", "NULL pointer");
+                return (-1);
+            }
+            if (strcmp(d_node->data, itemname) == 0)
+                break;
         }
+    }
+    if (d_node == NULL) {
+        vrmr_error(-1, "Internal Error",
+                "removing item '%s' from list failed: item not found",
+                itemname);
+        return (-1);
+    }
 
-        if (strcmp(listitemname, itemname) == 0) {
-            /* call vrmr_check_ipv4address with the quiet flag */
-            if (vrmr_check_ipv4address(NULL, NULL, itemname, 1) != 1) {
-                /* search for the name in the zones list */
-                if ((zone_ptr = vrmr_search_zonedata(zones, itemname))) {
-                    /* decrease refcnt */
-                    if (zone_ptr->refcnt_blocklist > 0)
-                        zone_ptr->refcnt_blocklist--;
-                    else {
-                        vrmr_error(-1, "Internal Error",
-                                "blocklist refcnt of '%s' already 0!",
-                                zone_ptr->name);
-                    }
-                }
+    if (vrmr_blocklist_addr_family(itemname, NULL) == 0) {
+        /* search for the name in the zones list */
+        if ((zone_ptr = vrmr_search_zonedata(zones, itemname))) {
+            /* decrease refcnt */
+            if (zone_ptr->refcnt_blocklist > 0)
+                zone_ptr->refcnt_blocklist--;
+            else {
+                vrmr_error(-1, "Internal Error",
+                        "blocklist refcnt of '%s' already 0!", zone_ptr->name);
             }
+        }
+    }
 
-            /* this one needs to be removed */
-            if (vrmr_list_remove_node(&blocklist->list, d_node) < 0) {
-                vrmr_error(
-                        -1, "Internal Error", "removing item from list failed");
-                return (-1);
+    /*  the address may have been added more than once, e.g. as a host and
+        as a groupmember. Only take it out of the set when this is the last
+        one. This is done before removing the node, as 'itemname' may be
+        the data of the node. */
+    if (blocklist->ipset) {
+        char last = TRUE;
+
+        if (blocklist->index.slots != NULL) {
+            last = !vrmr_blocklist_contains(blocklist, itemname);
+        } else {
+            struct vrmr_list_node *o_node = NULL;
+
+            for (o_node = blocklist->list.top; o_node; o_node = o_node->next) {
+                if (o_node != d_node && o_node->data != NULL &&
+                        strcmp(o_node->data, itemname) == 0) {
+                    last = FALSE;
+                    break;
+                }
             }
+        }
+
+        if (last && blocklist_ipset_push(blocklist, "del", itemname) < 0) {
+            if (blocklist->index.slots != NULL)
+                (void)vrmr_htable_insert(&blocklist->index,
+                        blocklist_hash(itemname), d_node);
+            return (-1);
+        }
+    }
+
+    /* this one needs to be removed */
+    if (vrmr_list_remove_node(&blocklist->list, d_node) < 0) {
+        vrmr_error(-1, "Internal Error", "removing item from list failed");
+        return (-1);
+    }
+
+    return (0);
+}
+
+/* growing array of prefixes */
+struct blocklist_prefixes {
+    struct blocklist_prefix *p;
+    size_t n;
+    size_t alloc;
+};
 
-            listitemname = NULL;
+static int blocklist_prefixes_add(
+        struct blocklist_prefixes *a, const struct blocklist_prefix *p)
+{
+    if (a->n == a->alloc) {
+        size_t alloc = a->alloc ? a->alloc * 2 : 1024;
+        struct blocklist_prefix *np = realloc(a->p, alloc * sizeof(*np));
+        if (np == NULL) {
+            vrmr_error(-1, "Error", "realloc failed: %s", strerror(errno));
+            return (-1);
+        }
+        a->p = np;
+        a->alloc = alloc;
+    }
+    a->p[a->n++] = *p;
+    return (0);
+}
+
+/* order by family, then address, then shortest prefix first, so a prefix
+ * is always directly followed by the prefixes it contains */
+static int blocklist_prefix_compare(const void *a, const void *b)
+{
+    const struct blocklist_prefix *pa = a, *pb = b;
+
+    if (pa->ipv != pb->ipv)
+        return (pa->ipv < pb->ipv ? -1 : 1);
+    int r = memcmp(pa->key, pb->key, sizeof(pa->key));
+    if (r != 0)
+        return (r);
+    return ((int)pa->plen - (int)pb->plen);
+}
+
+static inline int blocklist_prefix_bit(
+        const struct blocklist_prefix *p, int bit)
+{
+    return ((p->key[bit >> 3] >> (7 - (bit & 7))) & 1);
+}
+
+/* does 'a' contain 'b'? */
+static int blocklist_prefix_covers(
+        const struct blocklist_prefix *a, const struct blocklist_prefix *b)
+{
+    if (a->ipv != b->ipv || a->plen > b->plen)
+        return (0);
+
+    int bytes = a->plen >> 3;
+    if (memcmp(a->key, b->key, (size_t)bytes) != 0)
+        return (0);
+    for (int bit = bytes * 8; bit < a->plen; bit++) {
+        if (blocklist_prefix_bit(a, bit) != blocklist_prefix_bit(b, bit))
             return (0);
+    }
+    return (1);
+}
+
+/* are 'a' and 'b' the lower and upper half of the same prefix? The two /1
+ * halves are not merged, as the sets can't hold a /0. */
+static int blocklist_prefix_siblings(
+        const struct blocklist_prefix *a, const struct blocklist_prefix *b)
+{
+    if (a->ipv != b->ipv || a->plen != b->plen || a->plen <= 1)
+        return (0);
+
+    int bit = a->plen - 1;
+    if (blocklist_prefix_bit(a, bit) != 0 || blocklist_prefix_bit(b, bit) != 1)
+        return (0);
+
+    struct blocklist_prefix parent = *a;
+    parent.plen = (uint8_t)bit;
+    return (blocklist_prefix_covers(&parent, b));
+}
+
+/*  blocklist_aggregate
+
+    Sorts the prefixes and turns them into the smallest set of prefixes
+    that covers the same addresses: duplicates and prefixes inside another
+    one are dropped, and two halves of a prefix are merged into it,
+    repeatedly. The array is used as the stack of the result.
+
+    Returns the number of prefixes left. 'covered' is set to the number
+    of duplicates and prefixes that were inside another one.
+*/
+static size_t blocklist_aggregate(
+        struct blocklist_prefix *p, size_t n, unsigned int *covered)
+{
+    size_t out = 0;
+
+    *covered = 0;
+    if (n == 0)
+        return (0);
+
+    qsort(p, n, sizeof(*p), blocklist_prefix_compare);
+
+    for (size_t i = 0; i < n; i++) {
+        /* the result is sorted and has no overlap, so only the last one
+         * can contain this one */
+        if (out > 0 && blocklist_prefix_covers(&p[out - 1], &p[i])) {
+            (*covered)++;
+            continue;
+        }
+
+        p[out++] = p[i];
+
+        /* the lower half has the bit below the parent prefix cleared, so it
+         * is the parent once its prefix is shortened */
+        while (out >= 2 &&
+                blocklist_prefix_siblings(&p[out - 2], &p[out - 1])) {
+            out--;
+            p[out - 1].plen--;
+        }
+    }
+
+    return (out);
+}
+
+/*  blocklist_read_feed
+
+    Reads a feed file: an address or prefix per line. Everything after
+    the first whitespace, '#', ';' or ',' is ignored, so comments and the
+    extra columns many feeds have are skipped.
+
+    Returncodes:
+         0: ok
+        -1: error
+*/
+static int blocklist_read_feed(const char *path, struct blocklist_prefixes *a,
+        struct vrmr_blocklist_import_stats *stats)
+{
+    char line[256] = "";
+    struct blocklist_prefix p;
+    char net = 0;
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        vrmr_error(-1, "Error", "opening feed '%s' failed: %s", path,
+                strerror(errno));
+        return (-1);
+    }
+
+    while (fgets(line, (int)sizeof(line), fp) != NULL) {
+        size_t len = strlen(line);
+
+        /* skip the rest of lines that don't fit */
+        if (len > 0 && line[len - 1] != '\n' && !feof(fp)) {
+            int c;
+            while ((c = fgetc(fp)) != EOF && c != '\n')
+                ;
+        }
+        stats->lines++;
+
+        char *s = line;
+        while (*s == ' ' || *s == '\t')
+            s++;
+        s[strcspn(s, " \t\r\n#;,")] = '\0';
+        if (*s == '\0')
+            continue;
+
+        int r = blocklist_parse_prefix(s, &p, &net);
+        if (r == -2) {
+            vrmr_warning("Warning",
+                    "feed '%s': '%s' would block every address, dropped",
+                    path, s);
+            stats->invalid++;
+            continue;
+        } else if (r < 0) {
+            if (stats->invalid == 0)
+                vrmr_warning("Warning", "feed '%s': '%s' is not an address",
+                        path, s);
+            stats->invalid++;
+            continue;
+        }
+        if (blocklist_prefixes_add(a, &p) < 0) {
+            fclose(fp);
+            return (-1);
+        }
+    }
+
+    if (ferror(fp)) {
+        vrmr_error(-1, "Error", "reading feed '%s' failed", path);
+        fclose(fp);
+        return (-1);
+    }
+    fclose(fp);
+    stats->feeds++;
+    return (0);
+}
+
+/* reads all feeds in the 'dir' directory */
+static int blocklist_read_feeds(struct vrmr_config *cnf, const char *dir,
+        struct blocklist_prefixes *a, struct vrmr_blocklist_import_stats *stats)
+{
+    char path[256] = "";
+    struct dirent *de = NULL;
+
+    DIR *dp = opendir(dir);
+    if (dp == NULL) {
+        vrmr_error(-1, "Error", "opening feed directory '%s' failed: %s", dir,
+                strerror(errno));
+        return (-1);
+    }
+
+    while ((de = readdir(dp)) != NULL) {
+        size_t len = strlen(de->d_name);
+
+        /* skip hidden files, '.', '..' and editor backups */
+        if (de->d_name[0] == '.' || de->d_name[len - 1] == '~')
+            continue;
+
+        if (snprintf(path, sizeof(path), "%s/%s", dir, de->d_name) >=
+                (int)sizeof(path)) {
+            vrmr_warning("Warning", "feed path '%s/%s' too long, skipping",
+                    dir, de->d_name);
+            continue;
+        }
+
+        if (!vrmr_stat_ok(cnf, path, VRMR_STATOK_WANT_FILE, VRMR_STATOK_VERBOSE,
+                    VRMR_STATOK_MUST_EXIST))
+            continue;
+
+        if (blocklist_read_feed(path, a, stats) < 0) {
+            closedir(dp);
+            return (-1);
+        }
+    }
+
+    closedir(dp);
+    return (0);
+}
+
+/*  vrmr_blocklist_import
+
+    Adds the threat feeds from cnf->blocklist_feeds to the blocklist (as
+    loaded with load_ips). The feeds are merged into the smallest set of
+    prefixes that blocks the same addresses. Prefixes that are a full
+    length are stored as a plain address, so they end up in the hash:ip
+    sets.
+
+    The entries of the blocklist itself are left alone, also if a feed
+    prefix covers them, so they can still be removed one by one with
+    vrmr_blocklist_rem_one. The list may have an address twice then, which
+    rem_one deals with.
+
+    'stats' may be NULL. The result is logged either way.
+
+    Returncodes:
+         0: ok
+        -1: error
+*/
+int vrmr_blocklist_import(struct vrmr_config *cnf,
+        struct vrmr_blocklist *blocklist,
+        struct vrmr_blocklist_import_stats *stats)
+{
+    struct vrmr_blocklist_import_stats local_stats;
+    struct blocklist_prefixes a = {NULL, 0, 0};
+    char str[VRMR_MAX_IPV6_ADDR_LEN + 4] = "";
+
+    assert(cnf && blocklist);
+
+    if (stats == NULL)
+        stats = &local_stats;
+    memset(stats, 0, sizeof(*stats));
+
+    if (cnf->blocklist_feeds[0] == '\0')
+        return (0);
+
+    if (blocklist_read_feeds(cnf, cnf->blocklist_feeds, &a, stats) < 0)
+        goto error;
+
+    stats->entries = (unsigned int)a.n;
+    stats->result =
+            (unsigned int)blocklist_aggregate(a.p, a.n, &stats->duplicates);
+
+    for (size_t i = 0; i < stats->result; i++) {
+        int max = a.p[i].ipv == VRMR_IPV4 ? 32 : 128;
+
+        if (inet_ntop(a.p[i].ipv == VRMR_IPV4 ? AF_INET : AF_INET6,
+                    a.p[i].key, str, sizeof(str)) == NULL) {
+            vrmr_error(-1, "Internal Error", "inet_ntop failed: %s",
+                    strerror(errno));
+            goto error;
+        }
+        if (a.p[i].plen < max) {
+            size_t len = strlen(str);
+            snprintf(str + len, sizeof(str) - len, "/%u", a.p[i].plen);
+        }
+
+        char *entry = strdup(str);
+        if (entry == NULL) {
+            vrmr_error(-1, "Error", "strdup failed: %s", strerror(errno));
+            goto error;
         }
+        if (blocklist_append(blocklist, entry) < 0)
+            goto error;
     }
+    free(a.p);
 
-    /* if we get here something went wrong */
-    vrmr_error(-1, "Internal Error",
-            "removing item '%s' from list failed: item not found", itemname);
+    if (stats->feeds > 0) {
+        vrmr_info("Info",
+                "blocklist: %u feed entries (%u lines from %u feeds, %u "
+                "invalid, %u duplicate) merged into %u prefixes, %.1f:1.",
+                stats->entries, stats->lines, stats->feeds, stats->invalid,
+                stats->duplicates, stats->result,
+                stats->result ? (double)stats->entries / stats->result : 1.0);
+    }
+    return (0);
+
+error:
+    free(a.p);
     return (-1);
 }
 
-int vrmr_blocklist_init_list(struct vrmr_ctx *vctx,
-        struct vrmr_config *cfg ATTR_UNUSED, struct vrmr_zones *zones,
+int vrmr_blocklist_init_list(struct vrmr_ctx *vctx, struct vrmr_config *cfg,
+        struct vrmr_zones *zones,
         struct vrmr_blocklist *blocklist, char load_ips, char no_refcnt)
 {
     char line[128] = "";
@@ -303,6 +864,8 @@ int vrmr_blocklist_init_list(struct vrmr_ctx *vctx,
 
     /* setup the blocklist */
     vrmr_list_setup(&blocklist->list, free);
+    if (vrmr_htable_init(&blocklist->index, 64) < 0)
+        return (-1);
 
     /* see if the blocklist already exists in the backend */
     while (vctx->rf->list(vctx->rule_backend, rule_name, &type,
@@ -344,6 +907,13 @@ int vrmr_blocklist_init_list(struct vrmr_ctx *vctx,
         }
     }
 
+    /* with the addresses loaded, add the feeds */
+    if (load_ips && cfg != NULL &&
+            vrmr_blocklist_import(cfg, blocklist, NULL) < 0) {
+        vrmr_error(-1, "Error", "importing the blocklist feeds failed");
+        return (-1);
+    }
+
     return (0);
 }
 
@@ -392,3 +962,174 @@ int vrmr_blocklist_save_list(struct vrmr_ctx *vctx,
 
     return (0);
 }
+
+/*  vrmr_blocklist_ipset_load
+
+    Loads the whole blocklist into the kernel ipsets with one
+    'ipset restore'. The entries are loaded into new sets that are then
+    swapped with the live ones, so the old contents keep blocking until the
+    new ones are complete.
+
+    On success the blocklist is marked as living in the sets, so later
+    changes through vrmr_blocklist_add_one/rem_one are pushed to them.
+
+    Returncodes:
+         0: ok
+        -1: error
+*/
+int vrmr_blocklist_ipset_load(
+        struct vrmr_config *cnf, struct vrmr_blocklist *blocklist)
+{
+    static const struct {
+        const char *name;
+        const char *type;
+        const char *family;
+    } sets[] = {
+            {VRMR_BLOCKLIST_SET_IP4, "hash:ip", "inet"},
+            {VRMR_BLOCKLIST_SET_NET4, "hash:net", "inet"},
+            {VRMR_BLOCKLIST_SET_IP6, "hash:ip", "inet6"},
+            {VRMR_BLOCKLIST_SET_NET6, "hash:net", "inet6"},
+    };
+    char path[] = "/tmp/vuurmuur-ipset-XXXXXX";
+    struct vrmr_list_node *d_node = NULL;
+    size_t i;
+
+    assert(cnf && blocklist);
+
+    blocklist->ipset = FALSE;
+    blocklist->ipset_cnf = NULL;
+
+    int fd = vrmr_create_tempfile(path);
+    if (fd == -1)
+        return (-1);
+
+    FILE *fp = fdopen(fd, "w");
+    if (fp == NULL) {
+        vrmr_error(-1, "Error", "fdopen failed: %s", strerror(errno));
+        close(fd);
+        (void)unlink(path);
+        return (-1);
+    }
+
+    for (i = 0; i < sizeof(sets) / sizeof(sets[0]); i++) {
+        fprintf(fp, "create %s %s family %s maxelem %d\n", sets[i].name,
+                sets[i].type, sets[i].family, VRMR_BLOCKLIST_SET_MAXELEM);
+        fprintf(fp, "create %s-new %s family %s maxelem %d\n", sets[i].name,
+                sets[i].type, sets[i].family, VRMR_BLOCKLIST_SET_MAXELEM);
+        fprintf(fp, "flush %s-new\n", sets[i].name);
+    }
+
+    for (d_node = blocklist->list.top; d_node; d_node = d_node->next) {
+        const char *entry = d_node->data;
+        char net = 0;
+
+        if (entry == NULL)
+            continue;
+
+        int ipv = vrmr_blocklist_addr_family(entry, &net);
+        if (ipv == 0) {
+            vrmr_debug(MEDIUM, "'%s' is not an address, skipping", entry);
+            continue;
+        }
+        fprintf(fp, "add %s-new %s\n", blocklist_set_name(ipv, net), entry);
+    }
+
+    for (i = 0; i < sizeof(sets) / sizeof(sets[0]); i++) {
+        fprintf(fp, "swap %s-new %s\n", sets[i].name, sets[i].name);
+        fprintf(fp, "destroy %s-new\n", sets[i].name);
+    }
+
+    if (fclose(fp) != 0) {
+        vrmr_error(-1, "Error", "writing '%s' failed: %s", path,
+                strerror(errno));
+        (void)unlink(path);
+        return (-1);
+    }
+
+    const char *args[] = {
+            cnf->ipset_location, "-exist", "-file", path, "restore", NULL};
+    int r = libvuurmuur_exec_command(cnf, cnf->ipset_location, args, NULL);
+    (void)unlink(path);
+    if (r != 0) {
+        vrmr_error(-1, "Error", "loading the blocklist into ipsets failed: %d",
+                r);
+        return (-1);
+    }
+
+    vrmr_info("Info", "blocklist loaded into ipsets (%u entries).",
+            blocklist->list.len);
+    blocklist->ipset = TRUE;
+    blocklist->ipset_cnf = cnf;
+    return (0);
+}
+
+/*  vrmr_blocklist_ipset_begin
+
+    Starts a batch of changes to the ipsets: until
+    vrmr_blocklist_ipset_commit the entries added and removed with
+    vrmr_blocklist_add_one/rem_one are collected in a file instead of
+    starting ipset for each of them.
+
+    Returncodes:
+         0: ok
+        -1: error
+*/
+int vrmr_blocklist_ipset_begin(struct vrmr_blocklist *blocklist)
+{
+    assert(blocklist && blocklist->ipset && blocklist->ipset_batch == NULL);
+
+    strlcpy(blocklist->ipset_batch_path, "/tmp/vuurmuur-ipset-XXXXXX",
+            sizeof(blocklist->ipset_batch_path));
+    int fd = vrmr_create_tempfile(blocklist->ipset_batch_path);
+    if (fd == -1)
+        return (-1);
+
+    blocklist->ipset_batch = fdopen(fd, "w");
+    if (blocklist->ipset_batch == NULL) {
+        vrmr_error(-1, "Error", "fdopen failed: %s", strerror(errno));
+        close(fd);
+        (void)unlink(blocklist->ipset_batch_path);
+        return (-1);
+    }
+    return (0);
+}
+
+/*  vrmr_blocklist_ipset_commit
+
+    Ends the batch started with vrmr_blocklist_ipset_begin and loads the
+    changes into the sets with one 'ipset restore', in the order they were
+    made. With 'abort' set the changes are dropped.
+
+    Returncodes:
+         0: ok
+        -1: error, the sets may have only part of the changes
+*/
+int vrmr_blocklist_ipset_commit(struct vrmr_blocklist *blocklist, char abort)
+{
+    struct vrmr_config *cnf = blocklist->ipset_cnf;
+    int retval = 0;
+
+    assert(blocklist && blocklist->ipset_batch != NULL);
+
+    if (fclose(blocklist->ipset_batch) != 0) {
+        vrmr_error(-1, "Error", "writing '%s' failed: %s",
+                blocklist->ipset_batch_path, strerror(errno));
+        abort = TRUE;
+        retval = -1;
+    }
+    blocklist->ipset_batch = NULL;
+
+    if (!abort) {
+        const char *args[] = {cnf->ipset_location, "-exist", "-file",
+                blocklist->ipset_batch_path, "restore", NULL};
+        int r = libvuurmuur_exec_command(cnf, cnf->ipset_location, args, NULL);
+        if (r != 0) {
+            vrmr_error(-1, "Error",
+                    "loading the blocklist changes into ipsets failed: %d", r);
+            retval = -1;
+        }
+    }
+
+    (void)unlink(blocklist->ipset_batch_path);
+    return (retval);
+}
@@ -294,6 +294,34 @@ int vrmr_check_tc_command(
     return (1);
 }
 
+/*
+ */
+int vrmr_check_ipset_command(
+        struct vrmr_config *cnf, char *ipset_location, char quiet)
+{
+    assert(cnf && ipset_location);
+
+    /* first check if there even is a value */
+    if (strcmp(ipset_location, "") == 0) {
+        if (quiet == VRMR_IPTCHK_VERBOSE)
+            vrmr_error(
+                    0, "Error", "The path to the 'ipset'-command was not set");
+        return (0);
+    } else {
+        const char *args[] = {ipset_location, "version", NULL};
+        int r = libvuurmuur_exec_command(cnf, ipset_location, args, NULL);
+        if (r != 0) {
+            if (quiet == VRMR_IPTCHK_VERBOSE)
+                vrmr_error(0, "Error",
+                        "The path '%s' to the 'ipset'-command seems to be "
+                        "wrong.",
+                        ipset_location);
+            return (0);
+        }
+    }
+    return (1);
+}
+
 /* updates the logdirlocations in the cnf struct based on cnf->vuurmuur_log_dir,
  * also updates vrprint. */
 int vrmr_config_set_log_names(struct vrmr_config *cnf)
@@ -962,6 +990,323 @@ int vrmr_init_config(struct vrmr_config *cnf)
     } else
         return (VRMR_CNF_E_UNKNOWN_ERR);
 
+    /* NFLOG_GROUPS */
+    result = vrmr_ask_configfile(
+            cnf, "NFLOG_GROUPS", answer, cnf->configfile, sizeof(answer));
+    if (result == 1) {
+        /* ok, found */
+        result = atoi(answer);
+        if (result < 1 || result > (int)VRMR_MAX_NFLOG_GROUPS) {
+            vrmr_warning("Warning",
+                    "NFLOG groups (%d) must be between 1 and %u, using "
+                    "default (%u).",
+                    result, VRMR_MAX_NFLOG_GROUPS, VRMR_DEFAULT_NFLOG_GROUPS);
+            cnf->nflog_groups = VRMR_DEFAULT_NFLOG_GROUPS;
+
+            retval = VRMR_CNF_W_ILLEGAL_VAR;
+        } else {
+            cnf->nflog_groups = (unsigned int)result;
+        }
+    } else if (result == 0) {
+        /* if this is missing, we use the default */
+        cnf->nflog_groups = VRMR_DEFAULT_NFLOG_GROUPS;
+    } else
+        return (VRMR_CNF_E_UNKNOWN_ERR);
+
+    /* NFLOG_THRESHOLD */
+    result = vrmr_ask_configfile(
+            cnf, "NFLOG_THRESHOLD", answer, cnf->configfile, sizeof(answer));
+    if (result == 1) {
+        /* ok, found */
+        result = atoi(answer);
+        if (result < 1 || result > 65535) {
+            vrmr_warning("Warning",
+                    "NFLOG threshold (%d) must be between 1 and 65535, using "
+                    "default (%u).",
+                    result, VRMR_DEFAULT_NFLOG_THRESHOLD);
+            cnf->nflog_threshold = VRMR_DEFAULT_NFLOG_THRESHOLD;
+
+            retval = VRMR_CNF_W_ILLEGAL_VAR;
+        } else {
+            cnf->nflog_threshold = (unsigned int)result;
+        }
+    } else if (result == 0) {
+        /* if this is missing, we use the default */
+        cnf->nflog_threshold = VRMR_DEFAULT_NFLOG_THRESHOLD;
+    } else
+        return (VRMR_CNF_E_UNKNOWN_ERR);
+
+    /* NFLOG_TIMEOUT */
+    result = vrmr_ask_configfile(
+            cnf, "NFLOG_TIMEOUT", answer, cnf->configfile, sizeof(answer));
+    if (result == 1) {
+        /* ok, found */
+        result = atoi(answer);
+        if (result < 1 || result > 6000) {
+            vrmr_warning("Warning",
+                    "NFLOG timeout (%d) must be between 1 and 6000, using "
+                    "default (%u).",
+                    result, VRMR_DEFAULT_NFLOG_TIMEOUT);
+            cnf->nflog_timeout = VRMR_DEFAULT_NFLOG_TIMEOUT;
+
+            retval = VRMR_CNF_W_ILLEGAL_VAR;
+        } else {
+            cnf->nflog_timeout = (unsigned int)result;
+        }
+    } else if (result == 0) {
+        /* if this is missing, we use the default */
+        cnf->nflog_timeout = VRMR_DEFAULT_NFLOG_TIMEOUT;
+    } else
+        return (VRMR_CNF_E_UNKNOWN_ERR);
+
+    /* NFLOG_BUFSIZE */
+    result = vrmr_ask_configfile(
+            cnf, "NFLOG_BUFSIZE", answer, cnf->configfile, sizeof(answer));
+    if (result == 1) {
+        /* ok, found */
+        result = atoi(answer);
+        if (result < 4096 || result > (int)VRMR_MAX_NFLOG_BUFSIZE) {
+            vrmr_warning("Warning",
+                    "NFLOG buffer size (%d) must be between 4096 and %u, "
+                    "using default (%u).",
+                    result, VRMR_MAX_NFLOG_BUFSIZE, VRMR_DEFAULT_NFLOG_BUFSIZE);
+            cnf->nflog_bufsize = VRMR_DEFAULT_NFLOG_BUFSIZE;
+
+            retval = VRMR_CNF_W_ILLEGAL_VAR;
+        } else {
+            cnf->nflog_bufsize = (unsigned int)result;
+        }
+    } else if (result == 0) {
+        /* if this is missing, we use the default */
+        cnf->nflog_bufsize = VRMR_DEFAULT_NFLOG_BUFSIZE;
+    } else
+        return (VRMR_CNF_E_UNKNOWN_ERR);
+
+    /* NFLOG_SNAPLEN */
+    result = vrmr_ask_configfile(
+            cnf, "NFLOG_SNAPLEN", answer, cnf->configfile, sizeof(answer));
+    if (result == 1) {
+        /* ok, found */
+        result = atoi(answer);
+        if (result < (int)VRMR_MIN_NFLOG_SNAPLEN ||
+                result > (int)VRMR_MAX_NFLOG_SNAPLEN) {
+            vrmr_warning("Warning",
+                    "NFLOG snaplen (%d) must be between %u and %u, using "
+                    "default (%u).",
+                    result, VRMR_MIN_NFLOG_SNAPLEN, VRMR_MAX_NFLOG_SNAPLEN,
+                    VRMR_DEFAULT_NFLOG_SNAPLEN);
+            cnf->nflog_snaplen = VRMR_DEFAULT_NFLOG_SNAPLEN;
+
+            retval = VRMR_CNF_W_ILLEGAL_VAR;
+        } else {
+            cnf->nflog_snaplen = (unsigned int)result;
+        }
+    } else if (result == 0) {
+        /* if this is missing, we use the default */
+        cnf->nflog_snaplen = VRMR_DEFAULT_NFLOG_SNAPLEN;
+    } else
+        return (VRMR_CNF_E_UNKNOWN_ERR);
+
+    /* LOG_FLUSH_INTERVAL */
+    result = vrmr_ask_configfile(cnf, "LOG_FLUSH_INTERVAL", answer,
+            cnf->configfile, sizeof(answer));
+    if (result == 1) {
+        /* ok, found */
+        result = atoi(answer);
+        if (result < 0 || result > (int)VRMR_MAX_LOG_FLUSH_INTERVAL) {
+            vrmr_warning("Warning",
+                    "log flush interval (%d) must be between 0 and %u, using "
+                    "default (%u).",
+                    result, VRMR_MAX_LOG_FLUSH_INTERVAL,
+                    VRMR_DEFAULT_LOG_FLUSH_INTERVAL);
+            cnf->log_flush_interval = VRMR_DEFAULT_LOG_FLUSH_INTERVAL;
+
+            retval = VRMR_CNF_W_ILLEGAL_VAR;
+        } else {
+            cnf->log_flush_interval = (unsigned int)result;
+        }
+    } else if (result == 0) {
+        /* if this is missing, we use the default */
+        cnf->log_flush_interval = VRMR_DEFAULT_LOG_FLUSH_INTERVAL;
+    } else
+        return (VRMR_CNF_E_UNKNOWN_ERR);
+
+    /* LOG_ARCHIVE */
+    result = vrmr_ask_configfile(
+            cnf, "LOG_ARCHIVE", answer, cnf->configfile, sizeof(answer));
+    if (result == 1) {
+        /* ok, found */
+        if (strcasecmp(answer, "yes") == 0) {
+            cnf->log_archive = TRUE;
+        } else if (strcasecmp(answer, "no") == 0) {
+            cnf->log_archive = FALSE;
+        } else {
+            vrmr_warning("Warning",
+                    "'%s' is not a valid value for option LOG_ARCHIVE.",
+                    answer);
+            cnf->log_archive = VRMR_DEFAULT_LOG_ARCHIVE;
+
+            retval = VRMR_CNF_W_ILLEGAL_VAR;
+        }
+    } else if (result == 0) {
+        /* if this is missing, we use the default */
+        cnf->log_archive = VRMR_DEFAULT_LOG_ARCHIVE;
+    } else
+        return (VRMR_CNF_E_UNKNOWN_ERR);
+
+    /* LOG_ARCHIVE_DAYS */
+    result = vrmr_ask_configfile(cnf, "LOG_ARCHIVE_DAYS", answer,
+            cnf->configfile, sizeof(answer));
+    if (result == 1) {
+        /* ok, found */
+        result = atoi(answer);
+        if (result < 0 || result > (int)VRMR_MAX_LOG_ARCHIVE_DAYS) {
+            vrmr_warning("Warning",
+                    "log archive days (%d) must be between 0 and %u, using "
+                    "default (%u).",
+                    result, VRMR_MAX_LOG_ARCHIVE_DAYS,
+                    VRMR_DEFAULT_LOG_ARCHIVE_DAYS);
+            cnf->log_archive_days = VRMR_DEFAULT_LOG_ARCHIVE_DAYS;
+
+            retval = VRMR_CNF_W_ILLEGAL_VAR;
+        } else {
+            cnf->log_archive_days = (unsigned int)result;
+        }
+    } else if (result == 0) {
+        /* if this is missing, we use the default */
+        cnf->log_archive_days = VRMR_DEFAULT_LOG_ARCHIVE_DAYS;
+    } else
+        return (VRMR_CNF_E_UNKNOWN_ERR);
+
+    /* LOG_AGGREGATE_WINDOW */
+    result = vrmr_ask_configfile(cnf, "LOG_AGGREGATE_WINDOW", answer,
+            cnf->configfile, sizeof(answer));
+    if (result == 1) {
+        /* ok, found */
+        result = atoi(answer);
+        if (result < 0 || result > (int)VRMR_MAX_LOG_AGGREGATE_WINDOW) {
+            vrmr_warning("Warning",
+                    "log aggregate window (%d) must be between 0 and %u, "
+                    "using default (%u).",
+                    result, VRMR_MAX_LOG_AGGREGATE_WINDOW,
+                    VRMR_DEFAULT_LOG_AGGREGATE_WINDOW);
+            cnf->log_aggregate_window = VRMR_DEFAULT_LOG_AGGREGATE_WINDOW;
+
+            retval = VRMR_CNF_W_ILLEGAL_VAR;
+        } else {
+            cnf->log_aggregate_window = (unsigned int)result;
+        }
+    } else if (result == 0) {
+        /* if this is missing, we use the default */
+        cnf->log_aggregate_window = VRMR_DEFAULT_LOG_AGGREGATE_WINDOW;
+    } else
+        return (VRMR_CNF_E_UNKNOWN_ERR);
+
+    /* CONNLOG_EVENTS */
+    result = vrmr_ask_configfile(cnf, "CONNLOG_EVENTS", cnf->connlog_events,
+            cnf->configfile, sizeof(cnf->connlog_events));
+    if (result == 0) {
+        /* if this is missing, we use the default */
+        (void)strlcpy(cnf->connlog_events, VRMR_DEFAULT_CONNLOG_EVENTS,
+                sizeof(cnf->connlog_events));
+    } else if (result != 1)
+        return (VRMR_CNF_E_UNKNOWN_ERR);
+
+    /* CONNLOG_PROTO */
+    result = vrmr_ask_configfile(cnf, "CONNLOG_PROTO", cnf->connlog_proto,
+            cnf->configfile, sizeof(cnf->connlog_proto));
+    if (result == 0) {
+        /* if this is missing, we use the default */
+        (void)strlcpy(cnf->connlog_proto, VRMR_DEFAULT_CONNLOG_PROTO,
+                sizeof(cnf->connlog_proto));
+    } else if (result != 1)
+        return (VRMR_CNF_E_UNKNOWN_ERR);
+
+    /* CONNLOG_IGNORE */
+    result = vrmr_ask_configfile(cnf, "CONNLOG_IGNORE", cnf->connlog_ignore,
+            cnf->configfile, sizeof(cnf->connlog_ignore));
+    if (result == 0) {
+        /* if this is missing, we use the default */
+        (void)strlcpy(cnf->connlog_ignore, VRMR_DEFAULT_CONNLOG_IGNORE,
+                sizeof(cnf->connlog_ignore));
+    } else if (result != 1)
+        return (VRMR_CNF_E_UNKNOWN_ERR);
+
+    /* CONNLOG_MARK */
+    result = vrmr_ask_configfile(cnf, "CONNLOG_MARK", cnf->connlog_mark,
+            cnf->configfile, sizeof(cnf->connlog_mark));
+    if (result == 0) {
+        /* if this is missing, we use the default */
+        (void)strlcpy(cnf->connlog_mark, VRMR_DEFAULT_CONNLOG_MARK,
+                sizeof(cnf->connlog_mark));
+    } else if (result != 1)
+        return (VRMR_CNF_E_UNKNOWN_ERR);
+
+    struct vrmr_conntrack_filter ct_filter;
+    if (vrmr_conntrack_filter_parse(cnf, &ct_filter) < 0) {
+        vrmr_warning("Warning", "using the default connection log filter.");
+        (void)strlcpy(cnf->connlog_events, VRMR_DEFAULT_CONNLOG_EVENTS,
+                sizeof(cnf->connlog_events));
+        (void)strlcpy(cnf->connlog_proto, VRMR_DEFAULT_CONNLOG_PROTO,
+                sizeof(cnf->connlog_proto));
+        (void)strlcpy(cnf->connlog_ignore, VRMR_DEFAULT_CONNLOG_IGNORE,
+                sizeof(cnf->connlog_ignore));
+        (void)strlcpy(cnf->connlog_mark, VRMR_DEFAULT_CONNLOG_MARK,
+                sizeof(cnf->connlog_mark));
+        if (vrmr_conntrack_filter_parse(cnf, &ct_filter) < 0)
+            return (VRMR_CNF_E_UNKNOWN_ERR);
+
+        retval = VRMR_CNF_W_ILLEGAL_VAR;
+    }
+
+    /* CONNLOG_CTEVENTS */
+    result = vrmr_ask_configfile(
+            cnf, "CONNLOG_CTEVENTS", answer, cnf->configfile, sizeof(answer));
+    if (result == 1) {
+        /* ok, found */
+        if (strcasecmp(answer, "yes") == 0) {
+            cnf->connlog_ctevents = TRUE;
+        } else if (strcasecmp(answer, "no") == 0) {
+            cnf->connlog_ctevents = FALSE;
+        } else {
+            vrmr_warning("Warning",
+                    "'%s' is not a valid value for option CONNLOG_CTEVENTS.",
+                    answer);
+            cnf->connlog_ctevents = VRMR_DEFAULT_CONNLOG_CTEVENTS;
+
+            retval = VRMR_CNF_W_ILLEGAL_VAR;
+        }
+    } else if (result == 0) {
+        /* if this is missing, we use the default */
+        cnf->connlog_ctevents = VRMR_DEFAULT_CONNLOG_CTEVENTS;
+    } else
+        return (VRMR_CNF_E_UNKNOWN_ERR);
+
+    vrmr_rules_ctevents_options(cnf, &ct_filter, cnf->connlog_ctevents_opts,
+            sizeof(cnf->connlog_ctevents_opts));
+
+    /* METRICS */
+    result = vrmr_ask_configfile(
+            cnf, "METRICS", answer, cnf->configfile, sizeof(answer));
+    if (result == 1) {
+        /* ok, found */
+        if (strcasecmp(answer, "yes") == 0) {
+            cnf->metrics = TRUE;
+        } else if (strcasecmp(answer, "no") == 0) {
+            cnf->metrics = FALSE;
+        } else {
+            vrmr_warning("Warning",
+                    "'%s' is not a valid value for option METRICS.", answer);
+            cnf->metrics = VRMR_DEFAULT_METRICS;
+
+            retval = VRMR_CNF_W_ILLEGAL_VAR;
+        }
+    } else if (result == 0) {
+        /* if this is missing, we use the default */
+        cnf->metrics = VRMR_DEFAULT_METRICS;
+    } else
+        return (VRMR_CNF_E_UNKNOWN_ERR);
+
     /* LOG_POLICY_LIMIT */
     result = vrmr_ask_configfile(
             cnf, "LOG_POLICY_LIMIT", answer, cnf->configfile, sizeof(answer));
@@ -1180,6 +1525,29 @@ int vrmr_init_config(struct vrmr_config *cnf)
 
     vrmr_sanitize_path(cnf->tc_location, sizeof(cnf->tc_location));
 
+    result = vrmr_ask_configfile(cnf, "IPSET", cnf->ipset_location,
+            cnf->configfile, sizeof(cnf->ipset_location));
+    if (result == 1) {
+        /* ok */
+    } else if (result == 0) {
+        /*  no default: without it the blocklist is loaded as a rule per
+            address */
+    } else
+        return (VRMR_CNF_E_UNKNOWN_ERR);
+
+    vrmr_sanitize_path(cnf->ipset_location, sizeof(cnf->ipset_location));
+
+    result = vrmr_ask_configfile(cnf, "BLOCKLIST_FEEDS", cnf->blocklist_feeds,
+            cnf->configfile, sizeof(cnf->blocklist_feeds));
+    if (result == 1) {
+        /* ok */
+    } else if (result == 0) {
+        /* no feeds by default */
+    } else
+        return (VRMR_CNF_E_UNKNOWN_ERR);
+
+    vrmr_sanitize_path(cnf->blocklist_feeds, sizeof(cnf->blocklist_feeds));
+
     result = vrmr_ask_configfile(cnf, "MODPROBE", cnf->modprobe_location,
             cnf->configfile, sizeof(cnf->modprobe_location));
     if (result == 1) {
@@ -1552,6 +1920,16 @@ int vrmr_write_configfile(char *file_location, struct vrmr_config *cfg)
     fprintf(fp, "# Location of the tc-command (full path).\n");
     fprintf(fp, "TC=\"%s\"\n\n", cfg->tc_location);
 
+    fprintf(fp, "# Location of the ipset-command (full path). When set, the "
+                "blocklist is\n# loaded into ipsets instead of a rule per "
+                "address.\n");
+    fprintf(fp, "IPSET=\"%s\"\n\n", cfg->ipset_location);
+
+    fprintf(fp, "# Directory with threat feeds to add to the blocklist: files "
+                "with an\n# address or prefix per line. Leave empty for no "
+                "feeds.\n");
+    fprintf(fp, "BLOCKLIST_FEEDS=\"%s\"\n\n", cfg->blocklist_feeds);
+
     fprintf(fp, "# Location of the modprobe-command (full path).\n");
     fprintf(fp, "MODPROBE=\"%s\"\n\n", cfg->modprobe_location);
 
@@ -1566,9 +1944,54 @@ int vrmr_write_configfile(char *file_location, struct vrmr_config *cfg)
 
     fprintf(fp, "# netfilter group (only applicable when RULE_NFLOG=\"Yes\"\n");
     fprintf(fp, "NFGRP=\"%u\"\n\n", cfg->nfgrp);
+    fprintf(fp, "# number of netfilter groups, starting at NFGRP, the log "
+                "rules are spread over\n");
+    fprintf(fp, "NFLOG_GROUPS=\"%u\"\n", cfg->nflog_groups);
+    fprintf(fp, "# number of packets the kernel queues before sending them to "
+                "vuurmuur_log\n");
+    fprintf(fp, "NFLOG_THRESHOLD=\"%u\"\n", cfg->nflog_threshold);
+    fprintf(fp, "# maximum time in 1/100th of a second the kernel holds "
+                "queued packets\n");
+    fprintf(fp, "NFLOG_TIMEOUT=\"%u\"\n", cfg->nflog_timeout);
+    fprintf(fp, "# size of the netlink messages the kernel builds, in bytes\n");
+    fprintf(fp, "NFLOG_BUFSIZE=\"%u\"\n", cfg->nflog_bufsize);
+    fprintf(fp, "# number of bytes of each logged packet that is copied to "
+                "vuurmuur_log\n");
+    fprintf(fp, "NFLOG_SNAPLEN=\"%u\"\n\n", cfg->nflog_snaplen);
     fprintf(fp,
             "# The directory where the logs will be written to (full path).\n");
     fprintf(fp, "LOGDIR=\"%s\"\n\n", cfg->vuurmuur_logdir_location);
+    fprintf(fp, "# Maximum time in milliseconds vuurmuur_log buffers log "
+                "lines (0 writes every line right away).\n");
+    fprintf(fp, "LOG_FLUSH_INTERVAL=\"%u\"\n\n", cfg->log_flush_interval);
+    fprintf(fp, "# Keep a searchable archive of the traffic log in "
+                "LOGDIR/archive.\n");
+    fprintf(fp, "LOG_ARCHIVE=\"%s\"\n", cfg->log_archive ? "Yes" : "No");
+    fprintf(fp, "# Days the archive is kept (0 keeps it forever).\n");
+    fprintf(fp, "LOG_ARCHIVE_DAYS=\"%u\"\n\n", cfg->log_archive_days);
+    fprintf(fp, "# Seconds vuurmuur_log writes repeated log lines only once, "
+                "followed by a summary (0 disables).\n");
+    fprintf(fp, "LOG_AGGREGATE_WINDOW=\"%u\"\n\n",
+            cfg->log_aggregate_window);
+    fprintf(fp, "# Connection events to log: new, destroy.\n");
+    fprintf(fp, "CONNLOG_EVENTS=\"%s\"\n", cfg->connlog_events);
+    fprintf(fp, "# Only log connections of these protocols (empty for "
+                "all).\n");
+    fprintf(fp, "CONNLOG_PROTO=\"%s\"\n", cfg->connlog_proto);
+    fprintf(fp, "# Don't log connections from or to these networks.\n");
+    fprintf(fp, "CONNLOG_IGNORE=\"%s\"\n", cfg->connlog_ignore);
+    fprintf(fp, "# Only log connections with this mark (value[/mask], empty "
+                "for all).\n");
+    fprintf(fp, "CONNLOG_MARK=\"%s\"\n", cfg->connlog_mark);
+    fprintf(fp, "# Have new connections only generate the events above. "
+                "Other conntrack\n# event listeners see fewer events.\n");
+    fprintf(fp, "CONNLOG_CTEVENTS=\"%s\"\n\n",
+            cfg->connlog_ctevents ? "Yes" : "No");
+
+    fprintf(fp, "# Export metrics in the Prometheus text format on "
+                "/var/run/vuurmuur.metrics\n"
+                "# and /var/run/vuurmuur_log.metrics.\n");
+    fprintf(fp, "METRICS=\"%s\"\n\n", cfg->metrics ? "Yes" : "No");
 
     fprintf(fp, "# Check the dynamic interfaces for changes?\n");
     fprintf(fp, "DYN_INT_CHECK=\"%s\"\n\n",
@@ -1737,7 +2160,8 @@ int vrmr_load(struct vrmr_ctx *vctx)
 }
 
 int vrmr_create_log_hash(struct vrmr_ctx *vctx,
-        struct vrmr_hash_table *service_hash, struct vrmr_hash_table *zone_hash)
+        struct vrmr_service_classifier *service_sc,
+        struct vrmr_zone_index *zone_idx)
 {
     /* insert the interfaces as VRMR_TYPE_FIREWALL's into the zonelist as
      * 'firewall', so this appears in to log as 'firewall(interface)' */
@@ -1753,17 +2177,14 @@ int vrmr_create_log_hash(struct vrmr_ctx *vctx,
         return (-1);
     }
 
-    if (vrmr_init_zonedata_hashtable(vctx->zones.list.len * 3,
-                &vctx->zones.list, vrmr_hash_ipaddress, vrmr_compare_ipaddress,
-                zone_hash) < 0) {
-        vrmr_error(-1, "Error", "vrmr_init_zonedata_hashtable failed");
+    if (vrmr_zone_index_build(zone_idx, &vctx->zones.list) < 0) {
+        vrmr_error(-1, "Error", "vrmr_zone_index_build failed");
         return (-1);
     }
 
-    if (vrmr_init_services_hashtable(vctx->services.list.len * 500,
-                &vctx->services.list, vrmr_hash_port, vrmr_compare_ports,
-                service_hash) < 0) {
-        vrmr_error(-1, "Error", "vrmr_init_services_hashtable failed");
+    if (vrmr_service_classifier_build(service_sc, &vctx->services.list) < 0) {
+        vrmr_error(-1, "Error", "vrmr_service_classifier_build failed");
+        vrmr_zone_index_cleanup(zone_idx);
         return (-1);
     }
     return (0);
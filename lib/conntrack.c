@@ -22,16 +22,13 @@
 #include "conntrack.h"
 #include "vuurmuur.h"
 
-static void free_conntrack_entry(struct vrmr_conntrack_entry *ce)
+/* the names of unknown zones and services point into the entry itself,
+ * so they must be set again when the entry is copied */
+static void conn_entry_set_names(struct vrmr_conntrack_entry *ce)
 {
-    if (ce->from == NULL)
-        free(ce->fromname);
-    if (ce->to == NULL)
-        free(ce->toname);
-    if (ce->service == NULL)
-        free(ce->sername);
-
-    free(ce);
+    ce->fromname = ce->from ? ce->from->name : ce->src_ip;
+    ce->toname = ce->to ? ce->to->name : ce->dst_ip;
+    ce->sername = ce->service ? ce->service->name : ce->unknown_service;
 }
 
 /*
@@ -69,24 +66,15 @@ static int filtered_connection(
 
 /*  vrmr_conn_hash_name
 
-    Very simple string hashing function. It just adds up
-    all chars.
+    String hashing function for the names of connections.
 */
 unsigned int vrmr_conn_hash_name(const void *key)
 {
-    unsigned int hash = 0;
-
     assert(key);
 
-    char *name = (char *)key;
+    const char *name = (const char *)key;
 
-    size_t len = strlen(name);
-    while (len) {
-        hash = hash + name[len];
-        len--;
-    }
-
-    return (hash);
+    return (unsigned int)vrmr_hash_bytes(name, strlen(name));
 }
 
 // TODO silly names
@@ -163,14 +151,6 @@ void vrmr_conn_list_cleanup(struct vrmr_list *conn_dlist)
 
     for (d_node = conn_dlist->top; d_node; d_node = d_node->next) {
         cd_ptr = d_node->data;
-
-        if (cd_ptr->from == NULL)
-            free(cd_ptr->fromname);
-        if (cd_ptr->to == NULL)
-            free(cd_ptr->toname);
-        if (cd_ptr->service == NULL)
-            free(cd_ptr->sername);
-
         free(cd_ptr);
     }
 
@@ -285,6 +265,10 @@ struct vrmr_conntrack_api_entry {
     char dst_ip[46];
     char orig_dst_ip[46];
 
+    /* binary versions of src_ip and dst_ip */
+    union vrmr_ipaddr src_addr;
+    union vrmr_ipaddr dst_addr;
+
     uint64_t toserver_packets;
     uint64_t toserver_bytes;
     uint64_t toclient_packets;
@@ -293,60 +277,74 @@ struct vrmr_conntrack_api_entry {
     char helper[30];
 };
 
+/*  conn_show_zone
+
+    Returns the zone to show for 'addr', given what the zone index returned
+    for it. Hosts and firewall entries are always shown. If the request asks
+    for unknown ips to be shown as their network, the network is shown for
+    addresses that are not a host. The local loopback is never shown as a
+    network.
+*/
+static struct vrmr_zone *conn_show_zone(struct vrmr_zone *zone, int family,
+        const union vrmr_ipaddr *addr, const struct vrmr_conntrack_request *req)
+{
+    if (zone == NULL || zone->type != VRMR_TYPE_NETWORK)
+        return (zone);
+
+    if (req->unknown_ip_as_net == FALSE ||
+            (family == AF_INET && addr->bytes[0] == 127))
+        return (NULL);
+
+    return (zone);
+}
+
 /*
     This function analyzes the api entry supplied through the 'ae' ptr.
-    It should never fail, unless we have a serious problem: malloc failure
-    or parameter problems.
+    It should never fail, unless we have a serious problem: parameter
+    problems.
 
     Returncodes:
          0: ok
         -1: (serious) error
 */
 static int conn_data_to_entry(const struct vrmr_conntrack_api_entry *cae,
-        struct vrmr_conntrack_entry *ce, struct vrmr_hash_table *serhash,
-        struct vrmr_hash_table *zonehash, struct vrmr_list *zonelist,
+        struct vrmr_conntrack_entry *ce, struct vrmr_service_classifier *sersc,
+        struct vrmr_zone_index *zone_idx, struct vrmr_name_cache *cache,
         struct vrmr_conntrack_request *req)
 {
-    char service_name[VRMR_MAX_SERVICE] = "", *zone_name_ptr = NULL;
-
-    assert(cae && ce && serhash && zonehash && req);
+    const struct vrmr_name_cache_entry *nc = NULL;
 
-    if (req->unknown_ip_as_net && zonelist == NULL) {
-        vrmr_error(-1, "Internal Error", "parameter problem");
-        return (-1);
-    }
+    assert(cae && ce && sersc && zone_idx && req);
 
     ce->ipv6 = (cae->family == AF_INET6);
 
+    if (cache != NULL)
+        nc = vrmr_name_cache_lookup(cache, zone_idx, sersc, cae->family,
+                cae->protocol, &cae->src_addr, &cae->dst_addr, cae->sp,
+                cae->dp);
+
     /* first the service name */
-    ce->service = vrmr_search_service_in_hash(
-            cae->sp, cae->dp, cae->protocol, serhash);
+    ce->service = nc ? nc->service
+                     : vrmr_service_classify(
+                               sersc, cae->protocol, cae->sp, cae->dp);
     if (ce->service == NULL) {
         /* do a reverse lookup. This will prevent connections that
          * have been picked up by conntrack midstream to look
          * unrecognized  */
-        if ((ce->service = vrmr_search_service_in_hash(
-                     cae->dp, cae->sp, cae->protocol, serhash)) == NULL) {
+        ce->service = nc ? nc->rservice
+                         : vrmr_service_classify(
+                                   sersc, cae->protocol, cae->dp, cae->sp);
+        if (ce->service == NULL) {
             if (cae->protocol == 6 || cae->protocol == 17)
-                snprintf(service_name, sizeof(service_name), "%d -> %d",
-                        cae->sp, cae->dp);
+                snprintf(ce->unknown_service, sizeof(ce->unknown_service),
+                        "%d -> %d", cae->sp, cae->dp);
             else if (cae->protocol == 1)
-                snprintf(service_name, sizeof(service_name), "%d:%d", cae->sp,
-                        cae->dp);
+                snprintf(ce->unknown_service, sizeof(ce->unknown_service),
+                        "%d:%d", cae->sp, cae->dp);
             else
-                snprintf(service_name, sizeof(service_name), "proto %d",
-                        cae->protocol);
-
-            if (!(ce->sername = strdup(service_name))) {
-                vrmr_error(-1, "Error", "strdup() failed: %s", strerror(errno));
-                return (-1);
-            }
-        } else {
-            /* found! */
-            ce->sername = ce->service->name;
+                snprintf(ce->unknown_service, sizeof(ce->unknown_service),
+                        "proto %d", cae->protocol);
         }
-    } else {
-        ce->sername = ce->service->name;
     }
 
     /* for hashing and display */
@@ -369,79 +367,23 @@ static int conn_data_to_entry(const struct vrmr_conntrack_api_entry *cae,
     }
 
     /* then the from name */
-    if (!(ce->ipv6))
-        ce->from = vrmr_search_zone_in_hash_with_ipv4(ce->src_ip, zonehash);
-    if (ce->from == NULL) {
+    ce->from = conn_show_zone(nc ? nc->from
+                                 : vrmr_zone_index_lookup(zone_idx, cae->family,
+                                           &cae->src_addr),
+            cae->family, &cae->src_addr, req);
+    if (ce->from == NULL)
         vrmr_debug(HIGH, "unknown ip: '%s'.", ce->src_ip);
 
-        if (req->unknown_ip_as_net == FALSE) {
-            if (!(ce->fromname = strdup(ce->src_ip))) {
-                vrmr_error(-1, "Error",
-                        "strdup() "
-                        "failed: %s",
-                        strerror(errno));
-                return (-1);
-            }
-        } else {
-            if (!(zone_name_ptr = vrmr_get_network_for_ipv4(
-                          ce->src_ip, zonelist))) {
-                if (!(ce->fromname = strdup(ce->src_ip))) {
-                    vrmr_error(-1, "Internal Error", "malloc failed: %s",
-                            strerror(errno));
-                    return (-1);
-                }
-            } else {
-                if (!(ce->fromname = strdup(zone_name_ptr))) {
-                    vrmr_error(-1, "Internal Error", "strdup failed: %s",
-                            strerror(errno));
-                    free(zone_name_ptr);
-                    return (-1);
-                }
-
-                free(zone_name_ptr);
-            }
-        }
-    } else {
-        ce->fromname = ce->from->name;
-    }
-
     /* dst ip */
     strlcpy(ce->dst_ip, cae->dst_ip, sizeof(ce->dst_ip));
     /* dst ip */
     strlcpy(ce->orig_dst_ip, cae->orig_dst_ip, sizeof(ce->orig_dst_ip));
     /* then the to name */
-    if (!(ce->ipv6))
-        ce->to = vrmr_search_zone_in_hash_with_ipv4(ce->dst_ip, zonehash);
-    if (ce->to == NULL) {
-        if (req->unknown_ip_as_net == FALSE) {
-            if (!(ce->toname = strdup(ce->dst_ip))) {
-                vrmr_error(-1, "Internal Error", "strdup failed: %s",
-                        strerror(errno));
-                return (-1);
-            }
-        } else {
-            if (!(zone_name_ptr = vrmr_get_network_for_ipv4(
-                          ce->dst_ip, zonelist))) {
-                if (!(ce->toname = strdup(ce->dst_ip))) {
-                    vrmr_error(-1, "Internal Error", "strdup failed: %s",
-                            strerror(errno));
-                    return (-1);
-                }
-            } else {
-                if (!(ce->toname = strdup(zone_name_ptr))) {
-                    vrmr_error(-1, "Internal Error", "strdup failed: %s",
-                            strerror(errno));
-
-                    free(zone_name_ptr);
-                    return (-1);
-                }
-
-                free(zone_name_ptr);
-            }
-        }
-    } else {
-        ce->toname = ce->to->name;
-    }
+    ce->to = conn_show_zone(nc ? nc->to
+                               : vrmr_zone_index_lookup(zone_idx, cae->family,
+                                         &cae->dst_addr),
+            cae->family, &cae->dst_addr, req);
+    conn_entry_set_names(ce);
 
     vrmr_debug(NONE, "status cae->status %u", cae->status);
 
@@ -497,33 +439,25 @@ static int conn_data_to_entry(const struct vrmr_conntrack_api_entry *cae,
  * \retval 1 ok
  * \retval 0 skipped
  */
-int vrmr_conntrack_ct2ae(uint32_t type ATTR_UNUSED, struct nf_conntrack *ct,
+static int conntrack_ct2ae(const struct vrmr_conntrack_info *ct,
         struct vrmr_conntrack_api_entry *lr)
 {
-    uint64_t ts_start = nfct_get_attr_u64(ct, ATTR_TIMESTAMP_START);
-    uint64_t ts_stop = nfct_get_attr_u64(ct, ATTR_TIMESTAMP_STOP);
-    uint64_t ts_delta = ts_stop - ts_start;
+    uint64_t ts_delta = ct->ts_stop - ct->ts_start;
     uint32_t ts_delta_sec = ts_delta / 1000000000UL;
 
     lr->age_s = ts_delta_sec;
 
-    struct nfct_attr_grp_ctrs ctrs = {0, 0};
+    lr->toserver_packets = ct->orig_packets;
+    lr->toserver_bytes = ct->orig_bytes;
+    lr->toclient_packets = ct->repl_packets;
+    lr->toclient_bytes = ct->repl_bytes;
 
-    nfct_get_attr_grp(ct, ATTR_GRP_ORIG_COUNTERS, &ctrs);
-    lr->toserver_packets = ctrs.packets;
-    lr->toserver_bytes = ctrs.bytes;
-
-    nfct_get_attr_grp(ct, ATTR_GRP_REPL_COUNTERS, &ctrs);
-    lr->toclient_packets = ctrs.packets;
-    lr->toclient_bytes = ctrs.bytes;
-
-    uint8_t ipv = nfct_get_attr_u8(ct, ATTR_L3PROTO);
-    switch (ipv) {
+    switch (ct->family) {
         case AF_INET: {
-            uint32_t src_ip = nfct_get_attr_u32(ct, ATTR_IPV4_SRC);
-            uint32_t dst_ip = nfct_get_attr_u32(ct, ATTR_IPV4_DST);
-            uint32_t repl_src_ip = nfct_get_attr_u32(ct, ATTR_REPL_IPV4_SRC);
-            uint32_t repl_dst_ip = nfct_get_attr_u32(ct, ATTR_REPL_IPV4_DST);
+            uint32_t src_ip = ct->orig_src.ipv4.s_addr;
+            uint32_t dst_ip = ct->orig_dst.ipv4.s_addr;
+            uint32_t repl_src_ip = ct->repl_src.ipv4.s_addr;
+            uint32_t repl_dst_ip = ct->repl_dst.ipv4.s_addr;
 
             inet_ntop(AF_INET, &src_ip, lr->src_ip, sizeof(lr->src_ip));
             inet_ntop(AF_INET, &dst_ip, lr->dst_ip, sizeof(lr->dst_ip));
@@ -541,50 +475,52 @@ int vrmr_conntrack_ct2ae(uint32_t type ATTR_UNUSED, struct nf_conntrack *ct,
                 inet_ntop(AF_INET, &dst_ip, lr->orig_dst_ip,
                         sizeof(lr->orig_dst_ip));
             }
-            inet_ntop(AF_INET, &src_ip, lr->src_ip, sizeof(lr->src_ip));
 
             if (strncmp(lr->src_ip, "127.", 4) == 0)
                 goto skip;
+
+            lr->src_addr.ipv4.s_addr = src_ip;
+            if (src_ip == repl_dst_ip && dst_ip == repl_src_ip)
+                lr->dst_addr.ipv4.s_addr = dst_ip;
+            else if (src_ip == repl_dst_ip ||
+                     (src_ip != repl_src_ip && dst_ip != repl_dst_ip))
+                lr->dst_addr.ipv4.s_addr = repl_src_ip;
+            else
+                lr->dst_addr.ipv4.s_addr = dst_ip;
             break;
         }
         case AF_INET6: {
-            struct nfct_attr_grp_ipv6 addrs;
-            memset(&addrs, 0, sizeof(addrs));
-            nfct_get_attr_grp(ct, ATTR_GRP_ORIG_IPV6, &addrs);
-
-            inet_ntop(AF_INET6, &addrs.src, lr->src_ip, sizeof(lr->src_ip));
-            inet_ntop(AF_INET6, &addrs.dst, lr->dst_ip, sizeof(lr->dst_ip));
+            inet_ntop(AF_INET6, &ct->orig_src, lr->src_ip, sizeof(lr->src_ip));
+            inet_ntop(AF_INET6, &ct->orig_dst, lr->dst_ip, sizeof(lr->dst_ip));
+            lr->src_addr = ct->orig_src;
+            lr->dst_addr = ct->orig_dst;
             break;
         }
         default:
-            abort();
+            goto skip;
     }
-    lr->family = ipv;
+    lr->family = ct->family;
 
-    lr->protocol = nfct_get_attr_u8(ct, ATTR_L4PROTO);
+    lr->protocol = ct->protocol;
     switch (lr->protocol) {
         case IPPROTO_TCP:
         case IPPROTO_UDP:
-            lr->sp = ntohs(nfct_get_attr_u16(ct, ATTR_PORT_SRC));
-            lr->dp = ntohs(nfct_get_attr_u16(ct, ATTR_PORT_DST));
-            lr->alt_sp = ntohs(nfct_get_attr_u16(ct, ATTR_REPL_PORT_SRC));
-            lr->alt_dp = ntohs(nfct_get_attr_u16(ct, ATTR_REPL_PORT_DST));
+            lr->sp = ct->orig_sport;
+            lr->dp = ct->orig_dport;
+            lr->alt_sp = ct->repl_sport;
+            lr->alt_dp = ct->repl_dport;
             break;
     }
 
     if (lr->protocol == IPPROTO_TCP) {
-        lr->tcp_state = nfct_get_attr_u8(ct, ATTR_TCP_STATE);
-        lr->tcp_flags_ts = nfct_get_attr_u8(ct, ATTR_TCP_FLAGS_ORIG);
-        lr->tcp_flags_tc = nfct_get_attr_u8(ct, ATTR_TCP_FLAGS_REPL);
+        lr->tcp_state = ct->tcp_state;
+        lr->tcp_flags_ts = ct->tcp_flags_orig;
+        lr->tcp_flags_tc = ct->tcp_flags_repl;
     }
 
-    lr->nfmark = nfct_get_attr_u32(ct, ATTR_MARK);
-    lr->status = nfct_get_attr_u32(ct, ATTR_STATUS);
-
-    const char *helper = nfct_get_attr(ct, ATTR_HELPER_NAME);
-    if (helper) {
-        strlcpy(lr->helper, helper, sizeof(lr->helper));
-    }
+    lr->nfmark = ct->mark;
+    lr->status = ct->status;
+    strlcpy(lr->helper, ct->helper, sizeof(lr->helper));
 
     return 1;
 skip:
@@ -592,47 +528,40 @@ skip:
 }
 
 /**
+ * \param event VRMR_CT_EVENT_NEW or VRMR_CT_EVENT_DESTROY
  * \retval 1 ok
  * \retval 0 skipped
  */
-int vrmr_conntrack_ct2lr(
-        uint32_t type, struct nf_conntrack *ct, struct vrmr_log_record *lr)
+int vrmr_conntrack_ct2lr(unsigned int event,
+        const struct vrmr_conntrack_info *ct, struct vrmr_log_record *lr)
 {
-    memset(lr, 0, sizeof(*lr));
+    vrmr_log_record_reset(lr);
 
-    switch (type) {
-        case NFCT_T_NEW:
+    switch (event) {
+        case VRMR_CT_EVENT_NEW:
             lr->conn_rec.type = VRMR_LOG_CONN_NEW;
             break;
-        case NFCT_T_DESTROY: {
+        case VRMR_CT_EVENT_DESTROY: {
             lr->conn_rec.type = VRMR_LOG_CONN_COMPLETED;
 
-            uint64_t ts_start = nfct_get_attr_u64(ct, ATTR_TIMESTAMP_START);
-            uint64_t ts_stop = nfct_get_attr_u64(ct, ATTR_TIMESTAMP_STOP);
-            uint64_t ts_delta = ts_stop - ts_start;
+            uint64_t ts_delta = ct->ts_stop - ct->ts_start;
             uint32_t ts_delta_sec = ts_delta / 1000000000UL;
 
             lr->conn_rec.age_s = ts_delta_sec;
 
-            struct nfct_attr_grp_ctrs ctrs = {0, 0};
-
-            nfct_get_attr_grp(ct, ATTR_GRP_ORIG_COUNTERS, &ctrs);
-            lr->conn_rec.toserver_packets = ctrs.packets;
-            lr->conn_rec.toserver_bytes = ctrs.bytes;
-
-            nfct_get_attr_grp(ct, ATTR_GRP_REPL_COUNTERS, &ctrs);
-            lr->conn_rec.toclient_packets = ctrs.packets;
-            lr->conn_rec.toclient_bytes = ctrs.bytes;
+            lr->conn_rec.toserver_packets = ct->orig_packets;
+            lr->conn_rec.toserver_bytes = ct->orig_bytes;
+            lr->conn_rec.toclient_packets = ct->repl_packets;
+            lr->conn_rec.toclient_bytes = ct->repl_bytes;
             break;
         }
     }
 
-    uint8_t ipv = nfct_get_attr_u8(ct, ATTR_L3PROTO);
-    switch (ipv) {
+    switch (ct->family) {
         case AF_INET: {
-            uint32_t src_ip = nfct_get_attr_u32(ct, ATTR_IPV4_SRC);
-            uint32_t dst_ip = nfct_get_attr_u32(ct, ATTR_IPV4_DST);
-            uint32_t repl_src_ip = nfct_get_attr_u32(ct, ATTR_REPL_IPV4_SRC);
+            uint32_t src_ip = ct->orig_src.ipv4.s_addr;
+            uint32_t dst_ip = ct->orig_dst.ipv4.s_addr;
+            uint32_t repl_src_ip = ct->repl_src.ipv4.s_addr;
             inet_ntop(AF_INET, &src_ip, lr->src_ip, sizeof(lr->src_ip));
             /* DNAT has the ip we care about as repl_src_ip */
             if (repl_src_ip != dst_ip)
@@ -641,39 +570,38 @@ int vrmr_conntrack_ct2lr(
 
             if (strncmp(lr->src_ip, "127.", 4) == 0)
                 goto skip;
+
+            lr->src_addr.ipv4.s_addr = src_ip;
+            lr->dst_addr.ipv4.s_addr = dst_ip;
+            lr->have_addr = 1;
             break;
         }
         case AF_INET6: {
             lr->ipv6 = TRUE;
 
-            struct nfct_attr_grp_ipv6 addrs;
-            memset(&addrs, 0, sizeof(addrs));
-            nfct_get_attr_grp(ct, ATTR_GRP_ORIG_IPV6, &addrs);
-
-            inet_ntop(AF_INET6, &addrs.src, lr->src_ip, sizeof(lr->src_ip));
-            inet_ntop(AF_INET6, &addrs.dst, lr->dst_ip, sizeof(lr->dst_ip));
+            inet_ntop(AF_INET6, &ct->orig_src, lr->src_ip, sizeof(lr->src_ip));
+            inet_ntop(AF_INET6, &ct->orig_dst, lr->dst_ip, sizeof(lr->dst_ip));
+            lr->src_addr = ct->orig_src;
+            lr->dst_addr = ct->orig_dst;
+            lr->have_addr = 1;
             break;
         }
         default:
-            abort();
+            goto skip;
     }
 
-    lr->protocol = nfct_get_attr_u8(ct, ATTR_L4PROTO);
+    lr->protocol = ct->protocol;
     switch (lr->protocol) {
         case IPPROTO_TCP:
         case IPPROTO_UDP: {
-            lr->src_port = ntohs(nfct_get_attr_u16(ct, ATTR_PORT_SRC));
-            lr->dst_port = ntohs(nfct_get_attr_u16(ct, ATTR_PORT_DST));
+            lr->src_port = ct->orig_sport;
+            lr->dst_port = ct->orig_dport;
             break;
         }
     }
 
-    lr->conn_rec.mark = nfct_get_attr_u32(ct, ATTR_MARK);
-
-    const char *helper = nfct_get_attr(ct, ATTR_HELPER_NAME);
-    if (helper) {
-        strlcpy(lr->helper, helper, sizeof(lr->helper));
-    }
+    lr->conn_rec.mark = ct->mark;
+    strlcpy(lr->helper, ct->helper, sizeof(lr->helper));
 
     return 1;
 skip:
@@ -682,17 +610,16 @@ skip:
 
 struct dump_cb_ctx {
     struct vrmr_config *cnf;
-    struct vrmr_hash_table *serhash;
-    struct vrmr_hash_table *zonehash;
-    struct vrmr_list *zonelist;
+    struct vrmr_service_classifier *sersc;
+    struct vrmr_zone_index *zone_idx;
+    struct vrmr_name_cache *name_cache;
     struct vrmr_conntrack_request *req;
     struct vrmr_conntrack_stats *connstat_ptr;
     struct vrmr_list *conn_dlist;
     struct vrmr_hash_table *conn_hash;
 };
 
-static int dump_cb(
-        enum nf_conntrack_msg_type type, struct nf_conntrack *ct, void *data)
+static int dump_cb(const struct vrmr_conntrack_info *ct, void *data)
 {
     assert(ct);
     assert(data);
@@ -701,122 +628,99 @@ static int dump_cb(
     memset(&cae, 0, sizeof(cae));
 
     struct dump_cb_ctx *ctx = data;
-    if (vrmr_conntrack_ct2ae(type, ct, &cae)) {
-        struct vrmr_conntrack_entry *ce = NULL;
-        if (!(ce = calloc(1, sizeof(*ce)))) {
-            vrmr_error(-1, "Error", "calloc() failed: %s", strerror(errno));
-            return NFCT_CB_STOP;
-        }
+    if (!conntrack_ct2ae(ct, &cae))
+        return (0);
 
-        if (conn_data_to_entry(&cae, ce, ctx->serhash, ctx->zonehash,
-                    ctx->zonelist, ctx->req) < 0) {
-            vrmr_error(-1, "Error", "conn_data_to_entry() failed");
-            free(ce);
-            return NFCT_CB_STOP;
-        }
+    /* only allocated if it is not merged into an existing entry */
+    struct vrmr_conntrack_entry entry;
+    struct vrmr_conntrack_entry *ce = &entry;
+    memset(ce, 0, sizeof(*ce));
 
-        /*  we ignore the local loopback connections
-            and connections that are filtered */
-        if ((strncmp(ce->fromname, "127.", 4) == 0 ||
-                    strncmp(ce->toname, "127.", 4) == 0 ||
-                    (ctx->req->use_filter == TRUE &&
-                            filtered_connection(ce, &ctx->req->filter) == 1))) {
-            free_conntrack_entry(ce);
-            return NFCT_CB_CONTINUE;
-        }
+    if (conn_data_to_entry(&cae, ce, ctx->sersc, ctx->zone_idx,
+                ctx->name_cache, ctx->req) < 0) {
+        vrmr_error(-1, "Error", "conn_data_to_entry() failed");
+        return (-1);
+    }
 
-        /* update counters */
-        update_stats(ce, ctx->connstat_ptr);
-
-        /* now check if the cd is already in the list */
-        struct vrmr_conntrack_entry *found = NULL;
-        if (ctx->req->group_conns == TRUE &&
-                (found = vrmr_hash_search(ctx->conn_hash, (void *)ce)) !=
-                        NULL) {
-            /*  FOUND in the hash. Transfer the acc data */
-            found->to_src_packets += ce->to_src_packets;
-            found->to_src_bytes += ce->to_src_bytes;
-            found->to_dst_packets += ce->to_dst_packets;
-            found->to_dst_bytes += ce->to_dst_bytes;
-            found->cnt++;
-
-            free_conntrack_entry(ce);
-        } else {
-            /*  NOT found in the hash */
+    /*  we ignore the local loopback connections
+        and connections that are filtered */
+    if ((strncmp(ce->fromname, "127.", 4) == 0 ||
+                strncmp(ce->toname, "127.", 4) == 0 ||
+                (ctx->req->use_filter == TRUE &&
+                        filtered_connection(ce, &ctx->req->filter) == 1))) {
+        return (0);
+    }
 
-            /* append the new cd to the list */
-            if (vrmr_list_append(ctx->conn_dlist, ce) == NULL) {
-                vrmr_error(-1, "Internal Error", "unable to append into list");
-                free_conntrack_entry(ce);
-                return NFCT_CB_STOP;
-            }
+    /* update counters */
+    update_stats(ce, ctx->connstat_ptr);
+
+    /* now check if the cd is already in the list */
+    struct vrmr_conntrack_entry *found = NULL;
+    if (ctx->req->group_conns == TRUE &&
+            (found = vrmr_hash_search(ctx->conn_hash, (void *)ce)) != NULL) {
+        /*  FOUND in the hash. Transfer the acc data */
+        found->to_src_packets += ce->to_src_packets;
+        found->to_src_bytes += ce->to_src_bytes;
+        found->to_dst_packets += ce->to_dst_packets;
+        found->to_dst_bytes += ce->to_dst_bytes;
+        found->cnt++;
+    } else {
+        /*  NOT found in the hash */
+        if (!(ce = malloc(sizeof(*ce)))) {
+            vrmr_error(-1, "Error", "malloc() failed: %s", strerror(errno));
+            return (-1);
+        }
+        *ce = entry;
+        conn_entry_set_names(ce);
+        ce->cnt = 1;
 
-            /* and insert it into the hash */
-            if (vrmr_hash_insert(ctx->conn_hash, ce) != 0) {
-                vrmr_error(-1, "Internal Error", "unable to insert into hash");
-                free_conntrack_entry(ce);
-                return NFCT_CB_STOP;
-            }
+        /* append the new cd to the list */
+        if (vrmr_list_append(ctx->conn_dlist, ce) == NULL) {
+            vrmr_error(-1, "Internal Error", "unable to append into list");
+            free(ce);
+            return (-1);
+        }
 
-            ce->cnt = 1;
+        /* and insert it into the hash. The list owns it now. */
+        if (vrmr_hash_insert(ctx->conn_hash, ce) != 0) {
+            vrmr_error(-1, "Internal Error", "unable to insert into hash");
+            return (-1);
         }
     }
-    return NFCT_CB_CONTINUE;
+    return (0);
 }
 
 static int vrmr_conn_get_connections_api(struct vrmr_config *cnf,
-        struct vrmr_hash_table *serv_hash, struct vrmr_hash_table *zone_hash,
-        struct vrmr_list *conn_dlist, struct vrmr_hash_table *conn_hash,
-        struct vrmr_list *zone_list, struct vrmr_conntrack_request *req,
+        struct vrmr_service_classifier *serv_sc,
+        struct vrmr_zone_index *zone_idx, struct vrmr_name_cache *name_cache,
+        struct vrmr_list *conn_dlist,
+        struct vrmr_hash_table *conn_hash, struct vrmr_conntrack_request *req,
         struct vrmr_conntrack_stats *connstat_ptr)
 {
     assert(cnf);
-    assert(serv_hash);
-    assert(zone_hash);
+    assert(serv_sc);
+    assert(zone_idx);
     assert(req);
 
-    int retval = 0;
-
-    struct nf_conntrack *ct = nfct_new();
-    if (ct == NULL) {
-        vrmr_error(-1, "Error", "nfct_new failed");
-        return -1;
-    }
-
-    struct nfct_handle *h = nfct_open(CONNTRACK, 0);
-    if (h == NULL) {
-        vrmr_error(-1, "Error", "nfct_open failed");
-        nfct_destroy(ct);
-        return -1;
-    }
-
     struct dump_cb_ctx ctx = {
             .cnf = cnf,
-            .serhash = serv_hash,
-            .zonehash = zone_hash,
+            .sersc = serv_sc,
+            .zone_idx = zone_idx,
+            .name_cache = name_cache,
             .conn_dlist = conn_dlist,
-            .zonelist = zone_list,
             .req = req,
             .connstat_ptr = connstat_ptr,
             .conn_hash = conn_hash,
     };
 
-    nfct_callback_register(h, NFCT_T_ALL, dump_cb, &ctx);
-    int ret = nfct_query(h, NFCT_Q_DUMP, ct);
-    if (ret != 0) {
-        vrmr_error(-1, "Error", "nfct_query failed: %d", ret);
-        retval = -1;
-    }
-
-    nfct_close(h);
-    nfct_destroy(ct);
-    return retval;
+    return (vrmr_conntrack_dump(dump_cb, &ctx));
 }
 
 int vrmr_conn_get_connections(struct vrmr_config *cnf,
-        const unsigned int prev_conn_cnt, struct vrmr_hash_table *serv_hash,
-        struct vrmr_hash_table *zone_hash, struct vrmr_list *conn_dlist,
-        struct vrmr_list *zone_list, struct vrmr_conntrack_request *req,
+        const unsigned int prev_conn_cnt,
+        struct vrmr_service_classifier *serv_sc,
+        struct vrmr_zone_index *zone_idx, struct vrmr_name_cache *name_cache,
+        struct vrmr_list *conn_dlist, struct vrmr_conntrack_request *req,
         struct vrmr_conntrack_stats *connstat_ptr)
 {
     int retval = 0;
@@ -840,8 +744,8 @@ int vrmr_conn_get_connections(struct vrmr_config *cnf,
         return (-1);
     }
 
-    retval = vrmr_conn_get_connections_api(cnf, serv_hash, zone_hash,
-            conn_dlist, &conn_hash, zone_list, req, connstat_ptr);
+    retval = vrmr_conn_get_connections_api(cnf, serv_sc, zone_idx, name_cache,
+            conn_dlist, &conn_hash, req, connstat_ptr);
     if (retval == 0) {
         vrmr_hash_cleanup(&conn_hash);
         return (retval);
@@ -895,39 +799,15 @@ int vrmr_conn_kill_connection_api(const int family, const char *src_ip,
     return retval;
 }
 
-static int stub_cb(enum nf_conntrack_msg_type type ATTR_UNUSED,
-        struct nf_conntrack *ct ATTR_UNUSED, void *data ATTR_UNUSED)
+static int stub_cb(const struct vrmr_conntrack_info *ct ATTR_UNUSED,
+        void *data ATTR_UNUSED)
 {
-    return NFCT_CB_CONTINUE;
+    return (0);
 }
 
 bool vrmr_conn_check_api(void)
 {
-    bool retval = true;
-
-    struct nf_conntrack *ct = nfct_new();
-    if (ct == NULL) {
-        vrmr_error(-1, "Error", "nfct_new failed");
-        return false;
-    }
-
-    struct nfct_handle *h = nfct_open(CONNTRACK, 0);
-    if (h == NULL) {
-        vrmr_error(-1, "Error", "nfct_open failed");
-        nfct_destroy(ct);
-        return false;
-    }
-
-    nfct_callback_register(h, NFCT_T_ALL, stub_cb, NULL);
-    int ret = nfct_query(h, NFCT_Q_DUMP, ct);
-    if (ret != 0) {
-        vrmr_error(-1, "Error", "nfct_query failed: %d", ret);
-        retval = false;
-    }
-
-    nfct_close(h);
-    nfct_destroy(ct);
-    return retval;
+    return (vrmr_conntrack_dump(stub_cb, NULL) == 0);
 }
 
 struct count_cb_ctx {
@@ -936,12 +816,10 @@ struct count_cb_ctx {
     uint32_t other;
 };
 
-static int count_cb(enum nf_conntrack_msg_type type ATTR_UNUSED,
-        struct nf_conntrack *ct, void *data)
+static int count_cb(const struct vrmr_conntrack_info *ct, void *data)
 {
     struct count_cb_ctx *ctx = data;
-    uint8_t protocol = nfct_get_attr_u8(ct, ATTR_L4PROTO);
-    switch (protocol) {
+    switch (ct->protocol) {
         case IPPROTO_TCP:
             ctx->tcp++;
             break;
@@ -952,46 +830,268 @@ static int count_cb(enum nf_conntrack_msg_type type ATTR_UNUSED,
             ctx->other++;
             break;
     }
-    return NFCT_CB_CONTINUE;
+    return (0);
 }
 
 int vrmr_conn_count_connections_api(
         uint32_t *tcp, uint32_t *udp, uint32_t *other)
 {
-    int retval = 0;
     struct count_cb_ctx ctx = {.tcp = 0, .udp = 0, .other = 0};
 
     *tcp = 0;
     *udp = 0;
     *other = 0;
 
-    struct nf_conntrack *ct = nfct_new();
-    if (ct == NULL) {
-        vrmr_error(-1, "Error", "nfct_new failed");
-        return -1;
+    if (vrmr_conntrack_dump(count_cb, &ctx) < 0)
+        return (-1);
+
+    *tcp = ctx.tcp;
+    *udp = ctx.udp;
+    *other = ctx.other;
+    return (0);
+}
+
+/* split 'str' on commas and whitespace and call 'cb' for every item */
+static int conntrack_filter_foreach(const char *option, const char *str,
+        struct vrmr_conntrack_filter *f,
+        int (*cb)(struct vrmr_conntrack_filter *f, const char *item))
+{
+    char buf[512];
+    char *saveptr = NULL;
+
+    if (strlcpy(buf, str, sizeof(buf)) >= sizeof(buf)) {
+        vrmr_warning("Warning", "option %s is too long", option);
+        return (-1);
     }
 
-    struct nfct_handle *h = nfct_open(CONNTRACK, 0);
-    if (h == NULL) {
-        vrmr_error(-1, "Error", "nfct_open failed");
-        nfct_destroy(ct);
-        return -1;
+    for (char *item = strtok_r(buf, ", \t", &saveptr); item != NULL;
+            item = strtok_r(NULL, ", \t", &saveptr)) {
+        if (cb(f, item) < 0) {
+            vrmr_warning("Warning", "'%s' is not a valid value for option %s",
+                    item, option);
+            return (-1);
+        }
     }
+    return (0);
+}
 
-    nfct_callback_register(h, NFCT_T_ALL, count_cb, &ctx);
-    int ret = nfct_query(h, NFCT_Q_DUMP, ct);
-    if (ret != 0) {
-        vrmr_error(-1, "Error", "nfct_query failed: %d", ret);
-        retval = -1;
+static int conntrack_filter_add_event(
+        struct vrmr_conntrack_filter *f, const char *item)
+{
+    if (strcasecmp(item, "new") == 0)
+        f->events |= VRMR_CT_EVENT_NEW;
+    else if (strcasecmp(item, "destroy") == 0)
+        f->events |= VRMR_CT_EVENT_DESTROY;
+    else
+        return (-1);
+    return (0);
+}
+
+static int conntrack_filter_add_proto(
+        struct vrmr_conntrack_filter *f, const char *item)
+{
+    static const struct {
+        const char *name;
+        int proto;
+    } names[] = {
+            {"icmp", IPPROTO_ICMP},
+            {"tcp", IPPROTO_TCP},
+            {"udp", IPPROTO_UDP},
+            {"dccp", IPPROTO_DCCP},
+            {"gre", IPPROTO_GRE},
+            {"esp", IPPROTO_ESP},
+            {"ah", IPPROTO_AH},
+            {"icmpv6", IPPROTO_ICMPV6},
+            {"ipv6-icmp", IPPROTO_ICMPV6},
+            {"sctp", IPPROTO_SCTP},
+            {"udplite", IPPROTO_UDPLITE},
+    };
+    char *end = NULL;
+    long proto = -1;
+
+    if (f->proto_cnt >= VRMR_CT_FILTER_MAX_PROTO)
+        return (-1);
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcasecmp(item, names[i].name) == 0) {
+            proto = names[i].proto;
+            break;
+        }
+    }
+    /* or a protocol number */
+    if (proto == -1) {
+        proto = strtol(item, &end, 10);
+        if (end == item || *end != '\0')
+            return (-1);
     }
+    if (proto < 0 || proto > 255)
+        return (-1);
 
-    nfct_close(h);
-    nfct_destroy(ct);
+    f->proto[f->proto_cnt++] = (uint8_t)proto;
+    return (0);
+}
 
-    if (retval == 0) {
-        *tcp = ctx.tcp;
-        *udp = ctx.udp;
-        *other = ctx.other;
+static int conntrack_filter_add_ignore(
+        struct vrmr_conntrack_filter *f, const char *item)
+{
+    char addr[64];
+
+    if (f->ignore_cnt >= VRMR_CT_FILTER_MAX_ADDR)
+        return (-1);
+    if (strlcpy(addr, item, sizeof(addr)) >= sizeof(addr))
+        return (-1);
+
+    int family = strchr(addr, ':') ? AF_INET6 : AF_INET;
+    unsigned int prefix = family == AF_INET ? 32 : 128;
+
+    char *slash = strchr(addr, '/');
+    if (slash != NULL) {
+        char *end = NULL;
+        *slash = '\0';
+        unsigned long bits = strtoul(slash + 1, &end, 10);
+        if (end == slash + 1 || *end != '\0' || bits > prefix)
+            return (-1);
+        prefix = (unsigned int)bits;
     }
-    return retval;
+
+    union vrmr_ipaddr *a = &f->ignore[f->ignore_cnt].addr;
+    memset(a, 0, sizeof(*a));
+    if (inet_pton(family, addr, a) != 1)
+        return (-1);
+
+    f->ignore[f->ignore_cnt].family = family;
+    f->ignore[f->ignore_cnt].prefix = prefix;
+    f->ignore_cnt++;
+    return (0);
+}
+
+/*  vrmr_conntrack_filter_parse
+
+    Parses the CONNLOG_EVENTS, CONNLOG_PROTO, CONNLOG_IGNORE and
+    CONNLOG_MARK options into 'f'. vuurmuur_log installs the result as a
+    socket filter, so the kernel drops the events it would not log.
+
+    Returncodes:
+         0: ok
+        -1: invalid option, a warning is printed
+*/
+int vrmr_conntrack_filter_parse(
+        const struct vrmr_config *cnf, struct vrmr_conntrack_filter *f)
+{
+    assert(cnf && f);
+
+    memset(f, 0, sizeof(*f));
+
+    if (conntrack_filter_foreach("CONNLOG_EVENTS", cnf->connlog_events, f,
+                conntrack_filter_add_event) < 0)
+        return (-1);
+    if (f->events == 0) {
+        vrmr_warning("Warning", "option CONNLOG_EVENTS can't be empty");
+        return (-1);
+    }
+    if (conntrack_filter_foreach("CONNLOG_PROTO", cnf->connlog_proto, f,
+                conntrack_filter_add_proto) < 0)
+        return (-1);
+    if (conntrack_filter_foreach("CONNLOG_IGNORE", cnf->connlog_ignore, f,
+                conntrack_filter_add_ignore) < 0)
+        return (-1);
+
+    if (cnf->connlog_mark[0] != '\0') {
+        char *end = NULL;
+        unsigned long long val, mask = 0xffffffffULL;
+
+        errno = 0;
+        val = strtoull(cnf->connlog_mark, &end, 0);
+        if (errno == 0 && end != cnf->connlog_mark && *end == '/') {
+            char *m = end + 1;
+            mask = strtoull(m, &end, 0);
+            if (end == m)
+                errno = EINVAL;
+        }
+        if (errno != 0 || *end != '\0' || val > 0xffffffffULL ||
+                mask > 0xffffffffULL) {
+            vrmr_warning("Warning",
+                    "'%s' is not a valid value for option CONNLOG_MARK",
+                    cnf->connlog_mark);
+            return (-1);
+        }
+        f->have_mark = 1;
+        f->mark = (uint32_t)(val & mask);
+        f->mark_mask = (uint32_t)mask;
+    }
+    return (0);
+}
+
+static int conntrack_filter_in_net(
+        const union vrmr_ipaddr *addr, const union vrmr_ipaddr *net,
+        unsigned int prefix)
+{
+    unsigned int bytes = prefix / 8;
+    unsigned int bits = prefix % 8;
+
+    if (memcmp(addr->bytes, net->bytes, bytes) != 0)
+        return (0);
+    if (bits == 0)
+        return (1);
+
+    uint8_t mask = (uint8_t)(0xff << (8 - bits));
+    return ((addr->bytes[bytes] & mask) == (net->bytes[bytes] & mask));
+}
+
+/*  vrmr_conntrack_filter_match
+
+    Userspace version of the filter, for when the kernel refused it.
+
+    Returncodes:
+         1: log the connection
+         0: filtered out
+*/
+int vrmr_conntrack_filter_match(const struct vrmr_conntrack_filter *f,
+        const struct vrmr_log_record *lr)
+{
+    assert(f && lr);
+
+    unsigned int event = lr->conn_rec.type == VRMR_LOG_CONN_COMPLETED
+                                 ? VRMR_CT_EVENT_DESTROY
+                                 : VRMR_CT_EVENT_NEW;
+    if (!(f->events & event))
+        return (0);
+
+    if (f->proto_cnt > 0) {
+        unsigned int i;
+        for (i = 0; i < f->proto_cnt; i++) {
+            if (f->proto[i] == lr->protocol)
+                break;
+        }
+        if (i == f->proto_cnt)
+            return (0);
+    }
+
+    if (f->ignore_cnt > 0) {
+        int family = lr->ipv6 ? AF_INET6 : AF_INET;
+        union vrmr_ipaddr src = lr->src_addr, dst = lr->dst_addr;
+
+        /* not set for loopback */
+        if (!lr->have_addr) {
+            memset(&src, 0, sizeof(src));
+            memset(&dst, 0, sizeof(dst));
+            if (inet_pton(family, lr->src_ip, &src) != 1 ||
+                    inet_pton(family, lr->dst_ip, &dst) != 1)
+                return (1);
+        }
+
+        for (unsigned int i = 0; i < f->ignore_cnt; i++) {
+            if (f->ignore[i].family != family)
+                continue;
+            if (conntrack_filter_in_net(
+                        &src, &f->ignore[i].addr, f->ignore[i].prefix) ||
+                    conntrack_filter_in_net(
+                            &dst, &f->ignore[i].addr, f->ignore[i].prefix))
+                return (0);
+        }
+    }
+
+    if (f->have_mark && (lr->conn_rec.mark & f->mark_mask) != f->mark)
+        return (0);
+    return (1);
 }
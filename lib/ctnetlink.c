@@ -0,0 +1,388 @@
+/***************************************************************************
+ *   Copyright (C) 2003-2019 by Victor Julien                              *
+ *   victor@vuurmuur.org                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*  ctnetlink parser
+
+    Decodes conntrack netlink messages straight into a fixed size struct
+    vrmr_conntrack_info, without the per message allocation of
+    nfct_new()/nfct_nlmsg_parse(). vuurmuur_log uses it for the events and
+    the connection view of vuurmuur_conf for the dumps, so both have the
+    same view of a connection.
+
+    Only the attributes we use are decoded, the rest is skipped.
+*/
+
+#include "config.h"
+#include "vuurmuur.h"
+
+#include <endian.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+
+/* where a tuple is stored */
+struct ct_tuple {
+    union vrmr_ipaddr *src;
+    union vrmr_ipaddr *dst;
+    uint16_t *sport;
+    uint16_t *dport;
+    struct vrmr_conntrack_info *ct;
+};
+
+/* is the payload of the attribute at least 'len' bytes */
+static int ct_attr(const struct nlattr *attr, size_t len)
+{
+    return (mnl_attr_get_payload_len(attr) >= len);
+}
+
+static uint32_t ct_attr_be32(const struct nlattr *attr)
+{
+    uint32_t v;
+    memcpy(&v, mnl_attr_get_payload(attr), sizeof(v));
+    return (ntohl(v));
+}
+
+static uint64_t ct_attr_be64(const struct nlattr *attr)
+{
+    uint64_t v;
+    memcpy(&v, mnl_attr_get_payload(attr), sizeof(v));
+    return (be64toh(v));
+}
+
+static int ct_parse_ip(const struct nlattr *attr, void *data)
+{
+    struct ct_tuple *t = data;
+
+    switch (mnl_attr_get_type(attr)) {
+        case CTA_IP_V4_SRC:
+            if (ct_attr(attr, 4))
+                memcpy(t->src, mnl_attr_get_payload(attr), 4);
+            break;
+        case CTA_IP_V4_DST:
+            if (ct_attr(attr, 4))
+                memcpy(t->dst, mnl_attr_get_payload(attr), 4);
+            break;
+        case CTA_IP_V6_SRC:
+            if (ct_attr(attr, 16))
+                memcpy(t->src, mnl_attr_get_payload(attr), 16);
+            break;
+        case CTA_IP_V6_DST:
+            if (ct_attr(attr, 16))
+                memcpy(t->dst, mnl_attr_get_payload(attr), 16);
+            break;
+    }
+    return (MNL_CB_OK);
+}
+
+static int ct_parse_proto(const struct nlattr *attr, void *data)
+{
+    struct ct_tuple *t = data;
+    const uint8_t *p = mnl_attr_get_payload(attr);
+
+    switch (mnl_attr_get_type(attr)) {
+        case CTA_PROTO_NUM:
+            if (ct_attr(attr, 1))
+                t->ct->protocol = p[0];
+            break;
+        case CTA_PROTO_SRC_PORT:
+            if (ct_attr(attr, 2))
+                *t->sport = (uint16_t)((p[0] << 8) | p[1]);
+            break;
+        case CTA_PROTO_DST_PORT:
+            if (ct_attr(attr, 2))
+                *t->dport = (uint16_t)((p[0] << 8) | p[1]);
+            break;
+        /* only in the original tuple */
+        case CTA_PROTO_ICMP_TYPE:
+        case CTA_PROTO_ICMPV6_TYPE:
+            if (ct_attr(attr, 1) && t->src == &t->ct->orig_src)
+                t->ct->icmp_type = p[0];
+            break;
+        case CTA_PROTO_ICMP_CODE:
+        case CTA_PROTO_ICMPV6_CODE:
+            if (ct_attr(attr, 1) && t->src == &t->ct->orig_src)
+                t->ct->icmp_code = p[0];
+            break;
+    }
+    return (MNL_CB_OK);
+}
+
+static int ct_parse_tuple(const struct nlattr *attr, void *data)
+{
+    switch (mnl_attr_get_type(attr)) {
+        case CTA_TUPLE_IP:
+            return (mnl_attr_parse_nested(attr, ct_parse_ip, data));
+        case CTA_TUPLE_PROTO:
+            return (mnl_attr_parse_nested(attr, ct_parse_proto, data));
+    }
+    return (MNL_CB_OK);
+}
+
+static int ct_parse_tcp(const struct nlattr *attr, void *data)
+{
+    struct vrmr_conntrack_info *ct = data;
+    const uint8_t *p = mnl_attr_get_payload(attr);
+
+    switch (mnl_attr_get_type(attr)) {
+        case CTA_PROTOINFO_TCP_STATE:
+            if (ct_attr(attr, 1))
+                ct->tcp_state = p[0];
+            break;
+        /* struct nf_ct_tcp_flags: flags, mask */
+        case CTA_PROTOINFO_TCP_FLAGS_ORIGINAL:
+            if (ct_attr(attr, 2))
+                ct->tcp_flags_orig = p[0];
+            break;
+        case CTA_PROTOINFO_TCP_FLAGS_REPLY:
+            if (ct_attr(attr, 2))
+                ct->tcp_flags_repl = p[0];
+            break;
+    }
+    return (MNL_CB_OK);
+}
+
+static int ct_parse_protoinfo(const struct nlattr *attr, void *data)
+{
+    if (mnl_attr_get_type(attr) == CTA_PROTOINFO_TCP)
+        return (mnl_attr_parse_nested(attr, ct_parse_tcp, data));
+    return (MNL_CB_OK);
+}
+
+/* where a counters attribute is stored */
+struct ct_counters {
+    uint64_t *packets;
+    uint64_t *bytes;
+};
+
+static int ct_parse_counters(const struct nlattr *attr, void *data)
+{
+    struct ct_counters *c = data;
+
+    switch (mnl_attr_get_type(attr)) {
+        case CTA_COUNTERS_PACKETS:
+            if (ct_attr(attr, 8))
+                *c->packets = ct_attr_be64(attr);
+            break;
+        case CTA_COUNTERS_BYTES:
+            if (ct_attr(attr, 8))
+                *c->bytes = ct_attr_be64(attr);
+            break;
+    }
+    return (MNL_CB_OK);
+}
+
+static int ct_parse_help(const struct nlattr *attr, void *data)
+{
+    struct vrmr_conntrack_info *ct = data;
+
+    if (mnl_attr_get_type(attr) == CTA_HELP_NAME &&
+            mnl_attr_validate(attr, MNL_TYPE_NUL_STRING) == 0)
+        strlcpy(ct->helper, mnl_attr_get_str(attr), sizeof(ct->helper));
+    return (MNL_CB_OK);
+}
+
+static int ct_parse_timestamp(const struct nlattr *attr, void *data)
+{
+    struct vrmr_conntrack_info *ct = data;
+
+    switch (mnl_attr_get_type(attr)) {
+        case CTA_TIMESTAMP_START:
+            if (ct_attr(attr, 8))
+                ct->ts_start = ct_attr_be64(attr);
+            break;
+        case CTA_TIMESTAMP_STOP:
+            if (ct_attr(attr, 8))
+                ct->ts_stop = ct_attr_be64(attr);
+            break;
+    }
+    return (MNL_CB_OK);
+}
+
+static int ct_parse_attr(const struct nlattr *attr, void *data)
+{
+    struct vrmr_conntrack_info *ct = data;
+
+    switch (mnl_attr_get_type(attr)) {
+        case CTA_TUPLE_ORIG: {
+            struct ct_tuple t = {&ct->orig_src, &ct->orig_dst, &ct->orig_sport,
+                    &ct->orig_dport, ct};
+            return (mnl_attr_parse_nested(attr, ct_parse_tuple, &t));
+        }
+        case CTA_TUPLE_REPLY: {
+            struct ct_tuple t = {&ct->repl_src, &ct->repl_dst, &ct->repl_sport,
+                    &ct->repl_dport, ct};
+            return (mnl_attr_parse_nested(attr, ct_parse_tuple, &t));
+        }
+        case CTA_STATUS:
+            if (ct_attr(attr, 4))
+                ct->status = ct_attr_be32(attr);
+            break;
+        case CTA_MARK:
+            if (ct_attr(attr, 4))
+                ct->mark = ct_attr_be32(attr);
+            break;
+        case CTA_TIMEOUT:
+            if (ct_attr(attr, 4))
+                ct->timeout = ct_attr_be32(attr);
+            break;
+        case CTA_ID:
+            if (ct_attr(attr, 4))
+                ct->id = ct_attr_be32(attr);
+            break;
+        case CTA_PROTOINFO:
+            return (mnl_attr_parse_nested(attr, ct_parse_protoinfo, ct));
+        case CTA_COUNTERS_ORIG: {
+            struct ct_counters c = {&ct->orig_packets, &ct->orig_bytes};
+            return (mnl_attr_parse_nested(attr, ct_parse_counters, &c));
+        }
+        case CTA_COUNTERS_REPLY: {
+            struct ct_counters c = {&ct->repl_packets, &ct->repl_bytes};
+            return (mnl_attr_parse_nested(attr, ct_parse_counters, &c));
+        }
+        case CTA_HELP:
+            return (mnl_attr_parse_nested(attr, ct_parse_help, ct));
+        case CTA_TIMESTAMP:
+            return (mnl_attr_parse_nested(attr, ct_parse_timestamp, ct));
+    }
+    return (MNL_CB_OK);
+}
+
+/*  vrmr_conntrack_parse
+
+    Decodes the ctnetlink message 'nlh' into 'ct'. Attributes missing from
+    the message are left 0.
+
+    Returncodes:
+         0: ok
+        -1: not an IPv4 or IPv6 conntrack message, or malformed
+*/
+int vrmr_conntrack_parse(
+        const struct nlmsghdr *nlh, struct vrmr_conntrack_info *ct)
+{
+    assert(nlh && ct);
+
+    memset(ct, 0, sizeof(*ct));
+
+    if (nlh->nlmsg_len < mnl_nlmsg_size(sizeof(struct nfgenmsg)))
+        return (-1);
+
+    const struct nfgenmsg *nfg = mnl_nlmsg_get_payload(nlh);
+    if (nfg->nfgen_family != AF_INET && nfg->nfgen_family != AF_INET6)
+        return (-1);
+    ct->family = nfg->nfgen_family;
+
+    if (mnl_attr_parse(nlh, sizeof(struct nfgenmsg), ct_parse_attr, ct) <
+            MNL_CB_STOP)
+        return (-1);
+    return (0);
+}
+
+struct ct_dump_ctx {
+    int (*cb)(const struct vrmr_conntrack_info *, void *);
+    void *data;
+    int stopped; /* by the callback */
+};
+
+static int ct_dump_cb(const struct nlmsghdr *nlh, void *data)
+{
+    struct ct_dump_ctx *ctx = data;
+    struct vrmr_conntrack_info ct;
+
+    /* skip what we can't parse, like the rest of the dump does */
+    if (vrmr_conntrack_parse(nlh, &ct) < 0)
+        return (MNL_CB_OK);
+    if (ctx->cb(&ct, ctx->data) < 0) {
+        ctx->stopped = 1;
+        return (MNL_CB_ERROR);
+    }
+    return (MNL_CB_OK);
+}
+
+/*  vrmr_conntrack_dump
+
+    Dumps the conntrack table and calls 'cb' for every connection. The
+    struct passed to 'cb' is only valid during the call. If 'cb' returns
+    -1 the dump is stopped.
+
+    Returncodes:
+         0: ok
+        -1: error
+*/
+int vrmr_conntrack_dump(
+        int (*cb)(const struct vrmr_conntrack_info *, void *), void *data)
+{
+    char buf[MNL_SOCKET_BUFFER_SIZE];
+    struct ct_dump_ctx ctx = {cb, data, 0};
+    int retval = 0;
+
+    assert(cb);
+
+    struct mnl_socket *nl = mnl_socket_open(NETLINK_NETFILTER);
+    if (nl == NULL) {
+        vrmr_error(-1, "Error", "mnl_socket_open failed: %s", strerror(errno));
+        return (-1);
+    }
+    if (mnl_socket_bind(nl, 0, MNL_SOCKET_AUTOPID) < 0) {
+        vrmr_error(-1, "Error", "mnl_socket_bind failed: %s", strerror(errno));
+        mnl_socket_close(nl);
+        return (-1);
+    }
+
+    struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+    nlh->nlmsg_type = (NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_GET;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    nlh->nlmsg_seq = (unsigned int)time(NULL);
+    unsigned int seq = nlh->nlmsg_seq;
+
+    struct nfgenmsg *nfg = mnl_nlmsg_put_extra_header(nlh, sizeof(*nfg));
+    nfg->nfgen_family = AF_UNSPEC;
+    nfg->version = NFNETLINK_V0;
+    nfg->res_id = 0;
+
+    if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0) {
+        vrmr_error(-1, "Error", "mnl_socket_sendto failed: %s",
+                strerror(errno));
+        mnl_socket_close(nl);
+        return (-1);
+    }
+
+    unsigned int portid = mnl_socket_get_portid(nl);
+    ssize_t len;
+    while ((len = mnl_socket_recvfrom(nl, buf, sizeof(buf))) > 0) {
+        int ret = mnl_cb_run(buf, (size_t)len, seq, portid, ct_dump_cb, &ctx);
+        if (ret == MNL_CB_STOP)
+            break;
+        if (ret == MNL_CB_ERROR) {
+            /* the callback reports its own errors */
+            if (!ctx.stopped)
+                vrmr_error(-1, "Error", "conntrack dump failed: %s",
+                        strerror(errno));
+            retval = -1;
+            break;
+        }
+    }
+    if (len < 0) {
+        vrmr_error(-1, "Error", "mnl_socket_recvfrom failed: %s",
+                strerror(errno));
+        retval = -1;
+    }
+
+    mnl_socket_close(nl);
+    return (retval);
+}
@@ -0,0 +1,468 @@
+/***************************************************************************
+ *   Copyright (C) 2003-2019 by Victor Julien                              *
+ *   victor@vuurmuur.org                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*  Live event ring.
+
+    vuurmuur_log publishes every record it logs into a ring of fixed size
+    entries in a SysV shared memory segment. vuurmuur_conf attaches to it
+    read-only and gets the records as structured data, without tailing and
+    re-parsing the logfiles.
+
+    There is a single writer and any number of readers. The writer never
+    waits for the readers: a reader that falls behind by more than the size
+    of the ring loses the oldest events and skips ahead.
+
+    Every slot carries the sequence number of the event in it. The writer
+    clears it before it overwrites the slot and sets it when it is done, so
+    a reader can detect a slot that was (being) overwritten while it copied
+    it, and discard the copy.
+*/
+
+#include "config.h"
+#include "vuurmuur.h"
+
+#define VRMR_EVENT_RING_MAGIC 0x56524552U /* "VRER" */
+#define VRMR_EVENT_RING_VERSION 1U
+
+struct vrmr_event_slot {
+    uint64_t seq; /* 0 while the slot is written */
+    struct vrmr_event ev;
+};
+
+struct vrmr_event_ring {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entries;
+    uint32_t slot_size;
+    uint32_t closed; /* set when the writer exits */
+
+    /* sequence number of the last published event. Numbering starts at 1.
+     * On its own cache line, it is the only thing the readers poll. */
+    uint64_t head __attribute__((aligned(64)));
+
+    struct vrmr_event_slot slots[] __attribute__((aligned(64)));
+};
+
+static size_t event_ring_size(void)
+{
+    return (sizeof(struct vrmr_event_ring) +
+            (size_t)VRMR_EVENT_RING_ENTRIES * sizeof(struct vrmr_event_slot));
+}
+
+/*  vrmr_event_ring_create
+
+    Creates and initializes the ring in a new shared memory segment.
+
+    The segment is marked for removal right away, so it goes away with the
+    last process that detaches from it, even if vuurmuur_log crashes. Linux
+    still lets the readers attach to it by id until then.
+
+    Returncodes:
+         0: ok
+        -1: error
+*/
+int vrmr_event_ring_create(int *shm_id, struct vrmr_event_ring **ring)
+{
+    assert(shm_id && ring);
+
+    *shm_id = shmget(IPC_PRIVATE, event_ring_size(), 0600);
+    if (*shm_id < 0) {
+        vrmr_error(-1, "Error", "unable to create shared memory: %s.",
+                strerror(errno));
+        return (-1);
+    }
+
+    void *shmp = shmat(*shm_id, NULL, 0);
+    int attach_errno = errno;
+
+    if (shmctl(*shm_id, IPC_RMID, NULL) < 0) {
+        vrmr_error(-1, "Error", "marking shared memory for removal failed: %s.",
+                strerror(errno));
+        if (shmp != (void *)-1)
+            (void)shmdt(shmp);
+        return (-1);
+    }
+    if (shmp == (void *)-1) {
+        vrmr_error(-1, "Error", "unable to attach to shared memory: %s.",
+                strerror(attach_errno));
+        return (-1);
+    }
+
+    /* shmget zeroes the segment, so only the header needs setting */
+    *ring = shmp;
+    (*ring)->entries = VRMR_EVENT_RING_ENTRIES;
+    (*ring)->slot_size = (uint32_t)sizeof(struct vrmr_event_slot);
+    (*ring)->version = VRMR_EVENT_RING_VERSION;
+    __atomic_store_n(&(*ring)->magic, VRMR_EVENT_RING_MAGIC, __ATOMIC_RELEASE);
+    return (0);
+}
+
+/*  vrmr_event_ring_publish
+
+    Copies 'ev' into the next slot. Must only be called by one thread.
+*/
+void vrmr_event_ring_publish(
+        struct vrmr_event_ring *ring, const struct vrmr_event *ev)
+{
+    assert(ring && ev);
+
+    uint64_t seq = ring->head + 1;
+    struct vrmr_event_slot *slot =
+            &ring->slots[(seq - 1) & (VRMR_EVENT_RING_ENTRIES - 1)];
+
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&slot->ev, ev, sizeof(slot->ev));
+    __atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->head, seq, __ATOMIC_RELEASE);
+}
+
+/*  vrmr_event_ring_close
+
+    Tells the readers no more events will be published.
+*/
+void vrmr_event_ring_close(struct vrmr_event_ring *ring)
+{
+    assert(ring);
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+}
+
+/*  vrmr_event_ring_destroy
+
+    Closes the ring and detaches from it. The segment is already marked for
+    removal, so it is gone once the readers that are still attached detach.
+
+    Returncodes:
+         0: ok
+        -1: error
+*/
+int vrmr_event_ring_destroy(int shm_id, struct vrmr_event_ring *ring)
+{
+    assert(ring);
+
+    vrmr_event_ring_close(ring);
+
+    if (shmdt(ring) < 0) {
+        vrmr_error(-1, "Error", "detaching shared memory %d failed: %s.",
+                shm_id, strerror(errno));
+        return (-1);
+    }
+    return (0);
+}
+
+/*  vrmr_event_ring_attach
+
+    Attaches 'reader' read-only to the ring in segment 'shm_id'. The reader
+    starts at the current head, so it only gets new events.
+
+    Returncodes:
+         0: ok
+        -1: error
+*/
+int vrmr_event_ring_attach(int shm_id, struct vrmr_event_reader *reader)
+{
+    assert(reader);
+
+    memset(reader, 0, sizeof(*reader));
+
+    void *shmp = shmat(shm_id, NULL, SHM_RDONLY);
+    if (shmp == (void *)-1) {
+        vrmr_error(-1, "Error", "unable to attach to shared memory: %s.",
+                strerror(errno));
+        return (-1);
+    }
+
+    const struct vrmr_event_ring *ring = shmp;
+    if (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) !=
+                    VRMR_EVENT_RING_MAGIC ||
+            ring->version != VRMR_EVENT_RING_VERSION ||
+            ring->entries != VRMR_EVENT_RING_ENTRIES ||
+            ring->slot_size != sizeof(struct vrmr_event_slot)) {
+        vrmr_error(-1, "Error", "event ring in shared memory %d not usable",
+                shm_id);
+        (void)shmdt(shmp);
+        return (-1);
+    }
+
+    reader->ring = ring;
+    reader->next = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) + 1;
+    return (0);
+}
+
+/*  vrmr_event_ring_read
+
+    Copies the next event into 'ev'.
+
+    Returncodes:
+         1: got an event
+         0: no new event
+        -1: no new event and the writer closed the ring
+*/
+int vrmr_event_ring_read(
+        struct vrmr_event_reader *reader, struct vrmr_event *ev)
+{
+    assert(reader && reader->ring && ev);
+
+    const struct vrmr_event_ring *ring = reader->ring;
+
+    while (1) {
+        /* load 'closed' first: if it was set, head is final */
+        uint32_t closed = __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (reader->next > head)
+            return (closed ? -1 : 0);
+
+        /* the writer lapped us: skip to the oldest event still there */
+        if (head - reader->next >= VRMR_EVENT_RING_ENTRIES) {
+            uint64_t oldest = head - VRMR_EVENT_RING_ENTRIES + 1;
+            reader->lost += oldest - reader->next;
+            reader->next = oldest;
+        }
+
+        uint64_t idx = (reader->next - 1) & (VRMR_EVENT_RING_ENTRIES - 1);
+        const struct vrmr_event_slot *slot = &ring->slots[idx];
+
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == reader->next) {
+            memcpy(ev, &slot->ev, sizeof(*ev));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+                reader->next++;
+                return (1);
+            }
+        }
+
+        /* overwritten while we looked at it, so it is lost as well */
+        reader->lost++;
+        reader->next++;
+    }
+}
+
+/*  vrmr_event_ring_detach
+*/
+void vrmr_event_ring_detach(struct vrmr_event_reader *reader)
+{
+    assert(reader);
+
+    if (reader->ring != NULL)
+        (void)shmdt(reader->ring);
+    reader->ring = NULL;
+}
+
+/*  vrmr_event_from_log_record
+
+    Fills 'ev' from an annotated record.
+*/
+void vrmr_event_from_log_record(const struct vrmr_log_record *lr,
+        enum vrmr_event_type type, struct vrmr_event *ev)
+{
+    assert(lr && ev);
+
+    memset(ev, 0, sizeof(*ev));
+    ev->timestamp = (int64_t)lr->timestamp;
+    ev->type = (uint8_t)type;
+    ev->ipv6 = lr->ipv6 ? 1 : 0;
+    ev->protocol = (uint8_t)lr->protocol;
+    ev->src_port = (uint16_t)lr->src_port;
+    ev->dst_port = (uint16_t)lr->dst_port;
+
+    if (lr->have_addr) {
+        ev->src_addr = lr->src_addr;
+        ev->dst_addr = lr->dst_addr;
+    } else {
+        int af = lr->ipv6 ? AF_INET6 : AF_INET;
+        (void)inet_pton(af, lr->src_ip, &ev->src_addr);
+        (void)inet_pton(af, lr->dst_ip, &ev->dst_addr);
+    }
+
+    strlcpy(ev->action, lr->action, sizeof(ev->action));
+    strlcpy(ev->from_name, lr->from_name, sizeof(ev->from_name));
+    strlcpy(ev->to_name, lr->to_name, sizeof(ev->to_name));
+    strlcpy(ev->ser_name, lr->ser_name, sizeof(ev->ser_name));
+
+    if (type == VRMR_EVENT_TRAFFIC) {
+        ev->icmp_type = (uint8_t)lr->icmp_type;
+        ev->icmp_code = (uint8_t)lr->icmp_code;
+        ev->ttl = (uint8_t)lr->ttl;
+        ev->packet_len = lr->packet_len;
+        if (lr->fin)
+            ev->tcp_flags |= VRMR_EVENT_TCP_FIN;
+        if (lr->syn)
+            ev->tcp_flags |= VRMR_EVENT_TCP_SYN;
+        if (lr->rst)
+            ev->tcp_flags |= VRMR_EVENT_TCP_RST;
+        if (lr->psh)
+            ev->tcp_flags |= VRMR_EVENT_TCP_PSH;
+        if (lr->ack)
+            ev->tcp_flags |= VRMR_EVENT_TCP_ACK;
+        if (lr->urg)
+            ev->tcp_flags |= VRMR_EVENT_TCP_URG;
+        if (lr->have_hwaddr) {
+            memcpy(ev->src_hwaddr, lr->src_hwaddr, sizeof(ev->src_hwaddr));
+            memcpy(ev->dst_hwaddr, lr->dst_hwaddr, sizeof(ev->dst_hwaddr));
+            ev->have_hwaddr = 1;
+        }
+        strlcpy(ev->prefix, lr->logprefix, sizeof(ev->prefix));
+        strlcpy(ev->interface_in, lr->interface_in, sizeof(ev->interface_in));
+        strlcpy(ev->interface_out, lr->interface_out,
+                sizeof(ev->interface_out));
+    } else {
+        ev->age_s = lr->conn_rec.age_s;
+        ev->mark = lr->conn_rec.mark;
+        ev->toserver_bytes = lr->conn_rec.toserver_bytes;
+        ev->toclient_bytes = lr->conn_rec.toclient_bytes;
+        strlcpy(ev->helper, lr->helper, sizeof(ev->helper));
+    }
+}
+
+static void event_hwaddr2str(const struct vrmr_event *ev, const uint8_t *hw,
+        char *str, size_t size)
+{
+    if (!ev->have_hwaddr) {
+        str[0] = '\0';
+        return;
+    }
+    snprintf(str, size, "(%02x:%02x:%02x:%02x:%02x:%02x)", hw[0], hw[1],
+            hw[2], hw[3], hw[4], hw[5]);
+}
+
+/* the "(...)" part of a traffic log line */
+static void event_traffic_details(
+        const struct vrmr_event *ev, char *str, size_t size)
+{
+    char src[INET6_ADDRSTRLEN] = "";
+    char dst[INET6_ADDRSTRLEN] = "";
+    int af = ev->ipv6 ? AF_INET6 : AF_INET;
+    (void)inet_ntop(af, &ev->src_addr, src, sizeof(src));
+    (void)inet_ntop(af, &ev->dst_addr, dst, sizeof(dst));
+
+    char src_mac[20], dst_mac[20];
+    event_hwaddr2str(ev, ev->src_hwaddr, src_mac, sizeof(src_mac));
+    event_hwaddr2str(ev, ev->dst_hwaddr, dst_mac, sizeof(dst_mac));
+
+    char in[24] = "", out[24] = "";
+    if (ev->interface_in[0] != '\0')
+        snprintf(in, sizeof(in), "in: %s ", ev->interface_in);
+    if (ev->interface_out[0] != '\0')
+        snprintf(out, sizeof(out), "out: %s ", ev->interface_out);
+
+    switch (ev->protocol) {
+        case 6: { /* TCP */
+            char flags[7];
+            flags[0] = (ev->tcp_flags & VRMR_EVENT_TCP_URG) ? 'U' : '*';
+            flags[1] = (ev->tcp_flags & VRMR_EVENT_TCP_ACK) ? 'A' : '*';
+            flags[2] = (ev->tcp_flags & VRMR_EVENT_TCP_PSH) ? 'P' : '*';
+            flags[3] = (ev->tcp_flags & VRMR_EVENT_TCP_RST) ? 'R' : '*';
+            flags[4] = (ev->tcp_flags & VRMR_EVENT_TCP_SYN) ? 'S' : '*';
+            flags[5] = (ev->tcp_flags & VRMR_EVENT_TCP_FIN) ? 'F' : '*';
+            flags[6] = '\0';
+            snprintf(str, size,
+                    "(%s%s%s%s:%u -> %s%s:%u TCP flags: %s len:%u ttl:%u)", in,
+                    out, src, src_mac, ev->src_port, dst, dst_mac,
+                    ev->dst_port, flags, ev->packet_len, ev->ttl);
+            break;
+        }
+        case 17: /* UDP */
+            snprintf(str, size, "(%s%s%s%s:%u -> %s%s:%u UDP len:%u ttl:%u)",
+                    in, out, src, src_mac, ev->src_port, dst, dst_mac,
+                    ev->dst_port, ev->packet_len, ev->ttl);
+            break;
+        case 1:  /* ICMP */
+        case 58: /* ICMPv6 */
+            snprintf(str, size,
+                    "(%s%s%s%s -> %s%s %s type %u code %u len:%u ttl:%u)", in,
+                    out, src, src_mac, dst, dst_mac,
+                    ev->protocol == 1 ? "ICMP" : "ICMPv6", ev->icmp_type,
+                    ev->icmp_code, ev->packet_len, ev->ttl);
+            break;
+        case 47: /* GRE */
+        case 50: /* ESP */
+        case 51: /* AH */
+            snprintf(str, size, "(%s%s%s%s -> %s%s %s len:%u ttl:%u)", in, out,
+                    src, src_mac, dst, dst_mac,
+                    ev->protocol == 47 ? "GRE"
+                                       : (ev->protocol == 50 ? "ESP" : "AH"),
+                    ev->packet_len, ev->ttl);
+            break;
+        default:
+            snprintf(str, size, "(%s%s%s%s -> %s%s PROTO %u len:%u ttl:%u)", in,
+                    out, src, src_mac, dst, dst_mac, ev->protocol,
+                    ev->packet_len, ev->ttl);
+            break;
+    }
+}
+
+/* the "(...)" part of a connection log line */
+static void event_conn_details(
+        const struct vrmr_event *ev, char *str, size_t size)
+{
+    char src[INET6_ADDRSTRLEN] = "";
+    char dst[INET6_ADDRSTRLEN] = "";
+    int af = ev->ipv6 ? AF_INET6 : AF_INET;
+    (void)inet_ntop(af, &ev->src_addr, src, sizeof(src));
+    (void)inet_ntop(af, &ev->dst_addr, dst, sizeof(dst));
+
+    strlcpy(str, "(", size);
+
+    if (ev->type == VRMR_EVENT_CONN_COMPLETED) {
+        char ts[64], tc[64], extra[160];
+        vrmr_log_bytes2str(ev->toserver_bytes, ts, sizeof(ts));
+        vrmr_log_bytes2str(ev->toclient_bytes, tc, sizeof(tc));
+        snprintf(extra, sizeof(extra), "%us %s><%s ", ev->age_s, ts, tc);
+        strlcat(str, extra, size);
+    }
+
+    char addr[128];
+    if (ev->protocol == IPPROTO_TCP || ev->protocol == IPPROTO_UDP) {
+        snprintf(addr, sizeof(addr), "%s:%u -> %s:%u %s", src, ev->src_port,
+                dst, ev->dst_port, ev->protocol == IPPROTO_TCP ? "TCP" : "UDP");
+    } else {
+        snprintf(addr, sizeof(addr), "%s -> %s PROTO %u", src, dst,
+                ev->protocol);
+    }
+    strlcat(str, addr, size);
+
+    if (ev->type == VRMR_EVENT_CONN_COMPLETED && ev->mark > 0) {
+        char mark[24];
+        snprintf(mark, sizeof(mark), " mark:%u", ev->mark);
+        strlcat(str, mark, size);
+    }
+    if (ev->helper[0] != '\0') {
+        char helper[48];
+        snprintf(helper, sizeof(helper), " helper:%s", ev->helper);
+        strlcat(str, helper, size);
+    }
+    strlcat(str, ")", size);
+}
+
+/*  vrmr_event_details
+
+    Renders the details of 'ev' the way they appear between the brackets
+    at the end of its logfile line.
+*/
+void vrmr_event_details(const struct vrmr_event *ev, char *str, size_t size)
+{
+    assert(ev && str && size > 0);
+
+    if (ev->type == VRMR_EVENT_TRAFFIC)
+        event_traffic_details(ev, str, size);
+    else
+        event_conn_details(ev, str, size);
+}
@@ -0,0 +1,363 @@
+/***************************************************************************
+ *   Copyright (C) 2002-2019 by Victor Julien                              *
+ *   victor@vuurmuur.org                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*  Open addressing hash table with linear probing.
+
+    The slots are stored inline in one array and hold the (mixed) hash of
+    the data next to the data pointer. Storing the hash means we never have
+    to call the hash function again when the table grows, and that most
+    non-matching slots are skipped without calling the compare function.
+
+    Removal uses backward shift deletion, so there are no tombstones and
+    the probe sequences stay short after many insert/remove cycles.
+
+    The table is a multimap: the same data pointer may be inserted more
+    than once, under the same or under different hashes.
+*/
+
+#include "config.h"
+#include "vuurmuur.h"
+
+/* grow when the table is more than 3/4 full */
+#define VRMR_HTABLE_LOAD_NUM 3
+#define VRMR_HTABLE_LOAD_DEN 4
+
+#define VRMR_HTABLE_MIN_SIZE 16U
+#define VRMR_HTABLE_MAX_SIZE 0x80000000U
+
+/*  vrmr_hash_mix32
+
+    Finalizer from MurmurHash3. Spreads every input bit over the whole
+    output, so weak hash functions still use all the slots.
+*/
+uint32_t vrmr_hash_mix32(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return h;
+}
+
+/*  vrmr_hash_bytes
+
+    FNV-1a over the buffer, finalized with vrmr_hash_mix32.
+*/
+uint32_t vrmr_hash_bytes(const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint32_t h = 2166136261U;
+
+    assert(data || len == 0);
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619U;
+    }
+
+    return vrmr_hash_mix32(h);
+}
+
+static uint32_t htable_roundup(uint32_t n)
+{
+    uint32_t size = VRMR_HTABLE_MIN_SIZE;
+
+    while (size < n && size < VRMR_HTABLE_MAX_SIZE)
+        size <<= 1;
+
+    return size;
+}
+
+/* distance of the slot at 'idx' from the slot its hash maps to */
+static inline uint32_t htable_dist(
+        const struct vrmr_htable *ht, uint32_t hash, uint32_t idx)
+{
+    return (idx - (hash & (ht->size - 1))) & (ht->size - 1);
+}
+
+/*  vrmr_htable_init
+
+    Setup the table so it can hold 'hint' entries without growing.
+
+    Returncodes:
+         0: ok
+        -1: error
+*/
+int vrmr_htable_init(struct vrmr_htable *ht, uint32_t hint)
+{
+    assert(ht);
+
+    memset(ht, 0, sizeof(*ht));
+
+    uint32_t want = hint;
+    if (want < VRMR_HTABLE_MAX_SIZE / VRMR_HTABLE_LOAD_DEN)
+        want = (want * VRMR_HTABLE_LOAD_DEN) / VRMR_HTABLE_LOAD_NUM + 1;
+    ht->size = htable_roundup(want);
+
+    ht->slots = calloc(ht->size, sizeof(struct vrmr_htable_slot));
+    if (ht->slots == NULL) {
+        vrmr_error(-1, "Error", "calloc failed: %s", strerror(errno));
+        ht->size = 0;
+        return (-1);
+    }
+
+    return (0);
+}
+
+/*  vrmr_htable_cleanup
+
+    Frees the slots. If free_func is not NULL it is called for the data
+    in every used slot.
+*/
+void vrmr_htable_cleanup(struct vrmr_htable *ht, void (*free_func)(void *data))
+{
+    assert(ht);
+
+    if (ht->slots != NULL && free_func != NULL) {
+        for (uint32_t i = 0; i < ht->size; i++) {
+            if (ht->slots[i].data != NULL)
+                free_func(ht->slots[i].data);
+        }
+    }
+
+    free(ht->slots);
+    ht->slots = NULL;
+    ht->size = 0;
+    ht->used = 0;
+}
+
+/* place an entry without checking the load factor */
+static uint32_t htable_place(
+        struct vrmr_htable *ht, uint32_t hash, const void *data)
+{
+    uint32_t mask = ht->size - 1;
+    uint32_t idx = hash & mask;
+    uint32_t dist = 0;
+
+    while (ht->slots[idx].data != NULL) {
+        idx = (idx + 1) & mask;
+        dist++;
+    }
+
+    ht->slots[idx].hash = hash;
+    ht->slots[idx].data = (void *)data;
+    ht->used++;
+
+    if (dist > ht->max_probe)
+        ht->max_probe = dist;
+    return idx;
+}
+
+static int htable_grow(struct vrmr_htable *ht)
+{
+    struct vrmr_htable_slot *old = ht->slots;
+    uint32_t old_size = ht->size;
+
+    if (old_size >= VRMR_HTABLE_MAX_SIZE) {
+        vrmr_error(-1, "Internal Error", "hash table size limit reached");
+        return (-1);
+    }
+
+    struct vrmr_htable_slot *slots =
+            calloc((size_t)old_size * 2, sizeof(struct vrmr_htable_slot));
+    if (slots == NULL) {
+        vrmr_error(-1, "Error", "calloc failed: %s", strerror(errno));
+        return (-1);
+    }
+
+    ht->slots = slots;
+    ht->size = old_size * 2;
+    ht->used = 0;
+    ht->max_probe = 0;
+    ht->grows++;
+
+    /*  start right after an empty slot, so that clusters that wrap around
+        the end of the array are moved in probe order. This keeps entries
+        with the same hash in insertion order. */
+    uint32_t start = 0;
+    while (old[start].data != NULL)
+        start++;
+
+    for (uint32_t n = 1; n <= old_size; n++) {
+        uint32_t i = (start + n) & (old_size - 1);
+        if (old[i].data != NULL)
+            (void)htable_place(ht, old[i].hash, old[i].data);
+    }
+
+    free(old);
+    return (0);
+}
+
+/*  vrmr_htable_insert
+
+    Inserts 'data' under 'hash'. Duplicates are allowed.
+
+    Returncodes:
+         0: ok
+        -1: error
+*/
+int vrmr_htable_insert(struct vrmr_htable *ht, uint32_t hash, const void *data)
+{
+    assert(ht && ht->slots && data);
+
+    if ((uint64_t)(ht->used + 1) * VRMR_HTABLE_LOAD_DEN >
+            (uint64_t)ht->size * VRMR_HTABLE_LOAD_NUM) {
+        if (htable_grow(ht) < 0)
+            return (-1);
+    }
+
+    (void)htable_place(ht, hash, data);
+    return (0);
+}
+
+/*  vrmr_htable_search
+
+    Returns the first data stored under 'hash' for which
+    compare_func(table_data, search_data) returns non-zero, or NULL.
+*/
+void *vrmr_htable_search(const struct vrmr_htable *ht, uint32_t hash,
+        int (*compare_func)(const void *table_data, const void *search_data),
+        const void *search_data)
+{
+    assert(ht && compare_func);
+
+    if (ht->slots == NULL)
+        return (NULL);
+
+    uint32_t mask = ht->size - 1;
+    uint32_t idx = hash & mask;
+
+    /* no entry is ever further away than max_probe */
+    for (uint32_t dist = 0; dist <= ht->max_probe; dist++) {
+        const struct vrmr_htable_slot *slot = &ht->slots[idx];
+        if (slot->data == NULL)
+            break;
+
+        if (slot->hash == hash && compare_func(slot->data, search_data))
+            return (slot->data);
+
+        idx = (idx + 1) & mask;
+    }
+
+    return (NULL);
+}
+
+/*  vrmr_htable_remove
+
+    Removes the first entry stored under 'hash' that matches. The slots
+    following it are shifted back so the probe sequences stay intact.
+
+    Returns the removed data, or NULL if nothing matched.
+*/
+void *vrmr_htable_remove(struct vrmr_htable *ht, uint32_t hash,
+        int (*compare_func)(const void *table_data, const void *search_data),
+        const void *search_data)
+{
+    assert(ht && compare_func);
+
+    if (ht->slots == NULL)
+        return (NULL);
+
+    uint32_t mask = ht->size - 1;
+    uint32_t idx = hash & mask;
+    void *data = NULL;
+
+    for (uint32_t dist = 0; dist <= ht->max_probe; dist++) {
+        struct vrmr_htable_slot *slot = &ht->slots[idx];
+        if (slot->data == NULL)
+            return (NULL);
+
+        if (slot->hash == hash && compare_func(slot->data, search_data)) {
+            data = slot->data;
+            break;
+        }
+        idx = (idx + 1) & mask;
+    }
+    if (data == NULL)
+        return (NULL);
+
+    /*  backward shift: walk the rest of the cluster and move an entry
+        into the hole if that does not put it before its home slot. */
+    uint32_t hole = idx;
+    uint32_t next = (hole + 1) & mask;
+    while (ht->slots[next].data != NULL) {
+        if (htable_dist(ht, ht->slots[next].hash, next) >=
+                ((next - hole) & mask)) {
+            ht->slots[hole] = ht->slots[next];
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+    ht->slots[hole].data = NULL;
+    ht->slots[hole].hash = 0;
+    ht->used--;
+
+    return (data);
+}
+
+/*  vrmr_htable_next
+
+    Iterate over all entries. Set '*iter' to 0 before the first call.
+    Returns NULL when there are no more entries.
+*/
+void *vrmr_htable_next(const struct vrmr_htable *ht, uint32_t *iter)
+{
+    assert(ht && iter);
+
+    for (; *iter < ht->size; (*iter)++) {
+        if (ht->slots[*iter].data != NULL)
+            return (ht->slots[(*iter)++].data);
+    }
+    return (NULL);
+}
+
+/*  vrmr_htable_get_stats
+
+    Fills 'stats' with the occupancy and probe length of the table.
+    Walks the whole table, so it is meant for debugging and reporting.
+*/
+void vrmr_htable_get_stats(
+        const struct vrmr_htable *ht, struct vrmr_htable_stats *stats)
+{
+    assert(ht && stats);
+
+    memset(stats, 0, sizeof(*stats));
+    stats->size = ht->size;
+    stats->used = ht->used;
+    stats->grows = ht->grows;
+    if (ht->size > 0)
+        stats->load_permille =
+                (uint32_t)(((uint64_t)ht->used * 1000) / ht->size);
+
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < ht->size; i++) {
+        if (ht->slots[i].data == NULL)
+            continue;
+
+        uint32_t dist = htable_dist(ht, ht->slots[i].hash, i);
+        total += dist;
+        if (dist > stats->max_probe)
+            stats->max_probe = dist;
+    }
+
+    if (ht->used > 0)
+        stats->avg_probe_x100 = (uint32_t)((total * 100) / ht->used);
+}
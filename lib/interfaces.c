@@ -888,7 +888,8 @@ int vrmr_ins_iface_into_zonelist(
         /*
             we dont care about an interface without an ipaddress
         */
-        if (strcmp(iface_ptr->ipv4.ipaddress, "") != 0) {
+        if (strcmp(iface_ptr->ipv4.ipaddress, "") != 0 ||
+                strcmp(iface_ptr->ipv6.ip6, "") != 0) {
             /*
                 pretty name
             */
@@ -911,6 +912,8 @@ int vrmr_ins_iface_into_zonelist(
             /* copy the ipaddress */
             (void)strlcpy(zone_ptr->ipv4.ipaddress, iface_ptr->ipv4.ipaddress,
                     sizeof(zone_ptr->ipv4.ipaddress));
+            (void)strlcpy(zone_ptr->ipv6.ip6, iface_ptr->ipv6.ip6,
+                    sizeof(zone_ptr->ipv6.ip6));
 
             /*
                 set the type to firewall, so we can recognize the interface in
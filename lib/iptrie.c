@@ -0,0 +1,490 @@
+/***************************************************************************
+ *   Copyright (C) 2002-2019 by Victor Julien                              *
+ *   victor@vuurmuur.org                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*  Longest prefix match trie and the zone index built on top of it.
+
+    The trie is a path compressed binary radix trie. Every node stores its
+    full prefix, so a node that has no branch is skipped in one step and
+    a lookup only visits the nodes where prefixes actually differ. For a
+    typical setup that is a handful of nodes, for IPv4 and IPv6 alike.
+
+    The nodes live in one array and refer to each other by index. Node 0
+    is the root, the /0 prefix, so index 0 doubles as 'no child'.
+
+    The zone index puts all hosts, firewall interfaces and broadcasts in
+    as full length prefixes and all networks with their netmask, so one
+    lookup returns the host if the address is a known host, otherwise the
+    most specific network containing it.
+*/
+
+#include "config.h"
+#include "vuurmuur.h"
+
+#define VRMR_IPTRIE_MIN_NODES 16U
+
+static inline int iptrie_bit(const uint8_t *key, uint8_t bit)
+{
+    return (key[bit >> 3] >> (7 - (bit & 7))) & 1;
+}
+
+/* does 'addr' start with the first 'plen' bits of 'key'? */
+static inline int iptrie_prefix_match(
+        const uint8_t *key, const uint8_t *addr, uint8_t plen)
+{
+    uint8_t bytes = plen >> 3;
+    uint8_t rest = plen & 7;
+
+    if (bytes > 0 && memcmp(key, addr, bytes) != 0)
+        return 0;
+    if (rest == 0)
+        return 1;
+
+    uint8_t mask = (uint8_t)(0xff << (8 - rest));
+    return ((key[bytes] ^ addr[bytes]) & mask) == 0;
+}
+
+/* number of leading bits 'a' and 'b' have in common, at most 'max' */
+static uint8_t iptrie_common_len(
+        const uint8_t *a, const uint8_t *b, uint8_t max)
+{
+    uint8_t len = 0;
+
+    while (len < max) {
+        uint8_t x = a[len >> 3] ^ b[len >> 3];
+        if (x == 0) {
+            len = (uint8_t)((len | 7) + 1);
+            continue;
+        }
+        /* first differing bit in this byte */
+        len = (uint8_t)(len & ~7);
+        while ((x & 0x80) == 0) {
+            x <<= 1;
+            len++;
+        }
+        break;
+    }
+
+    return len < max ? len : max;
+}
+
+/* copy the first 'plen' bits of 'src', clearing the rest */
+static void iptrie_key_copy(uint8_t *dst, const uint8_t *src, uint8_t plen)
+{
+    uint8_t bytes = plen >> 3;
+    uint8_t rest = plen & 7;
+
+    memset(dst, 0, VRMR_IPTRIE_KEY_LEN);
+    memcpy(dst, src, bytes);
+    if (rest > 0)
+        dst[bytes] = (uint8_t)(src[bytes] & (0xff << (8 - rest)));
+}
+
+/*  vrmr_iptrie_init
+
+    Setup an empty trie for keys of 'bits' bits: 32 for IPv4, 128 for
+    IPv6.
+
+    Returncodes:
+         0: ok
+        -1: error
+*/
+int vrmr_iptrie_init(struct vrmr_iptrie *t, uint8_t bits)
+{
+    assert(t && bits > 0 && bits <= VRMR_IPTRIE_KEY_LEN * 8);
+
+    memset(t, 0, sizeof(*t));
+    t->bits = bits;
+
+    t->nodes = calloc(VRMR_IPTRIE_MIN_NODES, sizeof(struct vrmr_iptrie_node));
+    if (t->nodes == NULL) {
+        vrmr_error(-1, "Error", "calloc failed: %s", strerror(errno));
+        return (-1);
+    }
+    t->size = VRMR_IPTRIE_MIN_NODES;
+
+    /* the root: the /0 prefix */
+    t->used = 1;
+    return (0);
+}
+
+/*  vrmr_iptrie_cleanup
+
+    Frees the nodes. The data is not touched.
+*/
+void vrmr_iptrie_cleanup(struct vrmr_iptrie *t)
+{
+    assert(t);
+
+    free(t->nodes);
+    memset(t, 0, sizeof(*t));
+}
+
+/* make sure there is room for 'n' more nodes */
+static int iptrie_reserve(struct vrmr_iptrie *t, uint32_t n)
+{
+    if (t->used + n <= t->size)
+        return (0);
+
+    uint32_t size = t->size * 2;
+    struct vrmr_iptrie_node *nodes =
+            realloc(t->nodes, (size_t)size * sizeof(struct vrmr_iptrie_node));
+    if (nodes == NULL) {
+        vrmr_error(-1, "Error", "realloc failed: %s", strerror(errno));
+        return (-1);
+    }
+    memset(nodes + t->size, 0,
+            (size_t)(size - t->size) * sizeof(struct vrmr_iptrie_node));
+
+    t->nodes = nodes;
+    t->size = size;
+    return (0);
+}
+
+static uint32_t iptrie_node_new(struct vrmr_iptrie *t, const uint8_t *key,
+        uint8_t plen, const void *data)
+{
+    uint32_t idx = t->used++;
+    struct vrmr_iptrie_node *node = &t->nodes[idx];
+
+    iptrie_key_copy(node->key, key, plen);
+    node->plen = plen;
+    node->child[0] = node->child[1] = 0;
+    node->data = (void *)data;
+    return idx;
+}
+
+/*  vrmr_iptrie_insert
+
+    Insert 'data' for the prefix 'key'/'plen'. The key is in network byte
+    order. Bits beyond 'plen' are ignored.
+
+    If the prefix is already in the trie the existing data is kept, so
+    when two zones claim the same address the first one inserted wins.
+
+    Returncodes:
+         1: prefix already present, data not inserted
+         0: ok
+        -1: error
+*/
+int vrmr_iptrie_insert(struct vrmr_iptrie *t, const void *key, uint8_t plen,
+        const void *data)
+{
+    const uint8_t *k = key;
+    uint32_t n = 0;
+
+    assert(t && t->nodes && key && data);
+
+    if (plen > t->bits) {
+        vrmr_error(-1, "Internal Error", "prefix length %u out of range",
+                (unsigned int)plen);
+        return (-1);
+    }
+
+    /* a split needs at most two new nodes. Reserve them first so the
+     * node array does not move below us. */
+    if (iptrie_reserve(t, 2) < 0)
+        return (-1);
+
+    for (;;) {
+        struct vrmr_iptrie_node *node = &t->nodes[n];
+
+        /* invariant: 'node' is a prefix of 'key' and node->plen <= plen */
+        if (node->plen == plen) {
+            if (node->data != NULL)
+                return (1);
+            node->data = (void *)data;
+            t->prefixes++;
+            return (0);
+        }
+
+        int b = iptrie_bit(k, node->plen);
+        uint32_t c = node->child[b];
+        if (c == 0) {
+            node->child[b] = iptrie_node_new(t, k, plen, data);
+            t->prefixes++;
+            return (0);
+        }
+
+        struct vrmr_iptrie_node *child = &t->nodes[c];
+        uint8_t max = child->plen < plen ? child->plen : plen;
+        uint8_t common = iptrie_common_len(child->key, k, max);
+
+        if (common == child->plen) {
+            /* child is a prefix of key: descend */
+            n = c;
+            continue;
+        }
+
+        if (common == plen) {
+            /* key is a prefix of child: insert between node and child */
+            uint32_t x = iptrie_node_new(t, k, plen, data);
+            t->nodes[x].child[iptrie_bit(t->nodes[c].key, plen)] = c;
+            t->nodes[n].child[b] = x;
+            t->prefixes++;
+            return (0);
+        }
+
+        /* they differ at bit 'common': add a branch node */
+        uint32_t x = iptrie_node_new(t, k, common, NULL);
+        uint32_t leaf = iptrie_node_new(t, k, plen, data);
+        t->nodes[x].child[iptrie_bit(t->nodes[c].key, common)] = c;
+        t->nodes[x].child[iptrie_bit(k, common)] = leaf;
+        t->nodes[n].child[b] = x;
+        t->prefixes++;
+        return (0);
+    }
+}
+
+/*  vrmr_iptrie_lookup
+
+    Returns the data of the longest prefix that contains 'addr', or NULL.
+    If 'plen' is not NULL it is set to the length of that prefix.
+*/
+void *vrmr_iptrie_lookup(
+        const struct vrmr_iptrie *t, const void *addr, uint8_t *plen)
+{
+    const uint8_t *a = addr;
+    const struct vrmr_iptrie_node *best = NULL;
+    uint32_t n = 0;
+
+    assert(t && addr);
+
+    if (t->nodes == NULL)
+        return (NULL);
+
+    for (;;) {
+        const struct vrmr_iptrie_node *node = &t->nodes[n];
+
+        if (!iptrie_prefix_match(node->key, a, node->plen))
+            break;
+        if (node->data != NULL)
+            best = node;
+        if (node->plen >= t->bits)
+            break;
+
+        n = node->child[iptrie_bit(a, node->plen)];
+        if (n == 0)
+            break;
+    }
+
+    if (best == NULL)
+        return (NULL);
+
+    if (plen != NULL)
+        *plen = best->plen;
+    return (best->data);
+}
+
+/* netmask to prefix length, -1 if the mask is not contiguous */
+static int zone_index_masklen(struct in_addr mask)
+{
+    uint32_t m = ntohl(mask.s_addr);
+    int len = 0;
+
+    while (len < 32 && (m & 0x80000000U)) {
+        m <<= 1;
+        len++;
+    }
+    if (m != 0)
+        return (-1);
+    return (len);
+}
+
+static int zone_index_add_ipv4(struct vrmr_zone_index *zi,
+        struct vrmr_zone *zone_ptr, const char *ip, const char *netmask)
+{
+    struct in_addr addr, mask;
+    int plen = 32;
+
+    if (inet_pton(AF_INET, ip, &addr) != 1) {
+        vrmr_debug(HIGH, "%s: invalid ipaddress '%s'", zone_ptr->name, ip);
+        return (0);
+    }
+    if (netmask != NULL) {
+        if (inet_pton(AF_INET, netmask, &mask) != 1 ||
+                (plen = zone_index_masklen(mask)) < 0) {
+            vrmr_debug(HIGH, "%s: invalid netmask '%s'", zone_ptr->name,
+                    netmask);
+            return (0);
+        }
+    }
+
+    int result = vrmr_iptrie_insert(&zi->ipv4, &addr, (uint8_t)plen, zone_ptr);
+    if (result < 0)
+        return (-1);
+    if (result == 1)
+        vrmr_debug(HIGH, "%s: %s/%d already in the index", zone_ptr->name,
+                ip, plen);
+    return (0);
+}
+
+static int zone_index_add_ipv6(struct vrmr_zone_index *zi,
+        struct vrmr_zone *zone_ptr, const char *ip, int cidr)
+{
+    struct in6_addr addr;
+
+    if (cidr < 0 || cidr > 128)
+        return (0);
+    if (inet_pton(AF_INET6, ip, &addr) != 1) {
+        vrmr_debug(HIGH, "%s: invalid ipv6 address '%s'", zone_ptr->name, ip);
+        return (0);
+    }
+
+    int result = vrmr_iptrie_insert(&zi->ipv6, &addr, (uint8_t)cidr, zone_ptr);
+    if (result < 0)
+        return (-1);
+    if (result == 1)
+        vrmr_debug(HIGH, "%s: %s/%d already in the index", zone_ptr->name,
+                ip, cidr);
+    return (0);
+}
+
+/*  vrmr_zone_index_build
+
+    Builds the index for all hosts, networks and VRMR_TYPE_FIREWALL
+    entries (interfaces and broadcasts) in 'zonelist'. The zones must stay
+    in memory as long as the index is used.
+
+    Hosts and firewall entries are inserted before the networks, so a
+    network with a /32 (/128) netmask never hides a host.
+
+    Returncodes:
+         0: ok
+        -1: error
+*/
+int vrmr_zone_index_build(
+        struct vrmr_zone_index *zi, struct vrmr_list *zonelist)
+{
+    struct vrmr_list_node *d_node = NULL;
+    struct vrmr_zone *zone_ptr = NULL;
+
+    assert(zi && zonelist);
+
+    memset(zi, 0, sizeof(*zi));
+
+    if (vrmr_iptrie_init(&zi->ipv4, 32) < 0 ||
+            vrmr_iptrie_init(&zi->ipv6, 128) < 0)
+        goto error;
+
+    /* first pass: the full length prefixes */
+    for (d_node = zonelist->top; d_node; d_node = d_node->next) {
+        if (!(zone_ptr = d_node->data)) {
+            vrmr_error(-1, "Internal Error", "NULL pointer");
+            goto error;
+        }
+        if (zone_ptr->type != VRMR_TYPE_HOST &&
+                zone_ptr->type != VRMR_TYPE_FIREWALL)
+            continue;
+
+        if (zone_ptr->ipv4.ipaddress[0] != '\0') {
+            if (zone_index_add_ipv4(zi, zone_ptr, zone_ptr->ipv4.ipaddress,
+                        NULL) < 0)
+                goto error;
+        }
+        if (zone_ptr->ipv6.ip6[0] != '\0') {
+            if (zone_index_add_ipv6(zi, zone_ptr, zone_ptr->ipv6.ip6, 128) < 0)
+                goto error;
+        }
+    }
+
+    /* second pass: the networks */
+    for (d_node = zonelist->top; d_node; d_node = d_node->next) {
+        zone_ptr = d_node->data;
+        if (zone_ptr->type != VRMR_TYPE_NETWORK)
+            continue;
+
+        if (zone_ptr->ipv4.network[0] != '\0') {
+            if (zone_index_add_ipv4(zi, zone_ptr, zone_ptr->ipv4.network,
+                        zone_ptr->ipv4.netmask) < 0)
+                goto error;
+        }
+        if (zone_ptr->ipv6.net6[0] != '\0') {
+            if (zone_index_add_ipv6(zi, zone_ptr, zone_ptr->ipv6.net6,
+                        zone_ptr->ipv6.cidr6) < 0)
+                goto error;
+        }
+    }
+
+    vrmr_debug(LOW, "zone index: %u ipv4 prefixes (%u nodes), %u ipv6 "
+                    "prefixes (%u nodes)",
+            zi->ipv4.prefixes, zi->ipv4.used, zi->ipv6.prefixes,
+            zi->ipv6.used);
+    zi->generation = vrmr_name_cache_next_generation();
+    return (0);
+
+error:
+    vrmr_zone_index_cleanup(zi);
+    return (-1);
+}
+
+/*  vrmr_zone_index_cleanup
+
+    Frees the index. The zones are not touched.
+*/
+void vrmr_zone_index_cleanup(struct vrmr_zone_index *zi)
+{
+    assert(zi);
+
+    vrmr_iptrie_cleanup(&zi->ipv4);
+    vrmr_iptrie_cleanup(&zi->ipv6);
+    zi->generation = 0;
+}
+
+/*  vrmr_zone_index_lookup
+
+    Looks up the binary address 'addr' of family 'family' (AF_INET or
+    AF_INET6). Returns the host or firewall entry for the address, or
+    else the most specific network containing it, or NULL.
+*/
+struct vrmr_zone *vrmr_zone_index_lookup(
+        const struct vrmr_zone_index *zi, int family, const void *addr)
+{
+    assert(zi && addr);
+
+    if (family == AF_INET)
+        return (vrmr_iptrie_lookup(&zi->ipv4, addr, NULL));
+    else if (family == AF_INET6)
+        return (vrmr_iptrie_lookup(&zi->ipv6, addr, NULL));
+
+    return (NULL);
+}
+
+/*  vrmr_zone_index_lookup_ipstr
+
+    Like vrmr_zone_index_lookup, but for an address string. The family
+    is taken from the string. Returns NULL for invalid addresses.
+*/
+struct vrmr_zone *vrmr_zone_index_lookup_ipstr(
+        const struct vrmr_zone_index *zi, const char *ipaddress)
+{
+    struct in6_addr addr;
+
+    assert(zi && ipaddress);
+
+    if (strchr(ipaddress, ':') != NULL) {
+        if (inet_pton(AF_INET6, ipaddress, &addr) != 1)
+            return (NULL);
+        return (vrmr_iptrie_lookup(&zi->ipv6, &addr, NULL));
+    }
+
+    if (inet_pton(AF_INET, ipaddress, &addr) != 1)
+        return (NULL);
+    return (vrmr_iptrie_lookup(&zi->ipv4, &addr, NULL));
+}
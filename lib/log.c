@@ -388,9 +388,25 @@ static void vrmr_log_record_create_tcp_flags(
     *flagBuffer = '\0';
 }
 
+/* use the binary address if the source of the record provided it */
+static struct vrmr_zone *log_record_lookup_zone(
+        const struct vrmr_zone_index *zone_idx,
+        const struct vrmr_log_record *log_record,
+        const union vrmr_ipaddr *addr, const char *ipaddress)
+{
+    if (log_record->have_addr)
+        return (vrmr_zone_index_lookup(
+                zone_idx, log_record->ipv6 ? AF_INET6 : AF_INET, addr));
+
+    return (vrmr_zone_index_lookup_ipstr(zone_idx, ipaddress));
+}
+
 /*
     get the vuurmuurnames with the ips and ports
 
+    If 'cache' is not NULL the zone and service lookups for records with a
+    binary address go through it.
+
     Returncodes:
          1: ok
          0: logline not ok
@@ -400,65 +416,61 @@ static void vrmr_log_record_create_tcp_flags(
    is supposed to exit
 */
 int vrmr_log_record_get_names(struct vrmr_log_record *log_record,
-        struct vrmr_hash_table *zone_hash, struct vrmr_hash_table *service_hash)
+        struct vrmr_zone_index *zone_idx,
+        struct vrmr_service_classifier *service_sc,
+        struct vrmr_name_cache *cache)
 {
     struct vrmr_zone *zone = NULL;
     struct vrmr_service *service = NULL;
+    const struct vrmr_name_cache_entry *nc = NULL;
 
-    assert(log_record && zone_hash && service_hash);
+    assert(log_record && zone_idx && service_sc);
 
-    /* no support in looking up hosts, services, etc yet */
-    if (log_record->ipv6 == 1) {
+    if (cache != NULL && log_record->have_addr) {
+        int icmp = (log_record->protocol == 1 || log_record->protocol == 58);
+        nc = vrmr_name_cache_lookup(cache, zone_idx, service_sc,
+                log_record->ipv6 ? AF_INET6 : AF_INET, log_record->protocol,
+                &log_record->src_addr, &log_record->dst_addr,
+                icmp ? log_record->icmp_type : log_record->src_port,
+                icmp ? log_record->icmp_code : log_record->dst_port);
+    }
+
+    /*  search in the index with the ipaddress. This works for ipv4 and
+        ipv6 alike. Only hosts and firewall entries are named, other
+        addresses are logged as is. */
+    zone = nc ? nc->from
+              : log_record_lookup_zone(zone_idx, log_record,
+                        &log_record->src_addr, log_record->src_ip);
+    if (zone == NULL || zone->type == VRMR_TYPE_NETWORK) {
+        /* not found in the index */
         if (strlcpy(log_record->from_name, log_record->src_ip,
                     sizeof(log_record->from_name)) >=
                 sizeof(log_record->from_name))
             vrmr_error(-1, "Error", "buffer overflow attempt");
+    } else {
+        /* found in the index */
+        if (strlcpy(log_record->from_name, zone->name,
+                    sizeof(log_record->from_name)) >=
+                sizeof(log_record->from_name))
+            vrmr_error(-1, "Error", "buffer overflow attempt");
+    }
+
+    /*  do it all again for TO */
+    zone = nc ? nc->to
+              : log_record_lookup_zone(zone_idx, log_record,
+                        &log_record->dst_addr, log_record->dst_ip);
+    if (zone == NULL || zone->type == VRMR_TYPE_NETWORK) {
+        /* not found in the index */
         if (strlcpy(log_record->to_name, log_record->dst_ip,
                     sizeof(log_record->to_name)) >= sizeof(log_record->to_name))
             vrmr_error(-1, "Error", "buffer overflow attempt");
     } else {
-        /* search in the hash with the ipaddress */
-        if (!(zone = vrmr_search_zone_in_hash_with_ipv4(
-                      log_record->src_ip, zone_hash))) {
-            /* not found in hash */
-            if (strlcpy(log_record->from_name, log_record->src_ip,
-                        sizeof(log_record->from_name)) >=
-                    sizeof(log_record->from_name))
-                vrmr_error(-1, "Error", "buffer overflow attempt");
-        } else {
-            /* found in the hash */
-            if (strlcpy(log_record->from_name, zone->name,
-                        sizeof(log_record->from_name)) >=
-                    sizeof(log_record->from_name))
-                vrmr_error(-1, "Error", "buffer overflow attempt");
-
-            if (zone->type == VRMR_TYPE_NETWORK)
-                strlcpy(log_record->from_name, "firewall",
-                        sizeof(log_record->from_name));
-        }
-        zone = NULL;
-
-        /*  do it all again for TO */
-        if (!(zone = vrmr_search_zone_in_hash_with_ipv4(
-                      log_record->dst_ip, zone_hash))) {
-            /* not found in hash */
-            if (strlcpy(log_record->to_name, log_record->dst_ip,
-                        sizeof(log_record->to_name)) >=
-                    sizeof(log_record->to_name))
-                vrmr_error(-1, "Error", "buffer overflow attempt");
-        } else {
-            /* found in the hash */
-            if (strlcpy(log_record->to_name, zone->name,
-                        sizeof(log_record->to_name)) >=
-                    sizeof(log_record->to_name))
-                vrmr_error(-1, "Error", "buffer overflow attempt");
-
-            if (zone->type == VRMR_TYPE_NETWORK)
-                strlcpy(log_record->to_name, "firewall",
-                        sizeof(log_record->to_name));
-        }
-        zone = NULL;
+        /* found in the index */
+        if (strlcpy(log_record->to_name, zone->name,
+                    sizeof(log_record->to_name)) >= sizeof(log_record->to_name))
+            vrmr_error(-1, "Error", "buffer overflow attempt");
     }
+    zone = NULL;
 
     /*
         THE SERVICE
@@ -468,9 +480,10 @@ int vrmr_log_record_get_names(struct vrmr_log_record *log_record,
         and we can call vrmr_get_icmp_name_short.
     */
     if (log_record->protocol == 1 || log_record->protocol == 58) {
-        if (!(service = vrmr_search_service_in_hash(log_record->icmp_type,
-                      log_record->icmp_code, log_record->protocol,
-                      service_hash))) {
+        service = nc ? nc->service
+                     : vrmr_service_classify(service_sc, log_record->protocol,
+                               log_record->icmp_type, log_record->icmp_code);
+        if (service == NULL) {
             /* not found in hash */
             snprintf(log_record->ser_name, sizeof(log_record->ser_name),
                     "%d.%d(icmp)", log_record->icmp_type,
@@ -495,15 +508,19 @@ int vrmr_log_record_get_names(struct vrmr_log_record *log_record,
         /*  here we handle the rest */
 
         /* first a normal search */
-        if (!(service = vrmr_search_service_in_hash(log_record->src_port,
-                      log_record->dst_port, log_record->protocol,
-                      service_hash))) {
+        service = nc ? nc->service
+                     : vrmr_service_classify(service_sc, log_record->protocol,
+                               log_record->src_port, log_record->dst_port);
+        if (service == NULL) {
             /* only do the reverse check for tcp and udp */
             if (log_record->protocol == 6 || log_record->protocol == 17) {
                 /* not found, do a reverse search */
-                if (!(service = vrmr_search_service_in_hash(
-                              log_record->dst_port, log_record->src_port,
-                              log_record->protocol, service_hash))) {
+                service = nc ? nc->rservice
+                             : vrmr_service_classify(service_sc,
+                                       log_record->protocol,
+                                       log_record->dst_port,
+                                       log_record->src_port);
+                if (service == NULL) {
                     /* not found in the hash */
                     if (log_record->protocol == 6) /* tcp */
                     {
@@ -672,6 +689,81 @@ int vrmr_log_record_build_line(
     return (0);
 }
 
+/*  vrmr_log_bytes2str
+
+    Human readable byte count, as used in the connection logs.
+*/
+void vrmr_log_bytes2str(const uint64_t bytes, char *str, size_t size)
+{
+    if (bytes == 0)
+        snprintf(str, size, "0b");
+    /* 1 byte - 999 bytes */
+    else if (bytes > 0 && bytes < 1000)
+        snprintf(str, size, "%ub", (unsigned int)bytes);
+    /* 1kb - 999kb */
+    else if (bytes >= 1000 && bytes < 1000000)
+        snprintf(str, size, "%.1fk", (float)bytes / 1024);
+    /* 1mb - 10mb */
+    else if (bytes >= 1000000 && bytes < 10000000)
+        snprintf(str, size, "%1.1fM", (float)bytes / (1024 * 1024));
+    /* 10mb - 1000mb */
+    else if (bytes >= 10000000 && bytes < 1000000000)
+        snprintf(str, size, "%.0fM", (float)bytes / (1024 * 1024));
+    else if (bytes >= 1000000000 && bytes < 10000000000ULL)
+        snprintf(str, size, "%1.1fG", (float)bytes / (1024 * 1024 * 1024));
+    else if (bytes >= 10000000000ULL && bytes < 100000000000ULL)
+        snprintf(str, size, "%.0fG", (float)bytes / (1024 * 1024 * 1024));
+    else
+        snprintf(str, size, "%.0fG", (float)bytes / (1024 * 1024 * 1024));
+}
+
+/*  vrmr_log_record_reset
+
+    Prepare a record for the next packet or connection. Only the fields
+    the decoders don't always overwrite are cleared: strings are emptied by
+    their first byte. The hostname and the time fields are kept, so the
+    caller can fill those once and reuse them. This is a lot cheaper than
+    clearing the whole record for every packet.
+*/
+void vrmr_log_record_reset(struct vrmr_log_record *log_record)
+{
+    assert(log_record);
+
+    log_record->logger[0] = '\0';
+    log_record->action[0] = '\0';
+    log_record->logprefix[0] = '\0';
+    log_record->interface_in[0] = '\0';
+    log_record->interface_out[0] = '\0';
+    log_record->src_ip[0] = '\0';
+    log_record->dst_ip[0] = '\0';
+    log_record->ipv6 = 0;
+    log_record->have_addr = 0;
+    log_record->protocol = 0;
+    log_record->src_port = 0;
+    log_record->dst_port = 0;
+    log_record->icmp_type = 0;
+    log_record->icmp_code = 0;
+    log_record->src_mac[0] = '\0';
+    log_record->dst_mac[0] = '\0';
+    log_record->have_hwaddr = 0;
+    log_record->packet_len = 0;
+    log_record->syn = 0;
+    log_record->fin = 0;
+    log_record->rst = 0;
+    log_record->ack = 0;
+    log_record->psh = 0;
+    log_record->urg = 0;
+    log_record->ttl = 0;
+    log_record->from_name[0] = '\0';
+    log_record->to_name[0] = '\0';
+    log_record->ser_name[0] = '\0';
+    log_record->from_int[0] = '\0';
+    log_record->to_int[0] = '\0';
+    log_record->tcpflags[0] = '\0';
+    memset(&log_record->lu, 0, sizeof(log_record->lu));
+    log_record->helper[0] = '\0';
+}
+
 void vrmr_log_record_parse_prefix(
         struct vrmr_log_record *log_record, const char *prefix)
 {
@@ -0,0 +1,413 @@
+/***************************************************************************
+ *   Copyright (C) 2003-2019 by Victor Julien                              *
+ *   victor@vuurmuur.org                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*  Metrics in the Prometheus text format.
+
+    The daemons keep their counters and histograms themselves. When a
+    client connects to the metrics socket, a fill function writes them
+    into a struct vrmr_metrics buffer using the helpers below, and the
+    buffer is sent back before the connection is closed.
+
+    A client that sends a HTTP request gets a HTTP response, so both
+    'curl --unix-socket <path> http://localhost/metrics' and a plain
+    'socat - UNIX-CONNECT:<path>' work.
+*/
+
+#include "config.h"
+#include "vuurmuur.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* how long we wait for a client to send its request */
+#define VRMR_METRICS_REQUEST_WAIT_MS 100
+/* how long sending the response to a client may block */
+#define VRMR_METRICS_SEND_TIMEOUT_S 1
+
+/*  vrmr_metrics_now
+
+    Returns a monotonic timestamp in seconds, for measuring durations.
+*/
+double vrmr_metrics_now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        return (0.0);
+    return ((double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0);
+}
+
+/*  vrmr_histogram_init
+
+    Setup 'h' with the upper bounds in 'bounds', which must be ascending
+    and stay valid for the life time of the histogram.
+*/
+void vrmr_histogram_init(
+        struct vrmr_histogram *h, const double *bounds, unsigned int nbounds)
+{
+    assert(h && bounds);
+    assert(nbounds > 0 && nbounds <= VRMR_HISTOGRAM_MAX_BOUNDS);
+
+    memset(h, 0, sizeof(*h));
+    h->bounds = bounds;
+    h->nbounds = nbounds;
+}
+
+void vrmr_histogram_observe(struct vrmr_histogram *h, double value)
+{
+    unsigned int i;
+
+    assert(h);
+
+    for (i = 0; i < h->nbounds; i++) {
+        if (value <= h->bounds[i])
+            break;
+    }
+    /* i == nbounds is the +Inf bucket */
+    h->buckets[i]++;
+    h->count++;
+    h->sum += value;
+}
+
+static void metrics_vprintf(struct vrmr_metrics *m, const char *fmt, va_list ap)
+{
+    if (m->failed)
+        return;
+
+    for (;;) {
+        va_list aq;
+        va_copy(aq, ap);
+        int n = vsnprintf(m->buf + m->len, m->size - m->len, fmt, aq);
+        va_end(aq);
+        if (n < 0) {
+            m->failed = 1;
+            return;
+        }
+        if ((size_t)n < m->size - m->len) {
+            m->len += (size_t)n;
+            return;
+        }
+
+        size_t size = m->size * 2;
+        while (size - m->len <= (size_t)n)
+            size *= 2;
+        char *buf = realloc(m->buf, size);
+        if (buf == NULL) {
+            vrmr_error(-1, "Error", "realloc failed: %s", strerror(errno));
+            m->failed = 1;
+            return;
+        }
+        m->buf = buf;
+        m->size = size;
+    }
+}
+
+static void metrics_printf(struct vrmr_metrics *m, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    metrics_vprintf(m, fmt, ap);
+    va_end(ap);
+}
+
+/*  vrmr_metrics_help
+
+    Writes the HELP and TYPE lines of metric 'name'. 'type' is one of
+    "counter", "gauge" or "histogram".
+*/
+void vrmr_metrics_help(struct vrmr_metrics *m, const char *name,
+        const char *type, const char *help)
+{
+    assert(m && name && type && help);
+
+    metrics_printf(m, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/*  vrmr_metrics_u64
+
+    Writes a sample of metric 'name'. 'labels' is NULL or a label list
+    without the braces, like: table="filter",chain="INPUT"
+*/
+void vrmr_metrics_u64(struct vrmr_metrics *m, const char *name,
+        const char *labels, uint64_t value)
+{
+    assert(m && name);
+
+    if (labels != NULL)
+        metrics_printf(m, "%s{%s} %" PRIu64 "\n", name, labels, value);
+    else
+        metrics_printf(m, "%s %" PRIu64 "\n", name, value);
+}
+
+void vrmr_metrics_double(struct vrmr_metrics *m, const char *name,
+        const char *labels, double value)
+{
+    assert(m && name);
+
+    if (labels != NULL)
+        metrics_printf(m, "%s{%s} %.6f\n", name, labels, value);
+    else
+        metrics_printf(m, "%s %.6f\n", name, value);
+}
+
+/*  vrmr_metrics_histogram
+
+    Writes the cumulative buckets, the sum and the count of 'h'.
+*/
+void vrmr_metrics_histogram(struct vrmr_metrics *m, const char *name,
+        const char *labels, const struct vrmr_histogram *h)
+{
+    const char *sep = labels ? "," : "";
+    uint64_t total = 0;
+
+    assert(m && name && h);
+
+    if (labels == NULL)
+        labels = "";
+
+    for (unsigned int i = 0; i < h->nbounds; i++) {
+        total += h->buckets[i];
+        metrics_printf(m, "%s_bucket{%s%sle=\"%g\"} %" PRIu64 "\n", name,
+                labels, sep, h->bounds[i], total);
+    }
+    total += h->buckets[h->nbounds];
+    metrics_printf(m, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n", name, labels,
+            sep, total);
+
+    if (*labels != '\0') {
+        metrics_printf(m, "%s_sum{%s} %.6f\n", name, labels, h->sum);
+        metrics_printf(m, "%s_count{%s} %" PRIu64 "\n", name, labels, h->count);
+    } else {
+        metrics_printf(m, "%s_sum %.6f\n", name, h->sum);
+        metrics_printf(m, "%s_count %" PRIu64 "\n", name, h->count);
+    }
+}
+
+/*  vrmr_metrics_listen
+
+    Creates the metrics socket at 'path'. A stale socket from a previous
+    run is removed, anything else at 'path' is left alone.
+
+    Returncodes:
+         0: ok
+        -1: error
+*/
+int vrmr_metrics_listen(struct vrmr_metrics_server *s, const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+
+    assert(s && path);
+
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlcpy(addr.sun_path, path, sizeof(addr.sun_path)) >=
+                    sizeof(addr.sun_path) ||
+            strlcpy(s->path, path, sizeof(s->path)) >= sizeof(s->path)) {
+        vrmr_error(-1, "Error", "metrics socket path '%s' is too long", path);
+        return (-1);
+    }
+
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            vrmr_error(-1, "Error", "'%s' exists and is not a socket", path);
+            return (-1);
+        }
+        (void)unlink(path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        vrmr_error(-1, "Error", "socket failed: %s", strerror(errno));
+        return (-1);
+    }
+
+    /* only root gets to read the metrics */
+    mode_t old_mask = umask(0077);
+    int r = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    (void)umask(old_mask);
+    if (r == -1) {
+        vrmr_error(-1, "Error", "binding the metrics socket to '%s' failed: %s",
+                path, strerror(errno));
+        close(fd);
+        return (-1);
+    }
+    if (listen(fd, 8) == -1) {
+        vrmr_error(-1, "Error", "listen failed: %s", strerror(errno));
+        close(fd);
+        (void)unlink(path);
+        return (-1);
+    }
+
+    s->fd = fd;
+    return (0);
+}
+
+/*  vrmr_metrics_close
+
+    Closes and removes the metrics socket, if it is open.
+*/
+void vrmr_metrics_close(struct vrmr_metrics_server *s)
+{
+    assert(s);
+
+    if (s->fd == -1)
+        return;
+
+    close(s->fd);
+    (void)unlink(s->path);
+    s->fd = -1;
+}
+
+static int metrics_send(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return (-1);
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return (0);
+}
+
+/* answer one client */
+static void metrics_client(struct vrmr_metrics_server *s, int fd,
+        vrmr_metrics_fill_func fill, void *data)
+{
+    struct timeval tv = {VRMR_METRICS_SEND_TIMEOUT_S, 0};
+    struct pollfd pfd = {fd, POLLIN, 0};
+    char request[512];
+    ssize_t n = 0;
+
+    (void)setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    /* a HTTP client sends its request right away. We don't care about the
+     * rest of it, every path gets the metrics. */
+    if (poll(&pfd, 1, VRMR_METRICS_REQUEST_WAIT_MS) == 1)
+        n = recv(fd, request, sizeof(request) - 1, MSG_DONTWAIT);
+    int http = (n >= 4 && strncmp(request, "GET ", 4) == 0);
+
+    struct vrmr_metrics m = {NULL, 0, 0, 0};
+    m.size = 4096;
+    if ((m.buf = malloc(m.size)) == NULL) {
+        vrmr_error(-1, "Error", "malloc failed: %s", strerror(errno));
+        return;
+    }
+    m.buf[0] = '\0';
+
+    s->scrapes++;
+    fill(&m, data);
+
+    if (m.failed) {
+        if (http) {
+            static const char err[] =
+                    "HTTP/1.0 500 Internal Server Error\r\n\r\n";
+            (void)metrics_send(fd, err, sizeof(err) - 1);
+        }
+        free(m.buf);
+        return;
+    }
+
+    if (http) {
+        char hdr[128];
+        int len = snprintf(hdr, sizeof(hdr),
+                "HTTP/1.0 200 OK\r\n"
+                "Content-Type: text/plain; version=0.0.4\r\n"
+                "Content-Length: %zu\r\n\r\n",
+                m.len);
+        if (metrics_send(fd, hdr, (size_t)len) < 0) {
+            free(m.buf);
+            return;
+        }
+    }
+    if (metrics_send(fd, m.buf, m.len) < 0)
+        vrmr_debug(LOW, "sending metrics failed: %s", strerror(errno));
+    free(m.buf);
+}
+
+/*  vrmr_metrics_serve
+
+    Answers the clients that are waiting on the metrics socket. Call it
+    when the socket is readable. 'fill' writes the metrics.
+
+    A client can keep us busy for up to VRMR_METRICS_REQUEST_WAIT_MS plus
+    VRMR_METRICS_SEND_TIMEOUT_S per send, so don't call this from a thread
+    that has to keep up with the kernel.
+*/
+void vrmr_metrics_serve(struct vrmr_metrics_server *s,
+        vrmr_metrics_fill_func fill, void *data)
+{
+    assert(s && fill);
+
+    if (s->fd == -1)
+        return;
+
+    int fd;
+    while ((fd = accept4(s->fd, NULL, NULL, SOCK_CLOEXEC)) != -1) {
+        metrics_client(s, fd, fill, data);
+        close(fd);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        vrmr_debug(LOW, "accept failed: %s", strerror(errno));
+}
+
+/*  vrmr_metrics_wait
+
+    Waits 'timeout_ms' milliseconds, answering the metrics clients that
+    connect meanwhile. For loops that would otherwise sleep().
+*/
+void vrmr_metrics_wait(struct vrmr_metrics_server *s, unsigned int timeout_ms,
+        vrmr_metrics_fill_func fill, void *data)
+{
+    assert(s && fill);
+
+    double end = vrmr_metrics_now() + (double)timeout_ms / 1000.0;
+
+    for (;;) {
+        double left = end - vrmr_metrics_now();
+        if (left <= 0.0)
+            break;
+
+        if (s->fd == -1) {
+            struct timespec ts;
+            ts.tv_sec = (time_t)left;
+            ts.tv_nsec = (long)((left - (double)ts.tv_sec) * 1000000000.0);
+            /* interrupted by a signal: let the caller look at it */
+            (void)nanosleep(&ts, NULL);
+            break;
+        }
+
+        struct pollfd pfd = {s->fd, POLLIN, 0};
+        int r = poll(&pfd, 1, (int)(left * 1000.0) + 1);
+        if (r == -1)
+            break;
+        if (r == 1)
+            vrmr_metrics_serve(s, fill, data);
+    }
+}
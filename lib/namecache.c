@@ -0,0 +1,228 @@
+/***************************************************************************
+ *   Copyright (C) 2003-2019 by Victor Julien                              *
+ *   victor@vuurmuur.org                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*  Name resolution cache
+
+    Logged packets and connections come in bursts of the same address and
+    port pairs, so the zone index and service classifier are asked the same
+    questions over and over. This caches their answers per (source,
+    destination, protocol, source port, destination port).
+
+    The cache has a fixed number of entries and evicts with the CLOCK
+    algorithm. The zone index and the service classifier get a new
+    generation every time they are built, the cache is flushed when it sees
+    a different one. The entries point into the zones and services lists,
+    so they must not be used after a reload.
+
+    Not thread safe: each thread needs its own cache. Only the statistics
+    may be read by another thread, with relaxed atomic loads.
+*/
+
+#include "config.h"
+#include "vuurmuur.h"
+
+static uint32_t generation_counter = 0;
+
+/*  vrmr_name_cache_next_generation
+
+    Returns a generation number for a newly built zone index or service
+    classifier. Never returns 0, which is used for 'not built'.
+*/
+uint32_t vrmr_name_cache_next_generation(void)
+{
+    uint32_t gen;
+
+    do {
+        gen = __atomic_add_fetch(&generation_counter, 1, __ATOMIC_RELAXED);
+    } while (gen == 0);
+    return gen;
+}
+
+/*  vrmr_name_cache_init
+
+    Setup a cache that holds 'size' entries.
+
+    Returncodes:
+         0: ok
+        -1: error
+*/
+int vrmr_name_cache_init(struct vrmr_name_cache *c, uint32_t size)
+{
+    assert(c && size > 0);
+
+    memset(c, 0, sizeof(*c));
+
+    c->entries = calloc(size, sizeof(struct vrmr_name_cache_entry));
+    if (c->entries == NULL) {
+        vrmr_error(-1, "Error", "calloc failed: %s", strerror(errno));
+        return (-1);
+    }
+    c->size = size;
+
+    /* sized so that it never has to grow */
+    if (vrmr_htable_init(&c->index, size) < 0) {
+        free(c->entries);
+        c->entries = NULL;
+        c->size = 0;
+        return (-1);
+    }
+    return (0);
+}
+
+/*  vrmr_name_cache_cleanup
+
+    Frees the entries. The cache can be setup again with
+    vrmr_name_cache_init.
+*/
+void vrmr_name_cache_cleanup(struct vrmr_name_cache *c)
+{
+    assert(c);
+
+    vrmr_htable_cleanup(&c->index, NULL);
+    free(c->entries);
+    c->entries = NULL;
+    c->size = 0;
+}
+
+/*  vrmr_name_cache_flush
+
+    Removes all entries.
+
+    Returncodes:
+         0: ok
+        -1: error, the cache can't be used anymore
+*/
+int vrmr_name_cache_flush(struct vrmr_name_cache *c)
+{
+    assert(c);
+
+    if (c->entries == NULL)
+        return (-1);
+
+    vrmr_htable_cleanup(&c->index, NULL);
+    memset(c->entries, 0, c->size * sizeof(struct vrmr_name_cache_entry));
+    c->hand = 0;
+    __atomic_fetch_add(&c->flushes, 1, __ATOMIC_RELAXED);
+
+    if (vrmr_htable_init(&c->index, c->size) < 0) {
+        vrmr_name_cache_cleanup(c);
+        return (-1);
+    }
+    return (0);
+}
+
+static int name_cache_compare(const void *table_data, const void *search_data)
+{
+    const struct vrmr_name_cache_entry *e = table_data;
+    return (memcmp(&e->key, search_data, sizeof(e->key)) == 0);
+}
+
+/* find an entry to reuse: the first one the hand finds that was not
+ * referenced since the hand last passed it */
+static struct vrmr_name_cache_entry *name_cache_evict(
+        struct vrmr_name_cache *c)
+{
+    for (;;) {
+        struct vrmr_name_cache_entry *e = &c->entries[c->hand];
+        c->hand = (c->hand + 1) % c->size;
+
+        if (!e->used)
+            return (e);
+        if (e->referenced) {
+            e->referenced = 0;
+            continue;
+        }
+
+        (void)vrmr_htable_remove(
+                &c->index, e->hash, name_cache_compare, &e->key);
+        e->used = 0;
+        __atomic_fetch_add(&c->evictions, 1, __ATOMIC_RELAXED);
+        return (e);
+    }
+}
+
+/*  vrmr_name_cache_lookup
+
+    Looks up the zones for 'src' and 'dst' in 'zi' and the service for
+    the ports in 'sc', from the cache if possible. For ICMP 'sport' is the
+    type and 'dport' the code.
+
+    The entry has the raw results: from/to are what vrmr_zone_index_lookup
+    returns, service is the classification of (sport, dport) and rservice
+    of (dport, sport). It is valid until the next call.
+
+    Returns NULL if the cache can't be used, the caller has to do the
+    lookups itself then.
+*/
+const struct vrmr_name_cache_entry *vrmr_name_cache_lookup(
+        struct vrmr_name_cache *c, const struct vrmr_zone_index *zi,
+        const struct vrmr_service_classifier *sc, int family, int protocol,
+        const union vrmr_ipaddr *src, const union vrmr_ipaddr *dst, int sport,
+        int dport)
+{
+    assert(c && zi && sc && src && dst);
+
+    if (c->entries == NULL)
+        return (NULL);
+
+    /* the zones or services were reloaded */
+    if (c->zone_generation != zi->generation ||
+            c->service_generation != sc->generation) {
+        if (vrmr_name_cache_flush(c) < 0)
+            return (NULL);
+        c->zone_generation = zi->generation;
+        c->service_generation = sc->generation;
+    }
+
+    struct vrmr_name_cache_key key;
+    size_t alen = (family == AF_INET6) ? 16 : 4;
+    memset(&key, 0, sizeof(key));
+    memcpy(key.src, src->bytes, alen);
+    memcpy(key.dst, dst->bytes, alen);
+    key.sport = (uint16_t)sport;
+    key.dport = (uint16_t)dport;
+    key.protocol = (uint8_t)protocol;
+    key.family = (uint8_t)family;
+
+    uint32_t hash = vrmr_hash_bytes(&key, sizeof(key));
+    struct vrmr_name_cache_entry *e =
+            vrmr_htable_search(&c->index, hash, name_cache_compare, &key);
+    if (e != NULL) {
+        __atomic_fetch_add(&c->hits, 1, __ATOMIC_RELAXED);
+        e->referenced = 1;
+        return (e);
+    }
+
+    __atomic_fetch_add(&c->misses, 1, __ATOMIC_RELAXED);
+    e = name_cache_evict(c);
+    e->key = key;
+    e->hash = hash;
+    e->from = vrmr_zone_index_lookup(zi, family, src);
+    e->to = vrmr_zone_index_lookup(zi, family, dst);
+    e->service = vrmr_service_classify(sc, protocol, sport, dport);
+    e->rservice = vrmr_service_classify(sc, protocol, dport, sport);
+
+    /* doesn't fail: the index never grows */
+    if (vrmr_htable_insert(&c->index, hash, e) < 0)
+        return (NULL);
+    e->used = 1;
+    e->referenced = 0;
+    return (e);
+}
@@ -25,6 +25,68 @@
 #include "vuurmuur.h"
 #include <ctype.h>
 
+/* - vrmr_rules_nflog_group -
+ * Pick the NFLOG group for a log rule. The rules are spread over the
+ * 'nflog_groups' groups starting at 'nfgrp' by a hash of 'key', normally the
+ * log prefix, so a rule keeps its group when other rules are added or
+ * removed.
+ */
+unsigned int vrmr_rules_nflog_group(
+        const struct vrmr_config *cfg, const char *key)
+{
+    assert(cfg);
+
+    unsigned int group = (unsigned int)cfg->nfgrp;
+    if (cfg->nflog_groups > 1 && key != NULL)
+        group += vrmr_hash_bytes(key, strlen(key)) % cfg->nflog_groups;
+    return (group);
+}
+
+/* - vrmr_rules_nflog_options -
+ * Create the options for the NFLOG target: the group vuurmuur_log listens on,
+ * the number of packets the kernel may queue before it sends them and how
+ * much of each packet is copied. Batching the messages saves a netlink
+ * message and a wakeup of vuurmuur_log per packet, and vuurmuur_log only
+ * looks at the headers, so there is no need to copy the whole packet.
+ *
+ * 'key' selects the group, see vrmr_rules_nflog_group().
+ */
+void vrmr_rules_nflog_options(const struct vrmr_config *cfg, const char *key,
+        char *opts, size_t size)
+{
+    assert(cfg && opts);
+
+    (void)snprintf(opts, size,
+            "--nflog-group %u --nflog-threshold %u --nflog-size %u",
+            vrmr_rules_nflog_group(cfg, key), cfg->nflog_threshold,
+            cfg->nflog_snaplen);
+}
+
+/* - vrmr_rules_ctevents_options -
+ * Create the --ctevents option for the CT target if CONNLOG_CTEVENTS is
+ * enabled, or an empty string. New connections then only generate the
+ * events vuurmuur_log logs, so the kernel doesn't build and multicast
+ * update events nobody reads.
+ *
+ * 'f' is the parsed connection log filter. This is done once when the
+ * config is read, the result is kept in cfg->connlog_ctevents_opts.
+ */
+void vrmr_rules_ctevents_options(const struct vrmr_config *cfg,
+        const struct vrmr_conntrack_filter *f, char *opts, size_t size)
+{
+    assert(cfg && f && opts);
+
+    opts[0] = '\0';
+    if (!cfg->connlog_ctevents)
+        return;
+
+    (void)snprintf(opts, size, "--ctevents %s%s%s",
+            (f->events & VRMR_CT_EVENT_NEW) ? "new" : "",
+            (f->events == (VRMR_CT_EVENT_NEW | VRMR_CT_EVENT_DESTROY)) ? ","
+                                                                        : "",
+            (f->events & VRMR_CT_EVENT_DESTROY) ? "destroy" : "");
+}
+
 /* - determine_action -
  * In this function we translate the 'accept' or 'drop' from the 'rules.conf'
  * file to the values that iptables understands, like 'ACCEPT, DROP, REJECT'.
@@ -91,7 +153,10 @@ static int determine_action(struct vrmr_config *cfg, char *query, char *action,
             return (-1);
         }
     } else if (action_type == VRMR_AT_LOG) {
-        (void)snprintf(action, size, "NFLOG --nflog-group %u", cfg->nfgrp);
+        char nflog_opts[96];
+        vrmr_rules_nflog_options(
+                cfg, option->logprefix, nflog_opts, sizeof(nflog_opts));
+        (void)snprintf(action, size, "NFLOG %s", nflog_opts);
 
         /* when action is LOG, the log option must not be set */
         option->rule_log = FALSE;
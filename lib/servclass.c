@@ -0,0 +1,390 @@
+/***************************************************************************
+ *   Copyright (C) 2002-2019 by Victor Julien                              *
+ *   victor@vuurmuur.org                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*  Service classifier
+
+    Maps a (protocol, source port, destination port) tuple to the first
+    service in the services list that has a matching portrange. This
+    replaces the services hash table, which stored a service once for
+    every port in its destination range.
+
+    TCP and UDP: the destination port space is cut into segments at every
+    range boundary. Each segment has the list of portranges covering it,
+    ordered by the position of their service in the services list. A
+    lookup is a binary search for the segment followed by a source port
+    check of the (usually one or two) candidates.
+
+    ICMP: a sorted array of (type, code) pairs.
+
+    Other protocols: a direct table indexed by protocol number.
+
+    Memory use is proportional to the number of portranges times the
+    number of ranges that overlap, not to the width of the ranges.
+*/
+
+#include "config.h"
+#include "vuurmuur.h"
+
+struct vrmr_sc_range {
+    uint16_t src_low;
+    uint16_t src_high;
+    uint16_t dst_low;
+    uint16_t dst_high;
+    uint32_t order; /* position of the service in the services list */
+    struct vrmr_service *service;
+};
+
+struct vrmr_sc_ports {
+    /* all portranges, in services list order */
+    struct vrmr_sc_range *ranges;
+    uint32_t ranges_cnt;
+
+    /* start port of each segment, sorted. seg_start[0] is always 0 */
+    uint32_t *seg_start;
+    uint32_t seg_cnt;
+
+    /* candidates of segment i are cand[seg_first[i]] up to
+     * cand[seg_first[i + 1]] */
+    uint32_t *seg_first;
+    uint32_t *cand;
+    uint32_t cand_cnt;
+};
+
+struct vrmr_sc_icmp {
+    int type;
+    int code;
+    uint32_t order;
+    struct vrmr_service *service;
+};
+
+static void sc_ports_free(struct vrmr_sc_ports *p)
+{
+    if (p == NULL)
+        return;
+
+    free(p->ranges);
+    free(p->seg_start);
+    free(p->seg_first);
+    free(p->cand);
+    free(p);
+}
+
+static int sc_cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static int sc_cmp_icmp(const void *a, const void *b)
+{
+    const struct vrmr_sc_icmp *x = a;
+    const struct vrmr_sc_icmp *y = b;
+
+    if (x->type != y->type)
+        return (x->type > y->type) ? 1 : -1;
+    if (x->code != y->code)
+        return (x->code > y->code) ? 1 : -1;
+    return (x->order > y->order) - (x->order < y->order);
+}
+
+/* index of the segment containing 'port' */
+static uint32_t sc_segment(const struct vrmr_sc_ports *p, uint32_t port)
+{
+    uint32_t low = 0, high = p->seg_cnt;
+
+    /* find the last seg_start <= port */
+    while (high - low > 1) {
+        uint32_t mid = low + (high - low) / 2;
+        if (p->seg_start[mid] <= port)
+            low = mid;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+/*  sc_ports_build
+
+    Cut the port space into segments and fill the candidate lists. The
+    ranges are already in services list order, so appending them in order
+    keeps every candidate list ordered.
+*/
+static int sc_ports_build(struct vrmr_sc_ports *p)
+{
+    uint32_t n = 0;
+
+    /* segment boundaries: 0, every dst_low and every dst_high + 1 */
+    p->seg_start = malloc((2 * p->ranges_cnt + 1) * sizeof(uint32_t));
+    if (p->seg_start == NULL) {
+        vrmr_error(-1, "Error", "malloc failed: %s", strerror(errno));
+        return (-1);
+    }
+    p->seg_start[n++] = 0;
+    for (uint32_t i = 0; i < p->ranges_cnt; i++) {
+        p->seg_start[n++] = p->ranges[i].dst_low;
+        if (p->ranges[i].dst_high < 65535)
+            p->seg_start[n++] = (uint32_t)p->ranges[i].dst_high + 1;
+    }
+    qsort(p->seg_start, n, sizeof(uint32_t), sc_cmp_u32);
+
+    /* remove the duplicates */
+    p->seg_cnt = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (p->seg_cnt == 0 || p->seg_start[p->seg_cnt - 1] != p->seg_start[i])
+            p->seg_start[p->seg_cnt++] = p->seg_start[i];
+    }
+
+    p->seg_first = calloc(p->seg_cnt + 1, sizeof(uint32_t));
+    if (p->seg_first == NULL) {
+        vrmr_error(-1, "Error", "calloc failed: %s", strerror(errno));
+        return (-1);
+    }
+
+    /* first pass: count the candidates per segment */
+    for (uint32_t i = 0; i < p->ranges_cnt; i++) {
+        uint32_t s = sc_segment(p, p->ranges[i].dst_low);
+        for (; s < p->seg_cnt && p->seg_start[s] <= p->ranges[i].dst_high;
+                s++)
+            p->seg_first[s + 1]++;
+    }
+    for (uint32_t s = 0; s < p->seg_cnt; s++)
+        p->seg_first[s + 1] += p->seg_first[s];
+    p->cand_cnt = p->seg_first[p->seg_cnt];
+
+    p->cand = malloc((p->cand_cnt ? p->cand_cnt : 1) * sizeof(uint32_t));
+    uint32_t *fill = calloc(p->seg_cnt, sizeof(uint32_t));
+    if (p->cand == NULL || fill == NULL) {
+        vrmr_error(-1, "Error", "malloc failed: %s", strerror(errno));
+        free(fill);
+        return (-1);
+    }
+
+    /* second pass: fill them */
+    for (uint32_t i = 0; i < p->ranges_cnt; i++) {
+        uint32_t s = sc_segment(p, p->ranges[i].dst_low);
+        for (; s < p->seg_cnt && p->seg_start[s] <= p->ranges[i].dst_high;
+                s++) {
+            p->cand[p->seg_first[s] + fill[s]] = i;
+            fill[s]++;
+        }
+    }
+    free(fill);
+
+    return (0);
+}
+
+static int sc_ports_add(struct vrmr_sc_ports *p, uint32_t *alloc,
+        const struct vrmr_portdata *port, struct vrmr_service *ser_ptr,
+        uint32_t order)
+{
+    /*  a high of 0 means 'no range'. Ranges with low > high can never
+        match, so we leave them out. */
+    int dst_high = port->dst_high ? port->dst_high : port->dst_low;
+    int src_high = port->src_high ? port->src_high : port->src_low;
+
+    if (port->dst_low < 0 || dst_high > 65535 || port->dst_low > dst_high ||
+            port->src_low < 0 || src_high > 65535 || port->src_low > src_high)
+        return (0);
+
+    if (p->ranges_cnt == *alloc) {
+        uint32_t newsize = *alloc ? *alloc * 2 : 16;
+        struct vrmr_sc_range *r =
+                realloc(p->ranges, newsize * sizeof(struct vrmr_sc_range));
+        if (r == NULL) {
+            vrmr_error(-1, "Error", "realloc failed: %s", strerror(errno));
+            return (-1);
+        }
+        p->ranges = r;
+        *alloc = newsize;
+    }
+
+    struct vrmr_sc_range *r = &p->ranges[p->ranges_cnt++];
+    r->src_low = (uint16_t)port->src_low;
+    r->src_high = (uint16_t)src_high;
+    r->dst_low = (uint16_t)port->dst_low;
+    r->dst_high = (uint16_t)dst_high;
+    r->order = order;
+    r->service = ser_ptr;
+    return (0);
+}
+
+/*  vrmr_service_classifier_build
+
+    Builds the classifier for all services in 'services_list'. The services
+    must stay in memory as long as the classifier is used.
+
+    Returncodes:
+         0: ok
+        -1: error
+*/
+int vrmr_service_classifier_build(
+        struct vrmr_service_classifier *sc, struct vrmr_list *services_list)
+{
+    struct vrmr_list_node *d_node = NULL, *p_node = NULL;
+    uint32_t tcp_alloc = 0, udp_alloc = 0, icmp_alloc = 0, order = 0;
+
+    assert(sc && services_list);
+
+    memset(sc, 0, sizeof(*sc));
+
+    if (!(sc->tcp = calloc(1, sizeof(struct vrmr_sc_ports))) ||
+            !(sc->udp = calloc(1, sizeof(struct vrmr_sc_ports)))) {
+        vrmr_error(-1, "Error", "calloc failed: %s", strerror(errno));
+        goto error;
+    }
+
+    for (d_node = services_list->top; d_node; d_node = d_node->next, order++) {
+        struct vrmr_service *ser_ptr = d_node->data;
+        if (ser_ptr == NULL) {
+            vrmr_error(-1, "Internal Error", "NULL pointer");
+            goto error;
+        }
+        sc->services++;
+
+        for (p_node = ser_ptr->PortrangeList.top; p_node;
+                p_node = p_node->next) {
+            struct vrmr_portdata *port = p_node->data;
+            if (port == NULL) {
+                vrmr_error(-1, "Internal Error", "NULL pointer");
+                goto error;
+            }
+            sc->portranges++;
+
+            if (port->protocol == 6) {
+                if (sc_ports_add(sc->tcp, &tcp_alloc, port, ser_ptr, order) < 0)
+                    goto error;
+            } else if (port->protocol == 17) {
+                if (sc_ports_add(sc->udp, &udp_alloc, port, ser_ptr, order) < 0)
+                    goto error;
+            } else if (port->protocol == 1) {
+                /* icmp: dst_low is the type, dst_high the code */
+                if (sc->icmp_cnt == icmp_alloc) {
+                    uint32_t newsize = icmp_alloc ? icmp_alloc * 2 : 16;
+                    struct vrmr_sc_icmp *i = realloc(
+                            sc->icmp, newsize * sizeof(struct vrmr_sc_icmp));
+                    if (i == NULL) {
+                        vrmr_error(-1, "Error", "realloc failed: %s",
+                                strerror(errno));
+                        goto error;
+                    }
+                    sc->icmp = i;
+                    icmp_alloc = newsize;
+                }
+                struct vrmr_sc_icmp *i = &sc->icmp[sc->icmp_cnt++];
+                i->type = port->dst_low;
+                i->code = port->dst_high;
+                i->order = order;
+                i->service = ser_ptr;
+            } else if (port->protocol >= 0 && port->protocol < 256) {
+                /* other protocols have no ports: first service wins */
+                if (sc->proto[port->protocol] == NULL)
+                    sc->proto[port->protocol] = ser_ptr;
+            }
+        }
+    }
+
+    if (sc_ports_build(sc->tcp) < 0 || sc_ports_build(sc->udp) < 0)
+        goto error;
+
+    if (sc->icmp_cnt > 0)
+        qsort(sc->icmp, sc->icmp_cnt, sizeof(struct vrmr_sc_icmp),
+                sc_cmp_icmp);
+
+    vrmr_debug(LOW,
+            "service classifier: %u services, %u portranges, tcp %u "
+            "segments/%u candidates, udp %u segments/%u candidates, icmp %u.",
+            sc->services, sc->portranges, sc->tcp->seg_cnt, sc->tcp->cand_cnt,
+            sc->udp->seg_cnt, sc->udp->cand_cnt, sc->icmp_cnt);
+    sc->generation = vrmr_name_cache_next_generation();
+    return (0);
+
+error:
+    vrmr_service_classifier_cleanup(sc);
+    return (-1);
+}
+
+void vrmr_service_classifier_cleanup(struct vrmr_service_classifier *sc)
+{
+    assert(sc);
+
+    sc_ports_free(sc->tcp);
+    sc_ports_free(sc->udp);
+    free(sc->icmp);
+    memset(sc, 0, sizeof(*sc));
+}
+
+static struct vrmr_service *sc_ports_lookup(
+        const struct vrmr_sc_ports *p, int src, int dst)
+{
+    if (p == NULL || p->seg_cnt == 0 || dst < 0 || dst > 65535)
+        return (NULL);
+
+    uint32_t s = sc_segment(p, (uint32_t)dst);
+    for (uint32_t c = p->seg_first[s]; c < p->seg_first[s + 1]; c++) {
+        const struct vrmr_sc_range *r = &p->ranges[p->cand[c]];
+        if (src >= r->src_low && src <= r->src_high)
+            return (r->service);
+    }
+    return (NULL);
+}
+
+/*  vrmr_service_classify
+
+    Looks up the service for a protocol and port pair. For ICMP 'src' is
+    the type and 'dst' the code, for protocols other than TCP, UDP and
+    ICMP the ports are ignored. Allocates nothing.
+
+    Returns the service or NULL if not found.
+*/
+struct vrmr_service *vrmr_service_classify(
+        const struct vrmr_service_classifier *sc, int protocol, int src,
+        int dst)
+{
+    assert(sc);
+
+    if (protocol == 6)
+        return (sc_ports_lookup(sc->tcp, src, dst));
+    if (protocol == 17)
+        return (sc_ports_lookup(sc->udp, src, dst));
+
+    if (protocol == 1) {
+        uint32_t low = 0, high = sc->icmp_cnt;
+
+        /* find the first entry >= (type, code) */
+        while (low < high) {
+            uint32_t mid = low + (high - low) / 2;
+            const struct vrmr_sc_icmp *i = &sc->icmp[mid];
+            if (i->type < src || (i->type == src && i->code < dst))
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        if (low < sc->icmp_cnt && sc->icmp[low].type == src &&
+                sc->icmp[low].code == dst)
+            return (sc->icmp[low].service);
+        return (NULL);
+    }
+
+    if (protocol >= 0 && protocol < 256)
+        return (sc->proto[protocol]);
+    return (NULL);
+}
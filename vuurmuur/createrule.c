@@ -474,10 +474,11 @@ int create_rule_input(struct vrmr_config *conf, struct rule_scratch *rule,
                     (iptcap->table_raw == TRUE && iptcap->target_ct == TRUE)) &&
             (rule->ipv == VRMR_IPV4 || strcmp(rule->helper, "irc") != 0)) {
         snprintf(cmd, sizeof(cmd),
-                "%s %s %s %s %s %s %s -m connmark --mark 0 -j CT --helper %s",
+                "%s %s %s %s %s %s %s -m connmark --mark 0 -j CT --helper %s "
+                "%s",
                 input_device, rule->proto, rule->temp_src, rule->temp_src_port,
                 rule->temp_dst, rule->temp_dst_port, rule->from_mac,
-                rule->helper);
+                rule->helper, conf->connlog_ctevents_opts);
 
         if (queue_rule(rule, TB_RAW, CH_PREROUTING, cmd, 0, 0) < 0)
             return (-1);
@@ -938,9 +939,10 @@ int create_rule_output(struct vrmr_config *conf, struct rule_scratch *rule,
             (!conf->vrmr_check_iptcaps ||
                     (iptcap->table_raw == TRUE && iptcap->target_ct == TRUE)) &&
             (rule->ipv == VRMR_IPV4 || strcmp(rule->helper, "irc") != 0)) {
-        snprintf(cmd, sizeof(cmd), "%s %s %s %s %s %s -j CT --helper %s",
+        snprintf(cmd, sizeof(cmd), "%s %s %s %s %s %s -j CT --helper %s %s",
                 output_device, rule->proto, rule->temp_src, rule->temp_src_port,
-                rule->temp_dst, rule->temp_dst_port, rule->helper);
+                rule->temp_dst, rule->temp_dst_port, rule->helper,
+                conf->connlog_ctevents_opts);
 
         if (queue_rule(rule, TB_RAW, CH_OUTPUT, cmd, 0, 0) < 0)
             return (-1);
@@ -1407,10 +1409,11 @@ int create_rule_forward(struct vrmr_config *conf, struct rule_scratch *rule,
             (!conf->vrmr_check_iptcaps ||
                     (iptcap->table_raw == TRUE && iptcap->target_ct == TRUE)) &&
             (rule->ipv == VRMR_IPV4 || strcmp(rule->helper, "irc") != 0)) {
-        snprintf(cmd, sizeof(cmd), "%s %s %s %s %s %s %s -j CT --helper %s",
-                input_device, rule->proto, rule->temp_src, rule->temp_src_port,
+        snprintf(cmd, sizeof(cmd),
+                "%s %s %s %s %s %s %s -j CT --helper %s %s", input_device,
+                rule->proto, rule->temp_src, rule->temp_src_port,
                 rule->temp_dst, rule->temp_dst_port, rule->from_mac,
-                rule->helper);
+                rule->helper, conf->connlog_ctevents_opts);
 
         if (queue_rule(rule, TB_RAW, CH_PREROUTING, cmd, 0, 0) < 0)
             return (-1);
@@ -3438,6 +3441,7 @@ static int pre_rules_bad_packets(struct vrmr_config *conf,
     int retval = 0;
     char cmd[VRMR_MAX_PIPE_COMMAND] = "";
     char logprefix[64] = "";
+    char nflog_opts[96] = "";
 
     /*
         stealthscan protection
@@ -3451,11 +3455,12 @@ static int pre_rules_bad_packets(struct vrmr_config *conf,
                                             iptcap->target_nflog == TRUE)) {
         create_logprefix_string(conf, logprefix, sizeof(logprefix),
                 VRMR_RT_NOTSET, "DROP", "probe ALL");
+        vrmr_rules_nflog_options(
+                conf, logprefix, nflog_opts, sizeof(nflog_opts));
 
         snprintf(cmd, sizeof(cmd),
-                "-p tcp -m tcp --tcp-flags ALL NONE %s -j NFLOG %s "
-                "--nflog-group %u",
-                limit, logprefix, conf->nfgrp);
+                "-p tcp -m tcp --tcp-flags ALL NONE %s -j NFLOG %s %s",
+                limit, logprefix, nflog_opts);
 
         if (process_rule(conf, ruleset, ipv, TB_FILTER, CH_INPUT, cmd, 0, 0) <
                 0)
@@ -3481,11 +3486,12 @@ static int pre_rules_bad_packets(struct vrmr_config *conf,
                                             iptcap->target_nflog == TRUE)) {
         create_logprefix_string(conf, logprefix, sizeof(logprefix),
                 VRMR_RT_NOTSET, "DROP", "probe SYN-FIN");
+        vrmr_rules_nflog_options(
+                conf, logprefix, nflog_opts, sizeof(nflog_opts));
 
         snprintf(cmd, sizeof(cmd),
-                "-p tcp -m tcp --tcp-flags SYN,FIN SYN,FIN %s -j NFLOG %s "
-                "--nflog-group %u",
-                limit, logprefix, conf->nfgrp);
+                "-p tcp -m tcp --tcp-flags SYN,FIN SYN,FIN %s -j NFLOG %s %s",
+                limit, logprefix, nflog_opts);
 
         if (process_rule(conf, ruleset, ipv, TB_FILTER, CH_INPUT, cmd, 0, 0) <
                 0)
@@ -3512,11 +3518,12 @@ static int pre_rules_bad_packets(struct vrmr_config *conf,
                                             iptcap->target_nflog == TRUE)) {
         create_logprefix_string(conf, logprefix, sizeof(logprefix),
                 VRMR_RT_NOTSET, "DROP", "probe SYN-RST");
+        vrmr_rules_nflog_options(
+                conf, logprefix, nflog_opts, sizeof(nflog_opts));
 
         snprintf(cmd, sizeof(cmd),
-                "-p tcp -m tcp --tcp-flags SYN,RST SYN,RST %s -j NFLOG %s "
-                "--nflog-group %u",
-                limit, logprefix, conf->nfgrp);
+                "-p tcp -m tcp --tcp-flags SYN,RST SYN,RST %s -j NFLOG %s %s",
+                limit, logprefix, nflog_opts);
 
         if (process_rule(conf, ruleset, ipv, TB_FILTER, CH_INPUT, cmd, 0, 0) <
                 0)
@@ -3543,11 +3550,12 @@ static int pre_rules_bad_packets(struct vrmr_config *conf,
                                             iptcap->target_nflog == TRUE)) {
         create_logprefix_string(conf, logprefix, sizeof(logprefix),
                 VRMR_RT_NOTSET, "DROP", "probe FIN-RST");
+        vrmr_rules_nflog_options(
+                conf, logprefix, nflog_opts, sizeof(nflog_opts));
 
         snprintf(cmd, sizeof(cmd),
-                "-p tcp -m tcp --tcp-flags FIN,RST FIN,RST %s -j NFLOG %s "
-                "--nflog-group %u",
-                limit, logprefix, conf->nfgrp);
+                "-p tcp -m tcp --tcp-flags FIN,RST FIN,RST %s -j NFLOG %s %s",
+                limit, logprefix, nflog_opts);
 
         if (process_rule(conf, ruleset, ipv, TB_FILTER, CH_INPUT, cmd, 0, 0) <
                 0)
@@ -3574,11 +3582,12 @@ static int pre_rules_bad_packets(struct vrmr_config *conf,
                                             iptcap->target_nflog == TRUE)) {
         create_logprefix_string(conf, logprefix, sizeof(logprefix),
                 VRMR_RT_NOTSET, "DROP", "probe FIN");
+        vrmr_rules_nflog_options(
+                conf, logprefix, nflog_opts, sizeof(nflog_opts));
 
         snprintf(cmd, sizeof(cmd),
-                "-p tcp -m tcp --tcp-flags ACK,FIN FIN %s -j NFLOG %s "
-                "--nflog-group %u",
-                limit, logprefix, conf->nfgrp);
+                "-p tcp -m tcp --tcp-flags ACK,FIN FIN %s -j NFLOG %s %s",
+                limit, logprefix, nflog_opts);
 
         if (process_rule(conf, ruleset, ipv, TB_FILTER, CH_INPUT, cmd, 0, 0) <
                 0)
@@ -3604,11 +3613,12 @@ static int pre_rules_bad_packets(struct vrmr_config *conf,
                                             iptcap->target_nflog == TRUE)) {
         create_logprefix_string(conf, logprefix, sizeof(logprefix),
                 VRMR_RT_NOTSET, "DROP", "probe PSH");
+        vrmr_rules_nflog_options(
+                conf, logprefix, nflog_opts, sizeof(nflog_opts));
 
         snprintf(cmd, sizeof(cmd),
-                "-p tcp -m tcp --tcp-flags ACK,PSH PSH %s -j NFLOG %s "
-                "--nflog-group %u",
-                limit, logprefix, conf->nfgrp);
+                "-p tcp -m tcp --tcp-flags ACK,PSH PSH %s -j NFLOG %s %s",
+                limit, logprefix, nflog_opts);
 
         if (process_rule(conf, ruleset, ipv, TB_FILTER, CH_INPUT, cmd, 0, 0) <
                 0)
@@ -3634,11 +3644,12 @@ static int pre_rules_bad_packets(struct vrmr_config *conf,
                                             iptcap->target_nflog == TRUE)) {
         create_logprefix_string(conf, logprefix, sizeof(logprefix),
                 VRMR_RT_NOTSET, "DROP", "probe URG");
+        vrmr_rules_nflog_options(
+                conf, logprefix, nflog_opts, sizeof(nflog_opts));
 
         snprintf(cmd, sizeof(cmd),
-                "-p tcp -m tcp --tcp-flags ACK,URG URG %s -j NFLOG %s "
-                "--nflog-group %u",
-                limit, logprefix, conf->nfgrp);
+                "-p tcp -m tcp --tcp-flags ACK,URG URG %s -j NFLOG %s %s",
+                limit, logprefix, nflog_opts);
 
         if (process_rule(conf, ruleset, ipv, TB_FILTER, CH_INPUT, cmd, 0, 0) <
                 0)
@@ -3664,12 +3675,13 @@ static int pre_rules_bad_packets(struct vrmr_config *conf,
                                             iptcap->target_nflog == TRUE)) {
         create_logprefix_string(conf, logprefix, sizeof(logprefix),
                 VRMR_RT_NOTSET, "DROP", "no SYN");
+        vrmr_rules_nflog_options(
+                conf, logprefix, nflog_opts, sizeof(nflog_opts));
 
         snprintf(cmd, sizeof(cmd),
-                "-p tcp -m tcp ! --syn %s NEW %s -j NFLOG %s "
-                "--nflog-group %u",
+                "-p tcp -m tcp ! --syn %s NEW %s -j NFLOG %s %s",
                 create_state_string(conf, ipv, iptcap), limit, logprefix,
-                conf->nfgrp);
+                nflog_opts);
 
         if (process_rule(conf, ruleset, ipv, TB_FILTER, CH_INPUT, cmd, 0, 0) <
                 0)
@@ -3699,9 +3711,11 @@ static int pre_rules_bad_packets(struct vrmr_config *conf,
                                               iptcap->target_nflog == TRUE)) {
             create_logprefix_string(conf, logprefix, sizeof(logprefix),
                     VRMR_RT_NOTSET, "DROP", "FRAG");
+            vrmr_rules_nflog_options(
+                    conf, logprefix, nflog_opts, sizeof(nflog_opts));
 
-            snprintf(cmd, sizeof(cmd), "-f %s -j NFLOG %s --nflog-group %u",
-                    limit, logprefix, conf->nfgrp);
+            snprintf(cmd, sizeof(cmd), "-f %s -j NFLOG %s %s",
+                    limit, logprefix, nflog_opts);
 
             if (process_rule(
                         conf, ruleset, ipv, TB_FILTER, CH_INPUT, cmd, 0, 0) < 0)
@@ -3736,6 +3750,7 @@ static int pre_rules_conntrack_invalid(struct vrmr_config *conf,
     int retval = 0;
     char cmd[VRMR_MAX_PIPE_COMMAND] = "";
     char logprefix[64] = "";
+    char nflog_opts[96] = "";
 
     if (!conf->conntrack_invalid_drop) {
         if (conf->bash_out == TRUE)
@@ -3757,10 +3772,12 @@ static int pre_rules_conntrack_invalid(struct vrmr_config *conf,
                                              iptcap->target_nflog == TRUE)) {
         create_logprefix_string(conf, logprefix, sizeof(logprefix),
                 VRMR_RT_INPUT, "DROP", "in INVALID");
+        vrmr_rules_nflog_options(
+                conf, logprefix, nflog_opts, sizeof(nflog_opts));
 
-        snprintf(cmd, sizeof(cmd), "%s INVALID %s -j NFLOG %s --nflog-group %u",
+        snprintf(cmd, sizeof(cmd), "%s INVALID %s -j NFLOG %s %s",
                 create_state_string(conf, ipv, iptcap), limit, logprefix,
-                conf->nfgrp);
+                nflog_opts);
 
         if (process_rule(conf, ruleset, ipv, TB_FILTER, CH_INPUT, cmd, 0, 0) <
                 0)
@@ -3779,10 +3796,12 @@ static int pre_rules_conntrack_invalid(struct vrmr_config *conf,
                                              iptcap->target_nflog == TRUE)) {
         create_logprefix_string(conf, logprefix, sizeof(logprefix),
                 VRMR_RT_OUTPUT, "DROP", "out INVALID");
+        vrmr_rules_nflog_options(
+                conf, logprefix, nflog_opts, sizeof(nflog_opts));
 
-        snprintf(cmd, sizeof(cmd), "%s INVALID %s -j NFLOG %s --nflog-group %u",
+        snprintf(cmd, sizeof(cmd), "%s INVALID %s -j NFLOG %s %s",
                 create_state_string(conf, ipv, iptcap), limit, logprefix,
-                conf->nfgrp);
+                nflog_opts);
 
         if (process_rule(conf, ruleset, ipv, TB_FILTER, CH_OUTPUT, cmd, 0, 0) <
                 0)
@@ -3801,10 +3820,12 @@ static int pre_rules_conntrack_invalid(struct vrmr_config *conf,
                                              iptcap->target_nflog == TRUE)) {
         create_logprefix_string(conf, logprefix, sizeof(logprefix),
                 VRMR_RT_FORWARD, "DROP", "fw INVALID");
+        vrmr_rules_nflog_options(
+                conf, logprefix, nflog_opts, sizeof(nflog_opts));
 
-        snprintf(cmd, sizeof(cmd), "%s INVALID %s -j NFLOG %s --nflog-group %u",
+        snprintf(cmd, sizeof(cmd), "%s INVALID %s -j NFLOG %s %s",
                 create_state_string(conf, ipv, iptcap), limit, logprefix,
-                conf->nfgrp);
+                nflog_opts);
 
         if (process_rule(conf, ruleset, ipv, TB_FILTER, CH_FORWARD, cmd, 0, 0) <
                 0)
@@ -3825,6 +3846,7 @@ static int pre_rules_blocklist_ipv4(struct vrmr_config *conf,
     int retval = 0;
     char cmd[VRMR_MAX_PIPE_COMMAND] = "";
     char logprefix[64] = "";
+    char nflog_opts[96] = "";
 
     /*
         Setup Block lists
@@ -3876,9 +3898,11 @@ static int pre_rules_blocklist_ipv4(struct vrmr_config *conf,
                                                iptcap->target_nflog == TRUE)) {
         create_logprefix_string(conf, logprefix, sizeof(logprefix),
                 VRMR_RT_INPUT, "DROP", "BLOCKED");
+        vrmr_rules_nflog_options(
+                conf, logprefix, nflog_opts, sizeof(nflog_opts));
 
-        snprintf(cmd, sizeof(cmd), "%s -j NFLOG %s --nflog-group %u", limit,
-                logprefix, conf->nfgrp);
+        snprintf(cmd, sizeof(cmd), "%s -j NFLOG %s %s", limit,
+                logprefix, nflog_opts);
 
         if (process_rule(conf, ruleset, VRMR_IPV4, TB_FILTER, CH_BLOCKTARGET,
                     cmd, 0, 0) < 0)
@@ -4485,6 +4509,7 @@ int update_synlimit_rules(struct vrmr_config *conf,
     int retval = 0, result = 0;
     char cmd[VRMR_MAX_PIPE_COMMAND] = "";
     char logprefix[64] = "";
+    char nflog_opts[96] = "";
 
     /* caps */
     if (conf->vrmr_check_iptcaps == TRUE && iptcap->match_limit == FALSE) {
@@ -4535,11 +4560,13 @@ int update_synlimit_rules(struct vrmr_config *conf,
     if (conf->vrmr_check_iptcaps == FALSE || iptcap->target_nflog == TRUE) {
         create_logprefix_string(conf, logprefix, sizeof(logprefix),
                 VRMR_RT_INPUT, "DROP", "SYNLIMIT reach.");
+        vrmr_rules_nflog_options(
+                conf, logprefix, nflog_opts, sizeof(nflog_opts));
 
         snprintf(cmd, sizeof(cmd),
                 "-m limit --limit 1/s --limit-burst 2 "
-                "-j NFLOG %s --nflog-group %u",
-                logprefix, conf->nfgrp);
+                "-j NFLOG %s %s",
+                logprefix, nflog_opts);
 
         if (process_rule(conf, ruleset, ipv, TB_FILTER, CH_SYNLIMITTARGET, cmd,
                     0, 0) < 0)
@@ -4567,6 +4594,7 @@ int update_udplimit_rules(struct vrmr_config *conf,
     int retval = 0, result = 0;
     char cmd[VRMR_MAX_PIPE_COMMAND] = "";
     char logprefix[64] = "";
+    char nflog_opts[96] = "";
 
     /* caps */
     if (conf->vrmr_check_iptcaps == TRUE && iptcap->match_limit == FALSE) {
@@ -4616,11 +4644,13 @@ int update_udplimit_rules(struct vrmr_config *conf,
     if (conf->vrmr_check_iptcaps == FALSE || iptcap->target_nflog == TRUE) {
         create_logprefix_string(conf, logprefix, sizeof(logprefix),
                 VRMR_RT_INPUT, "DROP", "UDPLIMIT reach.");
+        vrmr_rules_nflog_options(
+                conf, logprefix, nflog_opts, sizeof(nflog_opts));
 
         snprintf(cmd, sizeof(cmd),
                 "-m limit --limit 1/s --limit-burst 2 "
-                "-j NFLOG %s --nflog-group %u",
-                logprefix, conf->nfgrp);
+                "-j NFLOG %s %s",
+                logprefix, nflog_opts);
 
         if (process_rule(conf, ruleset, ipv, TB_FILTER, CH_UDPLIMITTARGET, cmd,
                     0, 0) < 0)
@@ -4656,6 +4686,7 @@ int post_rules(struct vrmr_config *conf, /*@null@*/ struct rule_set *ruleset,
     char cmd[VRMR_MAX_PIPE_COMMAND] = "";
     char my_limit[42] = "";
     char logprefix[64] = "";
+    char nflog_opts[96] = "";
 
     assert(iptcap);
 
@@ -4692,9 +4723,11 @@ int post_rules(struct vrmr_config *conf, /*@null@*/ struct rule_set *ruleset,
             /* input */
             create_logprefix_string(conf, logprefix, sizeof(logprefix),
                     VRMR_RT_INPUT, "DROP", "in policy");
+            vrmr_rules_nflog_options(
+                    conf, logprefix, nflog_opts, sizeof(nflog_opts));
 
-            snprintf(cmd, sizeof(cmd), "%s -j NFLOG %s --nflog-group %u",
-                    my_limit, logprefix, conf->nfgrp);
+            snprintf(cmd, sizeof(cmd), "%s -j NFLOG %s %s",
+                    my_limit, logprefix, nflog_opts);
 
             if (process_rule(
                         conf, ruleset, ipv, TB_FILTER, CH_INPUT, cmd, 0, 0) < 0)
@@ -4703,9 +4736,11 @@ int post_rules(struct vrmr_config *conf, /*@null@*/ struct rule_set *ruleset,
             /* output */
             create_logprefix_string(conf, logprefix, sizeof(logprefix),
                     VRMR_RT_OUTPUT, "DROP", "out policy");
+            vrmr_rules_nflog_options(
+                    conf, logprefix, nflog_opts, sizeof(nflog_opts));
 
-            snprintf(cmd, sizeof(cmd), "%s -j NFLOG %s --nflog-group %u",
-                    my_limit, logprefix, conf->nfgrp);
+            snprintf(cmd, sizeof(cmd), "%s -j NFLOG %s %s",
+                    my_limit, logprefix, nflog_opts);
 
             if (process_rule(conf, ruleset, ipv, TB_FILTER, CH_OUTPUT, cmd, 0,
                         0) < 0)
@@ -4714,9 +4749,11 @@ int post_rules(struct vrmr_config *conf, /*@null@*/ struct rule_set *ruleset,
             /* forward */
             create_logprefix_string(conf, logprefix, sizeof(logprefix),
                     VRMR_RT_FORWARD, "DROP", "fw policy");
+            vrmr_rules_nflog_options(
+                    conf, logprefix, nflog_opts, sizeof(nflog_opts));
 
-            snprintf(cmd, sizeof(cmd), "%s -j NFLOG %s --nflog-group %u",
-                    my_limit, logprefix, conf->nfgrp);
+            snprintf(cmd, sizeof(cmd), "%s -j NFLOG %s %s",
+                    my_limit, logprefix, nflog_opts);
 
             if (process_rule(conf, ruleset, ipv, TB_FILTER, CH_FORWARD, cmd, 0,
                         0) < 0)
@@ -4724,6 +4761,35 @@ int post_rules(struct vrmr_config *conf, /*@null@*/ struct rule_set *ruleset,
         }
     }
 
+    /* limit the conntrack events of the new connections. This comes after
+     * the CT rules of the helpers, as only the first CT target a packet
+     * hits is used. Those rules set the same events. */
+    if (conf->connlog_ctevents_opts[0] != '\0') {
+        if (conf->vrmr_check_iptcaps == TRUE &&
+                !(ipv == VRMR_IPV4 && iptcap->table_raw && iptcap->target_ct)
+#ifdef IPV6_ENABLED
+                && !(ipv == VRMR_IPV6 && iptcap->table_ip6_raw &&
+                           iptcap->target_ip6_ct)
+#endif
+        ) {
+            vrmr_warning("Warning", "not limiting the conntrack events. "
+                                    "CT-target not supported by system.");
+        } else {
+            if (conf->bash_out == TRUE)
+                fprintf(stdout, "\n# Limiting conntrack events...\n");
+            vrmr_debug(LOW, "Limiting conntrack events...");
+
+            snprintf(cmd, sizeof(cmd), "-j CT %s",
+                    conf->connlog_ctevents_opts);
+            if (process_rule(conf, ruleset, ipv, TB_RAW, CH_PREROUTING, cmd, 0,
+                        0) < 0)
+                retval = -1;
+            if (process_rule(conf, ruleset, ipv, TB_RAW, CH_OUTPUT, cmd, 0,
+                        0) < 0)
+                retval = -1;
+        }
+    }
+
     /* enable or disable ip-forwarding */
     if (forward_rules) {
         if (conf->bash_out == TRUE)
@@ -4789,6 +4855,7 @@ static int create_interface_rpfilter_rules(struct vrmr_config *conf,
     char input_device[16 + 3] = ""; /* 16 + '-i ' */
     const char my_limit[] = "-m limit --limit 1/s --limit-burst 5";
     char logprefix[64] = "";
+    char nflog_opts[96] = "";
     char cmd[VRMR_MAX_PIPE_COMMAND] = "";
 
     if (if_ptr->device_virtual_oldstyle == TRUE) {
@@ -4826,11 +4893,12 @@ static int create_interface_rpfilter_rules(struct vrmr_config *conf,
     /* create the logprefix string */
     create_logprefix_string(conf, logprefix, sizeof(logprefix), VRMR_RT_NOTSET,
             "DROP", "%s", "rpfilter");
+    vrmr_rules_nflog_options(conf, logprefix, nflog_opts, sizeof(nflog_opts));
 
     /* log rule string */
     snprintf(cmd, sizeof(cmd),
-            "%s -m rpfilter --invert %s -j NFLOG %s --nflog-group %u",
-            input_device, my_limit, logprefix, conf->nfgrp);
+            "%s -m rpfilter --invert %s -j NFLOG %s %s",
+            input_device, my_limit, logprefix, nflog_opts);
 
     if (conf->vrmr_check_iptcaps == FALSE ||
             (iptcap->table_raw && iptcap->match_rpfilter &&
@@ -4999,6 +5067,7 @@ static int create_network_antispoof_rule(struct vrmr_config *conf,
     char output_device[16 + 3] = ""; /* 16 + '-i ' */
     const char my_limit[] = "-m limit --limit 1/s --limit-burst 5";
     char logprefix[64] = "";
+    char nflog_opts[96] = "";
     char cmd[VRMR_MAX_PIPE_COMMAND] = "";
 
     /*  see if the interface is active */
@@ -5039,15 +5108,16 @@ static int create_network_antispoof_rule(struct vrmr_config *conf,
             create_logprefix_string(conf, logprefix, sizeof(logprefix),
                     VRMR_RT_NOTSET, "DROP", "%s %s", create->danger.type,
                     create->danger.source);
+            vrmr_rules_nflog_options(
+                    conf, logprefix, nflog_opts, sizeof(nflog_opts));
 
             /* log rule string */
             snprintf(cmd, sizeof(cmd),
-                    "-s %s/%s -d %s/255.255.255.255 %s -j NFLOG %s "
-                    "--nflog-group %u",
+                    "-s %s/%s -d %s/255.255.255.255 %s -j NFLOG %s %s",
                     create->danger.source_ip.ipaddress,
                     create->danger.source_ip.netmask,
                     from_if_ptr->ipv4.ipaddress, my_limit, logprefix,
-                    conf->nfgrp);
+                    nflog_opts);
 
             if (process_rule(conf, ruleset, VRMR_IPV4, TB_FILTER, CH_ANTISPOOF,
                         cmd, 0, 0) < 0)
@@ -5069,15 +5139,16 @@ static int create_network_antispoof_rule(struct vrmr_config *conf,
             create_logprefix_string(conf, logprefix, sizeof(logprefix),
                     VRMR_RT_INPUT, "DROP", "%s %s", create->danger.type,
                     create->danger.source);
+            vrmr_rules_nflog_options(
+                    conf, logprefix, nflog_opts, sizeof(nflog_opts));
 
             /* log rule string */
             snprintf(cmd, sizeof(cmd),
-                    "-s %s/255.255.255.255 -d %s/%s %s -j NFLOG %s "
-                    "--nflog-group %u",
+                    "-s %s/255.255.255.255 -d %s/%s %s -j NFLOG %s %s",
                     from_if_ptr->ipv4.ipaddress,
                     create->danger.source_ip.ipaddress,
                     create->danger.source_ip.netmask, my_limit, logprefix,
-                    conf->nfgrp);
+                    nflog_opts);
 
             if (process_rule(conf, ruleset, VRMR_IPV4, TB_FILTER, CH_ANTISPOOF,
                         cmd, 0, 0) < 0)
@@ -5101,13 +5172,15 @@ static int create_network_antispoof_rule(struct vrmr_config *conf,
             create_logprefix_string(conf, logprefix, sizeof(logprefix),
                     VRMR_RT_NOTSET, "DROP", "%s %s", create->danger.type,
                     create->danger.source);
+            vrmr_rules_nflog_options(
+                    conf, logprefix, nflog_opts, sizeof(nflog_opts));
 
             /* log rule string */
             snprintf(cmd, sizeof(cmd),
-                    "%s -s %s/%s %s -j NFLOG %s --nflog-group %u", input_device,
+                    "%s -s %s/%s %s -j NFLOG %s %s", input_device,
                     create->danger.source_ip.ipaddress,
                     create->danger.source_ip.netmask, my_limit, logprefix,
-                    conf->nfgrp);
+                    nflog_opts);
             if (process_rule(conf, ruleset, VRMR_IPV4, TB_FILTER, CH_ANTISPOOF,
                         cmd, 0, 0) < 0)
                 return (-1);
@@ -5128,13 +5201,15 @@ static int create_network_antispoof_rule(struct vrmr_config *conf,
             create_logprefix_string(conf, logprefix, sizeof(logprefix),
                     VRMR_RT_INPUT, "DROP", "%s %s", create->danger.type,
                     create->danger.source);
+            vrmr_rules_nflog_options(
+                    conf, logprefix, nflog_opts, sizeof(nflog_opts));
 
             /* log rule string */
             snprintf(cmd, sizeof(cmd),
-                    "%s -d %s/%s %s -j NFLOG %s --nflog-group %u",
+                    "%s -d %s/%s %s -j NFLOG %s %s",
                     output_device, create->danger.source_ip.ipaddress,
                     create->danger.source_ip.netmask, my_limit, logprefix,
-                    conf->nfgrp);
+                    nflog_opts);
 
             if (process_rule(conf, ruleset, VRMR_IPV4, TB_FILTER, CH_ANTISPOOF,
                         cmd, 0, 0) < 0)
@@ -5484,6 +5559,30 @@ int create_network_protect_rules(struct vrmr_config *conf,
     return (0);
 }
 
+/* rules matching the blocklist ipsets of family 'ipv' as source and as
+ * destination */
+static int create_block_set_rules(struct vrmr_config *conf,
+        /*@null@*/ struct rule_set *ruleset, int ipv, const char *ip_set,
+        const char *net_set)
+{
+    char cmd[VRMR_MAX_PIPE_COMMAND] = "";
+    const char *set_names[] = {ip_set, net_set};
+    const char *dirs[] = {"src", "dst"};
+    int retval = 0;
+
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 2; j++) {
+            snprintf(cmd, sizeof(cmd), "-m set --match-set %s %s -j BLOCK",
+                    set_names[i], dirs[j]);
+            if (process_rule(conf, ruleset, ipv, TB_FILTER, CH_BLOCKLIST, cmd,
+                        0, 0) < 0)
+                retval = -1;
+        }
+    }
+
+    return (retval);
+}
+
 int create_block_rules(struct vrmr_config *conf,
         /*@null@*/ struct rule_set *ruleset, struct vrmr_blocklist *blocklist)
 {
@@ -5496,6 +5595,20 @@ int create_block_rules(struct vrmr_config *conf,
     if (conf->bash_out == TRUE)
         fprintf(stdout, "\n# Loading Blocklist...\n");
 
+    /*  the blocklist is in the ipsets: a fixed set of rules matches all of
+        it, also the entries that are added later. */
+    if (blocklist->ipset) {
+        if (create_block_set_rules(conf, ruleset, VRMR_IPV4,
+                    VRMR_BLOCKLIST_SET_IP4, VRMR_BLOCKLIST_SET_NET4) < 0)
+            retval = -1;
+#ifdef IPV6_ENABLED
+        if (create_block_set_rules(conf, ruleset, VRMR_IPV6,
+                    VRMR_BLOCKLIST_SET_IP6, VRMR_BLOCKLIST_SET_NET6) < 0)
+            retval = -1;
+#endif
+        return (retval);
+    }
+
     if (blocklist->list.len == 0) {
         vrmr_debug(HIGH, "no items in blocklist.");
         return (0);
@@ -5509,16 +5622,27 @@ int create_block_rules(struct vrmr_config *conf,
         }
         vrmr_debug(HIGH, "ipaddress to add: '%s'.", ipaddress);
 
+        int ipv = vrmr_blocklist_addr_family(ipaddress, NULL);
+#ifndef IPV6_ENABLED
+        if (ipv == VRMR_IPV6)
+            continue;
+#endif
+        if (ipv == 0) {
+            vrmr_warning("Warning", "'%s' is not an address, not blocking it.",
+                    ipaddress);
+            continue;
+        }
+
         /* ip is source */
-        snprintf(cmd, sizeof(cmd), "-s %s/255.255.255.255 -j BLOCK", ipaddress);
-        if (process_rule(conf, ruleset, VRMR_IPV4, TB_FILTER, CH_BLOCKLIST, cmd,
-                    0, 0) < 0)
+        snprintf(cmd, sizeof(cmd), "-s %s -j BLOCK", ipaddress);
+        if (process_rule(conf, ruleset, ipv, TB_FILTER, CH_BLOCKLIST, cmd, 0,
+                    0) < 0)
             retval = -1;
 
         /* ip is dst */
-        snprintf(cmd, sizeof(cmd), "-d %s/255.255.255.255 -j BLOCK", ipaddress);
-        if (process_rule(conf, ruleset, VRMR_IPV4, TB_FILTER, CH_BLOCKLIST, cmd,
-                    0, 0) < 0)
+        snprintf(cmd, sizeof(cmd), "-d %s -j BLOCK", ipaddress);
+        if (process_rule(conf, ruleset, ipv, TB_FILTER, CH_BLOCKLIST, cmd, 0,
+                    0) < 0)
             retval = -1;
     }
 
@@ -59,6 +59,7 @@
 #define NO 0
 
 #define PIDFILE "/var/run/vuurmuur.pid"
+#define METRICS_SOCKET "/var/run/vuurmuur.metrics"
 
 #define NFQ_MARK_BASE 3
 #define NFLOG_MARK_BASE 65536 + NFQ_MARK_BASE
@@ -153,6 +154,17 @@ struct rule_scratch {
     struct vrmr_zone *to_network;
 };
 
+/*  rules of a chain in the ruleset. The lines are stored back to back
+    in one buffer, each ending with a newline, so they can be passed on to
+    iptables-restore as they are.
+*/
+struct rule_lines {
+    char *buf;
+    size_t len;     /* bytes in use */
+    size_t size;    /* bytes allocated */
+    unsigned int n; /* number of lines */
+};
+
 /*  here we are going to assemble all rules for
     the creation of the file for iptables-restore.
 
@@ -163,69 +175,69 @@ struct rule_set {
     /*
         raw
     */
-    struct vrmr_list raw_preroute; /* list with rules */
+    struct rule_lines raw_preroute; /* lines with rules */
     char raw_preroute_policy;
-    struct vrmr_list raw_output; /* list with rules */
+    struct rule_lines raw_output; /* lines with rules */
     char raw_output_policy;
 
     /*
         mangle
     */
-    struct vrmr_list mangle_preroute; /* list with rules */
+    struct rule_lines mangle_preroute; /* lines with rules */
     char mangle_preroute_policy; /* policy for this chain: 0: accept, 1: drop */
-    struct vrmr_list mangle_input; /* list with rules */
+    struct rule_lines mangle_input; /* lines with rules */
     char mangle_input_policy; /* policy for this chain: 0: accept, 1: drop */
-    struct vrmr_list mangle_forward; /* list with rules */
+    struct rule_lines mangle_forward; /* lines with rules */
     char mangle_forward_policy; /* policy for this chain: 0: accept, 1: drop */
-    struct vrmr_list mangle_output; /* list with rules */
+    struct rule_lines mangle_output; /* lines with rules */
     char mangle_output_policy; /* policy for this chain: 0: accept, 1: drop */
-    struct vrmr_list mangle_postroute; /* list with rules */
+    struct rule_lines mangle_postroute; /* lines with rules */
     char mangle_postroute_policy; /* policy for this chain: 0: accept, 1: drop
                                    */
 
     /*
         extra mangle (no policies)
     */
-    struct vrmr_list mangle_shape_in;  /* list with rules */
-    struct vrmr_list mangle_shape_out; /* list with rules */
-    struct vrmr_list mangle_shape_fw;  /* list with rules */
+    struct rule_lines mangle_shape_in;  /* lines with rules */
+    struct rule_lines mangle_shape_out; /* lines with rules */
+    struct rule_lines mangle_shape_fw;  /* lines with rules */
 
     /*
         nat
     */
-    struct vrmr_list nat_preroute; /* list with rules */
+    struct rule_lines nat_preroute; /* lines with rules */
     char nat_preroute_policy; /* policy for this chain: 0: accept, 1: drop */
-    struct vrmr_list nat_postroute; /* list with rules */
+    struct rule_lines nat_postroute; /* lines with rules */
     char nat_postroute_policy;   /* policy for this chain: 0: accept, 1: drop */
-    struct vrmr_list nat_output; /* list with rules */
+    struct rule_lines nat_output; /* lines with rules */
     char nat_output_policy;      /* policy for this chain: 0: accept, 1: drop */
 
     /*
         filter
     */
-    struct vrmr_list filter_input; /* list with rules */
+    struct rule_lines filter_input; /* lines with rules */
     char filter_input_policy; /* policy for this chain: 0: accept, 1: drop */
-    struct vrmr_list filter_forward; /* list with rules */
+    struct rule_lines filter_forward; /* lines with rules */
     char filter_forward_policy; /* policy for this chain: 0: accept, 1: drop */
-    struct vrmr_list filter_output; /* list with rules */
+    struct rule_lines filter_output; /* lines with rules */
     char filter_output_policy; /* policy for this chain: 0: accept, 1: drop */
 
     /*
         extra filter (no policies)
     */
-    struct vrmr_list filter_antispoof;           /* list with rules */
-    struct vrmr_list filter_blocklist;           /* list with rules */
-    struct vrmr_list filter_blocktarget;         /* list with rules */
-    struct vrmr_list filter_badtcp;              /* list with rules */
-    struct vrmr_list filter_synlimittarget;      /* list with rules */
-    struct vrmr_list filter_udplimittarget;      /* list with rules */
-    struct vrmr_list filter_tcpresettarget;      /* list with rules */
-    struct vrmr_list filter_newaccepttarget;     /* list with rules */
-    struct vrmr_list filter_newnfqueuetarget;    /* list with rules */
-    struct vrmr_list filter_estrelnfqueuetarget; /* list with rules */
-    struct vrmr_list filter_newnflogtarget;      /* list with rules */
-    struct vrmr_list filter_estrelnflogtarget;   /* list with rules */
-    struct vrmr_list filter_accounting;          /* list with rules */
+    struct rule_lines filter_antispoof;           /* lines with rules */
+    struct rule_lines filter_blocklist;           /* lines with rules */
+    struct rule_lines filter_blocktarget;         /* lines with rules */
+    struct rule_lines filter_badtcp;              /* lines with rules */
+    struct rule_lines filter_synlimittarget;      /* lines with rules */
+    struct rule_lines filter_udplimittarget;      /* lines with rules */
+    struct rule_lines filter_tcpresettarget;      /* lines with rules */
+    struct rule_lines filter_newaccepttarget;     /* lines with rules */
+    struct rule_lines filter_newnfqueuetarget;    /* lines with rules */
+    struct rule_lines filter_estrelnfqueuetarget; /* lines with rules */
+    struct rule_lines filter_newnflogtarget;      /* lines with rules */
+    struct rule_lines filter_estrelnflogtarget;   /* lines with rules */
+    struct rule_lines filter_accounting;          /* lines with rules */
 
     /*
         special chains
@@ -239,6 +251,20 @@ struct rule_set {
     struct vrmr_list tc_rules; /* list with tc rules */
 };
 
+/* phases of apply_changes(), timed in the metrics */
+enum reload_phase {
+    RELOAD_PHASE_CONFIG = 0,
+    RELOAD_PHASE_BACKENDS,
+    RELOAD_PHASE_SERVICES,
+    RELOAD_PHASE_INTERFACES,
+    RELOAD_PHASE_ZONES,
+    RELOAD_PHASE_BLOCKLIST,
+    RELOAD_PHASE_RULES,
+    RELOAD_PHASE_ANALYZE,
+    RELOAD_PHASE_RULESET,
+    RELOAD_PHASE_MAX,
+};
+
 struct cmd_line {
     /* commandline overrides */
     char vrmr_check_iptcaps_set;
@@ -377,10 +403,21 @@ int reload_vrmr_interfaces_check(
 
 int check_for_changed_dynamic_ips(struct vrmr_interfaces *interfaces);
 
+/* metrics.c */
+void metrics_init(void);
+double metrics_reload_phase(enum reload_phase phase, double start);
+void metrics_reload_done(double start, int result);
+void metrics_restore(int ipv, double seconds, int result);
+void metrics_ruleset(const struct rule_set *ruleset);
+void metrics_setup(const struct vrmr_config *cnf);
+void metrics_wait(unsigned int seconds);
+void metrics_cleanup(void);
+
 /* ruleset */
 int ruleset_add_rule_to_set(
-        struct vrmr_list *, char *, char *, uint64_t, uint64_t);
+        struct rule_lines *, char *, char *, uint64_t, uint64_t);
 int load_ruleset(struct vrmr_ctx *);
+void ruleset_forget_applied(void);
 
 /* shape */
 int shaping_setup_roots(struct vrmr_config *cnf,
@@ -0,0 +1,251 @@
+/***************************************************************************
+ *   Copyright (C) 2003-2019 by Victor Julien                              *
+ *   victor@vuurmuur.org                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*  metrics of the vuurmuur daemon: how long reloads and their phases take,
+    how long iptables-restore takes and how big the ruleset is.
+
+    They are served on METRICS_SOCKET while we wait in the main loop.
+*/
+
+#include "main.h"
+
+#include <stddef.h>
+
+/* seconds */
+static const double reload_bounds[] = {
+        0.01, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60};
+static const double restore_bounds[] = {
+        0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+
+static const char *reload_phase_names[RELOAD_PHASE_MAX] = {
+        "config",
+        "backends",
+        "services",
+        "interfaces",
+        "zones",
+        "blocklist",
+        "rules",
+        "analyze",
+        "ruleset",
+};
+
+/* the chains of struct rule_set, as iptables-restore knows them */
+static const struct metrics_chain {
+    const char *table;
+    const char *chain;
+    size_t offset;
+} metrics_chains[] = {
+        {"raw", "PREROUTING", offsetof(struct rule_set, raw_preroute)},
+        {"raw", "OUTPUT", offsetof(struct rule_set, raw_output)},
+        {"mangle", "PREROUTING", offsetof(struct rule_set, mangle_preroute)},
+        {"mangle", "INPUT", offsetof(struct rule_set, mangle_input)},
+        {"mangle", "FORWARD", offsetof(struct rule_set, mangle_forward)},
+        {"mangle", "OUTPUT", offsetof(struct rule_set, mangle_output)},
+        {"mangle", "POSTROUTING", offsetof(struct rule_set, mangle_postroute)},
+        {"mangle", "SHAPEIN", offsetof(struct rule_set, mangle_shape_in)},
+        {"mangle", "SHAPEOUT", offsetof(struct rule_set, mangle_shape_out)},
+        {"mangle", "SHAPEFW", offsetof(struct rule_set, mangle_shape_fw)},
+        {"nat", "PREROUTING", offsetof(struct rule_set, nat_preroute)},
+        {"nat", "OUTPUT", offsetof(struct rule_set, nat_output)},
+        {"nat", "POSTROUTING", offsetof(struct rule_set, nat_postroute)},
+        {"filter", "INPUT", offsetof(struct rule_set, filter_input)},
+        {"filter", "FORWARD", offsetof(struct rule_set, filter_forward)},
+        {"filter", "OUTPUT", offsetof(struct rule_set, filter_output)},
+        {"filter", "ANTISPOOF", offsetof(struct rule_set, filter_antispoof)},
+        {"filter", "BLOCKLIST", offsetof(struct rule_set, filter_blocklist)},
+        {"filter", "BLOCK", offsetof(struct rule_set, filter_blocktarget)},
+        {"filter", "SYNLIMIT",
+                offsetof(struct rule_set, filter_synlimittarget)},
+        {"filter", "UDPLIMIT",
+                offsetof(struct rule_set, filter_udplimittarget)},
+        {"filter", "NEWACCEPT",
+                offsetof(struct rule_set, filter_newaccepttarget)},
+        {"filter", "NEWNFQUEUE",
+                offsetof(struct rule_set, filter_newnfqueuetarget)},
+        {"filter", "ESTRELNFQUEUE",
+                offsetof(struct rule_set, filter_estrelnfqueuetarget)},
+        {"filter", "NEWNFLOG",
+                offsetof(struct rule_set, filter_newnflogtarget)},
+        {"filter", "ESTRELNFLOG",
+                offsetof(struct rule_set, filter_estrelnflogtarget)},
+        {"filter", "TCPRESET",
+                offsetof(struct rule_set, filter_tcpresettarget)},
+        {"filter", "ACCOUNTING", offsetof(struct rule_set, filter_accounting)},
+};
+#define METRICS_CHAINS (sizeof(metrics_chains) / sizeof(metrics_chains[0]))
+
+/* index 0 is ipv4, 1 is ipv6 */
+static struct {
+    struct vrmr_histogram reload_phase[RELOAD_PHASE_MAX];
+    struct vrmr_histogram reload;
+    uint64_t reload_errors;
+    struct vrmr_histogram restore[2];
+    uint64_t restore_errors[2];
+    uint32_t chain_rules[2][METRICS_CHAINS];
+    int have_ruleset[2];
+} vm;
+
+static struct vrmr_metrics_server server = {.fd = -1};
+
+void metrics_init(void)
+{
+    memset(&vm, 0, sizeof(vm));
+
+    for (int i = 0; i < RELOAD_PHASE_MAX; i++)
+        vrmr_histogram_init(&vm.reload_phase[i], reload_bounds,
+                sizeof(reload_bounds) / sizeof(reload_bounds[0]));
+    vrmr_histogram_init(&vm.reload, reload_bounds,
+            sizeof(reload_bounds) / sizeof(reload_bounds[0]));
+    for (int i = 0; i < 2; i++)
+        vrmr_histogram_init(&vm.restore[i], restore_bounds,
+                sizeof(restore_bounds) / sizeof(restore_bounds[0]));
+}
+
+/*  metrics_reload_phase
+
+    Records that reload phase 'phase', started at 'start' (see
+    vrmr_metrics_now()), is done.
+
+    Returns the time it was done, which is the start of the next phase.
+*/
+double metrics_reload_phase(enum reload_phase phase, double start)
+{
+    double now = vrmr_metrics_now();
+
+    vrmr_histogram_observe(&vm.reload_phase[phase], now - start);
+    return (now);
+}
+
+void metrics_reload_done(double start, int result)
+{
+    vrmr_histogram_observe(&vm.reload, vrmr_metrics_now() - start);
+    if (result < 0)
+        vm.reload_errors++;
+}
+
+void metrics_restore(int ipv, double seconds, int result)
+{
+    int i = (ipv == VRMR_IPV6);
+
+    vrmr_histogram_observe(&vm.restore[i], seconds);
+    if (result < 0)
+        vm.restore_errors[i]++;
+}
+
+/*  metrics_ruleset
+
+    Remembers the number of rules per chain of the ruleset we are about
+    to load.
+*/
+void metrics_ruleset(const struct rule_set *ruleset)
+{
+    int i = (ruleset->ipv == VRMR_IPV6);
+
+    for (size_t c = 0; c < METRICS_CHAINS; c++) {
+        const struct rule_lines *l = (const struct rule_lines *)(
+                (const char *)ruleset + metrics_chains[c].offset);
+        vm.chain_rules[i][c] = l->n;
+    }
+    vm.have_ruleset[i] = 1;
+}
+
+static void metrics_fill(struct vrmr_metrics *m, void *data ATTR_UNUSED)
+{
+    static const char *ipvs[2] = {"ipv4", "ipv6"};
+    char labels[128];
+
+    vrmr_metrics_help(m, "vuurmuur_reload_duration_seconds", "histogram",
+            "Time it took to apply changes.");
+    vrmr_metrics_histogram(
+            m, "vuurmuur_reload_duration_seconds", NULL, &vm.reload);
+    vrmr_metrics_help(m, "vuurmuur_reload_errors_total", "counter",
+            "Reloads that failed.");
+    vrmr_metrics_u64(m, "vuurmuur_reload_errors_total", NULL, vm.reload_errors);
+
+    vrmr_metrics_help(m, "vuurmuur_reload_phase_duration_seconds", "histogram",
+            "Time it took to run each phase of a reload.");
+    for (int i = 0; i < RELOAD_PHASE_MAX; i++) {
+        snprintf(labels, sizeof(labels), "phase=\"%s\"",
+                reload_phase_names[i]);
+        vrmr_metrics_histogram(m, "vuurmuur_reload_phase_duration_seconds",
+                labels, &vm.reload_phase[i]);
+    }
+
+    vrmr_metrics_help(m, "vuurmuur_restore_duration_seconds", "histogram",
+            "Time it took iptables-restore to load the ruleset.");
+    for (int i = 0; i < 2; i++) {
+        snprintf(labels, sizeof(labels), "ipv=\"%s\"", ipvs[i]);
+        vrmr_metrics_histogram(m, "vuurmuur_restore_duration_seconds",
+                labels, &vm.restore[i]);
+    }
+    vrmr_metrics_help(m, "vuurmuur_restore_errors_total", "counter",
+            "Times iptables-restore failed.");
+    for (int i = 0; i < 2; i++) {
+        snprintf(labels, sizeof(labels), "ipv=\"%s\"", ipvs[i]);
+        vrmr_metrics_u64(m, "vuurmuur_restore_errors_total", labels,
+                vm.restore_errors[i]);
+    }
+
+    vrmr_metrics_help(m, "vuurmuur_ruleset_rules", "gauge",
+            "Rules per chain in the last ruleset we loaded.");
+    for (int i = 0; i < 2; i++) {
+        if (!vm.have_ruleset[i])
+            continue;
+        for (size_t c = 0; c < METRICS_CHAINS; c++) {
+            snprintf(labels, sizeof(labels),
+                    "ipv=\"%s\",table=\"%s\",chain=\"%s\"", ipvs[i],
+                    metrics_chains[c].table, metrics_chains[c].chain);
+            vrmr_metrics_u64(m, "vuurmuur_ruleset_rules", labels,
+                    vm.chain_rules[i][c]);
+        }
+    }
+}
+
+/*  metrics_setup
+
+    Opens or closes the metrics socket as the config says. The metrics
+    are not essential, so failing to open the socket is only reported.
+*/
+void metrics_setup(const struct vrmr_config *cnf)
+{
+    if (!cnf->metrics) {
+        vrmr_metrics_close(&server);
+        return;
+    }
+    if (server.fd != -1)
+        return;
+
+    if (vrmr_metrics_listen(&server, METRICS_SOCKET) < 0)
+        vrmr_warning("Warning", "metrics are not available");
+}
+
+/*  metrics_wait
+
+    Sleeps for 'seconds', answering metrics clients meanwhile.
+*/
+void metrics_wait(unsigned int seconds)
+{
+    vrmr_metrics_wait(&server, seconds * 1000, metrics_fill, NULL);
+}
+
+void metrics_cleanup(void)
+{
+    vrmr_metrics_close(&server);
+}
@@ -39,6 +39,7 @@ static int apply_changes_ruleset(struct vrmr_ctx *vctx, struct vrmr_regex *reg)
 {
     int retval = 0, // start at no changes
             result = 0;
+    double t = vrmr_metrics_now();
 
     vrmr_info("Info", "Reloading config...");
 
@@ -64,6 +65,7 @@ static int apply_changes_ruleset(struct vrmr_ctx *vctx, struct vrmr_regex *reg)
     }
 
     vrmr_shm_update_progress(sem_id, &shm_table->reload_progress, 10);
+    t = metrics_reload_phase(RELOAD_PHASE_CONFIG, t);
 
     /* reopen the backends */
     result = vrmr_backends_load(&vctx->conf, vctx);
@@ -72,6 +74,7 @@ static int apply_changes_ruleset(struct vrmr_ctx *vctx, struct vrmr_regex *reg)
         return (-1);
     }
     vrmr_shm_update_progress(sem_id, &shm_table->reload_progress, 15);
+    t = metrics_reload_phase(RELOAD_PHASE_BACKENDS, t);
 
     /* reload the services, interfaces, zones and rules. */
     vrmr_info("Info", "Reloading services...");
@@ -86,6 +89,7 @@ static int apply_changes_ruleset(struct vrmr_ctx *vctx, struct vrmr_regex *reg)
         return (-1);
     }
     vrmr_shm_update_progress(sem_id, &shm_table->reload_progress, 20);
+    t = metrics_reload_phase(RELOAD_PHASE_SERVICES, t);
 
     vrmr_info("Info", "Reloading interfaces...");
     result = reload_interfaces(vctx, &vctx->interfaces);
@@ -99,6 +103,7 @@ static int apply_changes_ruleset(struct vrmr_ctx *vctx, struct vrmr_regex *reg)
         return (-1);
     }
     vrmr_shm_update_progress(sem_id, &shm_table->reload_progress, 25);
+    t = metrics_reload_phase(RELOAD_PHASE_INTERFACES, t);
 
     vrmr_info("Info", "Reloading zones...");
     result = reload_zonedata(vctx, &vctx->zones, &vctx->interfaces, reg);
@@ -112,6 +117,7 @@ static int apply_changes_ruleset(struct vrmr_ctx *vctx, struct vrmr_regex *reg)
         return (-1);
     }
     vrmr_shm_update_progress(sem_id, &shm_table->reload_progress, 30);
+    t = metrics_reload_phase(RELOAD_PHASE_ZONES, t);
 
     /* changed networks (for antispoofing) */
     result = check_for_changed_networks(&vctx->zones);
@@ -135,6 +141,7 @@ static int apply_changes_ruleset(struct vrmr_ctx *vctx, struct vrmr_regex *reg)
     } else {
         vrmr_info("Info", "Blocklist changed.");
     }
+    t = metrics_reload_phase(RELOAD_PHASE_BLOCKLIST, t);
 
     /* reload the rules */
     result = reload_rules(vctx, reg);
@@ -146,6 +153,7 @@ static int apply_changes_ruleset(struct vrmr_ctx *vctx, struct vrmr_regex *reg)
         retval = -1;
     }
     vrmr_shm_update_progress(sem_id, &shm_table->reload_progress, 40);
+    t = metrics_reload_phase(RELOAD_PHASE_RULES, t);
 
     /* analyzing the rules */
     if (analyze_all_rules(vctx, &vctx->rules) != 0) {
@@ -153,6 +161,7 @@ static int apply_changes_ruleset(struct vrmr_ctx *vctx, struct vrmr_regex *reg)
         retval = -1;
     }
     vrmr_shm_update_progress(sem_id, &shm_table->reload_progress, 80);
+    t = metrics_reload_phase(RELOAD_PHASE_ANALYZE, t);
 
     /* create the new ruleset */
     if (load_ruleset(vctx) < 0) {
@@ -160,6 +169,7 @@ static int apply_changes_ruleset(struct vrmr_ctx *vctx, struct vrmr_regex *reg)
         retval = -1;
     }
     vrmr_shm_update_progress(sem_id, &shm_table->reload_progress, 90);
+    (void)metrics_reload_phase(RELOAD_PHASE_RULESET, t);
 
     if (retval == 0)
         vrmr_info("Info", "Reloading Vuurmuur completed successfully.");
@@ -169,7 +179,11 @@ static int apply_changes_ruleset(struct vrmr_ctx *vctx, struct vrmr_regex *reg)
 
 int apply_changes(struct vrmr_ctx *vctx, struct vrmr_regex *reg)
 {
-    return (apply_changes_ruleset(vctx, reg));
+    double start = vrmr_metrics_now();
+
+    int result = apply_changes_ruleset(vctx, reg);
+    metrics_reload_done(start, result);
+    return (result);
 }
 
 /*  reload_services
@@ -1429,9 +1443,91 @@ int reload_vrmr_interfaces_check(
     return (retval);
 }
 
+/*  reload_blocklist_sets
+
+    The blocklist lives in the ipsets: add the new entries and remove the
+    ones that are gone through vrmr_blocklist_add_one/rem_one. The changes
+    are collected in one batch, so a large feed update is a single ipset
+    call. The adds go first, so an address that moves to a wider prefix is
+    never unblocked in between. The order of the list doesn't matter here.
+
+    returncodes:
+        -1: error
+        0: no changes
+        1: changes
+*/
+static int reload_blocklist_sets(struct vrmr_zones *zones,
+        struct vrmr_blocklist *blocklist, struct vrmr_blocklist *new_blocklist)
+{
+    struct vrmr_list_node *d_node = NULL;
+    struct vrmr_list gone;
+    unsigned int added = 0, removed = 0;
+
+    /*  collect copies of what is gone first: with duplicates rem_one may
+        free another node than the one we are looking at */
+    vrmr_list_setup(&gone, free);
+    for (d_node = blocklist->list.top; d_node; d_node = d_node->next) {
+        if (d_node->data == NULL ||
+                vrmr_blocklist_contains(new_blocklist, d_node->data))
+            continue;
+
+        char *item = strdup(d_node->data);
+        if (item == NULL) {
+            vrmr_error(-1, "Error", "strdup failed: %s", strerror(errno));
+            vrmr_list_cleanup(&gone);
+            return (-1);
+        }
+        if (vrmr_list_append(&gone, item) == NULL) {
+            free(item);
+            vrmr_list_cleanup(&gone);
+            return (-1);
+        }
+    }
+
+    if (vrmr_blocklist_ipset_begin(blocklist) < 0) {
+        vrmr_list_cleanup(&gone);
+        return (-1);
+    }
+
+    for (d_node = new_blocklist->list.top; d_node; d_node = d_node->next) {
+        if (d_node->data == NULL ||
+                vrmr_blocklist_contains(blocklist, d_node->data))
+            continue;
+
+        if (vrmr_blocklist_add_one(zones, blocklist, /*load_ips*/ TRUE,
+                    /*no_refcnt*/ TRUE, d_node->data) < 0) {
+            (void)vrmr_blocklist_ipset_commit(blocklist, /*abort*/ TRUE);
+            vrmr_list_cleanup(&gone);
+            return (-1);
+        }
+        added++;
+    }
+
+    for (d_node = gone.top; d_node; d_node = d_node->next) {
+        if (vrmr_blocklist_rem_one(zones, blocklist, d_node->data) < 0) {
+            (void)vrmr_blocklist_ipset_commit(blocklist, /*abort*/ TRUE);
+            vrmr_list_cleanup(&gone);
+            return (-1);
+        }
+        removed++;
+    }
+    vrmr_list_cleanup(&gone);
+
+    if (vrmr_blocklist_ipset_commit(blocklist, /*abort*/ FALSE) < 0)
+        return (-1);
+
+    if (added == 0 && removed == 0)
+        return (0);
+
+    vrmr_info("Info", "BlockList: %u added to and %u removed from the ipsets.",
+            added, removed);
+    return (1);
+}
+
 /*  reload_blocklist
 
-    Reloads the blocklist.
+    Reloads the blocklist. If it lives in the ipsets the changes are
+    applied to the sets directly and the rules don't have to change.
 
     returncodes:
         -1: error
@@ -1462,6 +1558,24 @@ int reload_blocklist(struct vrmr_ctx *vctx, struct vrmr_config *cfg,
         return (-1);
     }
 
+    if (blocklist->ipset) {
+        status = reload_blocklist_sets(zones, blocklist, new_blocklist);
+        if (status >= 0) {
+            vrmr_blocklist_cleanup(new_blocklist);
+            free(new_blocklist);
+            /* the rules only refer to the sets */
+            return (0);
+        }
+
+        /*  the sets are now in an unknown state: reload them completely
+            along with the rules */
+        vrmr_warning("Warning", "updating the blocklist ipsets failed.");
+        vrmr_blocklist_cleanup(blocklist);
+        *blocklist = *new_blocklist;
+        free(new_blocklist);
+        return (1);
+    }
+
     /* run trough the lists and compare */
     if (blocklist->list.len != new_blocklist->list.len) {
         vrmr_info("Info",
@@ -1508,12 +1622,12 @@ int reload_blocklist(struct vrmr_ctx *vctx, struct vrmr_config *cfg,
 
     /* see if we need to swap the lists */
     if (status == 1) {
-        vrmr_list_cleanup(&blocklist->list);
+        vrmr_blocklist_cleanup(blocklist);
 
         /* copy the new list to the old */
         *blocklist = *new_blocklist;
     } else {
-        vrmr_list_cleanup(&new_blocklist->list);
+        vrmr_blocklist_cleanup(new_blocklist);
     }
     free(new_blocklist);
 
@@ -746,12 +746,32 @@ static int rulecreate_call_create_funcs(struct vrmr_config *conf,
     return (retval);
 }
 
+/*  rulecreate_nflog_options
+
+    Create the NFLOG options for the log rule of a user rule. The group is
+    picked by the log prefix and the zones and service of the rule, so the
+    log rules of one action are spread over all NFLOG groups.
+*/
+static void rulecreate_nflog_options(struct vrmr_config *conf,
+        struct vrmr_rule_cache *create, const char *logprefix, char *opts,
+        size_t size)
+{
+    char key[256];
+
+    snprintf(key, sizeof(key), "%s %s %s %s", logprefix,
+            create->from ? create->from->name : "any",
+            create->to ? create->to->name : "any",
+            create->service ? create->service->name : "any");
+    vrmr_rules_nflog_options(conf, key, opts, size);
+}
+
 static int rulecreate_create_rule_and_options(struct vrmr_config *conf,
         struct rule_scratch *rule, struct vrmr_rule_cache *create,
         struct vrmr_iptcaps *iptcap)
 {
     char action[64] = ""; /* if changes to size: see sscanf below as well */
     char logprefix[64] = "";
+    char nflog_opts[96] = "";
     unsigned int limit = 0;
     unsigned int burst = 0;
     char *unit = NULL;
@@ -812,10 +832,12 @@ static int rulecreate_create_rule_and_options(struct vrmr_config *conf,
         /* create the logprefix string */
         create_logprefix_string(conf, logprefix, sizeof(logprefix),
                 create->ruletype, action, "%s", create->option.logprefix);
+        rulecreate_nflog_options(
+                conf, create, logprefix, nflog_opts, sizeof(nflog_opts));
 
         /* create the action */
-        snprintf(rule->action, sizeof(rule->action),
-                "NFLOG %s --nflog-group %u", logprefix, conf->nfgrp);
+        snprintf(rule->action, sizeof(rule->action), "NFLOG %s %s", logprefix,
+                nflog_opts);
 
         /* set ip and netmask */
         if (rule->ipv == VRMR_IPV4) {
@@ -880,10 +902,12 @@ static int rulecreate_create_rule_and_options(struct vrmr_config *conf,
             /* create the logprefix string */
             create_logprefix_string(conf, logprefix, sizeof(logprefix),
                     create->ruletype, action, "%s", create->option.logprefix);
+            rulecreate_nflog_options(
+                    conf, create, logprefix, nflog_opts, sizeof(nflog_opts));
 
             /* action */
-            snprintf(rule->action, sizeof(rule->action),
-                    "NFLOG %s --nflog-group %u", logprefix, conf->nfgrp);
+            snprintf(rule->action, sizeof(rule->action), "NFLOG %s %s",
+                    logprefix, nflog_opts);
 
             /* set ip and netmask */
             (void)strlcpy(
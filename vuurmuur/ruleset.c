@@ -24,6 +24,9 @@
 
 #include "main.h"
 
+/* initial size of the buffer of a chain's rule lines */
+#define RULESET_LINES_SIZE 4096
+
 /* hack: in 0.8 we have to do this right! */
 struct vrmr_list accounting_chain_names; /* list with the chainnames */
 
@@ -44,53 +47,10 @@ static int ruleset_setup(struct rule_set *ruleset)
 {
     assert(ruleset);
 
-    /* init */
+    /* init, this also sets up the empty rule lines */
     memset(ruleset, 0, sizeof(struct rule_set));
 
-    /* init the lists */
-
-    /* raw */
-    vrmr_list_setup(&ruleset->raw_preroute, free);
-    vrmr_list_setup(&ruleset->raw_output, free);
-
-    /* mangle */
-    vrmr_list_setup(&ruleset->mangle_preroute, free);
-    vrmr_list_setup(&ruleset->mangle_input, free);
-    vrmr_list_setup(&ruleset->mangle_forward, free);
-    vrmr_list_setup(&ruleset->mangle_output, free);
-    vrmr_list_setup(&ruleset->mangle_postroute, free);
-
-    vrmr_list_setup(&ruleset->mangle_shape_in, free);
-    vrmr_list_setup(&ruleset->mangle_shape_out, free);
-    vrmr_list_setup(&ruleset->mangle_shape_fw, free);
-
-    /* nat */
-    vrmr_list_setup(&ruleset->nat_preroute, free);
-    vrmr_list_setup(&ruleset->nat_postroute, free);
-    vrmr_list_setup(&ruleset->nat_output, free);
-
-    /* filter */
-    vrmr_list_setup(&ruleset->filter_input, free);
-    vrmr_list_setup(&ruleset->filter_forward, free);
-    vrmr_list_setup(&ruleset->filter_output, free);
-
-    vrmr_list_setup(&ruleset->filter_antispoof, free);
-    vrmr_list_setup(&ruleset->filter_blocklist, free);
-    vrmr_list_setup(&ruleset->filter_blocktarget, free);
-    vrmr_list_setup(&ruleset->filter_badtcp, free);
-    vrmr_list_setup(&ruleset->filter_synlimittarget, free);
-    vrmr_list_setup(&ruleset->filter_udplimittarget, free);
-    vrmr_list_setup(&ruleset->filter_newaccepttarget, free);
-    /* NFQueue state */
-    vrmr_list_setup(&ruleset->filter_newnfqueuetarget, free);
-    vrmr_list_setup(&ruleset->filter_estrelnfqueuetarget, free);
-    /* NFLog state */
-    vrmr_list_setup(&ruleset->filter_newnflogtarget, free);
-    vrmr_list_setup(&ruleset->filter_estrelnflogtarget, free);
-    /* tcp reset */
-    vrmr_list_setup(&ruleset->filter_tcpresettarget, free);
     /* accounting */
-    vrmr_list_setup(&ruleset->filter_accounting, free);
     vrmr_list_setup(&accounting_chain_names, free);
 
     /* shaping */
@@ -98,9 +58,15 @@ static int ruleset_setup(struct rule_set *ruleset)
     return (0);
 }
 
+static void ruleset_lines_cleanup(struct rule_lines *lines)
+{
+    free(lines->buf);
+    memset(lines, 0, sizeof(*lines));
+}
+
 /*  cleanup the ruleset
 
-    All lists are cleaned.
+    All lines and lists are cleaned.
 
     Returns:
         nothing, void function
@@ -110,44 +76,44 @@ static void ruleset_cleanup(struct rule_set *ruleset)
     assert(ruleset);
 
     /* raw */
-    vrmr_list_cleanup(&ruleset->raw_preroute);
-    vrmr_list_cleanup(&ruleset->raw_output);
+    ruleset_lines_cleanup(&ruleset->raw_preroute);
+    ruleset_lines_cleanup(&ruleset->raw_output);
 
     /* mangle */
-    vrmr_list_cleanup(&ruleset->mangle_preroute);
-    vrmr_list_cleanup(&ruleset->mangle_input);
-    vrmr_list_cleanup(&ruleset->mangle_forward);
-    vrmr_list_cleanup(&ruleset->mangle_output);
-    vrmr_list_cleanup(&ruleset->mangle_postroute);
+    ruleset_lines_cleanup(&ruleset->mangle_preroute);
+    ruleset_lines_cleanup(&ruleset->mangle_input);
+    ruleset_lines_cleanup(&ruleset->mangle_forward);
+    ruleset_lines_cleanup(&ruleset->mangle_output);
+    ruleset_lines_cleanup(&ruleset->mangle_postroute);
 
-    vrmr_list_cleanup(&ruleset->mangle_shape_in);
-    vrmr_list_cleanup(&ruleset->mangle_shape_out);
-    vrmr_list_cleanup(&ruleset->mangle_shape_fw);
+    ruleset_lines_cleanup(&ruleset->mangle_shape_in);
+    ruleset_lines_cleanup(&ruleset->mangle_shape_out);
+    ruleset_lines_cleanup(&ruleset->mangle_shape_fw);
 
     /* nat */
-    vrmr_list_cleanup(&ruleset->nat_preroute);
-    vrmr_list_cleanup(&ruleset->nat_postroute);
-    vrmr_list_cleanup(&ruleset->nat_output);
+    ruleset_lines_cleanup(&ruleset->nat_preroute);
+    ruleset_lines_cleanup(&ruleset->nat_postroute);
+    ruleset_lines_cleanup(&ruleset->nat_output);
 
     /* filter */
-    vrmr_list_cleanup(&ruleset->filter_input);
-    vrmr_list_cleanup(&ruleset->filter_forward);
-    vrmr_list_cleanup(&ruleset->filter_output);
-
-    vrmr_list_cleanup(&ruleset->filter_antispoof);
-    vrmr_list_cleanup(&ruleset->filter_blocklist);
-    vrmr_list_cleanup(&ruleset->filter_blocktarget);
-    vrmr_list_cleanup(&ruleset->filter_badtcp);
-    vrmr_list_cleanup(&ruleset->filter_synlimittarget);
-    vrmr_list_cleanup(&ruleset->filter_udplimittarget);
-    vrmr_list_cleanup(&ruleset->filter_newaccepttarget);
-    vrmr_list_cleanup(&ruleset->filter_estrelnfqueuetarget);
-    vrmr_list_cleanup(&ruleset->filter_newnfqueuetarget);
-    vrmr_list_cleanup(&ruleset->filter_estrelnflogtarget);
-    vrmr_list_cleanup(&ruleset->filter_newnflogtarget);
-    vrmr_list_cleanup(&ruleset->filter_tcpresettarget);
-
-    vrmr_list_cleanup(&ruleset->filter_accounting);
+    ruleset_lines_cleanup(&ruleset->filter_input);
+    ruleset_lines_cleanup(&ruleset->filter_forward);
+    ruleset_lines_cleanup(&ruleset->filter_output);
+
+    ruleset_lines_cleanup(&ruleset->filter_antispoof);
+    ruleset_lines_cleanup(&ruleset->filter_blocklist);
+    ruleset_lines_cleanup(&ruleset->filter_blocktarget);
+    ruleset_lines_cleanup(&ruleset->filter_badtcp);
+    ruleset_lines_cleanup(&ruleset->filter_synlimittarget);
+    ruleset_lines_cleanup(&ruleset->filter_udplimittarget);
+    ruleset_lines_cleanup(&ruleset->filter_newaccepttarget);
+    ruleset_lines_cleanup(&ruleset->filter_estrelnfqueuetarget);
+    ruleset_lines_cleanup(&ruleset->filter_newnfqueuetarget);
+    ruleset_lines_cleanup(&ruleset->filter_estrelnflogtarget);
+    ruleset_lines_cleanup(&ruleset->filter_newnflogtarget);
+    ruleset_lines_cleanup(&ruleset->filter_tcpresettarget);
+
+    ruleset_lines_cleanup(&ruleset->filter_accounting);
     vrmr_list_cleanup(&accounting_chain_names);
 
     vrmr_list_cleanup(&ruleset->tc_rules);
@@ -243,190 +209,1147 @@ static int ruleset_check_accounting(char *chain)
     return (1);
 }
 
-/*  ruleset_add_rule_to_set
-
-    Add a iptables-restore compatible string 'line' to the ruleset.
-
-    Note: this function will alloc the string and copy rule to this
-    string.
+/*  ruleset_add_rule_to_set
+
+    Add a iptables-restore compatible string 'line' to the ruleset.
+
+    Note: the line is copied to the end of the buffer of 'lines', which
+    grows as needed.
+
+    Returncodes:
+         0: ok
+        -1: error
+*/
+int ruleset_add_rule_to_set(struct rule_lines *lines, char *chain, char *rule,
+        uint64_t packets, uint64_t bytes)
+{
+    size_t size = 0, numbers_size = 0;
+    char numbers[32] = "";
+    int result = 0;
+
+    assert(lines && chain && rule);
+
+    /* HACK: check for accounting special cases */
+    result = ruleset_check_accounting(chain);
+    if (result == -1)
+        return (-1);
+    else if (result == 0)
+        return (0);
+
+    /* create the counters */
+    if (packets > 0 || bytes > 0) {
+        snprintf(numbers, sizeof(numbers), "[%" PRIu64 ":%" PRIu64 "] ",
+                packets, bytes);
+        numbers_size = strlen(numbers);
+    }
+
+    /* size of the numbers string, chain, space, rule, newline and the
+       terminating \0 */
+    size = numbers_size + strlen(chain) + 1 + strlen(rule) + 2;
+
+    /* grow the buffer */
+    if (lines->len + size > lines->size) {
+        size_t new_size = lines->size ? lines->size : RULESET_LINES_SIZE;
+        char *buf = NULL;
+
+        while (lines->len + size > new_size)
+            new_size *= 2;
+
+        if (!(buf = realloc(lines->buf, new_size))) {
+            vrmr_error(-1, "Error", "realloc failed: %s", strerror(errno));
+            return (-1);
+        }
+        lines->buf = buf;
+        lines->size = new_size;
+    }
+
+    /* create the string */
+    result = snprintf(lines->buf + lines->len, size, "%s%s %s\n", numbers,
+            chain, rule);
+    if (result >= (int)size) {
+        vrmr_error(-1, "Error", "ruleset string overflow (%d >= %d, %s)",
+                result, (int)size, rule);
+        return (-1);
+    }
+    lines->len += (size_t)result;
+    lines->n++;
+
+    return (0);
+}
+
+#define RULESET_OUT_BUFSIZE 65536
+
+/* buffered output of the ruleset, into a file or streamed into the stdin of
+   iptables-restore */
+struct ruleset_out {
+    int fd;
+    pid_t pid;   /* iptables-restore reading from fd, 0 for a file */
+    int copy_fd; /* file that gets a copy of the output, or -1 */
+    int error;   /* errno of the first failed write */
+    char *buf;
+    size_t len;
+};
+
+static int ruleset_out_setup(struct ruleset_out *out, int fd)
+{
+    memset(out, 0, sizeof(*out));
+    out->fd = fd;
+    out->copy_fd = -1;
+
+    if (!(out->buf = malloc(RULESET_OUT_BUFSIZE))) {
+        vrmr_error(-1, "Error", "malloc failed: %s", strerror(errno));
+        return (-1);
+    }
+    return (0);
+}
+
+/* returns 0 or the errno of the failed write */
+static int ruleset_write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return (errno);
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return (0);
+}
+
+/*  ruleset_out_write
+
+    Writes 'data' to the output and its copy. After a failed write the
+    output is dropped, the error is reported when closing the output.
+*/
+static int ruleset_out_write(
+        struct ruleset_out *out, const char *data, size_t len)
+{
+    struct sigaction ignore, sigpipe;
+    int error = 0;
+
+    /* if iptables-restore bails out, we want to see EPIPE instead of
+       getting killed. Only while writing to it, so the commands we start
+       elsewhere don't inherit the ignored SIGPIPE. */
+    if (out->pid != 0) {
+        memset(&ignore, 0, sizeof(ignore));
+        ignore.sa_handler = SIG_IGN;
+        sigemptyset(&ignore.sa_mask);
+        (void)sigaction(SIGPIPE, &ignore, &sigpipe);
+    }
+    if (out->error == 0 && (error = ruleset_write_all(out->fd, data, len)))
+        out->error = error;
+    if (out->pid != 0)
+        (void)sigaction(SIGPIPE, &sigpipe, NULL);
+
+    if (out->copy_fd != -1 && (error = ruleset_write_all(out->copy_fd, data,
+                                       len)) != 0) {
+        vrmr_warning("Warning", "writing the ruleset copy failed: %s",
+                strerror(error));
+        out->copy_fd = -1;
+    }
+    return (out->error ? -1 : 0);
+}
+
+static int ruleset_out_flush(struct ruleset_out *out)
+{
+    size_t len = out->len;
+
+    out->len = 0;
+    if (len == 0)
+        return (out->error ? -1 : 0);
+    return (ruleset_out_write(out, out->buf, len));
+}
+
+/*  ruleset_out_writebuf
+
+    Buffers 'len' bytes of 'data' for the output, which is written when the
+    buffer is full or flushed. Data that doesn't fit in the buffer is
+    written right away.
+*/
+static int ruleset_out_writebuf(
+        struct ruleset_out *out, const char *data, size_t len)
+{
+    if (out->len + len > RULESET_OUT_BUFSIZE && ruleset_out_flush(out) < 0)
+        return (-1);
+    if (len > RULESET_OUT_BUFSIZE)
+        return (ruleset_out_write(out, data, len));
+
+    if (len > 0) {
+        memcpy(out->buf + out->len, data, len);
+        out->len += len;
+    }
+    return (0);
+}
+
+static int ruleset_writeprint(struct ruleset_out *out, const char *line)
+{
+    return (ruleset_out_writebuf(out, line, strlen(line)));
+}
+
+/* write all rules of a chain at once */
+static int ruleset_writelines(
+        struct ruleset_out *out, const struct rule_lines *lines)
+{
+    return (ruleset_out_writebuf(out, lines->buf, lines->len));
+}
+
+/*  ruleset_writecommit
+
+    Ends a table. The table is passed on right away, so iptables-restore
+    can process it while we write the next one.
+*/
+static int ruleset_writecommit(struct ruleset_out *out)
+{
+    if (ruleset_writeprint(out, "COMMIT\n") < 0)
+        return (-1);
+    return (ruleset_out_flush(out));
+}
+
+/*  ruleset_out_close
+
+    Flushes and frees the output of a file. The fd is left open.
+
+    Returncodes:
+         0: ok
+        -1: error
+*/
+static int ruleset_out_close(struct ruleset_out *out)
+{
+    int result = ruleset_out_flush(out);
+
+    if (result < 0) {
+        vrmr_error(-1, "Error", "writing the ruleset failed: %s",
+                strerror(out->error));
+    }
+    free(out->buf);
+    out->buf = NULL;
+    return (result);
+}
+
+/*  ruleset_restore_start
+
+    Starts (ip6)tables-restore with a pipe to its stdin, so the ruleset can
+    be streamed into it while it is created. Its stderr goes to 'result_fd'.
+
+    Returncodes:
+         0: ok
+        -1: error
+*/
+static int ruleset_restore_start(struct vrmr_config *cnf, int ipver,
+        int result_fd, struct ruleset_out *out)
+{
+    const char *path = cnf->iptablesrestore_location;
+    int fds[2] = {-1, -1};
+
+    assert(cnf && out);
+
+#ifdef IPV6_ENABLED
+    if (ipver == VRMR_IPV6)
+        path = cnf->ip6tablesrestore_location;
+#endif
+    const char *args[] = {path, "--counters", "--noflush", NULL};
+
+    if (ruleset_out_setup(out, -1) < 0)
+        return (-1);
+
+    /* close on exec so other commands we start don't keep the pipe open */
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        vrmr_error(-1, "Error", "creating pipe failed: %s", strerror(errno));
+        free(out->buf);
+        return (-1);
+    }
+
+    out->pid = fork();
+    if (out->pid == -1) {
+        vrmr_error(-1, "Error", "fork failed: %s", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        free(out->buf);
+        return (-1);
+    } else if (out->pid == 0) {
+        /* child: only async-signal-safe calls from here */
+        if (dup2(fds[0], STDIN_FILENO) == -1 ||
+                dup2(result_fd, STDERR_FILENO) == -1)
+            _exit(127);
+
+        execv(path, (char **)args);
+        _exit(127);
+    }
+    vrmr_debug(MEDIUM, "%s started, pid %u", path, (unsigned int)out->pid);
+
+    close(fds[0]);
+    out->fd = fds[1];
+    return (0);
+}
+
+/*  ruleset_restore_finish
+
+    Closes the stdin of iptables-restore and waits for it to load the
+    ruleset. With 'abort' set it is killed before it gets to the end of
+    the ruleset.
+
+    Returncodes:
+         0: ok
+        -1: error
+*/
+static int ruleset_restore_finish(struct ruleset_out *out, int abort)
+{
+    int status = 0, retval = 0;
+    pid_t rpid;
+
+    if (abort) {
+        (void)kill(out->pid, SIGTERM);
+        retval = -1;
+    } else if (ruleset_out_flush(out) < 0) {
+        vrmr_error(-1, "Error", "writing the ruleset to iptables-restore "
+                                "failed: %s",
+                strerror(out->error));
+        retval = -1;
+    }
+    free(out->buf);
+    out->buf = NULL;
+    close(out->fd);
+
+    do {
+        rpid = waitpid(out->pid, &status, 0);
+    } while (rpid == -1 && errno == EINTR);
+
+    if (rpid == -1) {
+        vrmr_error(-1, "Error", "waiting for iptables-restore failed: %s",
+                strerror(errno));
+        return (-1);
+    }
+    if (!abort && (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+        vrmr_error(-1, "Error", "loading the ruleset failed (status %d)",
+                WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        return (-1);
+    }
+    return (retval);
+}
+
+/* Create the shaping script file */
+static int ruleset_fill_shaping_file(struct rule_set *ruleset, int fd)
+{
+    struct vrmr_list_node *d_node = NULL;
+    char *ptr = NULL;
+    char cmd[VRMR_MAX_PIPE_COMMAND] = "";
+    struct ruleset_out out;
+
+    if (ruleset_out_setup(&out, fd) < 0)
+        return (-1);
+
+    ruleset_writeprint(&out, "#!/bin/bash\n");
+
+    for (d_node = ruleset->tc_rules.top; d_node; d_node = d_node->next) {
+        ptr = d_node->data;
+
+        snprintf(cmd, sizeof(cmd), "%s\n", ptr);
+        ruleset_writeprint(&out, cmd);
+    }
+
+    ruleset_writeprint(&out, "# EOF\n");
+
+    return (ruleset_out_close(&out));
+}
+
+/* the tables of the ruleset, in the order they are written to the file */
+enum ruleset_table {
+    RULESET_TABLE_RAW = 0,
+    RULESET_TABLE_MANGLE,
+    RULESET_TABLE_NAT,
+    RULESET_TABLE_FILTER,
+    RULESET_TABLES,
+};
+
+/* builtin chain and the offset of its policy in struct rule_set */
+struct ruleset_builtin {
+    const char *chain;
+    size_t policy;
+};
+
+#define RULESET_OFFSET(member) offsetof(struct rule_set, member)
+
+/* layout of a table: its builtin chains and the lists with its rules in the
+   order ruleset_fill_file writes them. The lists end with a 0 offset. */
+static const struct ruleset_table_def {
+    const char *name;
+    struct ruleset_builtin builtins[6];
+    size_t lists[16];
+    size_t ipv4_lists[4]; /* only written for ipv4 */
+} ruleset_tables[RULESET_TABLES] = {
+        {
+                "raw",
+                {
+                        {"PREROUTING", RULESET_OFFSET(raw_preroute_policy)},
+                        {"OUTPUT", RULESET_OFFSET(raw_output_policy)},
+                },
+                {
+                        RULESET_OFFSET(raw_preroute),
+                        RULESET_OFFSET(raw_output),
+                },
+                {0},
+        },
+        {
+                "mangle",
+                {
+                        {"PREROUTING", RULESET_OFFSET(mangle_preroute_policy)},
+                        {"INPUT", RULESET_OFFSET(mangle_input_policy)},
+                        {"FORWARD", RULESET_OFFSET(mangle_forward_policy)},
+                        {"OUTPUT", RULESET_OFFSET(mangle_output_policy)},
+                        {"POSTROUTING",
+                                RULESET_OFFSET(mangle_postroute_policy)},
+                },
+                {
+                        RULESET_OFFSET(mangle_preroute),
+                        RULESET_OFFSET(mangle_input),
+                        RULESET_OFFSET(mangle_forward),
+                        RULESET_OFFSET(mangle_output),
+                        RULESET_OFFSET(mangle_postroute),
+                },
+                {
+                        RULESET_OFFSET(mangle_shape_in),
+                        RULESET_OFFSET(mangle_shape_out),
+                        RULESET_OFFSET(mangle_shape_fw),
+                },
+        },
+        {
+                "nat",
+                {
+                        {"PREROUTING", RULESET_OFFSET(nat_preroute_policy)},
+                        {"OUTPUT", RULESET_OFFSET(nat_output_policy)},
+                        {"POSTROUTING", RULESET_OFFSET(nat_postroute_policy)},
+                },
+                {
+                        RULESET_OFFSET(nat_preroute),
+                        RULESET_OFFSET(nat_output),
+                        RULESET_OFFSET(nat_postroute),
+                },
+                {0},
+        },
+        {
+                "filter",
+                {
+                        {"INPUT", RULESET_OFFSET(filter_input_policy)},
+                        {"FORWARD", RULESET_OFFSET(filter_forward_policy)},
+                        {"OUTPUT", RULESET_OFFSET(filter_output_policy)},
+                },
+                {
+                        RULESET_OFFSET(filter_input),
+                        RULESET_OFFSET(filter_forward),
+                        RULESET_OFFSET(filter_output),
+                        RULESET_OFFSET(filter_antispoof),
+                        RULESET_OFFSET(filter_blocklist),
+                        RULESET_OFFSET(filter_blocktarget),
+                        RULESET_OFFSET(filter_synlimittarget),
+                        RULESET_OFFSET(filter_udplimittarget),
+                        RULESET_OFFSET(filter_newaccepttarget),
+                        RULESET_OFFSET(filter_newnfqueuetarget),
+                        RULESET_OFFSET(filter_estrelnfqueuetarget),
+                        RULESET_OFFSET(filter_newnflogtarget),
+                        RULESET_OFFSET(filter_estrelnflogtarget),
+                        RULESET_OFFSET(filter_tcpresettarget),
+                        RULESET_OFFSET(filter_accounting),
+                },
+                {0},
+        },
+};
+
+/* fingerprint of the rules in a chain */
+struct ruleset_chain_fp {
+    char name[32];
+    uint64_t hash;
+    unsigned int rules;
+    char changed;
+};
+
+/* fingerprint of a table of the ruleset */
+struct ruleset_table_fp {
+    char loaded;         /* table is part of the ruleset */
+    char partial;        /* only the changed chains were written */
+    char unknown;        /* has rules we could not get the chain of */
+    char system_changed; /* the system doesn't have the rules we loaded */
+    uint64_t structure;  /* chains vuurmuur creates in the table */
+    struct ruleset_chain_fp *chains;
+    unsigned int chains_n;
+    unsigned int chains_size;
+};
+
+struct ruleset_fp {
+    struct ruleset_table_fp tables[RULESET_TABLES];
+    unsigned int written; /* tables written to the ruleset file */
+    char partial;         /* some tables only have the changed chains */
+};
+
+/* fingerprint of the last ruleset iptables-restore loaded successfully, per
+   ip version. Only valid after a successful load. */
+static struct ruleset_fp ruleset_applied[2];
+static char ruleset_applied_valid[2] = {FALSE, FALSE};
+
+#define RULESET_FP_BASIS 14695981039346656037ULL
+#define RULESET_FP_PRIME 1099511628211ULL
+
+/* FNV-1a over 'len' bytes and a terminating \0, so that the hashes of
+   consecutive strings don't depend on where one ends. */
+static uint64_t ruleset_fp_hash_mem(uint64_t hash, const char *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= RULESET_FP_PRIME;
+    }
+    return (hash * RULESET_FP_PRIME);
+}
+
+static uint64_t ruleset_fp_hash(uint64_t hash, const char *str)
+{
+    return (ruleset_fp_hash_mem(hash, str, strlen(str)));
+}
+
+static void ruleset_fp_cleanup(struct ruleset_fp *fp)
+{
+    for (int t = 0; t < RULESET_TABLES; t++)
+        free(fp->tables[t].chains);
+
+    memset(fp, 0, sizeof(*fp));
+}
+
+/*  ruleset_fp_chain
+
+    Looks up the chain 'name' of 'len' chars in the table fingerprint and
+    adds it if it is not there yet.
+
+    Returns the chain or NULL on error.
+*/
+static struct ruleset_chain_fp *ruleset_fp_chain(
+        struct ruleset_table_fp *table, const char *name, size_t len)
+{
+    struct ruleset_chain_fp *chain = NULL;
+
+    for (unsigned int i = 0; i < table->chains_n; i++) {
+        chain = &table->chains[i];
+        if (strncmp(chain->name, name, len) == 0 && chain->name[len] == '\0')
+            return (chain);
+    }
+
+    if (len >= sizeof(chain->name)) {
+        vrmr_error(-1, "Internal Error", "chain name '%.*s' too long",
+                (int)len, name);
+        return (NULL);
+    }
+
+    if (table->chains_n == table->chains_size) {
+        unsigned int size = table->chains_size ? table->chains_size * 2 : 16;
+
+        chain = realloc(table->chains, size * sizeof(*chain));
+        if (chain == NULL) {
+            vrmr_error(-1, "Error", "realloc failed: %s", strerror(errno));
+            return (NULL);
+        }
+        table->chains = chain;
+        table->chains_size = size;
+    }
+
+    chain = &table->chains[table->chains_n++];
+    memset(chain, 0, sizeof(*chain));
+    memcpy(chain->name, name, len);
+    chain->hash = RULESET_FP_BASIS;
+    return (chain);
+}
+
+static struct ruleset_chain_fp *ruleset_fp_find(
+        const struct ruleset_table_fp *table, const char *name)
+{
+    for (unsigned int i = 0; i < table->chains_n; i++) {
+        if (strcmp(table->chains[i].name, name) == 0)
+            return (&table->chains[i]);
+    }
+    return (NULL);
+}
+
+/*  ruleset_line_chain
+
+    Gets the chain of a ruleset line "[packets:bytes] -A CHAIN rule" of
+    'size' chars. The counters are optional.
+
+    Returns the chain name, which is 'len' chars long, or NULL if the line
+    doesn't append to a chain. 'rule' is set to the line without the
+    counters, as those are not part of the fingerprint.
+*/
+static const char *ruleset_line_chain(
+        const char *line, size_t size, size_t *len, const char **rule)
+{
+    const char *end = line + size;
+
+    if (size > 0 && line[0] == '[') {
+        const char *c = memchr(line, ']', size);
+        if (c != NULL) {
+            line = c + 1;
+            while (line < end && *line == ' ')
+                line++;
+        }
+    }
+    *rule = line;
+
+    if (end - line < 3 || strncmp(line, "-A ", 3) != 0)
+        return (NULL);
+
+    line += 3;
+    for (*len = 0; line + *len < end && line[*len] != ' '; (*len)++)
+        ;
+    if (*len == 0)
+        return (NULL);
+    return (line);
+}
+
+/*  ruleset_lines_next
+
+    Returns the line at '*offset' and sets 'len' to its length without the
+    newline. '*offset' moves on to the next line. Returns NULL after the
+    last line.
+*/
+static const char *ruleset_lines_next(
+        const struct rule_lines *lines, size_t *offset, size_t *len)
+{
+    const char *line = NULL, *nl = NULL;
+
+    if (*offset >= lines->len)
+        return (NULL);
+
+    line = lines->buf + *offset;
+    nl = memchr(line, '\n', lines->len - *offset);
+    *len = nl ? (size_t)(nl - line) : lines->len - *offset;
+    *offset += *len + 1;
+    return (line);
+}
+
+/*  ruleset_table_enabled
+
+    Returns TRUE if the table is part of the ruleset for 'ipver'.
+*/
+static int ruleset_table_enabled(
+        struct vrmr_ctx *vctx, enum ruleset_table table, int ipver)
+{
+    if (table == RULESET_TABLE_NAT && ipver != VRMR_IPV4)
+        return (FALSE);
+    if (vctx->conf.vrmr_check_iptcaps == FALSE)
+        return (TRUE);
+
+    switch (table) {
+        case RULESET_TABLE_RAW:
+            if (ipver == VRMR_IPV4)
+                return (vctx->iptcaps.table_raw == TRUE);
+#ifdef IPV6_ENABLED
+            return (vctx->iptcaps.table_ip6_raw == TRUE);
+#else
+            return (FALSE);
+#endif
+        case RULESET_TABLE_MANGLE:
+            return (vctx->iptcaps.table_mangle == TRUE);
+        case RULESET_TABLE_NAT:
+            return (vctx->iptcaps.table_nat == TRUE);
+        case RULESET_TABLE_FILTER:
+            return (vctx->iptcaps.table_filter == TRUE);
+        default:
+            return (FALSE);
+    }
+}
+
+/* chains of the table as they are in the system, NULL for raw as we don't
+   create chains there. */
+static struct vrmr_list *ruleset_system_chains(
+        struct vrmr_ctx *vctx, enum ruleset_table table)
+{
+    switch (table) {
+        case RULESET_TABLE_MANGLE:
+            return (&vctx->rules.system_chain_mangle);
+        case RULESET_TABLE_NAT:
+            return (&vctx->rules.system_chain_nat);
+        case RULESET_TABLE_FILTER:
+            return (&vctx->rules.system_chain_filter);
+        default:
+            return (NULL);
+    }
+}
+
+static int ruleset_is_builtin(enum ruleset_table table, const char *chain)
+{
+    const struct ruleset_builtin *b = ruleset_tables[table].builtins;
+
+    for (; b->chain != NULL; b++) {
+        if (strcmp(b->chain, chain) == 0)
+            return (TRUE);
+    }
+    return (FALSE);
+}
+
+/*  ruleset_fp_lists
+
+    Adds the rules of the 0 terminated 'lists' to the table fingerprint.
+
+    Returncodes:
+         0: ok
+        -1: error
+*/
+static int ruleset_fp_lists(struct rule_set *ruleset, const size_t *lists,
+        struct ruleset_table_fp *table)
+{
+    struct ruleset_chain_fp *chain = NULL;
+    const char *line = NULL, *name = NULL, *rule = NULL;
+    size_t offset = 0, size = 0, len = 0;
+
+    for (; *lists != 0; lists++) {
+        const struct rule_lines *lines =
+                (const struct rule_lines *)((char *)ruleset + *lists);
+
+        for (offset = 0; (line = ruleset_lines_next(lines, &offset, &size));) {
+            if (!(name = ruleset_line_chain(line, size, &len, &rule))) {
+                table->unknown = TRUE;
+                continue;
+            }
+
+            /* the rules of a chain are mostly together */
+            if (chain == NULL || strncmp(chain->name, name, len) != 0 ||
+                    chain->name[len] != '\0') {
+                if (!(chain = ruleset_fp_chain(table, name, len)))
+                    return (-1);
+            }
+            chain->hash = ruleset_fp_hash_mem(
+                    chain->hash, rule, (size_t)(line + size - rule));
+            chain->rules++;
+        }
+    }
+    return (0);
+}
+
+/*  ruleset_fingerprint
+
+    Creates the fingerprint of the tables in 'ruleset': a hash of the
+    rules of each chain, and a hash of the chains vuurmuur (re)creates in
+    each table.
+
+    Returncodes:
+         0: ok
+        -1: error
+*/
+static int ruleset_fingerprint(struct vrmr_ctx *vctx, struct rule_set *ruleset,
+        int ipver, struct ruleset_fp *fp)
+{
+    struct vrmr_list_node *d_node = NULL;
+
+    for (int t = 0; t < RULESET_TABLES; t++) {
+        const struct ruleset_table_def *def = &ruleset_tables[t];
+        struct ruleset_table_fp *table = &fp->tables[t];
+
+        if (!ruleset_table_enabled(vctx, t, ipver))
+            continue;
+        table->loaded = TRUE;
+
+        /* the builtin chains always have an entry so a change of policy
+           is a change of the chain */
+        for (const struct ruleset_builtin *b = def->builtins; b->chain;
+                b++) {
+            struct ruleset_chain_fp *chain =
+                    ruleset_fp_chain(table, b->chain, strlen(b->chain));
+            if (chain == NULL)
+                return (-1);
+
+            chain->hash = ruleset_fp_hash(chain->hash,
+                    *((char *)ruleset + b->policy) ? "DROP" : "ACCEPT");
+        }
+
+        if (ruleset_fp_lists(ruleset, def->lists, table) < 0)
+            return (-1);
+        if (ipver == VRMR_IPV4 &&
+                ruleset_fp_lists(ruleset, def->ipv4_lists, table) < 0)
+            return (-1);
+
+        table->structure = ruleset_fp_hash(RULESET_FP_BASIS, def->name);
+        if (t == RULESET_TABLE_FILTER) {
+            for (d_node = vctx->rules.custom_chain_list.top; d_node;
+                    d_node = d_node->next) {
+                table->structure =
+                        ruleset_fp_hash(table->structure, d_node->data);
+            }
+            for (d_node = accounting_chain_names.top; d_node;
+                    d_node = d_node->next) {
+                table->structure =
+                        ruleset_fp_hash(table->structure, d_node->data);
+            }
+        }
+    }
+    return (0);
+}
+
+/*  ruleset_system_rules
+
+    Counts the rules per chain the table 't' has in the system, from the
+    'iptables -t <table> -S' listing. Only the rule counts of 'sys' are
+    set.
+
+    Returncodes:
+         0: ok
+        -1: error, or the table couldn't be listed
+*/
+static int ruleset_system_rules(struct vrmr_ctx *vctx, int ipver,
+        enum ruleset_table t, struct ruleset_table_fp *sys)
+{
+    struct ruleset_chain_fp *chain = NULL;
+    const char *name = NULL, *rule = NULL;
+    char line[1024] = "", cmd[256] = "";
+    size_t size = 0, len = 0;
+    int bol = TRUE, retval = 0;
+    FILE *p = NULL;
+
+    /* wait for the xtables lock instead of failing */
+    snprintf(cmd, sizeof(cmd), "%s -w -t %s -S 2>/dev/null",
+            ipver == VRMR_IPV4 ? vctx->conf.iptables_location
+                               : vctx->conf.ip6tables_location,
+            ruleset_tables[t].name);
+
+    if ((p = popen(cmd, "r")) == NULL) {
+        vrmr_debug(MEDIUM, "popen() failed: %s", strerror(errno));
+        return (-1);
+    }
+
+    while (fgets(line, (int)sizeof(line), p) != NULL) {
+        size = strlen(line);
+        /* only the start of a line tells the chain */
+        if (bol && (name = ruleset_line_chain(line, size, &len, &rule))) {
+            if (!(chain = ruleset_fp_chain(sys, name, len))) {
+                retval = -1;
+                break;
+            }
+            chain->rules++;
+        }
+        bol = (size > 0 && line[size - 1] == '\n');
+    }
+
+    if (pclose(p) != 0)
+        retval = -1;
+    return (retval);
+}
+
+/*  ruleset_system_changed
+
+    Checks the rule counts of the chains we loaded into table 't' against
+    the system, so that a table that was flushed or changed outside of
+    vuurmuur (e.g. 'iptables -t nat -F') is loaded as a whole again.
+
+    Returns TRUE if the system doesn't have the rules of 'prev', or if we
+    couldn't tell.
+*/
+static int ruleset_system_changed(struct vrmr_ctx *vctx, int ipver,
+        enum ruleset_table t, const struct ruleset_table_fp *prev)
+{
+    struct ruleset_table_fp sys;
+    const struct ruleset_chain_fp *chain = NULL;
+    int changed = FALSE;
+
+    memset(&sys, 0, sizeof(sys));
+
+    if (ruleset_system_rules(vctx, ipver, t, &sys) < 0) {
+        changed = TRUE;
+    } else {
+        for (unsigned int i = 0; i < prev->chains_n; i++) {
+            chain = ruleset_fp_find(&sys, prev->chains[i].name);
+            if ((chain ? chain->rules : 0) != prev->chains[i].rules) {
+                vrmr_info("Info",
+                        "ipv%d %s chain %s was changed outside of vuurmuur.",
+                        ipver, ruleset_tables[t].name, prev->chains[i].name);
+                changed = TRUE;
+                break;
+            }
+        }
+    }
+
+    free(sys.chains);
+    return (changed);
+}
+
+/*  ruleset_system_check
+
+    Sets 'system_changed' for the tables of 'fp' that only need their
+    changed chains written, see ruleset_system_changed(). Done for all
+    tables before the first one is written, so the listing doesn't have
+    to wait for iptables-restore to commit the tables before it.
+*/
+static void ruleset_system_check(
+        struct vrmr_ctx *vctx, int ipver, struct ruleset_fp *fp)
+{
+    int idx = (ipver == VRMR_IPV4) ? 0 : 1;
+
+    if (!ruleset_applied_valid[idx])
+        return;
+
+    for (int t = 0; t < RULESET_TABLES; t++) {
+        const struct ruleset_table_fp *prev = &ruleset_applied[idx].tables[t];
+        struct ruleset_table_fp *table = &fp->tables[t];
+
+        if (table->loaded && prev->loaded)
+            table->system_changed =
+                    (char)ruleset_system_changed(vctx, ipver, t, prev);
+    }
+}
+
+/*  ruleset_fill_changes
+
+    Writes only the chains of 'table' that changed since the last load:
+    the changed chains are flushed and refilled in one transaction with
+    iptables-restore --noflush, so the other chains keep their counters.
+
+    Falls back to writing the whole table if it isn't loaded yet, if the
+    chains vuurmuur creates in it changed, if one of them is missing from
+    the system or if the rules in the system are not the ones we loaded.
+
+    Returncodes:
+         1: table handled, only changed chains written (if any)
+         0: the whole table needs to be written
+        -1: error
+*/
+static int ruleset_fill_changes(struct vrmr_ctx *vctx,
+        struct rule_set *ruleset, struct ruleset_out *out, int ipver,
+        enum ruleset_table t, struct ruleset_fp *fp)
+{
+    const struct ruleset_table_def *def = &ruleset_tables[t];
+    const struct ruleset_table_fp *prev = NULL;
+    struct ruleset_table_fp *table = &fp->tables[t];
+    struct vrmr_list *system_chains = ruleset_system_chains(vctx, t);
+    struct ruleset_chain_fp *chain = NULL, *p = NULL;
+    const char *line = NULL, *name = NULL, *rule = NULL;
+    unsigned int i = 0, changed = 0;
+    size_t offset = 0, size = 0, len = 0;
+    char cmd[512] = "";
+
+    if (!table->loaded || !ruleset_applied_valid[ipver == VRMR_IPV4 ? 0 : 1])
+        return (0);
+    prev = &ruleset_applied[ipver == VRMR_IPV4 ? 0 : 1].tables[t];
+    if (!prev->loaded || prev->unknown || table->unknown ||
+            prev->structure != table->structure)
+        return (0);
+    if (table->system_changed)
+        return (0);
+
+    /* chains that lost all their rules still have to be flushed */
+    for (i = 0; i < prev->chains_n; i++) {
+        if (ruleset_fp_find(table, prev->chains[i].name) == NULL &&
+                ruleset_fp_chain(table, prev->chains[i].name,
+                        strlen(prev->chains[i].name)) == NULL)
+            return (-1);
+    }
+
+    for (i = 0; i < table->chains_n; i++) {
+        chain = &table->chains[i];
+
+        /* someone else may have removed our chains */
+        if (!ruleset_is_builtin(t, chain->name) &&
+                (system_chains == NULL ||
+                        !vrmr_rules_chain_in_list(system_chains, chain->name)))
+            return (0);
+
+        p = ruleset_fp_find(prev, chain->name);
+        if (p == NULL || p->hash != chain->hash || p->rules != chain->rules) {
+            chain->changed = TRUE;
+            changed++;
+        }
+    }
+
+    table->partial = TRUE;
+    fp->partial = TRUE;
+    if (changed == 0)
+        return (1);
+
+    snprintf(cmd, sizeof(cmd), "*%s\n", def->name);
+    ruleset_writeprint(out, cmd);
+    for (const struct ruleset_builtin *b = def->builtins; b->chain; b++) {
+        if (ruleset_fp_find(table, b->chain)->changed) {
+            snprintf(cmd, sizeof(cmd), ":%s %s [0:0]\n", b->chain,
+                    *((char *)ruleset + b->policy) ? "DROP" : "ACCEPT");
+            ruleset_writeprint(out, cmd);
+        }
+    }
+    for (i = 0; i < table->chains_n; i++) {
+        if (table->chains[i].changed) {
+            snprintf(cmd, sizeof(cmd), "--flush %s\n", table->chains[i].name);
+            ruleset_writeprint(out, cmd);
+        }
+    }
+
+    /* the rules of the changed chains, in their original order */
+    for (int pass = 0; pass < 2; pass++) {
+        const size_t *lists = pass == 0 ? def->lists : def->ipv4_lists;
+        if (pass == 1 && ipver != VRMR_IPV4)
+            break;
+
+        for (; *lists != 0; lists++) {
+            const struct rule_lines *lines =
+                    (const struct rule_lines *)((char *)ruleset + *lists);
+
+            for (offset = 0;
+                    (line = ruleset_lines_next(lines, &offset, &size));) {
+                name = ruleset_line_chain(line, size, &len, &rule);
+                if (chain == NULL || strncmp(chain->name, name, len) != 0 ||
+                        chain->name[len] != '\0') {
+                    chain = ruleset_fp_chain(table, name, len);
+                    if (chain == NULL)
+                        return (-1);
+                }
+                /* with its newline */
+                if (chain->changed)
+                    ruleset_out_writebuf(out, line, size + 1);
+            }
+        }
+    }
+
+    ruleset_writecommit(out);
+    fp->written++;
+    return (1);
+}
+
+/*  ruleset_fp_log
 
-    Returncodes:
-         0: ok
-        -1: error
+    Tells how much of the ruleset is loaded if only the changed chains are.
 */
-int ruleset_add_rule_to_set(struct vrmr_list *list, char *chain, char *rule,
-        uint64_t packets, uint64_t bytes)
+static void ruleset_fp_log(const struct ruleset_fp *fp, int ipver)
 {
-    size_t size = 0, numbers_size = 0;
-    char *line = NULL, numbers[32] = "";
-    int result = 0;
-
-    assert(list && chain && rule);
-
-    /* HACK: check for accounting special cases */
-    result = ruleset_check_accounting(chain);
-    if (result == -1)
-        return (-1);
-    else if (result == 0)
-        return (0);
-
-    /* create the counters */
-    if (packets > 0 || bytes > 0) {
-        snprintf(numbers, sizeof(numbers), "[%" PRIu64 ":%" PRIu64 "] ",
-                packets, bytes);
-        numbers_size = strlen(numbers);
-    }
-
-    /* size of the numbers string, chain, space, rule */
-    size = numbers_size + strlen(chain) + 1 + strlen(rule) + 1;
-    if (size == 0) {
-        vrmr_error(-1, "Internal Error", "cannot append an empty string");
-        return (-1);
-    }
+    unsigned int chains = 0, changed = 0;
 
-    /* alloc the size for line */
-    if (!(line = malloc(size))) {
-        vrmr_error(-1, "Error", "malloc failed: %s", strerror(errno));
-        return (-1);
-    }
+    if (!fp->partial)
+        return;
 
-    /* create the string */
-    result = snprintf(line, size, "%s%s %s", numbers, chain, rule);
-    if (result >= (int)size) {
-        vrmr_error(-1, "Error", "ruleset string overflow (%d >= %d, %s)",
-                result, (int)size, rule);
-        free(line);
-        return (-1);
-    }
+    for (int t = 0; t < RULESET_TABLES; t++) {
+        const struct ruleset_table_fp *table = &fp->tables[t];
 
-    /* append to the list */
-    if (vrmr_list_append(list, line) == NULL) {
-        vrmr_error(-1, "Internal Error", "appending rule to list failed");
-        free(line);
-        return (-1);
+        for (unsigned int i = 0; i < table->chains_n; i++) {
+            chains++;
+            if (!table->partial || table->chains[i].changed)
+                changed++;
+        }
     }
 
-    return (0);
+    vrmr_info("Info", "ipv%d ruleset: %u of %u chains changed.", ipver,
+            changed, chains);
 }
 
-/*  ruleset_writeprint
+/*  ruleset_fp_applied
 
-    wrapper around the write call
+    Remembers 'fp' as the fingerprint of the loaded ruleset, or forgets the
+    loaded ruleset if 'fp' is NULL, so the next load writes all tables.
 */
-static int ruleset_writeprint(const int fd, const char *line)
+static void ruleset_fp_applied(int ipver, struct ruleset_fp *fp)
 {
-    return ((int)write(fd, line, strlen(line)));
-}
-
-/* Create the shaping script file */
-static int ruleset_fill_shaping_file(struct rule_set *ruleset, int fd)
-{
-    struct vrmr_list_node *d_node = NULL;
-    char *ptr = NULL;
-    char cmd[VRMR_MAX_PIPE_COMMAND] = "";
+    int idx = (ipver == VRMR_IPV4) ? 0 : 1;
 
-    ruleset_writeprint(fd, "#!/bin/bash\n");
+    ruleset_fp_cleanup(&ruleset_applied[idx]);
+    ruleset_applied_valid[idx] = FALSE;
 
-    for (d_node = ruleset->tc_rules.top; d_node; d_node = d_node->next) {
-        ptr = d_node->data;
-
-        snprintf(cmd, sizeof(cmd), "%s\n", ptr);
-        ruleset_writeprint(fd, cmd);
+    if (fp != NULL) {
+        ruleset_applied[idx] = *fp;
+        ruleset_applied_valid[idx] = TRUE;
+        memset(fp, 0, sizeof(*fp));
     }
+}
 
-    ruleset_writeprint(fd, "# EOF\n");
+/*  ruleset_forget_applied
 
-    return (0);
+    Forgets the loaded rulesets, so the next load_ruleset() writes all
+    tables again. Used on SIGHUP to repair whatever was changed outside
+    of vuurmuur.
+*/
+void ruleset_forget_applied(void)
+{
+    ruleset_fp_applied(VRMR_IPV4, NULL);
+    ruleset_fp_applied(VRMR_IPV6, NULL);
 }
 
 /** \internal
  *
  *  \brief Creates the ruleset file to be loaded by iptables-restore
  *
+ *  Tables that were loaded before only get the chains that changed, see
+ *  ruleset_fill_changes(). The fingerprint of the ruleset is stored in
+ *  'fp'.
+ *
  *  \retval 0 ok
  *  \retval -1 error
  */
 static int ruleset_fill_file(struct vrmr_ctx *vctx, struct rule_set *ruleset,
-        int ruleset_fd, int ipver)
+        struct ruleset_out *out, int ipver, struct ruleset_fp *fp)
 {
     struct vrmr_list_node *d_node = NULL;
-    char *rule = NULL, *cname = NULL;
+    char *cname = NULL;
     char cmd[512] = "";
+    int result = 0;
 
-    assert(ruleset && (ipver == VRMR_IPV4 || ipver == VRMR_IPV6));
+    assert(ruleset && fp && (ipver == VRMR_IPV4 || ipver == VRMR_IPV6));
 
     /* get the current chains */
     (void)vrmr_rules_get_system_chains(&vctx->rules, &vctx->conf, ipver);
 
+    if (ruleset_fingerprint(vctx, ruleset, ipver, fp) < 0) {
+        vrmr_error(-1, "Error", "creating the ruleset fingerprint failed");
+        return (-1);
+    }
+    ruleset_system_check(vctx, ipver, fp);
+
     snprintf(cmd, sizeof(cmd),
             "# Generated by Vuurmuur %s (c) 2002-2019 Victor Julien\n",
             version_string);
-    ruleset_writeprint(ruleset_fd, cmd);
+    ruleset_writeprint(out, cmd);
     snprintf(cmd, sizeof(cmd), "# DO NOT EDIT: file will be overwritten.\n");
-    ruleset_writeprint(ruleset_fd, cmd);
+    ruleset_writeprint(out, cmd);
 
-    if (vctx->conf.vrmr_check_iptcaps == FALSE ||
-            (ipver == VRMR_IPV4 && vctx->iptcaps.table_raw == TRUE)
-#ifdef IPV6_ENABLED
-            || (ipver == VRMR_IPV6 && vctx->iptcaps.table_ip6_raw == TRUE)
-#endif
-    ) {
+    result = ruleset_fill_changes(
+            vctx, ruleset, out, ipver, RULESET_TABLE_RAW, fp);
+    if (result < 0)
+        return (-1);
+    if (result == 0 && fp->tables[RULESET_TABLE_RAW].loaded) {
+        fp->written++;
         /* first process the mangle table */
         snprintf(cmd, sizeof(cmd), "*raw\n");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
         snprintf(cmd, sizeof(cmd), ":PREROUTING %s [0:0]\n",
                 ruleset->raw_preroute_policy ? "DROP" : "ACCEPT");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
         snprintf(cmd, sizeof(cmd), ":OUTPUT %s [0:0]\n",
                 ruleset->raw_output_policy ? "DROP" : "ACCEPT");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
 
         /* PREROUTING */
-        for (d_node = ruleset->raw_preroute.top; d_node;
-                d_node = d_node->next) {
-            if (!(rule = d_node->data)) {
-                vrmr_error(-1, "Internal Error", "NULL pointer");
-                return (-1);
-            }
-
-            snprintf(cmd, sizeof(cmd), "%s\n", rule);
-            ruleset_writeprint(ruleset_fd, cmd);
-        }
+        ruleset_writelines(out, &ruleset->raw_preroute);
         /* OUTPUT */
-        for (d_node = ruleset->raw_output.top; d_node; d_node = d_node->next) {
-            if (!(rule = d_node->data)) {
-                vrmr_error(-1, "Internal Error", "NULL pointer");
-                return (-1);
-            }
-
-            snprintf(cmd, sizeof(cmd), "%s\n", rule);
-            ruleset_writeprint(ruleset_fd, cmd);
-        }
+        ruleset_writelines(out, &ruleset->raw_output);
 
-        snprintf(cmd, sizeof(cmd), "COMMIT\n");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writecommit(out);
     }
 
-    if (vctx->conf.vrmr_check_iptcaps == FALSE ||
-            vctx->iptcaps.table_mangle == TRUE) {
+    result = ruleset_fill_changes(
+            vctx, ruleset, out, ipver, RULESET_TABLE_MANGLE, fp);
+    if (result < 0)
+        return (-1);
+    if (result == 0 && fp->tables[RULESET_TABLE_MANGLE].loaded) {
+        fp->written++;
         /* first process the mangle table */
         snprintf(cmd, sizeof(cmd), "*mangle\n");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
         snprintf(cmd, sizeof(cmd), ":PREROUTING %s [0:0]\n",
                 ruleset->mangle_preroute_policy ? "DROP" : "ACCEPT");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
         snprintf(cmd, sizeof(cmd), ":INPUT %s [0:0]\n",
                 ruleset->mangle_input_policy ? "DROP" : "ACCEPT");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
         snprintf(cmd, sizeof(cmd), ":FORWARD %s [0:0]\n",
                 ruleset->mangle_forward_policy ? "DROP" : "ACCEPT");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
         snprintf(cmd, sizeof(cmd), ":OUTPUT %s [0:0]\n",
                 ruleset->mangle_output_policy ? "DROP" : "ACCEPT");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
         snprintf(cmd, sizeof(cmd), ":POSTROUTING %s [0:0]\n",
                 ruleset->mangle_postroute_policy ? "DROP" : "ACCEPT");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
 
         /*
             BEGIN -- PRE-VUURMUUR-CHAINS feature - by(as).
@@ -443,188 +1366,119 @@ static int ruleset_fill_file(struct vrmr_ctx *vctx, struct rule_set *ruleset,
         if (!vrmr_rules_chain_in_list(
                     &vctx->rules.system_chain_mangle, "PRE-VRMR-PREROUTING")) {
             snprintf(cmd, sizeof(cmd), "--new PRE-VRMR-PREROUTING\n");
-            ruleset_writeprint(ruleset_fd, cmd);
+            ruleset_writeprint(out, cmd);
         }
         if (!vrmr_rules_chain_in_list(
                     &vctx->rules.system_chain_mangle, "PRE-VRMR-INPUT")) {
             snprintf(cmd, sizeof(cmd), "--new PRE-VRMR-INPUT\n");
-            ruleset_writeprint(ruleset_fd, cmd);
+            ruleset_writeprint(out, cmd);
         }
         if (!vrmr_rules_chain_in_list(
                     &vctx->rules.system_chain_mangle, "PRE-VRMR-FORWARD")) {
             snprintf(cmd, sizeof(cmd), "--new PRE-VRMR-FORWARD\n");
-            ruleset_writeprint(ruleset_fd, cmd);
+            ruleset_writeprint(out, cmd);
         }
         if (!vrmr_rules_chain_in_list(
                     &vctx->rules.system_chain_mangle, "PRE-VRMR-POSTROUTING")) {
             snprintf(cmd, sizeof(cmd), "--new PRE-VRMR-POSTROUTING\n");
-            ruleset_writeprint(ruleset_fd, cmd);
+            ruleset_writeprint(out, cmd);
         }
         if (!vrmr_rules_chain_in_list(
                     &vctx->rules.system_chain_mangle, "PRE-VRMR-OUTPUT")) {
             snprintf(cmd, sizeof(cmd), "--new PRE-VRMR-OUTPUT\n");
-            ruleset_writeprint(ruleset_fd, cmd);
+            ruleset_writeprint(out, cmd);
         }
 
         /* END -- PRE-VUURMUUR-CHAINS feature - by(as). */
 
         snprintf(cmd, sizeof(cmd), "--flush PREROUTING\n");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
         snprintf(cmd, sizeof(cmd), "--flush INPUT\n");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
         snprintf(cmd, sizeof(cmd), "--flush FORWARD\n");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
         snprintf(cmd, sizeof(cmd), "--flush OUTPUT\n");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
         snprintf(cmd, sizeof(cmd), "--flush POSTROUTING\n");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
 
         if (ipver == VRMR_IPV4) {
             /* SHAPE IN */
             if (vrmr_rules_chain_in_list(
                         &vctx->rules.system_chain_mangle, "SHAPEIN")) {
                 snprintf(cmd, sizeof(cmd), "--flush SHAPEIN\n");
-                ruleset_writeprint(ruleset_fd, cmd);
+                ruleset_writeprint(out, cmd);
                 snprintf(cmd, sizeof(cmd), "--delete-chain SHAPEIN\n");
-                ruleset_writeprint(ruleset_fd, cmd);
+                ruleset_writeprint(out, cmd);
             }
             snprintf(cmd, sizeof(cmd), "--new SHAPEIN\n");
-            ruleset_writeprint(ruleset_fd, cmd);
+            ruleset_writeprint(out, cmd);
 
             /* SHAPE OUT */
             if (vrmr_rules_chain_in_list(
                         &vctx->rules.system_chain_mangle, "SHAPEOUT")) {
                 snprintf(cmd, sizeof(cmd), "--flush SHAPEOUT\n");
-                ruleset_writeprint(ruleset_fd, cmd);
+                ruleset_writeprint(out, cmd);
                 snprintf(cmd, sizeof(cmd), "--delete-chain SHAPEOUT\n");
-                ruleset_writeprint(ruleset_fd, cmd);
+                ruleset_writeprint(out, cmd);
             }
             snprintf(cmd, sizeof(cmd), "--new SHAPEOUT\n");
-            ruleset_writeprint(ruleset_fd, cmd);
+            ruleset_writeprint(out, cmd);
 
             /* SHAPE FW */
             if (vrmr_rules_chain_in_list(
                         &vctx->rules.system_chain_mangle, "SHAPEFW")) {
                 snprintf(cmd, sizeof(cmd), "--flush SHAPEFW\n");
-                ruleset_writeprint(ruleset_fd, cmd);
+                ruleset_writeprint(out, cmd);
                 snprintf(cmd, sizeof(cmd), "--delete-chain SHAPEFW\n");
-                ruleset_writeprint(ruleset_fd, cmd);
+                ruleset_writeprint(out, cmd);
             }
             snprintf(cmd, sizeof(cmd), "--new SHAPEFW\n");
-            ruleset_writeprint(ruleset_fd, cmd);
+            ruleset_writeprint(out, cmd);
         }
 
         /* prerouting */
-        for (d_node = ruleset->mangle_preroute.top; d_node;
-                d_node = d_node->next) {
-            if (!(rule = d_node->data)) {
-                vrmr_error(-1, "Internal Error", "NULL pointer");
-                return (-1);
-            }
-
-            snprintf(cmd, sizeof(cmd), "%s\n", rule);
-            ruleset_writeprint(ruleset_fd, cmd);
-        }
+        ruleset_writelines(out, &ruleset->mangle_preroute);
         /* input */
-        for (d_node = ruleset->mangle_input.top; d_node;
-                d_node = d_node->next) {
-            if (!(rule = d_node->data)) {
-                vrmr_error(-1, "Internal Error", "NULL pointer");
-                return (-1);
-            }
-
-            snprintf(cmd, sizeof(cmd), "%s\n", rule);
-            ruleset_writeprint(ruleset_fd, cmd);
-        }
+        ruleset_writelines(out, &ruleset->mangle_input);
         /* forward */
-        for (d_node = ruleset->mangle_forward.top; d_node;
-                d_node = d_node->next) {
-            if (!(rule = d_node->data)) {
-                vrmr_error(-1, "Internal Error", "NULL pointer");
-                return (-1);
-            }
-
-            snprintf(cmd, sizeof(cmd), "%s\n", rule);
-            ruleset_writeprint(ruleset_fd, cmd);
-        }
+        ruleset_writelines(out, &ruleset->mangle_forward);
         /* output */
-        for (d_node = ruleset->mangle_output.top; d_node;
-                d_node = d_node->next) {
-            if (!(rule = d_node->data)) {
-                vrmr_error(-1, "Internal Error", "NULL pointer");
-                return (-1);
-            }
-
-            snprintf(cmd, sizeof(cmd), "%s\n", rule);
-            ruleset_writeprint(ruleset_fd, cmd);
-        }
+        ruleset_writelines(out, &ruleset->mangle_output);
         /* postrouting */
-        for (d_node = ruleset->mangle_postroute.top; d_node;
-                d_node = d_node->next) {
-            if (!(rule = d_node->data)) {
-                vrmr_error(-1, "Internal Error", "NULL pointer");
-                return (-1);
-            }
-
-            snprintf(cmd, sizeof(cmd), "%s\n", rule);
-            ruleset_writeprint(ruleset_fd, cmd);
-        }
+        ruleset_writelines(out, &ruleset->mangle_postroute);
 
         if (ipver == VRMR_IPV4) {
             /* shape in */
-            for (d_node = ruleset->mangle_shape_in.top; d_node;
-                    d_node = d_node->next) {
-                if (!(rule = d_node->data)) {
-                    vrmr_error(-1, "Internal Error", "NULL pointer");
-                    return (-1);
-                }
-
-                snprintf(cmd, sizeof(cmd), "%s\n", rule);
-                ruleset_writeprint(ruleset_fd, cmd);
-            }
+            ruleset_writelines(out, &ruleset->mangle_shape_in);
 
             /* shape out */
-            for (d_node = ruleset->mangle_shape_out.top; d_node;
-                    d_node = d_node->next) {
-                if (!(rule = d_node->data)) {
-                    vrmr_error(-1, "Internal Error", "NULL pointer");
-                    return (-1);
-                }
-
-                snprintf(cmd, sizeof(cmd), "%s\n", rule);
-                ruleset_writeprint(ruleset_fd, cmd);
-            }
+            ruleset_writelines(out, &ruleset->mangle_shape_out);
 
             /* shape fw */
-            for (d_node = ruleset->mangle_shape_fw.top; d_node;
-                    d_node = d_node->next) {
-                if (!(rule = d_node->data)) {
-                    vrmr_error(-1, "Internal Error", "NULL pointer");
-                    return (-1);
-                }
-
-                snprintf(cmd, sizeof(cmd), "%s\n", rule);
-                ruleset_writeprint(ruleset_fd, cmd);
-            }
+            ruleset_writelines(out, &ruleset->mangle_shape_fw);
         }
-        snprintf(cmd, sizeof(cmd), "COMMIT\n");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writecommit(out);
     }
 
-    if (ipver == VRMR_IPV4 && (vctx->conf.vrmr_check_iptcaps == FALSE ||
-                                      vctx->iptcaps.table_nat == TRUE)) {
+    result = ruleset_fill_changes(
+            vctx, ruleset, out, ipver, RULESET_TABLE_NAT, fp);
+    if (result < 0)
+        return (-1);
+    if (result == 0 && fp->tables[RULESET_TABLE_NAT].loaded) {
+        fp->written++;
         /* nat table */
         snprintf(cmd, sizeof(cmd), "*nat\n");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
         snprintf(cmd, sizeof(cmd), ":PREROUTING %s [0:0]\n",
                 ruleset->nat_preroute_policy ? "DROP" : "ACCEPT");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
         snprintf(cmd, sizeof(cmd), ":OUTPUT %s [0:0]\n",
                 ruleset->nat_output_policy ? "DROP" : "ACCEPT");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
         snprintf(cmd, sizeof(cmd), ":POSTROUTING %s [0:0]\n",
                 ruleset->nat_postroute_policy ? "DROP" : "ACCEPT");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
 
         /*
             BEGIN -- PRE-VUURMUUR-CHAINS feature - by(as).
@@ -640,86 +1494,63 @@ static int ruleset_fill_file(struct vrmr_ctx *vctx, struct rule_set *ruleset,
         if (!vrmr_rules_chain_in_list(
                     &vctx->rules.system_chain_nat, "PRE-VRMR-PREROUTING")) {
             snprintf(cmd, sizeof(cmd), "--new PRE-VRMR-PREROUTING\n");
-            ruleset_writeprint(ruleset_fd, cmd);
+            ruleset_writeprint(out, cmd);
         }
         if (!vrmr_rules_chain_in_list(
                     &vctx->rules.system_chain_nat, "PRE-VRMR-POSTROUTING")) {
             snprintf(cmd, sizeof(cmd), "--new PRE-VRMR-POSTROUTING\n");
-            ruleset_writeprint(ruleset_fd, cmd);
+            ruleset_writeprint(out, cmd);
         }
         if (!vrmr_rules_chain_in_list(
                     &vctx->rules.system_chain_nat, "PRE-VRMR-OUTPUT")) {
             snprintf(cmd, sizeof(cmd), "--new PRE-VRMR-OUTPUT\n");
-            ruleset_writeprint(ruleset_fd, cmd);
+            ruleset_writeprint(out, cmd);
         }
 
         /* END -- PRE-VUURMUUR-CHAINS feature - by(as). */
 
         snprintf(cmd, sizeof(cmd), "--flush PREROUTING\n");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
         snprintf(cmd, sizeof(cmd), "--flush OUTPUT\n");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
         snprintf(cmd, sizeof(cmd), "--flush POSTROUTING\n");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
 
         /* prerouting */
-        for (d_node = ruleset->nat_preroute.top; d_node;
-                d_node = d_node->next) {
-            if (!(rule = d_node->data)) {
-                vrmr_error(-1, "Internal Error", "NULL pointer");
-                return (-1);
-            }
-
-            snprintf(cmd, sizeof(cmd), "%s\n", rule);
-            ruleset_writeprint(ruleset_fd, cmd);
-        }
+        ruleset_writelines(out, &ruleset->nat_preroute);
         /* output */
-        for (d_node = ruleset->nat_output.top; d_node; d_node = d_node->next) {
-            if (!(rule = d_node->data)) {
-                vrmr_error(-1, "Internal Error", "NULL pointer");
-                return (-1);
-            }
-
-            snprintf(cmd, sizeof(cmd), "%s\n", rule);
-            ruleset_writeprint(ruleset_fd, cmd);
-        }
+        ruleset_writelines(out, &ruleset->nat_output);
         /* postrouting */
-        for (d_node = ruleset->nat_postroute.top; d_node;
-                d_node = d_node->next) {
-            if (!(rule = d_node->data)) {
-                vrmr_error(-1, "Internal Error", "NULL pointer");
-                return (-1);
-            }
-
-            snprintf(cmd, sizeof(cmd), "%s\n", rule);
-            ruleset_writeprint(ruleset_fd, cmd);
-        }
+        ruleset_writelines(out, &ruleset->nat_postroute);
 
-        snprintf(cmd, sizeof(cmd), "COMMIT\n");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writecommit(out);
     }
 
-    if (vctx->conf.vrmr_check_iptcaps == FALSE ||
-            vctx->iptcaps.table_filter == TRUE) {
+    result = ruleset_fill_changes(
+            vctx, ruleset, out, ipver, RULESET_TABLE_FILTER, fp);
+    if (result < 0)
+        return (-1);
+    if (result == 0 && fp->tables[RULESET_TABLE_FILTER].loaded) {
+        fp->written++;
         /* finally the filter table */
         snprintf(cmd, sizeof(cmd), "*filter\n");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
         snprintf(cmd, sizeof(cmd), ":INPUT %s [0:0]\n",
                 ruleset->filter_input_policy ? "DROP" : "ACCEPT");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
         snprintf(cmd, sizeof(cmd), ":FORWARD %s [0:0]\n",
                 ruleset->filter_forward_policy ? "DROP" : "ACCEPT");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
         snprintf(cmd, sizeof(cmd), ":OUTPUT %s [0:0]\n",
                 ruleset->filter_output_policy ? "DROP" : "ACCEPT");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
 
         snprintf(cmd, sizeof(cmd), "--flush INPUT\n");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
         snprintf(cmd, sizeof(cmd), "--flush FORWARD\n");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
         snprintf(cmd, sizeof(cmd), "--flush OUTPUT\n");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
 
         /*
             Allow to make some specials rules before the Vuurmuur rules kick in.
@@ -733,17 +1564,17 @@ static int ruleset_fill_file(struct vrmr_ctx *vctx, struct rule_set *ruleset,
         if (!vrmr_rules_chain_in_list(
                     &vctx->rules.system_chain_filter, "PRE-VRMR-INPUT")) {
             snprintf(cmd, sizeof(cmd), "--new PRE-VRMR-INPUT\n");
-            ruleset_writeprint(ruleset_fd, cmd);
+            ruleset_writeprint(out, cmd);
         }
         if (!vrmr_rules_chain_in_list(
                     &vctx->rules.system_chain_filter, "PRE-VRMR-FORWARD")) {
             snprintf(cmd, sizeof(cmd), "--new PRE-VRMR-FORWARD\n");
-            ruleset_writeprint(ruleset_fd, cmd);
+            ruleset_writeprint(out, cmd);
         }
         if (!vrmr_rules_chain_in_list(
                     &vctx->rules.system_chain_filter, "PRE-VRMR-OUTPUT")) {
             snprintf(cmd, sizeof(cmd), "--new PRE-VRMR-OUTPUT\n");
-            ruleset_writeprint(ruleset_fd, cmd);
+            ruleset_writeprint(out, cmd);
         }
 
         /* create the custom chains, because some rules will depend on them */
@@ -757,329 +1588,195 @@ static int ruleset_fill_file(struct vrmr_ctx *vctx, struct rule_set *ruleset,
             if (!vrmr_rules_chain_in_list(
                         &vctx->rules.system_chain_filter, cname)) {
                 snprintf(cmd, sizeof(cmd), "--new %s\n", cname);
-                ruleset_writeprint(ruleset_fd, cmd);
+                ruleset_writeprint(out, cmd);
             }
         }
 
         if (vrmr_rules_chain_in_list(
                     &vctx->rules.system_chain_filter, "ANTISPOOF")) {
             snprintf(cmd, sizeof(cmd), "--flush ANTISPOOF\n");
-            ruleset_writeprint(ruleset_fd, cmd);
+            ruleset_writeprint(out, cmd);
             snprintf(cmd, sizeof(cmd), "--delete-chain ANTISPOOF\n");
-            ruleset_writeprint(ruleset_fd, cmd);
+            ruleset_writeprint(out, cmd);
         }
         snprintf(cmd, sizeof(cmd), "--new ANTISPOOF\n");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
 
         if (vrmr_rules_chain_in_list(
                     &vctx->rules.system_chain_filter, "BLOCKLIST")) {
             snprintf(cmd, sizeof(cmd), "--flush BLOCKLIST\n");
-            ruleset_writeprint(ruleset_fd, cmd);
+            ruleset_writeprint(out, cmd);
             snprintf(cmd, sizeof(cmd), "--delete-chain BLOCKLIST\n");
-            ruleset_writeprint(ruleset_fd, cmd);
+            ruleset_writeprint(out, cmd);
         }
         snprintf(cmd, sizeof(cmd), "--new BLOCKLIST\n");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
 
         if (vrmr_rules_chain_in_list(
                     &vctx->rules.system_chain_filter, "BLOCK")) {
             snprintf(cmd, sizeof(cmd), "--flush BLOCK\n");
-            ruleset_writeprint(ruleset_fd, cmd);
+            ruleset_writeprint(out, cmd);
             snprintf(cmd, sizeof(cmd), "--delete-chain BLOCK\n");
-            ruleset_writeprint(ruleset_fd, cmd);
+            ruleset_writeprint(out, cmd);
         }
         snprintf(cmd, sizeof(cmd), "--new BLOCK\n");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
 
         /* do NEWACCEPT and NEWQUEUE before SYNLIMIT and UDPLIMIT */
         if (vrmr_rules_chain_in_list(
                     &vctx->rules.system_chain_filter, "NEWACCEPT")) {
             snprintf(cmd, sizeof(cmd), "--flush NEWACCEPT\n");
-            ruleset_writeprint(ruleset_fd, cmd);
+            ruleset_writeprint(out, cmd);
             snprintf(cmd, sizeof(cmd), "--delete-chain NEWACCEPT\n");
-            ruleset_writeprint(ruleset_fd, cmd);
+            ruleset_writeprint(out, cmd);
         }
         snprintf(cmd, sizeof(cmd), "--new NEWACCEPT\n");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
 
         if (vrmr_rules_chain_in_list(
                     &vctx->rules.system_chain_filter, "NEWQUEUE")) {
             snprintf(cmd, sizeof(cmd), "--flush NEWQUEUE\n");
-            ruleset_writeprint(ruleset_fd, cmd);
+            ruleset_writeprint(out, cmd);
             snprintf(cmd, sizeof(cmd), "--delete-chain NEWQUEUE\n");
-            ruleset_writeprint(ruleset_fd, cmd);
+            ruleset_writeprint(out, cmd);
         }
         snprintf(cmd, sizeof(cmd), "--new NEWQUEUE\n");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
 
         /* Do this before NEWNFQUEUE because it references
          * to it. */
         if (vrmr_rules_chain_in_list(
                     &vctx->rules.system_chain_filter, "ESTRELNFQUEUE")) {
             snprintf(cmd, sizeof(cmd), "--flush ESTRELNFQUEUE\n");
-            ruleset_writeprint(ruleset_fd, cmd);
+            ruleset_writeprint(out, cmd);
             snprintf(cmd, sizeof(cmd), "--delete-chain ESTRELNFQUEUE\n");
-            ruleset_writeprint(ruleset_fd, cmd);
+            ruleset_writeprint(out, cmd);
         }
         snprintf(cmd, sizeof(cmd), "--new ESTRELNFQUEUE\n");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writeprint(out, cmd);
 
         if (vrmr_rules_chain_in_list(
                     &vctx->rules.system_chain_filter, "NEWNFQUEUE")) {
             snprintf(cmd, sizeof(cmd), "--flush NEWNFQUEUE\n");
-            ruleset_writeprint(ruleset_fd, cmd);
+            ruleset_writeprint(out, cmd);
             snprintf(cmd, sizeof(cmd), "--delete-chain NEWNFQUEUE\n");
-            ruleset_writeprint(ruleset_fd, cmd);
+            ruleset_writeprint(out, cmd);
         }
         snprintf(cmd, sizeof(cmd), "--new NEWNFQUEUE\n");
-        ruleset_writeprint(ruleset_fd, cmd);
-
-        /* Do this before NEWNFLOG because it references
-         * to it. */
-        if (vrmr_rules_chain_in_list(
-                    &vctx->rules.system_chain_filter, "ESTRELNFLOG")) {
-            snprintf(cmd, sizeof(cmd), "--flush ESTRELNFLOG\n");
-            ruleset_writeprint(ruleset_fd, cmd);
-            snprintf(cmd, sizeof(cmd), "--delete-chain ESTRELNFLOG\n");
-            ruleset_writeprint(ruleset_fd, cmd);
-        }
-        snprintf(cmd, sizeof(cmd), "--new ESTRELNFLOG\n");
-        ruleset_writeprint(ruleset_fd, cmd);
-
-        if (vrmr_rules_chain_in_list(
-                    &vctx->rules.system_chain_filter, "NEWNFLOG")) {
-            snprintf(cmd, sizeof(cmd), "--flush NEWNFLOG\n");
-            ruleset_writeprint(ruleset_fd, cmd);
-            snprintf(cmd, sizeof(cmd), "--delete-chain NEWNFLOG\n");
-            ruleset_writeprint(ruleset_fd, cmd);
-        }
-        snprintf(cmd, sizeof(cmd), "--new NEWNFLOG\n");
-        ruleset_writeprint(ruleset_fd, cmd);
-
-        if (vrmr_rules_chain_in_list(
-                    &vctx->rules.system_chain_filter, "SYNLIMIT")) {
-            snprintf(cmd, sizeof(cmd), "--flush SYNLIMIT\n");
-            ruleset_writeprint(ruleset_fd, cmd);
-            snprintf(cmd, sizeof(cmd), "--delete-chain SYNLIMIT\n");
-            ruleset_writeprint(ruleset_fd, cmd);
-        }
-        snprintf(cmd, sizeof(cmd), "--new SYNLIMIT\n");
-        ruleset_writeprint(ruleset_fd, cmd);
-
-        if (vrmr_rules_chain_in_list(
-                    &vctx->rules.system_chain_filter, "UDPLIMIT")) {
-            snprintf(cmd, sizeof(cmd), "--flush UDPLIMIT\n");
-            ruleset_writeprint(ruleset_fd, cmd);
-            snprintf(cmd, sizeof(cmd), "--delete-chain UDPLIMIT\n");
-            ruleset_writeprint(ruleset_fd, cmd);
-        }
-        snprintf(cmd, sizeof(cmd), "--new UDPLIMIT\n");
-        ruleset_writeprint(ruleset_fd, cmd);
-
-        if (vrmr_rules_chain_in_list(
-                    &vctx->rules.system_chain_filter, "TCPRESET")) {
-            snprintf(cmd, sizeof(cmd), "--flush TCPRESET\n");
-            ruleset_writeprint(ruleset_fd, cmd);
-            snprintf(cmd, sizeof(cmd), "--delete-chain TCPRESET\n");
-            ruleset_writeprint(ruleset_fd, cmd);
-        }
-        snprintf(cmd, sizeof(cmd), "--new TCPRESET\n");
-        ruleset_writeprint(ruleset_fd, cmd);
-
-        /* finally the accounting chains */
-        for (d_node = accounting_chain_names.top; d_node;
-                d_node = d_node->next) {
-            if (!(cname = d_node->data)) {
-                vrmr_error(-1, "Internal Error", "NULL pointer");
-                return (-1);
-            }
-
-            if (vrmr_rules_chain_in_list(
-                        &vctx->rules.system_chain_filter, cname)) {
-                snprintf(cmd, sizeof(cmd), "--flush %s\n", cname);
-                ruleset_writeprint(ruleset_fd, cmd);
-                snprintf(cmd, sizeof(cmd), "--delete-chain %s\n", cname);
-                ruleset_writeprint(ruleset_fd, cmd);
-            }
-            snprintf(cmd, sizeof(cmd), "--new %s\n", cname);
-            ruleset_writeprint(ruleset_fd, cmd);
-        }
-
-        /* input */
-        for (d_node = ruleset->filter_input.top; d_node;
-                d_node = d_node->next) {
-            if (!(rule = d_node->data)) {
-                vrmr_error(-1, "Internal Error", "NULL pointer");
-                return (-1);
-            }
-
-            snprintf(cmd, sizeof(cmd), "%s\n", rule);
-            ruleset_writeprint(ruleset_fd, cmd);
-        }
-        /* forward */
-        for (d_node = ruleset->filter_forward.top; d_node;
-                d_node = d_node->next) {
-            if (!(rule = d_node->data)) {
-                vrmr_error(-1, "Internal Error", "NULL pointer");
-                return (-1);
-            }
-
-            snprintf(cmd, sizeof(cmd), "%s\n", rule);
-            ruleset_writeprint(ruleset_fd, cmd);
-        }
-        /* output */
-        for (d_node = ruleset->filter_output.top; d_node;
-                d_node = d_node->next) {
-            if (!(rule = d_node->data)) {
-                vrmr_error(-1, "Internal Error", "NULL pointer");
-                return (-1);
-            }
-
-            snprintf(cmd, sizeof(cmd), "%s\n", rule);
-            ruleset_writeprint(ruleset_fd, cmd);
-        }
-
-        /* antispoof */
-        for (d_node = ruleset->filter_antispoof.top; d_node;
-                d_node = d_node->next) {
-            if (!(rule = d_node->data)) {
-                vrmr_error(-1, "Internal Error", "NULL pointer");
-                return (-1);
-            }
-
-            snprintf(cmd, sizeof(cmd), "%s\n", rule);
-            ruleset_writeprint(ruleset_fd, cmd);
-        }
-        /* blocklist */
-        for (d_node = ruleset->filter_blocklist.top; d_node;
-                d_node = d_node->next) {
-            if (!(rule = d_node->data)) {
-                vrmr_error(-1, "Internal Error", "NULL pointer");
-                return (-1);
-            }
-
-            snprintf(cmd, sizeof(cmd), "%s\n", rule);
-            ruleset_writeprint(ruleset_fd, cmd);
-        }
-        /* block */
-        for (d_node = ruleset->filter_blocktarget.top; d_node;
-                d_node = d_node->next) {
-            if (!(rule = d_node->data)) {
-                vrmr_error(-1, "Internal Error", "NULL pointer");
-                return (-1);
-            }
-
-            snprintf(cmd, sizeof(cmd), "%s\n", rule);
-            ruleset_writeprint(ruleset_fd, cmd);
-        }
-        /* synlimit */
-        for (d_node = ruleset->filter_synlimittarget.top; d_node;
-                d_node = d_node->next) {
-            if (!(rule = d_node->data)) {
-                vrmr_error(-1, "Internal Error", "NULL pointer");
-                return (-1);
-            }
-
-            snprintf(cmd, sizeof(cmd), "%s\n", rule);
-            ruleset_writeprint(ruleset_fd, cmd);
-        }
-        /* udplimit */
-        for (d_node = ruleset->filter_udplimittarget.top; d_node;
-                d_node = d_node->next) {
-            if (!(rule = d_node->data)) {
-                vrmr_error(-1, "Internal Error", "NULL pointer");
-                return (-1);
-            }
-
-            snprintf(cmd, sizeof(cmd), "%s\n", rule);
-            ruleset_writeprint(ruleset_fd, cmd);
-        }
-        /* newaccept */
-        for (d_node = ruleset->filter_newaccepttarget.top; d_node;
-                d_node = d_node->next) {
-            if (!(rule = d_node->data)) {
-                vrmr_error(-1, "Internal Error", "NULL pointer");
-                return (-1);
-            }
+        ruleset_writeprint(out, cmd);
 
-            snprintf(cmd, sizeof(cmd), "%s\n", rule);
-            ruleset_writeprint(ruleset_fd, cmd);
+        /* Do this before NEWNFLOG because it references
+         * to it. */
+        if (vrmr_rules_chain_in_list(
+                    &vctx->rules.system_chain_filter, "ESTRELNFLOG")) {
+            snprintf(cmd, sizeof(cmd), "--flush ESTRELNFLOG\n");
+            ruleset_writeprint(out, cmd);
+            snprintf(cmd, sizeof(cmd), "--delete-chain ESTRELNFLOG\n");
+            ruleset_writeprint(out, cmd);
         }
-        /* newnfqueue */
-        for (d_node = ruleset->filter_newnfqueuetarget.top; d_node;
-                d_node = d_node->next) {
-            if (!(rule = d_node->data)) {
-                vrmr_error(-1, "Internal Error", "NULL pointer");
-                return (-1);
-            }
+        snprintf(cmd, sizeof(cmd), "--new ESTRELNFLOG\n");
+        ruleset_writeprint(out, cmd);
 
-            snprintf(cmd, sizeof(cmd), "%s\n", rule);
-            ruleset_writeprint(ruleset_fd, cmd);
+        if (vrmr_rules_chain_in_list(
+                    &vctx->rules.system_chain_filter, "NEWNFLOG")) {
+            snprintf(cmd, sizeof(cmd), "--flush NEWNFLOG\n");
+            ruleset_writeprint(out, cmd);
+            snprintf(cmd, sizeof(cmd), "--delete-chain NEWNFLOG\n");
+            ruleset_writeprint(out, cmd);
         }
-        /* estrelnfqueue */
-        for (d_node = ruleset->filter_estrelnfqueuetarget.top; d_node;
-                d_node = d_node->next) {
-            if (!(rule = d_node->data)) {
-                vrmr_error(-1, "Internal Error", "NULL pointer");
-                return (-1);
-            }
+        snprintf(cmd, sizeof(cmd), "--new NEWNFLOG\n");
+        ruleset_writeprint(out, cmd);
 
-            snprintf(cmd, sizeof(cmd), "%s\n", rule);
-            ruleset_writeprint(ruleset_fd, cmd);
+        if (vrmr_rules_chain_in_list(
+                    &vctx->rules.system_chain_filter, "SYNLIMIT")) {
+            snprintf(cmd, sizeof(cmd), "--flush SYNLIMIT\n");
+            ruleset_writeprint(out, cmd);
+            snprintf(cmd, sizeof(cmd), "--delete-chain SYNLIMIT\n");
+            ruleset_writeprint(out, cmd);
         }
-        /* newnflog */
-        for (d_node = ruleset->filter_newnflogtarget.top; d_node;
-                d_node = d_node->next) {
-            if (!(rule = d_node->data)) {
-                vrmr_error(-1, "Internal Error", "NULL pointer");
-                return (-1);
-            }
+        snprintf(cmd, sizeof(cmd), "--new SYNLIMIT\n");
+        ruleset_writeprint(out, cmd);
 
-            snprintf(cmd, sizeof(cmd), "%s\n", rule);
-            ruleset_writeprint(ruleset_fd, cmd);
+        if (vrmr_rules_chain_in_list(
+                    &vctx->rules.system_chain_filter, "UDPLIMIT")) {
+            snprintf(cmd, sizeof(cmd), "--flush UDPLIMIT\n");
+            ruleset_writeprint(out, cmd);
+            snprintf(cmd, sizeof(cmd), "--delete-chain UDPLIMIT\n");
+            ruleset_writeprint(out, cmd);
         }
-        /* estrelnflog */
-        for (d_node = ruleset->filter_estrelnflogtarget.top; d_node;
-                d_node = d_node->next) {
-            if (!(rule = d_node->data)) {
-                vrmr_error(-1, "Internal Error", "NULL pointer");
-                return (-1);
-            }
+        snprintf(cmd, sizeof(cmd), "--new UDPLIMIT\n");
+        ruleset_writeprint(out, cmd);
 
-            snprintf(cmd, sizeof(cmd), "%s\n", rule);
-            ruleset_writeprint(ruleset_fd, cmd);
+        if (vrmr_rules_chain_in_list(
+                    &vctx->rules.system_chain_filter, "TCPRESET")) {
+            snprintf(cmd, sizeof(cmd), "--flush TCPRESET\n");
+            ruleset_writeprint(out, cmd);
+            snprintf(cmd, sizeof(cmd), "--delete-chain TCPRESET\n");
+            ruleset_writeprint(out, cmd);
         }
+        snprintf(cmd, sizeof(cmd), "--new TCPRESET\n");
+        ruleset_writeprint(out, cmd);
 
-        /* tcpreset */
-        for (d_node = ruleset->filter_tcpresettarget.top; d_node;
+        /* finally the accounting chains */
+        for (d_node = accounting_chain_names.top; d_node;
                 d_node = d_node->next) {
-            if (!(rule = d_node->data)) {
+            if (!(cname = d_node->data)) {
                 vrmr_error(-1, "Internal Error", "NULL pointer");
                 return (-1);
             }
 
-            snprintf(cmd, sizeof(cmd), "%s\n", rule);
-            ruleset_writeprint(ruleset_fd, cmd);
+            if (vrmr_rules_chain_in_list(
+                        &vctx->rules.system_chain_filter, cname)) {
+                snprintf(cmd, sizeof(cmd), "--flush %s\n", cname);
+                ruleset_writeprint(out, cmd);
+                snprintf(cmd, sizeof(cmd), "--delete-chain %s\n", cname);
+                ruleset_writeprint(out, cmd);
+            }
+            snprintf(cmd, sizeof(cmd), "--new %s\n", cname);
+            ruleset_writeprint(out, cmd);
         }
 
-        /* accounting */
-        for (d_node = ruleset->filter_accounting.top; d_node;
-                d_node = d_node->next) {
-            if (!(rule = d_node->data)) {
-                vrmr_error(-1, "Internal Error", "NULL pointer");
-                return (-1);
-            }
+        /* input */
+        ruleset_writelines(out, &ruleset->filter_input);
+        /* forward */
+        ruleset_writelines(out, &ruleset->filter_forward);
+        /* output */
+        ruleset_writelines(out, &ruleset->filter_output);
 
-            snprintf(cmd, sizeof(cmd), "%s\n", rule);
-            ruleset_writeprint(ruleset_fd, cmd);
-        }
+        /* antispoof */
+        ruleset_writelines(out, &ruleset->filter_antispoof);
+        /* blocklist */
+        ruleset_writelines(out, &ruleset->filter_blocklist);
+        /* block */
+        ruleset_writelines(out, &ruleset->filter_blocktarget);
+        /* synlimit */
+        ruleset_writelines(out, &ruleset->filter_synlimittarget);
+        /* udplimit */
+        ruleset_writelines(out, &ruleset->filter_udplimittarget);
+        /* newaccept */
+        ruleset_writelines(out, &ruleset->filter_newaccepttarget);
+        /* newnfqueue */
+        ruleset_writelines(out, &ruleset->filter_newnfqueuetarget);
+        /* estrelnfqueue */
+        ruleset_writelines(out, &ruleset->filter_estrelnfqueuetarget);
+        /* newnflog */
+        ruleset_writelines(out, &ruleset->filter_newnflogtarget);
+        /* estrelnflog */
+        ruleset_writelines(out, &ruleset->filter_estrelnflogtarget);
+
+        /* tcpreset */
+        ruleset_writelines(out, &ruleset->filter_tcpresettarget);
+
+        /* accounting */
+        ruleset_writelines(out, &ruleset->filter_accounting);
 
-        snprintf(cmd, sizeof(cmd), "COMMIT\n");
-        ruleset_writeprint(ruleset_fd, cmd);
+        ruleset_writecommit(out);
     }
 
     snprintf(cmd, sizeof(cmd), "# Completed\n");
-    ruleset_writeprint(ruleset_fd, cmd);
+    ruleset_writeprint(out, cmd);
+
+    ruleset_fp_log(fp, ipver);
 
     /* list of chains in the system */
     vrmr_list_cleanup(&vctx->rules.system_chain_filter);
@@ -1090,62 +1787,6 @@ static int ruleset_fill_file(struct vrmr_ctx *vctx, struct rule_set *ruleset,
     return (0);
 }
 
-/*  ruleset_load_ruleset
-
-    Actually loads the ruleset
-
-    Returncodes:
-        -1: error
-         0: ok
-*/
-static int ruleset_load_ruleset(char *path_to_ruleset, char *path_to_resultfile,
-        struct vrmr_config *cnf, int ipver)
-{
-    char cmd[256] = "";
-
-    assert(path_to_ruleset && cnf);
-
-    /*
-        final checks on the file
-    */
-
-    /* vrmr_stat_ok */
-    if (!(vrmr_stat_ok(cnf, path_to_ruleset, VRMR_STATOK_WANT_FILE,
-                VRMR_STATOK_VERBOSE, VRMR_STATOK_MUST_EXIST))) {
-        vrmr_error(-1, "Error", "serious file problem");
-        return (-1);
-    }
-
-    /*
-        create and execute the command
-    */
-    if (ipver == VRMR_IPV4) {
-        if (snprintf(cmd, sizeof(cmd), "%s  --counters --noflush < %s 2>> %s",
-                    cnf->iptablesrestore_location, path_to_ruleset,
-                    path_to_resultfile) >= (int)sizeof(cmd)) {
-            vrmr_error(-1, "Error", "command string overflow");
-            return (-1);
-        }
-    } else if (ipver == VRMR_IPV6) {
-#ifdef IPV6_ENABLED
-        if (snprintf(cmd, sizeof(cmd), "%s  --counters --noflush < %s 2>> %s",
-                    cnf->ip6tablesrestore_location, path_to_ruleset,
-                    path_to_resultfile) >= (int)sizeof(cmd)) {
-            vrmr_error(-1, "Error", "command string overflow");
-            return (-1);
-        }
-#endif
-    }
-
-    /* all good so far, lets load the ruleset */
-    if (vrmr_pipe_command(cnf, cmd, VRMR_PIPE_VERBOSE) < 0) {
-        vrmr_error(-1, "Error", "loading the ruleset failed");
-        return (-1);
-    }
-
-    return (0);
-}
-
 /*  ruleset_load_shape_ruleset
 
     Actually loads the shape ruleset
@@ -1414,6 +2055,35 @@ static int ruleset_store_failed_set(const char *file)
     return (0);
 }
 
+/*  ruleset_store_failed_ruleset
+
+    Stores the ruleset that failed to load as '<path>.failed'. The ruleset
+    is streamed into iptables-restore, so unless a copy was kept in 'fd' it
+    is written out again for this.
+*/
+static void ruleset_store_failed_ruleset(struct vrmr_ctx *vctx,
+        struct rule_set *ruleset, int ipver, char *path, int fd)
+{
+    struct ruleset_out out;
+    struct ruleset_fp fp;
+
+    if (fd <= 0) {
+        if ((fd = vrmr_create_tempfile(path)) == -1)
+            return;
+
+        memset(&fp, 0, sizeof(fp));
+        if (ruleset_out_setup(&out, fd) == 0) {
+            (void)ruleset_fill_file(vctx, ruleset, &out, ipver, &fp);
+            (void)ruleset_out_close(&out);
+        }
+        ruleset_fp_cleanup(&fp);
+        close(fd);
+    }
+
+    vrmr_error(-1, "Error", "rulesetfile will be stored as '%s.failed'", path);
+    (void)ruleset_store_failed_set(path);
+}
+
 static int ruleset_log_resultfile(char *path)
 {
     char line[256] = "";
@@ -1478,14 +2148,19 @@ static void ruleset_load_helper_modules(struct vrmr_ctx *vctx)
  *
  *  \retval 0 ok
  *  \retval -1 error
+ *  \retval -2 loading only the changed chains failed
  */
 static int load_ruleset_ipv4(struct vrmr_ctx *vctx)
 {
     struct rule_set ruleset;
+    struct ruleset_fp fp;
+    struct ruleset_out out;
     char cur_ruleset_path[] = "/tmp/vuurmuur-XXXXXX";
     char cur_result_path[] = "/tmp/vuurmuur-load-result-XXXXXX";
     char cur_shape_path[] = "/tmp/vuurmuur-shape-XXXXXX";
     int ruleset_fd = 0, result_fd = 0, shape_fd = 0;
+    double start = 0;
+    int result = 0;
 
     /* setup the ruleset */
     if (ruleset_setup(&ruleset) != 0) {
@@ -1494,40 +2169,64 @@ static int load_ruleset_ipv4(struct vrmr_ctx *vctx)
     }
 
     ruleset.ipv = VRMR_IPV4;
+    memset(&fp, 0, sizeof(fp));
+
+    /* create the tempfile */
+    result_fd = vrmr_create_tempfile(cur_result_path);
+    if (result_fd == -1) {
+        vrmr_error(-1, "Error", "creating resultfile failed");
+        ruleset_cleanup(&ruleset);
+        return (-1);
+    }
+
+    /* start iptables-restore first, so it gets ready while we create the
+       ruleset */
+    if (ruleset_restore_start(&vctx->conf, VRMR_IPV4, result_fd, &out) < 0) {
+        vrmr_error(-1, "Error", "starting iptables-restore failed");
+        ruleset_cleanup(&ruleset);
+        load_ruleset_free_fds(ruleset_fd, result_fd, shape_fd);
+        return (-1);
+    }
 
     /* store counters */
     if (ruleset_save_interface_counters(&vctx->conf, &vctx->interfaces) < 0) {
         vrmr_error(-1, "Error", "saving interface counters failed");
+        ruleset_cleanup(&ruleset);
+        (void)ruleset_restore_finish(&out, TRUE);
+        load_ruleset_free_fds(ruleset_fd, result_fd, shape_fd);
         return (-1);
     }
 
     /* create the ruleset */
     if (ruleset_create_ruleset(vctx, &ruleset) < 0) {
         vrmr_error(-1, "Error", "creating ruleset failed");
+        ruleset_cleanup(&ruleset);
+        (void)ruleset_restore_finish(&out, TRUE);
+        load_ruleset_free_fds(ruleset_fd, result_fd, shape_fd);
         return (-1);
     }
+    metrics_ruleset(&ruleset);
 
     /* clear the counters again */
     if (ruleset_clear_interface_counters(&vctx->interfaces) < 0) {
         vrmr_error(-1, "Error", "clearing interface counters failed");
-        return (-1);
-    }
-
-    /* create the tempfile */
-    ruleset_fd = vrmr_create_tempfile(cur_ruleset_path);
-    if (ruleset_fd == -1) {
-        vrmr_error(-1, "Error", "creating rulesetfile failed");
         ruleset_cleanup(&ruleset);
+        (void)ruleset_restore_finish(&out, TRUE);
+        load_ruleset_free_fds(ruleset_fd, result_fd, shape_fd);
         return (-1);
     }
 
-    /* create the tempfile */
-    result_fd = vrmr_create_tempfile(cur_result_path);
-    if (result_fd == -1) {
-        vrmr_error(-1, "Error", "creating resultfile failed");
-        ruleset_cleanup(&ruleset);
-        load_ruleset_free_fds(ruleset_fd, result_fd, shape_fd);
-        return (-1);
+    /* the ruleset only goes into a file when we're asked to keep it */
+    if (cmdline.keep_file == TRUE) {
+        ruleset_fd = vrmr_create_tempfile(cur_ruleset_path);
+        if (ruleset_fd == -1) {
+            vrmr_error(-1, "Error", "creating rulesetfile failed");
+            ruleset_cleanup(&ruleset);
+            (void)ruleset_restore_finish(&out, TRUE);
+            load_ruleset_free_fds(0, result_fd, shape_fd);
+            return (-1);
+        }
+        out.copy_fd = ruleset_fd;
     }
 
     /* create the tempfile */
@@ -1535,41 +2234,32 @@ static int load_ruleset_ipv4(struct vrmr_ctx *vctx)
     if (shape_fd == -1) {
         vrmr_error(-1, "Error", "creating shape script file failed");
         ruleset_cleanup(&ruleset);
-        load_ruleset_free_fds(ruleset_fd, result_fd, shape_fd);
+        (void)ruleset_restore_finish(&out, TRUE);
+        load_ruleset_free_fds(ruleset_fd, result_fd, 0);
         return (-1);
     }
 
     /* get the custom chains we have to create */
     if (vrmr_rules_get_custom_chains(&vctx->rules) < 0) {
         vrmr_error(-1, "Internal Error", "rules_get_chains() failed");
-        load_ruleset_free_fds(ruleset_fd, result_fd, shape_fd);
-        return (-1);
-    }
-    /* now create the currentrulesetfile */
-    if (ruleset_fill_file(vctx, &ruleset, ruleset_fd, VRMR_IPV4) < 0) {
-        vrmr_error(-1, "Error", "filling rulesetfile failed");
         ruleset_cleanup(&ruleset);
+        (void)ruleset_restore_finish(&out, TRUE);
         load_ruleset_free_fds(ruleset_fd, result_fd, shape_fd);
-        (void)ruleset_store_failed_set(cur_ruleset_path);
+        vrmr_list_cleanup(&vctx->rules.custom_chain_list);
         return (-1);
     }
-    /* cleanup */
-    vrmr_list_cleanup(&vctx->rules.custom_chain_list);
 
     /* now create the shape file */
     if (ruleset_fill_shaping_file(&ruleset, shape_fd) < 0) {
         vrmr_error(-1, "Error", "filling rulesetfile failed");
         ruleset_cleanup(&ruleset);
+        (void)ruleset_restore_finish(&out, TRUE);
         load_ruleset_free_fds(ruleset_fd, result_fd, shape_fd);
-        (void)ruleset_store_failed_set(cur_ruleset_path);
+        (void)ruleset_store_failed_set(cur_shape_path);
+        vrmr_list_cleanup(&vctx->rules.custom_chain_list);
         return (-1);
     }
 
-    if (vrmr_debug_level >= HIGH) {
-        vrmr_debug(HIGH, "sleeping so you can look into the tmpfile.");
-        sleep(15);
-    }
-
     ruleset_load_helper_modules(vctx);
 
     /* load the shaping rules */
@@ -1581,33 +2271,49 @@ static int load_ruleset_ipv4(struct vrmr_ctx *vctx)
                 cur_shape_path);
         (void)ruleset_store_failed_set(cur_shape_path);
         (void)ruleset_log_resultfile(cur_result_path);
+        (void)ruleset_restore_finish(&out, TRUE);
         load_ruleset_free_fds(ruleset_fd, result_fd, shape_fd);
         ruleset_cleanup(&ruleset);
+        vrmr_list_cleanup(&vctx->rules.custom_chain_list);
         return (-1);
     }
-    /* now load the iptables ruleset */
-    if (ruleset_load_ruleset(cur_ruleset_path, cur_result_path, &vctx->conf,
-                VRMR_IPV4) != 0) {
+
+    /* now stream the ruleset into iptables-restore and wait for it */
+    start = vrmr_metrics_now();
+    if (ruleset_fill_file(vctx, &ruleset, &out, VRMR_IPV4, &fp) < 0) {
+        vrmr_error(-1, "Error", "filling rulesetfile failed");
+        (void)ruleset_restore_finish(&out, TRUE);
+        result = -1;
+    } else {
+        result = ruleset_restore_finish(&out, FALSE);
+    }
+    if (fp.written > 0)
+        metrics_restore(VRMR_IPV4, vrmr_metrics_now() - start, result);
+
+    if (result != 0) {
         /* oops, something went wrong */
-        vrmr_error(-1, "Error", "rulesetfile will be stored as '%s.failed'",
-                cur_ruleset_path);
-        (void)ruleset_store_failed_set(cur_ruleset_path);
+        int retval = fp.partial ? -2 : -1;
+
+        ruleset_store_failed_ruleset(
+                vctx, &ruleset, VRMR_IPV4, cur_ruleset_path, ruleset_fd);
         (void)ruleset_log_resultfile(cur_result_path);
         load_ruleset_free_fds(ruleset_fd, result_fd, shape_fd);
         ruleset_cleanup(&ruleset);
-        return (-1);
+        ruleset_fp_cleanup(&fp);
+        vrmr_list_cleanup(&vctx->rules.custom_chain_list);
+        /* we don't know what made it into the system */
+        ruleset_fp_applied(VRMR_IPV4, NULL);
+        return (retval);
     }
+    if (fp.written == 0)
+        vrmr_info("Info", "ipv4 ruleset unchanged, nothing to load.");
+    ruleset_fp_applied(VRMR_IPV4, &fp);
+
+    /* cleanup */
+    vrmr_list_cleanup(&vctx->rules.custom_chain_list);
     load_ruleset_free_fds(ruleset_fd, result_fd, shape_fd);
 
     if (cmdline.keep_file == FALSE) {
-        /* remove the rules tempfile */
-        if (unlink(cur_ruleset_path) == -1) {
-            vrmr_error(-1, "Error", "removing tempfile failed: %s",
-                    strerror(errno));
-            ruleset_cleanup(&ruleset);
-            return (-1);
-        }
-
         /* remove the result tempfile */
         if (unlink(cur_result_path) == -1) {
             vrmr_error(-1, "Error", "removing tempfile failed: %s",
@@ -1641,13 +2347,18 @@ static int load_ruleset_ipv4(struct vrmr_ctx *vctx)
  *
  *  \retval 0 ok
  *  \retval -1 error
+ *  \retval -2 loading only the changed chains failed
  */
 static int load_ruleset_ipv6(struct vrmr_ctx *vctx)
 {
     struct rule_set ruleset;
+    struct ruleset_fp fp;
+    struct ruleset_out out;
     char cur_ruleset_path[] = "/tmp/vuurmuur-XXXXXX";
     char cur_result_path[] = "/tmp/vuurmuur-load-result-XXXXXX";
     int ruleset_fd = 0, result_fd = 0;
+    double start = 0;
+    int result = 0;
 
     /* setup the ruleset */
     if (ruleset_setup(&ruleset) != 0) {
@@ -1656,87 +2367,112 @@ static int load_ruleset_ipv6(struct vrmr_ctx *vctx)
     }
 
     ruleset.ipv = VRMR_IPV6;
+    memset(&fp, 0, sizeof(fp));
+
+    /* create the tempfile */
+    result_fd = vrmr_create_tempfile(cur_result_path);
+    if (result_fd == -1) {
+        vrmr_error(-1, "Error", "creating resultfile failed");
+        ruleset_cleanup(&ruleset);
+        return (-1);
+    }
+
+    /* start ip6tables-restore first, so it gets ready while we create the
+       ruleset */
+    if (ruleset_restore_start(&vctx->conf, VRMR_IPV6, result_fd, &out) < 0) {
+        vrmr_error(-1, "Error", "starting ip6tables-restore failed");
+        ruleset_cleanup(&ruleset);
+        load_ruleset_free_fds(ruleset_fd, result_fd, 0);
+        return (-1);
+    }
 
     /* store counters */
     if (ruleset_save_interface_counters(&vctx->conf, &vctx->interfaces) < 0) {
         vrmr_error(-1, "Error", "saving interface counters failed");
+        ruleset_cleanup(&ruleset);
+        (void)ruleset_restore_finish(&out, TRUE);
+        load_ruleset_free_fds(ruleset_fd, result_fd, 0);
         return (-1);
     }
 
     /* create the ruleset */
     if (ruleset_create_ruleset(vctx, &ruleset) < 0) {
         vrmr_error(-1, "Error", "creating ruleset failed");
+        ruleset_cleanup(&ruleset);
+        (void)ruleset_restore_finish(&out, TRUE);
+        load_ruleset_free_fds(ruleset_fd, result_fd, 0);
         return (-1);
     }
+    metrics_ruleset(&ruleset);
 
     /* clear the counters again */
     if (ruleset_clear_interface_counters(&vctx->interfaces) < 0) {
         vrmr_error(-1, "Error", "clearing interface counters failed");
-        return (-1);
-    }
-
-    /* create the tempfile */
-    ruleset_fd = vrmr_create_tempfile(cur_ruleset_path);
-    if (ruleset_fd == -1) {
-        vrmr_error(-1, "Error", "creating rulesetfile failed");
         ruleset_cleanup(&ruleset);
+        (void)ruleset_restore_finish(&out, TRUE);
+        load_ruleset_free_fds(ruleset_fd, result_fd, 0);
         return (-1);
     }
 
-    /* create the tempfile */
-    result_fd = vrmr_create_tempfile(cur_result_path);
-    if (result_fd == -1) {
-        vrmr_error(-1, "Error", "creating resultfile failed");
-        ruleset_cleanup(&ruleset);
-        load_ruleset_free_fds(ruleset_fd, result_fd, 0);
-        return (-1);
+    /* the ruleset only goes into a file when we're asked to keep it */
+    if (cmdline.keep_file == TRUE) {
+        ruleset_fd = vrmr_create_tempfile(cur_ruleset_path);
+        if (ruleset_fd == -1) {
+            vrmr_error(-1, "Error", "creating rulesetfile failed");
+            ruleset_cleanup(&ruleset);
+            (void)ruleset_restore_finish(&out, TRUE);
+            load_ruleset_free_fds(0, result_fd, 0);
+            return (-1);
+        }
+        out.copy_fd = ruleset_fd;
     }
 
     /* get the custom chains we have to create */
     if (vrmr_rules_get_custom_chains(&vctx->rules) < 0) {
         vrmr_error(-1, "Internal Error", "rules_get_chains() failed");
-        load_ruleset_free_fds(ruleset_fd, result_fd, 0);
-        return (-1);
-    }
-    /* now create the currentrulesetfile */
-    if (ruleset_fill_file(vctx, &ruleset, ruleset_fd, VRMR_IPV6) < 0) {
-        vrmr_error(-1, "Error", "filling rulesetfile failed");
         ruleset_cleanup(&ruleset);
+        (void)ruleset_restore_finish(&out, TRUE);
         load_ruleset_free_fds(ruleset_fd, result_fd, 0);
-        (void)ruleset_store_failed_set(cur_ruleset_path);
+        vrmr_list_cleanup(&vctx->rules.custom_chain_list);
         return (-1);
     }
-    /* cleanup */
-    vrmr_list_cleanup(&vctx->rules.custom_chain_list);
 
-    if (vrmr_debug_level >= HIGH) {
-        vrmr_debug(HIGH, "sleeping so you can look into the tmpfile.");
-        sleep(15);
+    /* now stream the ruleset into ip6tables-restore and wait for it */
+    start = vrmr_metrics_now();
+    if (ruleset_fill_file(vctx, &ruleset, &out, VRMR_IPV6, &fp) < 0) {
+        vrmr_error(-1, "Error", "filling rulesetfile failed");
+        (void)ruleset_restore_finish(&out, TRUE);
+        result = -1;
+    } else {
+        result = ruleset_restore_finish(&out, FALSE);
     }
+    if (fp.written > 0)
+        metrics_restore(VRMR_IPV6, vrmr_metrics_now() - start, result);
 
-    /* now load the iptables ruleset */
-    if (ruleset_load_ruleset(cur_ruleset_path, cur_result_path, &vctx->conf,
-                VRMR_IPV6) != 0) {
+    if (result != 0) {
         /* oops, something went wrong */
-        vrmr_error(-1, "Error", "rulesetfile will be stored as '%s.failed'",
-                cur_ruleset_path);
-        (void)ruleset_store_failed_set(cur_ruleset_path);
+        int retval = fp.partial ? -2 : -1;
+
+        ruleset_store_failed_ruleset(
+                vctx, &ruleset, VRMR_IPV6, cur_ruleset_path, ruleset_fd);
         (void)ruleset_log_resultfile(cur_result_path);
         load_ruleset_free_fds(ruleset_fd, result_fd, 0);
         ruleset_cleanup(&ruleset);
-        return (-1);
+        ruleset_fp_cleanup(&fp);
+        vrmr_list_cleanup(&vctx->rules.custom_chain_list);
+        /* we don't know what made it into the system */
+        ruleset_fp_applied(VRMR_IPV6, NULL);
+        return (retval);
     }
+    if (fp.written == 0)
+        vrmr_info("Info", "ipv6 ruleset unchanged, nothing to load.");
+    ruleset_fp_applied(VRMR_IPV6, &fp);
+
+    /* cleanup */
+    vrmr_list_cleanup(&vctx->rules.custom_chain_list);
     load_ruleset_free_fds(ruleset_fd, result_fd, 0);
 
     if (cmdline.keep_file == FALSE) {
-        /* remove the rules tempfile */
-        if (unlink(cur_ruleset_path) == -1) {
-            vrmr_error(-1, "Error", "removing tempfile failed: %s",
-                    strerror(errno));
-            ruleset_cleanup(&ruleset);
-            return (-1);
-        }
-
         /* remove the result tempfile */
         if (unlink(cur_result_path) == -1) {
             vrmr_error(-1, "Error", "removing tempfile failed: %s",
@@ -1754,17 +2490,66 @@ static int load_ruleset_ipv6(struct vrmr_ctx *vctx)
 }
 #endif
 
+/*  ruleset_load_blocklist_sets
+
+    Loads the blocklist into the kernel ipsets when the ipset command is
+    available. Otherwise, or if loading fails, the blocklist is created as
+    a pair of rules per address.
+
+    Once loaded the sets are kept up to date by reload_blocklist, so they
+    are only loaded again after a problem or a change of the ipset command.
+*/
+static void ruleset_load_blocklist_sets(struct vrmr_ctx *vctx)
+{
+    struct vrmr_blocklist *blocklist = &vctx->blocklist;
+
+    if (blocklist->ipset && vctx->conf.ipset_location[0] != '\0')
+        return;
+
+    blocklist->ipset = FALSE;
+    if (vctx->conf.bash_out == TRUE || vctx->conf.ipset_location[0] == '\0')
+        return;
+
+    if (!vrmr_check_ipset_command(&vctx->conf, vctx->conf.ipset_location,
+                VRMR_IPTCHK_QUIET)) {
+        vrmr_warning("Warning",
+                "ipset command '%s' not usable, using a rule per address "
+                "for the blocklist.",
+                vctx->conf.ipset_location);
+        return;
+    }
+
+    if (vrmr_blocklist_ipset_load(&vctx->conf, blocklist) < 0) {
+        vrmr_warning("Warning", "loading the blocklist into ipsets failed, "
+                                "using a rule per address.");
+    }
+}
+
 int load_ruleset(struct vrmr_ctx *vctx)
 {
+    /* the sets have to exist before the rules that match on them are
+       loaded */
+    ruleset_load_blocklist_sets(vctx);
+
     int r = load_ruleset_ipv4(vctx);
-    if (r == -1) {
+    if (r == -2) {
+        vrmr_warning("Warning", "loading the changed chains failed, "
+                                "loading the full ipv4 ruleset.");
+        r = load_ruleset_ipv4(vctx);
+    }
+    if (r < 0) {
         return (-1);
     }
 
 #ifdef IPV6_ENABLED
     vrmr_info("Info", "loading ipv6 ruleset");
     r = load_ruleset_ipv6(vctx);
-    if (r == -1) {
+    if (r == -2) {
+        vrmr_warning("Warning", "loading the changed chains failed, "
+                                "loading the full ipv6 ruleset.");
+        r = load_ruleset_ipv6(vctx);
+    }
+    if (r < 0) {
         return (-1);
     }
 #endif
@@ -118,6 +118,7 @@ int main(int argc, char *argv[])
             libvuurmuur_get_version());
 
     vrmr_init(&vctx, "vuurmuur");
+    metrics_init();
 
     /* registering signals we use */
     setup_signal_handler(SIGINT, handle_sigint);
@@ -580,6 +581,8 @@ int main(int argc, char *argv[])
                 exit(EXIT_FAILURE);
             }
 
+            metrics_setup(&vctx.conf);
+
             vrmr_info("Info", "Entering the loop... (interval %d seconds)",
                     LOOP_INT);
 
@@ -634,11 +637,17 @@ int main(int argc, char *argv[])
                 */
                 if (sighup_count > 0 || reload_shm == TRUE ||
                         reload_dyn == TRUE) {
+                    /* a SIGHUP reloads the whole ruleset */
+                    if (sighup_count > 0)
+                        ruleset_forget_applied();
+
                     /* apply changes */
                     result = apply_changes(&vctx, &vctx.reg);
                     if (result < 0) {
                         vrmr_error(-1, "Error", "applying changes failed.");
                     }
+                    /* the metrics may have been switched on or off */
+                    metrics_setup(&vctx.conf);
 
                     /* if we are reloading because of an IPC command, we need to
                      * communicate with the caller */
@@ -680,7 +689,7 @@ int main(int argc, char *argv[])
                             }
 
                             wait_time++;
-                            sleep(1);
+                            metrics_wait(1);
                         }
 
                         /* damn, we didn't get one */
@@ -713,7 +722,8 @@ int main(int argc, char *argv[])
                     reload_dyn = FALSE;
                 }
 
-                sleep(LOOP_INT);
+                /* answers metrics clients while we wait */
+                metrics_wait(LOOP_INT);
             }
 
             if (sigint_count || sigterm_count)
@@ -741,6 +751,8 @@ int main(int argc, char *argv[])
                 retval = -1;
             }
 
+            metrics_cleanup();
+
             vrmr_info("Info", "Loop shutting down...");
         } else {
             fprintf(stdout,
@@ -772,7 +784,7 @@ int main(int argc, char *argv[])
     if (vrmr_rules_cleanup_list(&vctx.rules) < 0)
         retval = -1;
 
-    vrmr_list_cleanup(&vctx.blocklist.list);
+    vrmr_blocklist_cleanup(&vctx.blocklist);
 
     vrmr_deinit(&vctx);
 
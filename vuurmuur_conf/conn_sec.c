@@ -506,10 +506,9 @@ void conn_free_ct(struct conntrack **ct, struct vrmr_zones *zones)
     }
 
     /* cleanup */
-    vrmr_list_cleanup(&(*ct)->network_list);
-    /* destroy hashtables */
-    vrmr_hash_cleanup(&(*ct)->zone_hash);
-    vrmr_hash_cleanup(&(*ct)->service_hash);
+    vrmr_zone_index_cleanup(&(*ct)->zone_idx);
+    vrmr_service_classifier_cleanup(&(*ct)->service_sc);
+    vrmr_name_cache_cleanup(&(*ct)->name_cache);
     free(*ct);
 }
 
@@ -528,21 +527,14 @@ struct conntrack *ATTR_RETURNS_NONNULL conn_init_ct(struct vrmr_zones *zones,
         vrmr_rem_iface_from_zonelist() (see below) */
     vrmr_fatal_if(vrmr_add_broadcasts_zonelist(zones) < 0);
 
-    /* create hashtables */
-    vrmr_fatal_if(vrmr_init_zonedata_hashtable(zones->list.len * 3,
-                          &zones->list, vrmr_hash_ipaddress,
-                          vrmr_compare_ipaddress, &ct->zone_hash) < 0);
+    /* create the lookup tables */
+    vrmr_fatal_if(vrmr_zone_index_build(&ct->zone_idx, &zones->list) < 0);
 
-    /*  the hashtable size may seem very big, but some services have
-        really a lot items. e.g. 137->1024:65535 */
-    vrmr_fatal_if(vrmr_init_services_hashtable(services->list.len * 500,
-                          &services->list, vrmr_hash_port, vrmr_compare_ports,
-                          &ct->service_hash) < 0);
+    vrmr_fatal_if(vrmr_service_classifier_build(
+                          &ct->service_sc, &services->list) < 0);
 
-    /*  initialize this list with destroy is null, because it only
-        points to zonedatalist nodes */
-    vrmr_list_setup(&ct->network_list, NULL);
-    vrmr_zonelist_to_networklist(zones, &ct->network_list);
+    /* not fatal: without it every connection is looked up */
+    (void)vrmr_name_cache_init(&ct->name_cache, VRMR_NAME_CACHE_SIZE);
 
     /* initialize the prev size because it is used in get_connections */
     ct->prev_list_size = 500;
@@ -576,8 +568,8 @@ int conn_ct_get_connections(struct vrmr_config *cnf, struct conntrack *ct,
 #endif
 
     /* get the connections from the proc */
-    if (vrmr_conn_get_connections(cnf, ct->prev_list_size, &ct->service_hash,
-                &ct->zone_hash, &ct->conn_list, &ct->network_list, req,
+    if (vrmr_conn_get_connections(cnf, ct->prev_list_size, &ct->service_sc,
+                &ct->zone_idx, &ct->name_cache, &ct->conn_list, req,
                 &ct->conn_stats) < 0) {
         vrmr_error(-1, VR_ERR, gettext("getting the connections failed."));
         return (-1);
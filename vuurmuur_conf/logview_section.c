@@ -37,6 +37,8 @@ static void logline2logrule(const char *logline, struct log_record *logrule)
     vrmr_fatal_if_null(logline);
     vrmr_fatal_if_null(logrule);
 
+    logrule->have_fields = 0;
+
     /* scan the line. Note: 'time' has a ':' as last char, and 'to' has a comma
      * as last char. */
     sscanf(logline, "%3s %2s %9s %s service %s from %s to %s", logrule->month,
@@ -86,6 +88,81 @@ static void logline2logrule(const char *logline, struct log_record *logrule)
         logrule->details[details_len - 1] = '\0';
 }
 
+/*  event2logrule
+
+    Load an event from the live event ring into the 'logrule' struct. Unlike
+    logline2logrule this also fills the address fields.
+*/
+static void event2logrule(
+        const struct vrmr_event *ev, struct log_record *logrule)
+{
+    vrmr_fatal_if_null(ev);
+    vrmr_fatal_if_null(logrule);
+
+    struct tm tm;
+    time_t when = (time_t)ev->timestamp;
+    if (localtime_r(&when, &tm) == NULL)
+        memset(&tm, 0, sizeof(tm));
+
+    strftime(logrule->month, sizeof(logrule->month), "%b", &tm);
+    snprintf(logrule->date, sizeof(logrule->date), "%d", tm.tm_mday);
+    snprintf(logrule->time, sizeof(logrule->time), "%02d:%02d:%02d",
+            tm.tm_hour, tm.tm_min, tm.tm_sec);
+
+    strlcpy(logrule->action, ev->action, sizeof(logrule->action));
+    strlcpy(logrule->service, ev->ser_name, sizeof(logrule->service));
+    strlcpy(logrule->from, ev->from_name, sizeof(logrule->from));
+    strlcpy(logrule->to, ev->to_name, sizeof(logrule->to));
+    strlcpy(logrule->prefix, ev->prefix, sizeof(logrule->prefix));
+    vrmr_event_details(ev, logrule->details, sizeof(logrule->details));
+
+    int af = ev->ipv6 ? AF_INET6 : AF_INET;
+    if (inet_ntop(af, &ev->src_addr, logrule->src_ip,
+                sizeof(logrule->src_ip)) == NULL)
+        logrule->src_ip[0] = '\0';
+    if (inet_ntop(af, &ev->dst_addr, logrule->dst_ip,
+                sizeof(logrule->dst_ip)) == NULL)
+        logrule->dst_ip[0] = '\0';
+    logrule->protocol = ev->protocol;
+    logrule->src_port = ev->src_port;
+    logrule->dst_port = ev->dst_port;
+    logrule->have_fields = 1;
+}
+
+/*  logview_attach_event_ring
+
+    Attach to the live event ring of vuurmuur_log, if it has one. 'type' is
+    set to the type of the events that belong in the log 'logname'.
+
+    Returncodes:
+         0: attached
+        -1: no ring
+*/
+static int logview_attach_event_ring(const char *logname,
+        struct vrmr_event_reader *reader, enum vrmr_event_type *type)
+{
+    int shm_id = -1;
+
+    if (vuurmuurlog_shmtable == NULL)
+        return (-1);
+
+    if (vrmr_lock(vuurmuurlog_semid)) {
+        shm_id = vuurmuurlog_shmtable->event_ring_shm_id;
+        vrmr_unlock(vuurmuurlog_semid);
+    }
+    if (shm_id < 0)
+        return (-1);
+
+    if (strcmp(logname, "connections.log") == 0)
+        *type = VRMR_EVENT_CONN_COMPLETED;
+    else if (strcmp(logname, "connnew.log") == 0)
+        *type = VRMR_EVENT_CONN_NEW;
+    else
+        *type = VRMR_EVENT_TRAFFIC;
+
+    return (vrmr_event_ring_attach(shm_id, reader));
+}
+
 static void logline2plainlogrule(
         char *logline, struct plain_log_record *logrule)
 {
@@ -601,6 +678,12 @@ int logview_section(struct vrmr_ctx *vctx, struct vrmr_config *cnf,
     /* is the current log the trafficlog? */
     char traffic_log = FALSE;
 
+    /* live event ring. While we're attached the logfile is only read for
+     * searching. */
+    struct vrmr_event_reader ev_reader = {NULL, 0, 0};
+    enum vrmr_event_type ev_type = VRMR_EVENT_TRAFFIC;
+    uint64_t ev_lost = 0;
+
     /* top menu */
     const char *key_choices[] = {"F12", "m", "s", "f", "p", "c", "1-7", "F10"};
     int key_choices_n = 8;
@@ -824,6 +907,11 @@ int logview_section(struct vrmr_ctx *vctx, struct vrmr_config *cnf,
     del_panel(wait_panels[0]);
     destroy_win(wait_win);
 
+    /* from here on get the new records from vuurmuur_log directly if we can,
+     * instead of tailing the logfile */
+    if (traffic_log)
+        (void)logview_attach_event_ring(logname, &ev_reader, &ev_type);
+
     /* create the info bar window, start hidden */
     filter_ib_win = newwin(1, 32, 3, 2); /* 32 + filter: */
     vrmr_fatal_if_null(filter_ib_win);
@@ -855,12 +943,72 @@ int logview_section(struct vrmr_ctx *vctx, struct vrmr_config *cnf,
 
     /* the main loop */
     while (quit == 0) {
+        int tail_file = (ev_reader.ring == NULL || search_mode);
+
+        /* get what vuurmuur_log published since the last run, but no more
+         * than fits in the ring so a busy log can't keep us here */
+        if (!tail_file && !control.pause) {
+            struct vrmr_event ev;
+            int result = 0;
+
+            for (unsigned int n = 0; n < VRMR_EVENT_RING_ENTRIES; n++) {
+                result = vrmr_event_ring_read(&ev_reader, &ev);
+                if (result != 1)
+                    break;
+                if (ev.type != ev_type)
+                    continue;
+
+                log_record = malloc(sizeof(struct log_record));
+                vrmr_fatal_alloc("malloc", log_record);
+
+                /* we asume unfiltered (was filtered) */
+                log_record->filtered = 0;
+
+                event2logrule(&ev, log_record);
+
+                /* if we have a filter check it now */
+                if (use_filter) {
+                    log_record->filtered =
+                            logrule_filtered(log_record, &vfilter);
+                }
+
+                /* now really insert the rule into the buffer */
+                vrmr_fatal_if(vrmr_list_append(buffer_ptr, log_record) == NULL);
+
+                /* if the bufferlist is full, remove the oldest item from it */
+                if (buffer_ptr->len > max_buffer_size) {
+                    vrmr_fatal_if(vrmr_list_remove_top(buffer_ptr) < 0);
+                }
+
+                control.queue++;
+                log_record = NULL;
+            }
+
+            if (ev_reader.lost != ev_lost) {
+                status_print(status_win,
+                        gettext("Logview fell behind, %" PRIu64
+                                " records skipped."),
+                        ev_reader.lost - ev_lost);
+                ev_lost = ev_reader.lost;
+            }
+
+            /* vuurmuur_log is gone, continue at the end of the logfile */
+            if (result == -1) {
+                vrmr_event_ring_detach(&ev_reader);
+                (void)fseek(fp, 0, SEEK_END);
+            }
+        }
+
         /* read line from log */
-        line = malloc(READLINE_LEN);
-        vrmr_fatal_alloc("malloc", line);
+        line = NULL;
+        if (tail_file) {
+            line = malloc(READLINE_LEN);
+            vrmr_fatal_alloc("malloc", line);
+        }
 
         /* read a line if we are not in pause mode */
-        if (!control.pause && fgets(line, READLINE_LEN, fp) != NULL) {
+        if (line != NULL && !control.pause &&
+                fgets(line, READLINE_LEN, fp) != NULL) {
             linelen = StrMemLen(line);
 
             /* if the line doesn't end with a newline character we rewind and
@@ -1363,7 +1511,7 @@ int logview_section(struct vrmr_ctx *vctx, struct vrmr_config *cnf,
 
                     /* search already checked */
                     if (search_script_ok) {
-                        if ((search_ptr = input_box(32, gettext("Search"),
+                        if ((search_ptr = input_box(64, gettext("Search"),
                                      gettext("What do you want to search "
                                              "for?")))) {
                             /* regex check the search-string */
@@ -1379,15 +1527,37 @@ int logview_section(struct vrmr_ctx *vctx, struct vrmr_config *cnf,
                             /* temp store the traffic pointer */
                             traffic_fp = fp;
 
+                            /* a query like 'ip:10.0.0.1 since:2d' is run
+                             * against the traffic archive by vuurmuur_log,
+                             * anything else is grepped from the logfiles */
+                            struct vrmr_archive_filter query;
+                            int use_archive =
+                                    (strcmp(logname, "traffic.log") == 0 &&
+                                            vctx->conf.log_archive &&
+                                            strchr(search_ptr, ':') != NULL &&
+                                            vrmr_archive_filter_parse(
+                                                    search_ptr, &query) == 0);
+                            int len;
+
                             /* assemble search string => ignore stderr because
                              * it messes up the screen */
-                            if (snprintf(search_string, sizeof(search_string),
+                            if (use_archive) {
+                                len = snprintf(search_string,
+                                        sizeof(search_string),
+                                        "%s/vuurmuur_log -c %s --query '%s' "
+                                        "--searchlog 2>/dev/null",
+                                        xstr(BINDIR), vctx->conf.configfile,
+                                        search_ptr);
+                            } else {
+                                len = snprintf(search_string,
+                                        sizeof(search_string),
                                         "/bin/bash %s/vuurmuur-searchlog.sh %s "
                                         "%s/ '%s' 2>/dev/null",
                                         vccnf.scripts_location, logname,
                                         vctx->conf.vuurmuur_logdir_location,
-                                        search_ptr) >=
-                                    (int)sizeof(search_string)) {
+                                        search_ptr);
+                            }
+                            if (len >= (int)sizeof(search_string)) {
                                 vrmr_error(-1, VR_ERR,
                                         gettext("opening pipe failed: %s."),
                                         strerror(errno));
@@ -1638,6 +1808,7 @@ int logview_section(struct vrmr_ctx *vctx, struct vrmr_config *cnf,
     nodelay(log_win, FALSE);
     vrmr_fatal_if(vrmr_list_cleanup(buffer_ptr) < 0);
     (void)fclose(fp);
+    vrmr_event_ring_detach(&ev_reader);
 
     /* info bar stuff */
     show_panel(info_bar_panels[0]);
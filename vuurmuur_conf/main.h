@@ -451,14 +451,23 @@ struct log_record {
     char prefix[32];
 
     char details[256];
+
+    /* set if the record came from the live event ring: the fields below are
+     * filled, so they don't have to be parsed out of 'details' */
+    char have_fields;
+    char src_ip[46];
+    char dst_ip[46];
+    int protocol;
+    int src_port;
+    int dst_port;
 };
 
 struct conntrack {
-    /* hashes for the vuurmuur names */
-    struct vrmr_hash_table zone_hash;
-    struct vrmr_hash_table service_hash;
-
-    struct vrmr_list network_list;
+    /* lookup tables for the vuurmuur names */
+    struct vrmr_zone_index zone_idx;
+    struct vrmr_service_classifier service_sc;
+    /* the same connections are looked up on every refresh */
+    struct vrmr_name_cache name_cache;
 
     struct vrmr_list conn_list;
     /* sorted array of entries. Sorted by cnt */
@@ -266,6 +266,17 @@ static char statevent_convert_log(struct stat_event_ctx *ctl)
 
         log->filtered = log_record->filtered;
 
+        /* records from the live event ring need no parsing */
+        if (log_record->have_fields) {
+            strlcpy(log->src_ip, log_record->src_ip, sizeof(log->src_ip));
+            strlcpy(log->dst_ip, log_record->dst_ip, sizeof(log->dst_ip));
+            log->protocol = log_record->protocol;
+            log->src_port = log_record->src_port;
+            log->dst_port = log_record->dst_port;
+            vrmr_fatal_if(vrmr_list_append(&ctl->list, log) == NULL);
+            continue;
+        }
+
         /* parse the details :-S */
         // vrprint.error(-1, "Details", "%s", log_record->details);
 
@@ -444,7 +444,7 @@ int main(int argc, char *argv[])
     }
 
     /* cleanup the datastructures */
-    (void)vrmr_list_cleanup(&vctx.blocklist.list);
+    vrmr_blocklist_cleanup(&vctx.blocklist);
     (void)vrmr_destroy_serviceslist(&vctx.services);
     (void)vrmr_destroy_zonedatalist(&vctx.zones);
     (void)vrmr_rules_cleanup_list(&vctx.rules);
@@ -0,0 +1,307 @@
+/***************************************************************************
+ *   Copyright (C) 2003-2019 by Victor Julien                              *
+ *   victor@vuurmuur.org                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/** \file
+ *  aggregate.c folds repeated log lines into a single summary line.
+ *
+ *  A scan or a flood produces the same line over and over, only the ports
+ *  differ. Lines are considered the same when they go to the same log and
+ *  have the same action, zones, service and source address. The first one
+ *  is written as usual. The ones that follow within LOG_AGGREGATE_WINDOW
+ *  seconds are only counted, and when the window expires a single summary
+ *  line with the count, the bytes and the first and last time is written.
+ */
+
+#include "vuurmuur_log.h"
+#include "aggregate.h"
+
+struct aggregate_entry {
+    struct aggregate_entry *next;
+    struct aggregate_entry *prev;
+    uint32_t hash;
+
+    /* key */
+    struct logwriter *lw;
+    enum pipeline_source source;
+    char action[16];
+    char from_name[VRMR_VRMR_MAX_HOST_NET_ZONE];
+    char to_name[VRMR_VRMR_MAX_HOST_NET_ZONE];
+    char ser_name[VRMR_MAX_SERVICE];
+    char src_ip[46];
+
+    char prefix[32];
+    time_t first;      /* time of the written line, starts the window */
+    char first_tm[16]; /* "HH:MM:SS" of the written line */
+
+    /* suppressed lines */
+    uint32_t count;
+    uint64_t bytes;
+    char month[4];
+    int day;
+    int hour;
+    int minute;
+    int second;
+};
+
+/* what a record is compared against an entry with */
+struct aggregate_key {
+    struct logwriter *lw;
+    enum pipeline_source source;
+    const struct vrmr_log_record *lr;
+};
+
+static uint32_t aggregate_hash(const struct aggregate_key *k)
+{
+    const char *parts[] = {k->lr->action, k->lr->from_name, k->lr->to_name,
+            k->lr->ser_name, k->lr->src_ip};
+    uint32_t hash = vrmr_hash_bytes(&k->lw, sizeof(k->lw)) ^ k->source;
+
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++)
+        hash = hash * 31 + vrmr_hash_bytes(parts[i], strlen(parts[i]));
+    return (hash);
+}
+
+static int aggregate_compare(const void *table_data, const void *search_data)
+{
+    const struct aggregate_entry *e = table_data;
+    const struct aggregate_key *k = search_data;
+
+    return (e->lw == k->lw && e->source == k->source &&
+            strcmp(e->action, k->lr->action) == 0 &&
+            strcmp(e->src_ip, k->lr->src_ip) == 0 &&
+            strcmp(e->ser_name, k->lr->ser_name) == 0 &&
+            strcmp(e->from_name, k->lr->from_name) == 0 &&
+            strcmp(e->to_name, k->lr->to_name) == 0);
+}
+
+static int aggregate_compare_ptr(
+        const void *table_data, const void *search_data)
+{
+    return (table_data == search_data);
+}
+
+/* bytes a record stands for: the packet, or both directions of a completed
+ * connection */
+static uint64_t aggregate_bytes(
+        enum pipeline_source source, const struct vrmr_log_record *lr)
+{
+    if (source == PIPELINE_CONN)
+        return (lr->conn_rec.toserver_bytes + lr->conn_rec.toclient_bytes);
+    return (lr->packet_len);
+}
+
+/** \internal
+ *
+ *  \brief write the summary of an entry if it suppressed anything and
+ *         release it
+ */
+static void aggregate_finish(struct aggregate *agg, struct aggregate_entry *e,
+        aggregate_emit_func emit)
+{
+    if (e->count > 0) {
+        char bytes[64];
+        char prefix[64] = "";
+        char line[PIPELINE_LINE_MAX];
+
+        vrmr_log_bytes2str(e->bytes, bytes, sizeof(bytes));
+        /* the connection logs have no prefix */
+        if (e->source == PIPELINE_TRAFFIC)
+            snprintf(prefix, sizeof(prefix), ", prefix: \"%s\"", e->prefix);
+
+        snprintf(line, sizeof(line),
+                "%s %2d %02d:%02d:%02d: %s service %s from %s to %s%s "
+                "(aggregated: %u more from %s, %s, first %s last "
+                "%02d:%02d:%02d)\n",
+                e->month, e->day, e->hour, e->minute, e->second, e->action,
+                e->ser_name, e->from_name, e->to_name, prefix, e->count,
+                e->src_ip, bytes, e->first_tm, e->hour, e->minute,
+                e->second);
+        emit(e->lw, line);
+        __atomic_fetch_add(&agg->summaries, 1, __ATOMIC_RELAXED);
+    }
+
+    (void)vrmr_htable_remove(
+            &agg->index, e->hash, aggregate_compare_ptr, (const void *)e);
+
+    if (e->prev != NULL)
+        e->prev->next = e->next;
+    else
+        agg->head = e->next;
+    if (e->next != NULL)
+        e->next->prev = e->prev;
+    else
+        agg->tail = e->prev;
+
+    e->prev = NULL;
+    e->next = agg->free;
+    agg->free = e;
+}
+
+/** \brief setup aggregation
+ *
+ *  'agg' is either zeroed or cleaned up. The counters are kept, so they
+ *  survive a reload.
+ *
+ *  \param window seconds lines are aggregated, 0 disables it
+ *  \retval 0 ok
+ *  \retval -1 error, aggregation is disabled
+ */
+int aggregate_init(struct aggregate *agg, unsigned int window)
+{
+    assert(agg && agg->entries == NULL);
+
+    agg->window = 0;
+    agg->free = agg->head = agg->tail = NULL;
+    if (window == 0)
+        return (0);
+
+    agg->entries = calloc(AGGREGATE_MAX_ENTRIES, sizeof(*agg->entries));
+    if (agg->entries == NULL) {
+        vrmr_error(-1, "Error", "calloc failed: %s", strerror(errno));
+        return (-1);
+    }
+    if (vrmr_htable_init(&agg->index, AGGREGATE_MAX_ENTRIES) < 0) {
+        free(agg->entries);
+        agg->entries = NULL;
+        return (-1);
+    }
+
+    for (int i = AGGREGATE_MAX_ENTRIES - 1; i >= 0; i--) {
+        agg->entries[i].next = agg->free;
+        agg->free = &agg->entries[i];
+    }
+    agg->window = window;
+    return (0);
+}
+
+/** \brief free the entries, without writing the summaries
+ *
+ *  Call aggregate_flush() first to write them.
+ */
+void aggregate_cleanup(struct aggregate *agg)
+{
+    assert(agg);
+
+    if (agg->window > 0)
+        vrmr_htable_cleanup(&agg->index, NULL);
+    free(agg->entries);
+    agg->entries = NULL;
+    agg->free = agg->head = agg->tail = NULL;
+    agg->window = 0;
+}
+
+/** \brief check if the line of a record should be written
+ *
+ *  Called by the annotate thread for every line it built. If the record
+ *  starts a new window its line is written and later ones like it are
+ *  counted. Summaries of expired or evicted entries are passed to 'emit'.
+ *
+ *  \param lw the log the line of 'lr' is for
+ *  \retval 0 write the line
+ *  \retval 1 the line is suppressed
+ */
+int aggregate_record(struct aggregate *agg, enum pipeline_source source,
+        struct logwriter *lw, const struct vrmr_log_record *lr,
+        aggregate_emit_func emit)
+{
+    assert(agg && lw && lr && emit);
+
+    if (agg->window == 0)
+        return (0);
+
+    struct aggregate_key key = {lw, source, lr};
+    uint32_t hash = aggregate_hash(&key);
+
+    struct aggregate_entry *e = vrmr_htable_search(
+            &agg->index, hash, aggregate_compare, (const void *)&key);
+    if (e != NULL) {
+        if (lr->timestamp < e->first + (time_t)agg->window) {
+            e->count++;
+            e->bytes += aggregate_bytes(source, lr);
+            strlcpy(e->month, lr->month, sizeof(e->month));
+            e->day = lr->day;
+            e->hour = lr->hour;
+            e->minute = lr->minute;
+            e->second = lr->second;
+            __atomic_fetch_add(&agg->suppressed, 1, __ATOMIC_RELAXED);
+            return (1);
+        }
+        /* the window is over, this line starts a new one */
+        aggregate_finish(agg, e, emit);
+    }
+
+    if (agg->free == NULL) {
+        aggregate_finish(agg, agg->head, emit);
+        __atomic_fetch_add(&agg->evictions, 1, __ATOMIC_RELAXED);
+    }
+    e = agg->free;
+
+    e->hash = hash;
+    e->lw = lw;
+    e->source = source;
+    strlcpy(e->action, lr->action, sizeof(e->action));
+    strlcpy(e->from_name, lr->from_name, sizeof(e->from_name));
+    strlcpy(e->to_name, lr->to_name, sizeof(e->to_name));
+    strlcpy(e->ser_name, lr->ser_name, sizeof(e->ser_name));
+    strlcpy(e->src_ip, lr->src_ip, sizeof(e->src_ip));
+    strlcpy(e->prefix, lr->logprefix, sizeof(e->prefix));
+    e->first = lr->timestamp;
+    snprintf(e->first_tm, sizeof(e->first_tm), "%02d:%02d:%02d", lr->hour,
+            lr->minute, lr->second);
+    e->count = 0;
+    e->bytes = 0;
+
+    /* not tracking it only means its repeats are written */
+    if (vrmr_htable_insert(&agg->index, hash, e) < 0)
+        return (0);
+
+    agg->free = e->next;
+    e->next = NULL;
+    e->prev = agg->tail;
+    if (agg->tail != NULL)
+        agg->tail->next = e;
+    else
+        agg->head = e;
+    agg->tail = e;
+    return (0);
+}
+
+/** \brief summarize the entries whose window is over at 'now'
+ *
+ *  Called periodically by the annotate thread.
+ */
+void aggregate_expire(
+        struct aggregate *agg, time_t now, aggregate_emit_func emit)
+{
+    assert(agg && emit);
+
+    while (agg->head != NULL &&
+            agg->head->first + (time_t)agg->window <= now)
+        aggregate_finish(agg, agg->head, emit);
+}
+
+/** \brief summarize all entries, on reload and shutdown */
+void aggregate_flush(struct aggregate *agg, aggregate_emit_func emit)
+{
+    assert(agg && emit);
+
+    while (agg->head != NULL)
+        aggregate_finish(agg, agg->head, emit);
+}
@@ -0,0 +1,66 @@
+/***************************************************************************
+ *   Copyright (C) 2003-2019 by Victor Julien                              *
+ *   victor@vuurmuur.org                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __AGGREGATE_H__
+#define __AGGREGATE_H__
+
+#include "logwriter.h"
+#include "pipeline.h"
+
+/* max number of distinct lines tracked, the oldest is summarized early
+ * when this is reached */
+#define AGGREGATE_MAX_ENTRIES 4096
+
+/** \brief hands a summary line to a log writer */
+typedef void (*aggregate_emit_func)(struct logwriter *lw, const char *line);
+
+struct aggregate_entry;
+
+/** \brief repeated line suppression
+ *
+ *  Only used by the annotate thread, or by the main thread while the
+ *  pipeline is paused or stopped.
+ */
+struct aggregate {
+    unsigned int window; /* seconds, 0 if disabled */
+
+    struct vrmr_htable index;
+    struct aggregate_entry *entries; /* pool of AGGREGATE_MAX_ENTRIES */
+    struct aggregate_entry *free;
+    /* in use, oldest first. As all entries share the window this is also
+     * the order in which they expire. */
+    struct aggregate_entry *head;
+    struct aggregate_entry *tail;
+
+    /* counters, the main thread reads them for the metrics */
+    uint64_t suppressed; /* lines not written */
+    uint64_t summaries;  /* summary lines written */
+    uint64_t evictions;  /* entries summarized early */
+};
+
+int aggregate_init(struct aggregate *, unsigned int window);
+void aggregate_cleanup(struct aggregate *);
+int aggregate_record(struct aggregate *, enum pipeline_source,
+        struct logwriter *lw, const struct vrmr_log_record *lr,
+        aggregate_emit_func emit);
+void aggregate_expire(struct aggregate *, time_t now, aggregate_emit_func emit);
+void aggregate_flush(struct aggregate *, aggregate_emit_func emit);
+
+#endif /* __AGGREGATE_H__ */
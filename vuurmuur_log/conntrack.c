@@ -27,38 +27,25 @@
 #include <inttypes.h>
 #include <sys/time.h>
 #include <linux/netfilter/nf_conntrack_tcp.h>
+#include <linux/netfilter/nfnetlink.h>
 
 #include "conntrack.h"
+#include "logwriter.h"
+#include "pipeline.h"
 
 static struct mnl_socket *nl = NULL;
-extern struct vrmr_hash_table zone_htbl;
-extern struct vrmr_hash_table service_htbl;
-extern FILE *g_connections_log_fp;
-extern FILE *g_conn_new_log_fp;
-
-static void bytes2str(const uint64_t bytes, char *str, size_t size)
-{
-    if (bytes == 0)
-        snprintf(str, size, "0b");
-    /* 1 byte - 999 bytes */
-    else if (bytes > 0 && bytes < 1000)
-        snprintf(str, size, "%ub", (unsigned int)bytes);
-    /* 1kb - 999kb */
-    else if (bytes >= 1000 && bytes < 1000000)
-        snprintf(str, size, "%.1fk", (float)bytes / 1024);
-    /* 1mb - 10mb */
-    else if (bytes >= 1000000 && bytes < 10000000)
-        snprintf(str, size, "%1.1fM", (float)bytes / (1024 * 1024));
-    /* 10mb - 1000mb */
-    else if (bytes >= 10000000 && bytes < 1000000000)
-        snprintf(str, size, "%.0fM", (float)bytes / (1024 * 1024));
-    else if (bytes >= 1000000000 && bytes < 10000000000ULL)
-        snprintf(str, size, "%1.1fG", (float)bytes / (1024 * 1024 * 1024));
-    else if (bytes >= 10000000000ULL && bytes < 100000000000ULL)
-        snprintf(str, size, "%.0fG", (float)bytes / (1024 * 1024 * 1024));
-    else
-        snprintf(str, size, "%.0fG", (float)bytes / (1024 * 1024 * 1024));
-}
+static struct logcounters *counters = NULL;
+static int rcvbuf_size = 0;
+/* the filter in use, and the events we joined the groups of */
+static struct vrmr_conntrack_filter ct_filter;
+static unsigned int ct_events = 0;
+/* the kernel refused the filter, so we apply it ourselves */
+static int ct_filter_userspace = 0;
+extern struct vrmr_zone_index zone_idx;
+extern struct vrmr_service_classifier service_sc;
+extern struct vrmr_name_cache name_cache;
+extern struct logwriter g_connections_log_writer;
+extern struct logwriter g_conn_new_log_writer;
 
 static void mark2str(const uint32_t mark, char *str, size_t size)
 {
@@ -74,54 +61,46 @@ static void mark2str(const uint32_t mark, char *str, size_t size)
     }
 }
 
-/* process one record */
-static int process_connrecord(struct vrmr_log_record *lr)
+/** \brief build the log line for a connection record
+ *
+ *  Called by the annotate thread of the pipeline.
+ *
+ *  \retval lw the connection log 'line' is for
+ */
+struct logwriter *conntrack_annotate(
+        struct vrmr_log_record *lr, char *line, size_t size)
 {
-    char line[1024] = "";
-    FILE *fp;
+    struct logwriter *lw;
 
-    int result = vrmr_log_record_get_names(lr, &zone_htbl, &service_htbl);
+    int result = vrmr_log_record_get_names(
+            lr, &zone_idx, &service_sc, &name_cache);
     if (result < 0) {
         vrmr_debug(NONE, "vrmr_log_record_get_names returned %d", result);
         exit(EXIT_FAILURE);
     }
 
-    char s[256];
-    struct timeval tv;
-    memset(&tv, 0, sizeof(tv));
-    gettimeofday(&tv, NULL);
-    time_t when = tv.tv_sec;
-    struct tm *tm = localtime(&when);
-    strftime(s, 256, "%b %d %T", tm);
-
-    if (sscanf(s, "%3s %2d %2d:%2d:%2d", lr->month, &lr->day, &lr->hour,
-                &lr->minute, &lr->second) != 5) {
-        vrmr_debug(NONE, "did not find properly formatted timestamp");
-        return -1;
-    }
-
     char action[32];
     if (lr->conn_rec.type == VRMR_LOG_CONN_COMPLETED)
         mark2str(lr->conn_rec.mark, action, sizeof(action));
     else
         strlcpy(action, "NEW", sizeof(action));
+    strlcpy(lr->action, action, sizeof(lr->action));
 
-    snprintf(line, sizeof(line),
-            "%s %2d %02d:%02d:%02d: %s service %s from %s to %s (", lr->month,
-            lr->day, lr->hour, lr->minute, lr->second, action, lr->ser_name,
-            lr->from_name, lr->to_name);
+    snprintf(line, size, "%s %2d %02d:%02d:%02d: %s service %s from %s to %s (",
+            lr->month, lr->day, lr->hour, lr->minute, lr->second, action,
+            lr->ser_name, lr->from_name, lr->to_name);
 
     if (lr->conn_rec.type == VRMR_LOG_CONN_COMPLETED) {
         char ts[64];
         char tc[64];
 
-        bytes2str(lr->conn_rec.toserver_bytes, ts, sizeof(ts));
-        bytes2str(lr->conn_rec.toclient_bytes, tc, sizeof(tc));
+        vrmr_log_bytes2str(lr->conn_rec.toserver_bytes, ts, sizeof(ts));
+        vrmr_log_bytes2str(lr->conn_rec.toclient_bytes, tc, sizeof(tc));
 
         char extra[1024];
         snprintf(extra, sizeof(extra), "%us %s><%s ", lr->conn_rec.age_s, ts,
                 tc);
-        strlcat(line, extra, sizeof(line));
+        strlcat(line, extra, size);
     }
 
     if (lr->protocol == IPPROTO_TCP || lr->protocol == IPPROTO_UDP) {
@@ -129,19 +108,19 @@ static int process_connrecord(struct vrmr_log_record *lr)
         snprintf(addrports, sizeof(addrports), "%s:%u -> %s:%u %s", lr->src_ip,
                 lr->src_port, lr->dst_ip, lr->dst_port,
                 lr->protocol == IPPROTO_TCP ? "TCP" : "UDP");
-        strlcat(line, addrports, sizeof(line));
+        strlcat(line, addrports, size);
     } else {
         char addr[256];
         snprintf(addr, sizeof(addr), "%s -> %s PROTO %u", lr->src_ip,
                 lr->dst_ip, lr->protocol);
-        strlcat(line, addr, sizeof(line));
+        strlcat(line, addr, size);
     }
 
     if (lr->conn_rec.type == VRMR_LOG_CONN_COMPLETED) {
         if (lr->conn_rec.mark > 0) {
             char mark[16];
             snprintf(mark, sizeof(mark), " mark:%u", lr->conn_rec.mark);
-            strlcat(line, mark, sizeof(line));
+            strlcat(line, mark, size);
         }
 
 #if 0 // looks like this is not available in a DESTROY record :-(
@@ -189,101 +168,244 @@ static int process_connrecord(struct vrmr_log_record *lr)
             }
             snprintf(tcp, sizeof(tcp), " tcp_state:%s tcp_flags_ts:%02x tcp_flags_tc:%02x",
                 tcp_state, lr->conn_rec.tcp_flags_ts, lr->conn_rec.tcp_flags_tc);
-            strlcat(line, tcp, sizeof(line));
+            strlcat(line, tcp, size);
         }
 #endif
     }
     if (strlen(lr->helper)) {
         char helper[64];
         snprintf(helper, sizeof(helper), " helper:%s", lr->helper);
-        strlcat(line, helper, sizeof(line));
+        strlcat(line, helper, size);
     }
 
     if (lr->conn_rec.type == VRMR_LOG_CONN_COMPLETED) {
-        fp = g_connections_log_fp;
+        lw = &g_connections_log_writer;
     } else {
-        fp = g_conn_new_log_fp;
+        lw = &g_conn_new_log_writer;
     }
-    assert(fp);
 
-    fprintf(fp, "%s)\n", line);
-    fflush(fp);
-
-    return 0;
+    /* a truncated line must still end in a newline */
+    if (strlcat(line, ")\n", size) >= size)
+        line[size - 2] = '\n';
+    return (lw);
 }
 
 static int record_cb(const struct nlmsghdr *nlh, void *data)
 {
-    uint32_t type = NFCT_T_UNKNOWN;
+    unsigned int event = 0;
     struct vrmr_log_record *lr = (struct vrmr_log_record *)data;
 
     switch (nlh->nlmsg_type & 0xFF) {
         case IPCTNL_MSG_CT_NEW:
             if (nlh->nlmsg_flags & (NLM_F_CREATE | NLM_F_EXCL))
-                type = NFCT_T_NEW;
-            else
-                type = NFCT_T_UPDATE;
+                event = VRMR_CT_EVENT_NEW;
             break;
         case IPCTNL_MSG_CT_DELETE:
-            type = NFCT_T_DESTROY;
+            event = VRMR_CT_EVENT_DESTROY;
             break;
         default:
-            abort();
             break;
     }
-
-    struct nf_conntrack *ct = nfct_new();
-    if (ct == NULL)
+    /* updates are not logged */
+    if (event == 0)
         return MNL_CB_OK;
-    nfct_nlmsg_parse(nlh, ct);
+    if (event == VRMR_CT_EVENT_NEW)
+        counters->conntrack_new++;
+    else
+        counters->conntrack_destroy++;
 
-    vrmr_conntrack_ct2lr(type, ct, lr);
+    /* parsed on the stack: no allocations per event */
+    struct vrmr_conntrack_info info;
+    if (vrmr_conntrack_parse(nlh, &info) < 0)
+        return MNL_CB_OK;
 
-    process_connrecord(lr);
+    if (vrmr_conntrack_ct2lr(event, &info, lr) == 0)
+        return MNL_CB_OK;
+    if (ct_filter_userspace && !vrmr_conntrack_filter_match(&ct_filter, lr))
+        return MNL_CB_OK;
+    (void)log_record_set_time(lr, time(NULL));
 
-    nfct_destroy(ct);
+    /* a full pipeline is counted there */
+    (void)pipeline_submit(PIPELINE_CONN, lr);
     return MNL_CB_OK;
 }
 
-int conntrack_subscribe(struct vrmr_log_record *lr)
+/** \internal
+ *
+ *  \brief build the socket filter for 'f'
+ *
+ *  The protocols are OR'd, the ignored networks are negated and apply to
+ *  both the source and the destination of the original direction.
+ */
+static struct nfct_filter *conntrack_build_filter(
+        const struct vrmr_conntrack_filter *f)
+{
+    struct nfct_filter *filter = nfct_filter_create();
+    if (filter == NULL)
+        return (NULL);
+
+    for (unsigned int i = 0; i < f->proto_cnt; i++)
+        nfct_filter_add_attr_u32(filter, NFCT_FILTER_L4PROTO, f->proto[i]);
+
+    int have_ipv4 = 0, have_ipv6 = 0;
+    for (unsigned int i = 0; i < f->ignore_cnt; i++) {
+        unsigned int prefix = f->ignore[i].prefix;
+
+        if (f->ignore[i].family == AF_INET) {
+            struct nfct_filter_ipv4 net = {
+                    .addr = ntohl(f->ignore[i].addr.ipv4.s_addr),
+                    .mask = prefix ? 0xffffffffU << (32 - prefix) : 0,
+            };
+            nfct_filter_add_attr(filter, NFCT_FILTER_SRC_IPV4, &net);
+            nfct_filter_add_attr(filter, NFCT_FILTER_DST_IPV4, &net);
+            have_ipv4 = 1;
+        } else {
+            struct nfct_filter_ipv6 net;
+            for (int w = 0; w < 4; w++) {
+                uint32_t word;
+                memcpy(&word, &f->ignore[i].addr.bytes[w * 4], sizeof(word));
+                net.addr[w] = ntohl(word);
+
+                unsigned int bits = prefix > 32 ? 32 : prefix;
+                net.mask[w] = bits ? 0xffffffffU << (32 - bits) : 0;
+                prefix -= bits;
+            }
+            nfct_filter_add_attr(filter, NFCT_FILTER_SRC_IPV6, &net);
+            nfct_filter_add_attr(filter, NFCT_FILTER_DST_IPV6, &net);
+            have_ipv6 = 1;
+        }
+    }
+    if (have_ipv4) {
+        nfct_filter_set_logic(
+                filter, NFCT_FILTER_SRC_IPV4, NFCT_FILTER_LOGIC_NEGATIVE);
+        nfct_filter_set_logic(
+                filter, NFCT_FILTER_DST_IPV4, NFCT_FILTER_LOGIC_NEGATIVE);
+    }
+    if (have_ipv6) {
+        nfct_filter_set_logic(
+                filter, NFCT_FILTER_SRC_IPV6, NFCT_FILTER_LOGIC_NEGATIVE);
+        nfct_filter_set_logic(
+                filter, NFCT_FILTER_DST_IPV6, NFCT_FILTER_LOGIC_NEGATIVE);
+    }
+
+    if (f->have_mark) {
+        struct nfct_filter_dump_mark mark = {f->mark, f->mark_mask};
+        nfct_filter_add_attr(filter, NFCT_FILTER_MARK, &mark);
+    }
+    return (filter);
+}
+
+/** \brief apply the CONNLOG_* options to the conntrack socket
+ *
+ *  Joins the multicast groups of the events we log and leaves the others,
+ *  and attaches a socket filter so the kernel drops the events we would
+ *  not log. If the kernel or libnetfilter_conntrack can't do the filter,
+ *  the events are filtered after parsing.
+ *
+ *  \retval 0 ok
+ *  \retval -1 error
+ */
+int conntrack_setup_filter(const struct vrmr_config *cnf)
+{
+    static const struct {
+        unsigned int event;
+        int group;
+    } groups[] = {
+            {VRMR_CT_EVENT_NEW, NFNLGRP_CONNTRACK_NEW},
+            {VRMR_CT_EVENT_DESTROY, NFNLGRP_CONNTRACK_DESTROY},
+    };
+    struct vrmr_conntrack_filter f;
+
+    assert(nl && cnf);
+
+    if (vrmr_conntrack_filter_parse(cnf, &f) < 0)
+        return (-1);
+
+    for (size_t i = 0; i < sizeof(groups) / sizeof(groups[0]); i++) {
+        unsigned int want = f.events & groups[i].event;
+        if (want == (ct_events & groups[i].event))
+            continue;
+
+        int group = groups[i].group;
+        if (mnl_socket_setsockopt(nl,
+                    want ? NETLINK_ADD_MEMBERSHIP : NETLINK_DROP_MEMBERSHIP,
+                    &group, sizeof(group)) < 0) {
+            vrmr_error(-1, "Error", "joining conntrack group %d failed: %s",
+                    group, strerror(errno));
+            return (-1);
+        }
+        ct_events ^= groups[i].event;
+    }
+
+    int fd = mnl_socket_get_fd(nl);
+    struct nfct_filter *filter = conntrack_build_filter(&f);
+    if (filter == NULL || nfct_filter_attach(fd, filter) < 0) {
+        vrmr_warning("Warning",
+                "no kernel filter for the connection events: %s, "
+                "filtering them in vuurmuur_log",
+                strerror(errno));
+        (void)nfct_filter_detach(fd);
+        ct_filter_userspace = 1;
+    } else {
+        ct_filter_userspace = 0;
+    }
+    if (filter != NULL)
+        nfct_filter_destroy(filter);
+
+    ct_filter = f;
+    return (0);
+}
+
+int conntrack_subscribe(struct vrmr_log_record *lr, struct logcounters *c,
+        const struct vrmr_config *cnf)
 {
     assert(!nl);
-    assert(lr);
+    assert(lr && c && cnf);
+
+    counters = c;
 
     nl = mnl_socket_open(NETLINK_NETFILTER);
     if (nl == NULL) {
         vrmr_error(-1, "Error", "mnl_socket_open failed: %s", strerror(errno));
         return -1;
     }
-    if (mnl_socket_bind(nl,
-                NF_NETLINK_CONNTRACK_NEW | NF_NETLINK_CONNTRACK_DESTROY,
-                MNL_SOCKET_AUTOPID) < 0) {
+    /* the groups are joined by conntrack_setup_filter() */
+    if (mnl_socket_bind(nl, 0, MNL_SOCKET_AUTOPID) < 0) {
         vrmr_error(-1, "Error", "mnl_socket_bind failed: %s", strerror(errno));
         mnl_socket_close(nl);
         return -1;
     }
 
-    /* set a timeout to the socket so we can check for a signal
-     * in case we don't get packets for a longer period. */
-    struct timeval timev;
-    timev.tv_sec = 0;
-    timev.tv_usec = 1000;
-
-    if (mnl_socket_setsockopt(nl, SO_RCVTIMEO, &timev, sizeof(timev)) == -1) {
-        vrmr_warning(
-                "Warning", "can't set mnl socket timeout: %s", strerror(errno));
+    /* the main loop polls the socket, so reads must never block */
+    int fd = mnl_socket_get_fd(nl);
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        vrmr_error(-1, "Error", "can't set mnl socket non-blocking: %s",
+                strerror(errno));
+        mnl_socket_close(nl);
+        nl = NULL;
+        return -1;
     }
 
-    /* set timeout on the socket itself as well. W/o it it would still
-     * block on reads. */
-    int fd = mnl_socket_get_fd(nl);
-    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timev, sizeof(timev)) == -1) {
-        vrmr_warning(
-                "Warning", "can't set raw socket timeout: %s", strerror(errno));
+    /* a conntrack event burst easily overflows the default buffer */
+    if (socket_set_rcvbuf(fd, NETLINK_RCVBUF_MIN) == 0)
+        rcvbuf_size = NETLINK_RCVBUF_MIN;
+
+    if (conntrack_setup_filter(cnf) < 0) {
+        mnl_socket_close(nl);
+        nl = NULL;
+        return -1;
     }
     return 0;
 }
 
+/** \brief get the conntrack socket fd for polling */
+int conntrack_get_fd(void)
+{
+    assert(nl);
+    return mnl_socket_get_fd(nl);
+}
+
 int conntrack_disconnect(void)
 {
     assert(nl);
@@ -291,6 +413,11 @@ int conntrack_disconnect(void)
     return 0;
 }
 
+/**
+ *  \retval 1 message processed or overrun handled, keep reading
+ *  \retval 0 no data available
+ *  \retval -1 error
+ */
 int conntrack_read(struct vrmr_log_record *lr)
 {
     assert(nl);
@@ -300,8 +427,16 @@ int conntrack_read(struct vrmr_log_record *lr)
     char buf[MNL_SOCKET_BUFFER_SIZE];
     int ret = mnl_socket_recvfrom(nl, buf, sizeof(buf));
     if (ret == -1) {
-        if (errno == EAGAIN) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
             return 0;
+        } else if (errno == ENOBUFS) {
+            /* the kernel dropped events because we were too slow. The
+             * socket is usable again right away, so count it and go on. */
+            counters->conntrack_overruns++;
+            if (rcvbuf_size > 0)
+                socket_grow_rcvbuf(
+                        mnl_socket_get_fd(nl), &rcvbuf_size, "conntrack");
+            return 1;
         }
         vrmr_warning(
                 "Warning", "mnl_socket_recvfrom failed: %s", strerror(errno));
@@ -313,5 +448,5 @@ int conntrack_read(struct vrmr_log_record *lr)
         vrmr_warning("Warning", "mnl_cb_run failed: %s", strerror(errno));
         return -1;
     }
-    return 0;
+    return 1;
 }
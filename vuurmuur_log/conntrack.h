@@ -21,8 +21,16 @@
 #ifndef __CONNTRACK_H__
 #define __CONNTRACK_H__
 
-int conntrack_subscribe(struct vrmr_log_record *);
+#include "stats.h"
+#include "logwriter.h"
+
+int conntrack_subscribe(struct vrmr_log_record *, struct logcounters *,
+        const struct vrmr_config *);
+int conntrack_setup_filter(const struct vrmr_config *);
 int conntrack_disconnect(void);
+int conntrack_get_fd(void);
 int conntrack_read(struct vrmr_log_record *);
+struct logwriter *conntrack_annotate(
+        struct vrmr_log_record *lr, char *line, size_t size);
 
 #endif /* __CONNTRACK_H__ */
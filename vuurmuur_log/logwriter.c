@@ -0,0 +1,189 @@
+/***************************************************************************
+ *   Copyright (C) 2003-2019 by Victor Julien                              *
+ *   victor@vuurmuur.org                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/** \file
+ *  logwriter.c implements the buffered writer for the traffic and
+ *  connection logs.
+ */
+
+#include "vuurmuur_log.h"
+
+#include <sys/uio.h>
+
+#include "logwriter.h"
+
+/** \brief setup a writer with a buffer of 'size' bytes
+ *
+ *  The writer is not attached to a file yet: lines are dropped until
+ *  logwriter_attach() is called.
+ *
+ *  \retval 0 ok
+ *  \retval -1 error
+ */
+int logwriter_init(struct logwriter *lw, const char *name, size_t size)
+{
+    assert(lw && name && size > 0);
+
+    memset(lw, 0, sizeof(*lw));
+    lw->name = name;
+    lw->fd = -1;
+
+    lw->buf = malloc(size);
+    if (lw->buf == NULL) {
+        vrmr_error(-1, "Error", "malloc failed: %s", strerror(errno));
+        return (-1);
+    }
+    lw->size = size;
+    return (0);
+}
+
+/** \brief write to the file behind 'fp'
+ *
+ *  Call logwriter_flush() before the old file is closed, or the lines
+ *  still in the buffer end up in the new file. The stdio buffer of 'fp' is
+ *  bypassed, so 'fp' must not be written to directly.
+ *
+ *  \param write_through write every line right away instead of buffering
+ */
+void logwriter_attach(struct logwriter *lw, FILE *fp, int write_through)
+{
+    assert(lw);
+
+    lw->fd = fp ? fileno(fp) : -1;
+    lw->write_through = write_through;
+}
+
+/** \internal
+ *  \brief write all of 'iov', continuing after short writes
+ */
+static int logwriter_writev(struct logwriter *lw, struct iovec *iov, int iovcnt)
+{
+    lw->writes++;
+
+    while (iovcnt > 0) {
+        ssize_t n = writev(lw->fd, iov, iovcnt);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            vrmr_error(-1, "Error", "writing to %s failed: %s", lw->name,
+                    strerror(errno));
+            return (-1);
+        }
+
+        /* skip what was written */
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return (0);
+}
+
+/** \brief count the lines in 'buf' as dropped */
+static void logwriter_drop(struct logwriter *lw, const char *buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] == '\n')
+            lw->dropped++;
+    }
+}
+
+/** \brief add a line to the buffer
+ *
+ *  'line' must be a complete line including the newline. If it doesn't fit
+ *  in the buffer, the buffer and the line are written out together.
+ *
+ *  \retval 0 ok
+ *  \retval -1 write error, the line and the buffered lines are lost
+ */
+int logwriter_write(struct logwriter *lw, const char *line, size_t len)
+{
+    assert(lw && line);
+
+    lw->lines++;
+
+    if (lw->fd == -1) {
+        lw->dropped++;
+        return (-1);
+    }
+
+    if (!lw->write_through && lw->len + len <= lw->size) {
+        memcpy(lw->buf + lw->len, line, len);
+        lw->len += len;
+        if (lw->len < lw->size)
+            return (0);
+        return (logwriter_flush(lw));
+    }
+
+    struct iovec iov[2] = {
+            {.iov_base = lw->buf, .iov_len = lw->len},
+            {.iov_base = (void *)line, .iov_len = len},
+    };
+    int r = logwriter_writev(lw, iov, 2);
+    if (r < 0) {
+        logwriter_drop(lw, lw->buf, lw->len);
+        lw->dropped++;
+    }
+    lw->len = 0;
+    return (r);
+}
+
+/** \brief write out the buffered lines
+ *
+ *  \retval 0 ok or nothing to write
+ *  \retval -1 write error, the buffered lines are lost
+ */
+int logwriter_flush(struct logwriter *lw)
+{
+    assert(lw);
+
+    if (lw->len == 0)
+        return (0);
+
+    if (lw->fd == -1) {
+        logwriter_drop(lw, lw->buf, lw->len);
+        lw->len = 0;
+        return (-1);
+    }
+
+    struct iovec iov = {.iov_base = lw->buf, .iov_len = lw->len};
+    int r = logwriter_writev(lw, &iov, 1);
+    if (r < 0)
+        logwriter_drop(lw, lw->buf, lw->len);
+    lw->len = 0;
+    return (r);
+}
+
+/** \brief flush and free the buffer */
+void logwriter_cleanup(struct logwriter *lw)
+{
+    assert(lw);
+
+    (void)logwriter_flush(lw);
+    free(lw->buf);
+    lw->buf = NULL;
+    lw->size = 0;
+    lw->fd = -1;
+}
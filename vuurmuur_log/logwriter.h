@@ -0,0 +1,59 @@
+/***************************************************************************
+ *   Copyright (C) 2003-2019 by Victor Julien                              *
+ *   victor@vuurmuur.org                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __LOGWRITER_H__
+#define __LOGWRITER_H__
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* size of the userspace buffer of each log file */
+#define LOGWRITER_BUFSIZE (64 * 1024)
+
+/** \brief buffered writer for one log file
+ *
+ *  Collects complete lines in a buffer and writes them out with a single
+ *  syscall when the buffer is full, or when logwriter_flush() is called by
+ *  the flush timer, on reload or on shutdown. Only whole lines are ever
+ *  written, so a reader tailing the file never sees half a line.
+ */
+struct logwriter {
+    const char *name;  /* for error messages */
+    int fd;            /* fd of the log file, -1 if not attached */
+    int write_through; /* write every line right away */
+
+    char *buf;
+    size_t size;
+    size_t len;
+
+    /* counters */
+    uint64_t lines;
+    uint64_t writes;
+    uint64_t dropped; /* lines lost to write errors */
+};
+
+int logwriter_init(struct logwriter *, const char *name, size_t size);
+void logwriter_attach(struct logwriter *, FILE *fp, int write_through);
+int logwriter_write(struct logwriter *, const char *line, size_t len);
+int logwriter_flush(struct logwriter *);
+void logwriter_cleanup(struct logwriter *);
+
+#endif /* __LOGWRITER_H__ */
@@ -0,0 +1,154 @@
+/***************************************************************************
+ *   Copyright (C) 2003-2019 by Victor Julien                              *
+ *   victor@vuurmuur.org                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/** \file
+ *  metrics.c serves the metrics socket of vuurmuur_log in its own thread.
+ *
+ *  Answering a client can block: we give it a moment to send its request,
+ *  and a slow reader can keep a send busy for a while. The main thread
+ *  can't afford that, it has to keep reading the netlink sockets. So it
+ *  only takes a snapshot of the counters now and then (metrics_update()),
+ *  and the metrics thread answers the clients from the last snapshot.
+ */
+
+#include "vuurmuur_log.h"
+
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "stats.h"
+#include "metrics.h"
+
+static struct {
+    struct vrmr_metrics_server server;
+    pthread_t thread;
+    int running;
+    int stop_fd; /* eventfd to stop the thread */
+
+    /* protects 'snap' */
+    pthread_mutex_t lock;
+    struct metrics_snapshot snap;
+} ms = {
+        .server = {.fd = -1},
+        .stop_fd = -1,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void metrics_fill(struct vrmr_metrics *m, void *data ATTR_UNUSED)
+{
+    struct metrics_snapshot snap;
+
+    pthread_mutex_lock(&ms.lock);
+    snap = ms.snap;
+    pthread_mutex_unlock(&ms.lock);
+
+    write_metrics(m, &snap);
+}
+
+static void *metrics_main(void *arg ATTR_UNUSED)
+{
+    struct pollfd pfd[2] = {
+            {ms.server.fd, POLLIN, 0},
+            {ms.stop_fd, POLLIN, 0},
+    };
+
+    for (;;) {
+        if (poll(pfd, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            vrmr_error(-1, "Error", "poll failed: %s", strerror(errno));
+            break;
+        }
+        if (pfd[1].revents != 0)
+            break;
+        if (pfd[0].revents != 0)
+            vrmr_metrics_serve(&ms.server, metrics_fill, NULL);
+    }
+    return (NULL);
+}
+
+/** \brief open the metrics socket at 'path' and start serving it
+ *
+ *  Must be called with the signals blocked, like pipeline_start().
+ *
+ *  \retval 0 ok
+ *  \retval -1 error
+ */
+int metrics_start(const char *path)
+{
+    assert(path);
+    assert(!ms.running);
+
+    if (vrmr_metrics_listen(&ms.server, path) < 0)
+        return (-1);
+
+    ms.stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (ms.stop_fd == -1) {
+        vrmr_error(-1, "Error", "eventfd failed: %s", strerror(errno));
+        vrmr_metrics_close(&ms.server);
+        return (-1);
+    }
+
+    int r = pthread_create(&ms.thread, NULL, metrics_main, NULL);
+    if (r != 0) {
+        vrmr_error(-1, "Error", "pthread_create failed: %s", strerror(r));
+        close(ms.stop_fd);
+        ms.stop_fd = -1;
+        vrmr_metrics_close(&ms.server);
+        return (-1);
+    }
+    (void)pthread_setname_np(ms.thread, "vrmr-metrics");
+
+    ms.running = 1;
+    return (0);
+}
+
+/** \brief stop serving and remove the metrics socket */
+void metrics_stop(void)
+{
+    if (!ms.running)
+        return;
+
+    uint64_t one = 1;
+    if (write(ms.stop_fd, &one, sizeof(one)) != (ssize_t)sizeof(one))
+        vrmr_debug(NONE, "eventfd write failed: %s", strerror(errno));
+    (void)pthread_join(ms.thread, NULL);
+    ms.running = 0;
+
+    close(ms.stop_fd);
+    ms.stop_fd = -1;
+    vrmr_metrics_close(&ms.server);
+}
+
+int metrics_running(void)
+{
+    return (ms.running);
+}
+
+/** \brief hand a new snapshot of the counters to the metrics thread */
+void metrics_update(const struct metrics_snapshot *snap)
+{
+    assert(snap);
+
+    pthread_mutex_lock(&ms.lock);
+    ms.snap = *snap;
+    pthread_mutex_unlock(&ms.lock);
+}
@@ -42,8 +42,40 @@
 #include <netinet/icmp6.h>
 #endif /* IPV6_ENABLED */
 
-static int fd = -1;
-static struct nflog_handle *h = NULL;
+/* number of netlink messages we try to get per recvmmsg() call. Each message
+ * holds up to 'nflog_threshold' packets, as batched by the kernel. */
+#define NFLOG_RECV_BATCH 8
+
+/** \brief receiver for one NFLOG group
+ *
+ *  Every group has its own handle and socket, so the kernel queues the
+ *  messages of each group separately and a burst in one group does not
+ *  overrun the others.
+ */
+struct nflog_worker {
+    unsigned int group;
+    struct nflog_handle *h;
+    int fd;
+    int rcvbuf_size;
+    char name[16]; /* "nflog <group>" for messages */
+
+    /* the next NFULA_SEQ we expect, to detect lost packets */
+    uint32_t seq_next;
+    int seq_valid;
+
+    char *recv_bufs;
+    size_t recv_bufsize;
+    struct mmsghdr recv_msgs[NFLOG_RECV_BATCH];
+    struct iovec recv_iovs[NFLOG_RECV_BATCH];
+
+    /* the record the callback fills: it keeps the hostname between
+     * packets */
+    struct vrmr_log_record record;
+};
+
+static struct nflog_worker workers[VRMR_MAX_NFLOG_GROUPS];
+static unsigned int nworkers = 0;
+static struct logcounters *counters = NULL;
 
 union ipv4_adress {
     uint8_t a[4];
@@ -87,23 +119,29 @@ static int createlogrule_callback(struct nflog_g_handle *gh ATTR_UNUSED,
     char *payload;
     int payload_len;
     struct timeval tv;
-    struct vrmr_log_record *log_record = data;
-    char s[256];
+    struct nflog_worker *w = data;
+    struct vrmr_log_record *log_record = &w->record;
     union ipv4_adress ip;
 
-    memset(log_record, 0, sizeof(struct vrmr_log_record));
+    /* the kernel numbers every packet it logs to our group, so a gap in
+     * the numbers is the count of packets that never reached us. A number
+     * lower than expected means the sequence was reset (e.g. the group was
+     * rebound), so we just resync on it. */
+    uint32_t seq;
+    if (nflog_get_seq(nfa, &seq) == 0) {
+        int32_t gap = (int32_t)(seq - w->seq_next);
+        if (w->seq_valid && gap > 0)
+            counters->nflog_lost += (uint32_t)gap;
+        w->seq_next = seq + 1;
+        w->seq_valid = 1;
+    }
+
+    vrmr_log_record_reset(log_record);
 
     /* Check first if this pkt comes from a vuurmuur logrule */
     char *prefix = nflog_get_prefix(nfa);
     vrmr_log_record_parse_prefix(log_record, prefix);
 
-    /* Copy hostname in log_rule struct, seems kind of silly to do this every
-     * time */
-    if (gethostname(log_record->hostname, HOST_NAME_MAX) == -1) {
-        vrmr_debug(NONE, "Error getting hostname");
-        return -1;
-    }
-
     /* Alright, get the nflog packet header and determine what hw_protocol we're
      * dealing with */
     if (!(ph = nflog_get_msg_packet_hdr(nfa))) {
@@ -121,6 +159,9 @@ static int createlogrule_callback(struct nflog_g_handle *gh ATTR_UNUSED,
             mac2str(hwhdr + 6, macstr, sizeof(macstr));
             snprintf(log_record->src_mac, sizeof(log_record->src_mac), "(%17s)",
                     macstr);
+            memcpy(log_record->dst_hwaddr, hwhdr, 6);
+            memcpy(log_record->src_hwaddr, hwhdr + 6, 6);
+            log_record->have_hwaddr = 1;
         }
     }
 
@@ -149,17 +190,9 @@ static int createlogrule_callback(struct nflog_g_handle *gh ATTR_UNUSED,
     /* Put packet's timestamp in log_rule struct */
     /* If not in pkt, generate it ourselves */
     if (nflog_get_timestamp(nfa, &tv) == -1) {
-        gettimeofday(&tv, NULL);
-    }
-    time_t when = tv.tv_sec;
-    struct tm *tm = localtime(&when);
-    strftime(s, 256, "%b %d %T", tm);
-    if (sscanf(s, "%3s %2d %2d:%2d:%2d", log_record->month, &log_record->day,
-                &log_record->hour, &log_record->minute,
-                &log_record->second) != 5) {
-        vrmr_debug(NONE, "did not find properly formatted timestamp");
-        return -1;
+        tv.tv_sec = time(NULL);
     }
+    (void)log_record_set_time(log_record, tv.tv_sec);
 
     /* Now we still need to look into the packet itself for source/dest ports */
     if ((payload_len = nflog_get_payload(nfa, &payload)) == -1) {
@@ -197,10 +230,15 @@ static int createlogrule_callback(struct nflog_g_handle *gh ATTR_UNUSED,
 
                 struct iphdr *iph = (struct iphdr *)payload;
                 protoh = (uint32_t *)iph + iph->ihl;
+                /* the packet is cut at NFLOG_SNAPLEN, so what is left of
+                 * it may not hold the complete protocol header */
+                int protoh_len = payload_len - iph->ihl * 4;
                 log_record->protocol = iph->protocol;
                 log_record->packet_len = ntohs(iph->tot_len) - iph->ihl * 4;
                 switch (log_record->protocol) {
                     case IPPROTO_TCP:
+                        if (protoh_len < (int)sizeof(struct tcphdr))
+                            break;
                         tcph = (struct tcphdr *)protoh;
                         log_record->src_port = ntohs(tcph->source);
                         log_record->dst_port = ntohs(tcph->dest);
@@ -212,11 +250,15 @@ static int createlogrule_callback(struct nflog_g_handle *gh ATTR_UNUSED,
                         log_record->urg = tcph->urg;
                         break;
                     case IPPROTO_ICMP:
+                        if (protoh_len < (int)sizeof(struct icmphdr))
+                            break;
                         icmph = (struct icmphdr *)protoh;
                         log_record->icmp_type = icmph->type;
                         log_record->icmp_code = icmph->code;
                         break;
                     case IPPROTO_UDP:
+                        if (protoh_len < (int)sizeof(struct udphdr))
+                            break;
                         udph = (struct udphdr *)protoh;
                         log_record->src_port = ntohs(udph->source);
                         log_record->dst_port = ntohs(udph->dest);
@@ -228,6 +270,9 @@ static int createlogrule_callback(struct nflog_g_handle *gh ATTR_UNUSED,
                 ip.saddr = iph->daddr;
                 snprintf(log_record->dst_ip, sizeof(log_record->dst_ip),
                         "%u.%u.%u.%u", ip.a[0], ip.a[1], ip.a[2], ip.a[3]);
+                log_record->src_addr.ipv4.s_addr = iph->saddr;
+                log_record->dst_addr.ipv4.s_addr = iph->daddr;
+                log_record->have_addr = 1;
                 log_record->ttl = iph->ttl;
                 break;
             }
@@ -246,6 +291,9 @@ static int createlogrule_callback(struct nflog_g_handle *gh ATTR_UNUSED,
                         log_record->src_ip, sizeof(log_record->src_ip));
                 inet_ntop(AF_INET6, (const void *)&ip6h->ip6_dst,
                         log_record->dst_ip, sizeof(log_record->dst_ip));
+                log_record->src_addr.ipv6 = ip6h->ip6_src;
+                log_record->dst_addr.ipv6 = ip6h->ip6_dst;
+                log_record->have_addr = 1;
 
                 log_record->ttl = ip6h->ip6_hlim;
                 log_record->packet_len = 40 + ntohs(ip6h->ip6_plen);
@@ -279,7 +327,7 @@ static int createlogrule_callback(struct nflog_g_handle *gh ATTR_UNUSED,
                         }
                         break;
                     case IPPROTO_UDP:
-                        if (payload_len >= (int)sizeof(struct tcphdr)) {
+                        if (payload_len >= (int)sizeof(struct udphdr)) {
                             udph = (struct udphdr *)payload;
                             log_record->src_port = ntohs(udph->source);
                             log_record->dst_port = ntohs(udph->dest);
@@ -301,72 +349,218 @@ static int createlogrule_callback(struct nflog_g_handle *gh ATTR_UNUSED,
     }
 
     /* process the record */
+    counters->nflog_records++;
     process_logrecord(log_record);
     return 0; /* success */
 }
 
-/**
- * \brief subscribe_nflog sets up the nflog handles and callback
+/** \internal
+ *  \brief set up the handle, socket and buffers of a worker
  *
- * And a more detailed description of the function that doesn't fit
- * on 1 line
- *
- * \pre The preconditions of the function, which should be checked by the
- * function \post The postconditions of the function \param[in] var1 The value
- * that is used to devide \param[in,out] var2 A pointer to the result, and ...
- * \return The function returns the value of the calculation.
- * \retval -1 When var1 or var2 is 0
- * \note A note that applies to the function
+ *  \retval 0 ok
+ *  \retval -1 error
  */
-int subscribe_nflog(
-        const struct vrmr_config *conf, struct vrmr_log_record *log_record)
+static int nflog_worker_setup(
+        const struct vrmr_config *conf, struct nflog_worker *w)
 {
-    h = nflog_open();
-    if (!h) {
+    w->h = nflog_open();
+    if (!w->h) {
         vrmr_error(-1, "Internal Error", "nflog_open error");
         return (-1);
     }
 
-    if (nflog_bind_pf(h, AF_INET) < 0) {
+    if (nflog_bind_pf(w->h, AF_INET) < 0) {
         vrmr_error(-1, "Internal Error", "nflog_bind_pf error");
         return (-1);
     }
 
-    struct nflog_g_handle *qh = nflog_bind_group(h, conf->nfgrp);
+    struct nflog_g_handle *qh = nflog_bind_group(w->h, (uint16_t)w->group);
     if (!qh) {
         vrmr_error(-1, "Internal Error",
-                "nflog_bind_group(%p, %d) error, other process attached? %s", h,
-                conf->nfgrp, strerror(errno));
+                "nflog_bind_group(%p, %u) error, other process attached? %s",
+                w->h, w->group, strerror(errno));
         return (-1);
     }
 
-    if (nflog_set_mode(qh, NFULNL_COPY_PACKET, 0xffff) < 0) {
+    /* we only look at the headers, so only have those copied to us */
+    if (nflog_set_mode(qh, NFULNL_COPY_PACKET, conf->nflog_snaplen) < 0) {
         vrmr_error(-1, "Internal Error", "nflog_set_mode error %s",
                 strerror(errno));
         return (-1);
     }
 
-    nflog_callback_register(qh, &createlogrule_callback, log_record);
+    /* let the kernel batch the packets into large netlink messages. Failing
+     * to set these is not fatal: we just get the kernel defaults. */
+    if (nflog_set_nlbufsiz(qh, conf->nflog_bufsize) < 0) {
+        vrmr_warning("Warning", "nflog_set_nlbufsiz(%u) failed: %s",
+                conf->nflog_bufsize, strerror(errno));
+    }
+    if (nflog_set_qthresh(qh, conf->nflog_threshold) < 0) {
+        vrmr_warning("Warning", "nflog_set_qthresh(%u) failed: %s",
+                conf->nflog_threshold, strerror(errno));
+    }
+    if (nflog_set_timeout(qh, conf->nflog_timeout) < 0) {
+        vrmr_warning("Warning", "nflog_set_timeout(%u) failed: %s",
+                conf->nflog_timeout, strerror(errno));
+    }
+
+    /* have the kernel number the packets so we can count what we lose. We
+     * don't use NFULNL_CFG_F_SEQ_GLOBAL: it counts the packets logged to all
+     * groups, so gaps in it are no sign of loss in ours. */
+    if (nflog_set_flags(qh, NFULNL_CFG_F_SEQ) < 0) {
+        vrmr_warning("Warning",
+                "nflog_set_flags failed: %s, can't count lost packets",
+                strerror(errno));
+    }
+
+    nflog_callback_register(qh, &createlogrule_callback, w);
+
+    w->fd = nflog_fd(w->h);
+
+    if (socket_set_rcvbuf(w->fd, NETLINK_RCVBUF_MIN) == 0)
+        w->rcvbuf_size = NETLINK_RCVBUF_MIN;
+
+    /* a receive buffer must hold a complete netlink message, or the
+     * message is truncated and all packets in it are lost. */
+    w->recv_bufsize = conf->nflog_bufsize;
+    w->recv_bufs = malloc(w->recv_bufsize * NFLOG_RECV_BATCH);
+    if (w->recv_bufs == NULL) {
+        vrmr_error(-1, "Error", "malloc failed: %s", strerror(errno));
+        return (-1);
+    }
+    for (int i = 0; i < NFLOG_RECV_BATCH; i++) {
+        w->recv_iovs[i].iov_base = w->recv_bufs + (i * w->recv_bufsize);
+        w->recv_iovs[i].iov_len = w->recv_bufsize;
+        memset(&w->recv_msgs[i], 0, sizeof(w->recv_msgs[i]));
+        w->recv_msgs[i].msg_hdr.msg_iov = &w->recv_iovs[i];
+        w->recv_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    return (0);
+}
+
+/**
+ * \brief subscribe_nflog sets up a worker for every NFLOG group
+ *
+ * vuurmuur spreads the log rules over 'nflog_groups' groups starting at
+ * 'nfgrp'. Each group gets its own handle, socket and buffers, see
+ * struct nflog_worker. The records of all groups go to the same pipeline.
+ *
+ * \retval 0 ok
+ * \retval -1 error
+ */
+int subscribe_nflog(const struct vrmr_config *conf, struct logcounters *c)
+{
+    assert(conf && c);
+    assert(nworkers == 0);
 
-    fd = nflog_fd(h);
+    counters = c;
 
-    vrmr_info("Info", "subscribed to nflog group %u", conf->nfgrp);
+    unsigned int groups = conf->nflog_groups;
+    if (groups < 1 || groups > VRMR_MAX_NFLOG_GROUPS)
+        groups = 1;
+
+    for (unsigned int i = 0; i < groups; i++) {
+        struct nflog_worker *w = &workers[i];
+
+        memset(w, 0, sizeof(*w));
+        w->fd = -1;
+        w->group = (unsigned int)conf->nfgrp + i;
+        snprintf(w->name, sizeof(w->name), "nflog %u", w->group);
+        nworkers++;
+
+        if (nflog_worker_setup(conf, w) < 0)
+            return (-1);
+    }
+    nflog_update_hostname();
+
+    vrmr_info("Info",
+            "subscribed to nflog groups %u-%u (threshold %u, timeout %u, "
+            "bufsize %u)",
+            workers[0].group, workers[nworkers - 1].group,
+            conf->nflog_threshold, conf->nflog_timeout, conf->nflog_bufsize);
     return 0;
 }
 
-int readnflog(void)
+/** \brief (re)read the hostname into the record
+ *
+ *  The hostname rarely changes, so we only look it up at startup and
+ *  reload instead of for every packet.
+ */
+void nflog_update_hostname(void)
+{
+    char hostname[sizeof(workers[0].record.hostname)];
+
+    if (gethostname(hostname, sizeof(hostname)) == -1) {
+        vrmr_debug(NONE, "Error getting hostname: %s", strerror(errno));
+        hostname[0] = '\0';
+    }
+    hostname[sizeof(hostname) - 1] = '\0';
+
+    for (unsigned int i = 0; i < nworkers; i++)
+        memcpy(workers[i].record.hostname, hostname, sizeof(hostname));
+}
+
+/** \brief close the nflog handles and free the receive buffers
+ */
+void unsubscribe_nflog(void)
+{
+    for (unsigned int i = 0; i < nworkers; i++) {
+        struct nflog_worker *w = &workers[i];
+
+        if (w->h != NULL)
+            nflog_close(w->h);
+        free(w->recv_bufs);
+        memset(w, 0, sizeof(*w));
+        w->fd = -1;
+    }
+    nworkers = 0;
+}
+
+/** \brief get the number of nflog workers, one per group */
+unsigned int get_nflog_workers(void)
 {
-    int rv;
-    char buf[4096];
+    return nworkers;
+}
 
-    if ((rv = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) == -1) {
+/** \brief get the socket fd of a worker for polling
+ *  \retval fd or -1 if not subscribed
+ */
+int get_nflog_fd(unsigned int worker)
+{
+    if (worker >= nworkers)
+        return -1;
+    return workers[worker].fd;
+}
+
+/**
+ *  \brief read a batch of netlink messages from the socket of a worker
+ *
+ *  Gets up to NFLOG_RECV_BATCH messages with a single recvmmsg() call and
+ *  feeds them to libnetfilter_log, which calls createlogrule_callback for
+ *  every packet in them.
+ *
+ *  \retval >0 number of messages read, or 1 after an overrun: keep reading
+ *  \retval 0 no data available
+ *  \retval -1 error
+ */
+int readnflog(unsigned int worker)
+{
+    assert(worker < nworkers);
+    struct nflog_worker *w = &workers[worker];
+
+    int n = recvmmsg(
+            w->fd, w->recv_msgs, NFLOG_RECV_BATCH, MSG_DONTWAIT, NULL);
+    if (n == -1) {
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
             return 0;
         } else if (errno == ENOBUFS) {
-            vrmr_error(-1, "Error",
-                    "ENOBUFS on recv, may need to "
-                    "increase netlink_socket_buffer_size");
-            return -1;
+            /* the socket buffer overflowed and the kernel dropped messages.
+             * The socket works again right away and the sequence numbers
+             * tell how many packets we lost, so just keep reading. */
+            counters->nflog_overruns++;
+            if (w->rcvbuf_size > 0)
+                socket_grow_rcvbuf(w->fd, &w->rcvbuf_size, w->name);
+            return 1;
         } else {
             vrmr_error(
                     -1, "Internal Error", "cannot recv: %s", strerror(errno));
@@ -374,15 +568,22 @@ int readnflog(void)
         }
     }
 
-    errno = 0;
-    rv = nflog_handle_packet(h, buf, rv);
-    if (rv != 0) {
-        if (errno != 0)
-            vrmr_debug(NONE, "nflog_handle_packet() returned %d: %s", rv,
-                    strerror(errno));
-        else
-            vrmr_debug(LOW, "nflog_handle_packet() returned %d", rv);
-        return (2); /* invalid record */
+    for (int i = 0; i < n; i++) {
+        if (w->recv_msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            vrmr_debug(NONE, "nflog message truncated, increase NFLOG_BUFSIZE");
+            continue;
+        }
+
+        errno = 0;
+        int rv = nflog_handle_packet(
+                w->h, w->recv_iovs[i].iov_base, (int)w->recv_msgs[i].msg_len);
+        if (rv != 0) {
+            if (errno != 0)
+                vrmr_debug(NONE, "nflog_handle_packet() returned %d: %s", rv,
+                        strerror(errno));
+            else
+                vrmr_debug(LOW, "nflog_handle_packet() returned %d", rv);
+        }
     }
-    return (1);
+    return (n);
 }
@@ -26,8 +26,11 @@
 #include <netinet/ip.h>
 #include <libnetfilter_log/libnetfilter_log.h>
 
-int subscribe_nflog(
-        const struct vrmr_config *, struct vrmr_log_record *logrule);
-int readnflog(void);
+int subscribe_nflog(const struct vrmr_config *, struct logcounters *);
+void nflog_update_hostname(void);
+void unsubscribe_nflog(void);
+unsigned int get_nflog_workers(void);
+int get_nflog_fd(unsigned int worker);
+int readnflog(unsigned int worker);
 
 #endif
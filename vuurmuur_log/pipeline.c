@@ -0,0 +1,573 @@
+/***************************************************************************
+ *   Copyright (C) 2003-2019 by Victor Julien                              *
+ *   victor@vuurmuur.org                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/** \file
+ *  pipeline.c runs the annotate and write stages of vuurmuur_log in their
+ *  own threads.
+ *
+ *  The main thread receives the records from the nflog and conntrack
+ *  sockets and queues them. The annotate thread looks up the names and
+ *  builds the log lines, the write thread hands them to the log writers
+ *  and the events to the archive.
+ *  The stages are connected by single producer, single consumer rings, so
+ *  no lock is taken per record, and a slow disk fills the rings instead of
+ *  stalling the socket reads.
+ *
+ *  The zone index, the service classifier and the log writers are shared
+ *  with the main thread. Before the main thread touches them (reload,
+ *  reopening the logs, shutdown) it calls pipeline_pause(), which returns
+ *  once both stages are idle with empty rings.
+ */
+
+#include "vuurmuur_log.h"
+
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "pipeline.h"
+
+#define CACHE_LINE_SIZE 64
+
+/* wake the annotate thread after this many records, even if the main
+ * thread is still busy draining a socket */
+#define PIPELINE_KICK_BATCH 64
+
+/** \brief single producer, single consumer ring
+ *
+ *  'head' is only written by the producer and 'tail' only by the consumer.
+ *  The consumer advances 'tail' when it is done with a slot, so the
+ *  producer never overwrites a slot that is still in use.
+ */
+struct ring {
+    uint32_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+    uint32_t max_depth; /* written by the producer */
+    uint32_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+
+    uint32_t size __attribute__((aligned(CACHE_LINE_SIZE)));
+    size_t slot_size;
+    char *slots;
+    int efd; /* eventfd to wake the consumer */
+};
+
+struct record_slot {
+    enum pipeline_source source;
+    struct vrmr_log_record lr;
+};
+
+/* 'lw' NULL means the slot holds an event for the archive */
+struct line_slot {
+    struct logwriter *lw;
+    size_t len;
+    union {
+        char line[PIPELINE_LINE_MAX];
+        struct vrmr_event ev;
+    };
+};
+
+static struct {
+    struct ring records;
+    struct ring lines;
+
+    pipeline_annotate_func annotate;
+    pipeline_tick_func tick;
+    pipeline_archive_func archive;
+    struct logwriter **writers;
+
+    pthread_t annotate_thread;
+    pthread_t write_thread;
+    int running;
+
+    /* protects the flags below */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int paused;
+    int stop;
+    int flush;
+    int tick_pending;
+    int annotate_parked;
+    int write_parked;
+
+    /* main thread only */
+    uint32_t unkicked;
+    uint64_t received;
+    uint64_t dropped;
+    /* annotate thread only */
+    uint64_t annotated;
+    uint64_t write_stalls;
+    /* write thread only */
+    uint64_t written;
+} pl = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static int ring_init(struct ring *r, uint32_t size, size_t slot_size)
+{
+    assert(size > 0 && (size & (size - 1)) == 0);
+
+    memset(r, 0, sizeof(*r));
+    r->efd = -1;
+
+    r->slots = calloc(size, slot_size);
+    if (r->slots == NULL) {
+        vrmr_error(-1, "Error", "calloc failed: %s", strerror(errno));
+        return (-1);
+    }
+    r->size = size;
+    r->slot_size = slot_size;
+
+    r->efd = eventfd(0, EFD_CLOEXEC);
+    if (r->efd == -1) {
+        vrmr_error(-1, "Error", "eventfd failed: %s", strerror(errno));
+        free(r->slots);
+        r->slots = NULL;
+        return (-1);
+    }
+    return (0);
+}
+
+static void ring_destroy(struct ring *r)
+{
+    free(r->slots);
+    r->slots = NULL;
+    if (r->efd != -1)
+        close(r->efd);
+    r->efd = -1;
+}
+
+static inline void *ring_slot(const struct ring *r, uint32_t pos)
+{
+    return (r->slots + (size_t)(pos & (r->size - 1)) * r->slot_size);
+}
+
+/* producer: get the next free slot, or NULL if the ring is full */
+static void *ring_produce_slot(struct ring *r)
+{
+    uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (r->head - tail == r->size)
+        return (NULL);
+    return (ring_slot(r, r->head));
+}
+
+/* producer: publish the slot returned by ring_produce_slot() */
+static void ring_produce(struct ring *r)
+{
+    uint32_t head = r->head + 1;
+    __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+
+    uint32_t depth = head - __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    if (depth > r->max_depth)
+        __atomic_store_n(&r->max_depth, depth, __ATOMIC_RELAXED);
+}
+
+/* consumer: get the oldest used slot, or NULL if the ring is empty */
+static void *ring_consume_slot(struct ring *r)
+{
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    if (head == r->tail)
+        return (NULL);
+    return (ring_slot(r, r->tail));
+}
+
+/* consumer: release the slot returned by ring_consume_slot() */
+static void ring_consume(struct ring *r)
+{
+    __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+
+static uint32_t ring_depth(const struct ring *r)
+{
+    return (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) -
+            __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+}
+
+static void ring_wake(struct ring *r)
+{
+    uint64_t one = 1;
+    if (write(r->efd, &one, sizeof(one)) != (ssize_t)sizeof(one))
+        vrmr_debug(NONE, "eventfd write failed: %s", strerror(errno));
+}
+
+/* consumer: sleep until the producer calls ring_wake() */
+static void ring_wait(struct ring *r)
+{
+    uint64_t cnt;
+    while (read(r->efd, &cnt, sizeof(cnt)) == -1 && errno == EINTR)
+        ;
+}
+
+/** \internal
+ *  \brief wait for work, or park while the pipeline is paused
+ *
+ *  A stage parks only if its input ring is empty and 'upstream_parked' is
+ *  set, so pipeline_pause() returns with all queued records written.
+ *
+ *  \retval 1 the thread should exit
+ *  \retval 0 look for work again
+ */
+static int stage_wait(struct ring *in, int *parked, const int *upstream_parked)
+{
+    pthread_mutex_lock(&pl.lock);
+    if (pl.stop) {
+        pthread_mutex_unlock(&pl.lock);
+        return (1);
+    }
+    if (!pl.paused) {
+        pthread_mutex_unlock(&pl.lock);
+        ring_wait(in);
+        return (0);
+    }
+    if (ring_depth(in) > 0 || (upstream_parked && !*upstream_parked)) {
+        /* still work to do before we can park */
+        pthread_mutex_unlock(&pl.lock);
+        if (ring_depth(in) == 0)
+            ring_wait(in);
+        return (0);
+    }
+
+    *parked = 1;
+    pthread_cond_broadcast(&pl.cond);
+    /* the write stage waits for us to park */
+    if (in == &pl.records)
+        ring_wake(&pl.lines);
+    while (pl.paused && !pl.stop)
+        pthread_cond_wait(&pl.cond, &pl.lock);
+    *parked = 0;
+    int stop = pl.stop;
+    pthread_mutex_unlock(&pl.lock);
+    return (stop);
+}
+
+/* annotate thread: get a free line slot, waiting for the write stage if
+ * the ring is full */
+static struct line_slot *annotate_line_slot(void)
+{
+    struct line_slot *ls;
+
+    while ((ls = ring_produce_slot(&pl.lines)) == NULL) {
+        /* the write stage is behind, give it some time */
+        ring_wake(&pl.lines);
+        __atomic_add_fetch(&pl.write_stalls, 1, __ATOMIC_RELAXED);
+        usleep(1000);
+    }
+    return (ls);
+}
+
+static void *annotate_main(void *arg ATTR_UNUSED)
+{
+    char line[PIPELINE_LINE_MAX];
+
+    do {
+        struct record_slot *rs;
+
+        while ((rs = ring_consume_slot(&pl.records)) != NULL) {
+            /* the line is built outside of the ring: the annotate function
+             * may queue events and lines itself, which take line slots */
+            struct logwriter *lw =
+                    pl.annotate(rs->source, &rs->lr, line, sizeof(line));
+            if (lw != NULL) {
+                struct line_slot *ls = annotate_line_slot();
+                ls->lw = lw;
+                ls->len = strlen(line);
+                memcpy(ls->line, line, ls->len + 1);
+                ring_produce(&pl.lines);
+            }
+            ring_consume(&pl.records);
+            __atomic_add_fetch(&pl.annotated, 1, __ATOMIC_RELAXED);
+        }
+
+        pthread_mutex_lock(&pl.lock);
+        int tick = pl.tick_pending;
+        pl.tick_pending = 0;
+        pthread_mutex_unlock(&pl.lock);
+        if (tick && pl.tick != NULL)
+            pl.tick();
+
+        ring_wake(&pl.lines);
+    } while (stage_wait(&pl.records, &pl.annotate_parked, NULL) == 0);
+
+    return (NULL);
+}
+
+/** \brief queue an extra line for the write stage
+ *
+ *  Only to be called by the annotate and tick functions, in the annotate
+ *  thread. From the annotate function the line goes before the line of
+ *  the record being annotated. Lines longer than PIPELINE_LINE_MAX are cut.
+ */
+void pipeline_emit(struct logwriter *lw, const char *line)
+{
+    assert(lw && line);
+
+    struct line_slot *ls = annotate_line_slot();
+    ls->lw = lw;
+    ls->len = strlcpy(ls->line, line, sizeof(ls->line));
+    if (ls->len >= sizeof(ls->line))
+        ls->len = sizeof(ls->line) - 1;
+    ring_produce(&pl.lines);
+}
+
+/** \brief queue an event for the archive
+ *
+ *  Only to be called by the annotate function, in the annotate thread.
+ *  The write thread hands it to the archive function, so the archive file
+ *  is written next to the logs and not in the annotate thread.
+ */
+void pipeline_archive(const struct vrmr_event *ev)
+{
+    assert(ev);
+
+    if (pl.archive == NULL)
+        return;
+
+    struct line_slot *ls = annotate_line_slot();
+    ls->lw = NULL;
+    ls->len = 0;
+    memcpy(&ls->ev, ev, sizeof(ls->ev));
+    ring_produce(&pl.lines);
+}
+
+static void *write_main(void *arg ATTR_UNUSED)
+{
+    do {
+        struct line_slot *ls;
+
+        while ((ls = ring_consume_slot(&pl.lines)) != NULL) {
+            if (ls->lw == NULL)
+                pl.archive(&ls->ev);
+            else
+                (void)logwriter_write(ls->lw, ls->line, ls->len);
+            ring_consume(&pl.lines);
+            __atomic_add_fetch(&pl.written, 1, __ATOMIC_RELAXED);
+        }
+
+        pthread_mutex_lock(&pl.lock);
+        int flush = pl.flush;
+        pl.flush = 0;
+        pthread_mutex_unlock(&pl.lock);
+        if (flush) {
+            for (int i = 0; pl.writers[i] != NULL; i++)
+                (void)logwriter_flush(pl.writers[i]);
+        }
+    } while (stage_wait(&pl.lines, &pl.write_parked, &pl.annotate_parked) ==
+             0);
+
+    return (NULL);
+}
+
+/** \brief start the annotate and write threads
+ *
+ *  Must be called after daemon(), and with the signals blocked so they are
+ *  all delivered to the main thread.
+ *
+ *  \param tick called by the annotate thread on pipeline_request_tick(),
+ *              may be NULL
+ *  \param archive called by the write thread for the events queued with
+ *                 pipeline_archive(), may be NULL
+ *  \param writers NULL terminated list of the writers the lines go to,
+ *                 flushed on pipeline_request_flush()
+ *  \retval 0 ok
+ *  \retval -1 error
+ */
+int pipeline_start(pipeline_annotate_func annotate, pipeline_tick_func tick,
+        pipeline_archive_func archive, struct logwriter **writers)
+{
+    assert(annotate && writers);
+    assert(!pl.running);
+
+    pl.annotate = annotate;
+    pl.tick = tick;
+    pl.archive = archive;
+    pl.writers = writers;
+
+    if (ring_init(&pl.records, PIPELINE_RECORD_SLOTS,
+                sizeof(struct record_slot)) < 0)
+        return (-1);
+    if (ring_init(&pl.lines, PIPELINE_LINE_SLOTS, sizeof(struct line_slot)) <
+            0) {
+        ring_destroy(&pl.records);
+        return (-1);
+    }
+
+    int r = pthread_create(&pl.annotate_thread, NULL, annotate_main, NULL);
+    if (r != 0) {
+        vrmr_error(-1, "Error", "pthread_create failed: %s", strerror(r));
+        goto error;
+    }
+    r = pthread_create(&pl.write_thread, NULL, write_main, NULL);
+    if (r != 0) {
+        vrmr_error(-1, "Error", "pthread_create failed: %s", strerror(r));
+        pthread_mutex_lock(&pl.lock);
+        pl.stop = 1;
+        pthread_mutex_unlock(&pl.lock);
+        ring_wake(&pl.records);
+        (void)pthread_join(pl.annotate_thread, NULL);
+        pl.stop = 0;
+        goto error;
+    }
+    (void)pthread_setname_np(pl.annotate_thread, "vrmr-annotate");
+    (void)pthread_setname_np(pl.write_thread, "vrmr-write");
+
+    pl.running = 1;
+    return (0);
+
+error:
+    ring_destroy(&pl.records);
+    ring_destroy(&pl.lines);
+    return (-1);
+}
+
+/** \brief stop the threads after the queued records are written */
+void pipeline_stop(void)
+{
+    if (!pl.running)
+        return;
+
+    pipeline_pause();
+
+    pthread_mutex_lock(&pl.lock);
+    pl.stop = 1;
+    pthread_cond_broadcast(&pl.cond);
+    pthread_mutex_unlock(&pl.lock);
+
+    (void)pthread_join(pl.annotate_thread, NULL);
+    (void)pthread_join(pl.write_thread, NULL);
+    pl.running = 0;
+
+    ring_destroy(&pl.records);
+    ring_destroy(&pl.lines);
+}
+
+/** \brief queue a record for the annotate stage
+ *
+ *  The record is copied, so the caller can reuse it right away.
+ *
+ *  \retval 0 queued
+ *  \retval -1 dropped, the ring is full
+ */
+int pipeline_submit(
+        enum pipeline_source source, const struct vrmr_log_record *lr)
+{
+    struct record_slot *rs = ring_produce_slot(&pl.records);
+    if (rs == NULL) {
+        pl.dropped++;
+        pipeline_kick();
+        return (-1);
+    }
+
+    rs->source = source;
+    memcpy(&rs->lr, lr, sizeof(rs->lr));
+    ring_produce(&pl.records);
+    pl.received++;
+
+    if (++pl.unkicked >= PIPELINE_KICK_BATCH)
+        pipeline_kick();
+    return (0);
+}
+
+/** \brief wake the annotate stage if records were queued since last time
+ *
+ *  The main thread calls this after handling a batch of events, so the
+ *  annotate thread is woken once per batch instead of once per record.
+ */
+void pipeline_kick(void)
+{
+    if (pl.unkicked == 0)
+        return;
+
+    pl.unkicked = 0;
+    ring_wake(&pl.records);
+}
+
+/** \brief have the write stage flush the log writers */
+void pipeline_request_flush(void)
+{
+    pthread_mutex_lock(&pl.lock);
+    pl.flush = 1;
+    pthread_mutex_unlock(&pl.lock);
+    ring_wake(&pl.lines);
+}
+
+/** \brief have the annotate stage call the tick function */
+void pipeline_request_tick(void)
+{
+    pthread_mutex_lock(&pl.lock);
+    pl.tick_pending = 1;
+    pthread_mutex_unlock(&pl.lock);
+    ring_wake(&pl.records);
+}
+
+/** \brief wait until all queued records are written and both stages idle
+ *
+ *  Until pipeline_resume() the main thread has the zone index, the service
+ *  classifier and the log writers to itself.
+ */
+void pipeline_pause(void)
+{
+    if (!pl.running)
+        return;
+
+    pipeline_kick();
+
+    pthread_mutex_lock(&pl.lock);
+    pl.paused = 1;
+    pthread_mutex_unlock(&pl.lock);
+
+    ring_wake(&pl.records);
+    ring_wake(&pl.lines);
+
+    pthread_mutex_lock(&pl.lock);
+    while (!pl.annotate_parked || !pl.write_parked)
+        pthread_cond_wait(&pl.cond, &pl.lock);
+    pthread_mutex_unlock(&pl.lock);
+}
+
+void pipeline_resume(void)
+{
+    pthread_mutex_lock(&pl.lock);
+    pl.paused = 0;
+    pthread_cond_broadcast(&pl.cond);
+    pthread_mutex_unlock(&pl.lock);
+}
+
+/** \brief get the counters of the stages
+ *
+ *  The per-thread counters are read without locking, so they are only
+ *  exact while the pipeline is paused or stopped.
+ */
+void pipeline_get_stats(struct pipeline_stats *stats)
+{
+    assert(stats);
+
+    memset(stats, 0, sizeof(*stats));
+    stats->received = pl.received;
+    stats->dropped = pl.dropped;
+    stats->annotated = __atomic_load_n(&pl.annotated, __ATOMIC_RELAXED);
+    stats->written = __atomic_load_n(&pl.written, __ATOMIC_RELAXED);
+    stats->write_stalls = __atomic_load_n(&pl.write_stalls, __ATOMIC_RELAXED);
+    if (pl.records.slots != NULL) {
+        stats->annotate_depth = ring_depth(&pl.records);
+        stats->write_depth = ring_depth(&pl.lines);
+    }
+    stats->annotate_max_depth =
+            __atomic_load_n(&pl.records.max_depth, __ATOMIC_RELAXED);
+    stats->write_max_depth =
+            __atomic_load_n(&pl.lines.max_depth, __ATOMIC_RELAXED);
+}
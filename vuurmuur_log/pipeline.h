@@ -0,0 +1,88 @@
+/***************************************************************************
+ *   Copyright (C) 2003-2019 by Victor Julien                              *
+ *   victor@vuurmuur.org                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include "logwriter.h"
+
+/* number of slots in the record and line rings, must be a power of 2 */
+#define PIPELINE_RECORD_SLOTS 4096
+#define PIPELINE_LINE_SLOTS 4096
+#define PIPELINE_LINE_MAX 1024
+
+enum pipeline_source {
+    PIPELINE_TRAFFIC = 0,
+    PIPELINE_CONN,
+};
+
+/** \brief turn a record into a log line
+ *
+ *  Called by the annotate thread. It may queue extra lines and events with
+ *  pipeline_emit() and pipeline_archive(), but 'line' is not in the ring
+ *  yet: those go before it.
+ *
+ *  \retval lw the log the line in 'line' is for
+ *  \retval NULL nothing to log
+ */
+typedef struct logwriter *(*pipeline_annotate_func)(
+        enum pipeline_source source, struct vrmr_log_record *lr, char *line,
+        size_t size);
+
+/** \brief periodic work of the annotate thread, see pipeline_request_tick()
+ */
+typedef void (*pipeline_tick_func)(void);
+
+/** \brief store an event queued by pipeline_archive()
+ *
+ *  Called by the write thread.
+ */
+typedef void (*pipeline_archive_func)(const struct vrmr_event *ev);
+
+struct pipeline_stats {
+    /* records queued by the receiver and lost because the ring was full */
+    uint64_t received;
+    uint64_t dropped;
+    /* records handled by the annotate stage, lines by the write stage */
+    uint64_t annotated;
+    uint64_t written;
+    /* ring fill levels: current and highest seen */
+    uint32_t annotate_depth;
+    uint32_t annotate_max_depth;
+    uint32_t write_depth;
+    uint32_t write_max_depth;
+    /* times the annotate stage had to wait for the write stage */
+    uint64_t write_stalls;
+};
+
+int pipeline_start(pipeline_annotate_func annotate, pipeline_tick_func tick,
+        pipeline_archive_func archive, struct logwriter **writers);
+void pipeline_stop(void);
+int pipeline_submit(enum pipeline_source, const struct vrmr_log_record *);
+void pipeline_kick(void);
+void pipeline_request_flush(void);
+void pipeline_request_tick(void);
+void pipeline_emit(struct logwriter *lw, const char *line);
+void pipeline_archive(const struct vrmr_event *ev);
+void pipeline_pause(void);
+void pipeline_resume(void);
+void pipeline_get_stats(struct pipeline_stats *);
+
+#endif /* __PIPELINE_H__ */
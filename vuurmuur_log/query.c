@@ -0,0 +1,118 @@
+/***************************************************************************
+ *   Copyright (C) 2003-2019 by Victor Julien                              *
+ *   victor@vuurmuur.org                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/** \file
+ *  query.c implements 'vuurmuur_log --query': searching the traffic
+ *  archive that the daemon writes, see lib/archive.c.
+ */
+
+#include "vuurmuur_log.h"
+#include "query.h"
+
+/** \brief get the location of the traffic archive
+ *
+ *  \retval 0 ok
+ *  \retval -1 error
+ */
+int query_archive_dir(const struct vrmr_config *cnf, char *dir, size_t size)
+{
+    assert(cnf && dir);
+
+    if (snprintf(dir, size, "%s/archive", cnf->vuurmuur_logdir_location) >=
+            (int)size) {
+        vrmr_error(-1, "Error", "archive directory name too long");
+        return (-1);
+    }
+    return (0);
+}
+
+/** \internal
+ *
+ *  \brief print a record from the archive like it is in the traffic log
+ *
+ *  \retval -1 writing failed, most likely the reader went away
+ */
+static int query_print(const struct vrmr_event *ev, void *data)
+{
+    FILE *out = data;
+    char month[8] = "";
+    char details[512];
+    struct tm tm;
+    time_t when = (time_t)ev->timestamp;
+
+    if (localtime_r(&when, &tm) == NULL)
+        memset(&tm, 0, sizeof(tm));
+    strftime(month, sizeof(month), "%b", &tm);
+    vrmr_event_details(ev, details, sizeof(details));
+
+    if (fprintf(out,
+                "%s %2d %02d:%02d:%02d: %s service %s from %s to %s, "
+                "prefix: \"%s\" %s\n",
+                month, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+                ev->action, ev->ser_name, ev->from_name, ev->to_name,
+                ev->prefix, details) < 0)
+        return (-1);
+    return (0);
+}
+
+/** \brief run a query against the traffic archive
+ *
+ *  Prints the matching records to stdout in the format of the traffic log.
+ *  With 'searchlog' the output ends with the same status lines as
+ *  vuurmuur-searchlog.sh prints, so vuurmuur_conf can use either.
+ *
+ *  \retval 0 ok
+ *  \retval -1 error
+ */
+int query_archive(
+        const struct vrmr_config *cnf, const char *query, int searchlog)
+{
+    struct vrmr_archive_filter filter;
+    char dir[PATH_MAX];
+
+    assert(cnf && query);
+
+    if (vrmr_archive_filter_parse(query, &filter) < 0) {
+        if (searchlog)
+            fprintf(stdout, "SL:ERROR: invalid query '%s'\n", query);
+        else
+            fprintf(stderr,
+                    "Error: invalid query '%s'. Use terms like ip:<address> "
+                    "zone:<name> service:<name> action:<action> "
+                    "since:<time> until:<time>\n",
+                    query);
+        return (-1);
+    }
+
+    if (query_archive_dir(cnf, dir, sizeof(dir)) < 0 ||
+            vrmr_archive_query(dir, &filter, query_print, stdout) < 0) {
+        if (searchlog)
+            fprintf(stdout, "SL:ERROR: searching the archive failed, see "
+                            "error.log\n");
+        else
+            fprintf(stderr, "Error: searching the archive failed, see "
+                            "error.log\n");
+        return (-1);
+    }
+
+    if (searchlog)
+        fprintf(stdout, "SL:EOF: search done\n");
+    return (fflush(stdout) == 0 ? 0 : -1);
+}
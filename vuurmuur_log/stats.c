@@ -23,8 +23,12 @@
 
 #include "vuurmuur_log.h"
 #include "stats.h"
+#include "pipeline.h"
+#include "aggregate.h"
 
-void show_stats(struct logcounters *c)
+#include <inttypes.h>
+
+void show_stats(struct logcounters *c, const struct vrmr_name_cache *nc)
 {
     fprintf(stdout, "\nStatistics:\n");
 
@@ -44,20 +48,183 @@ void show_stats(struct logcounters *c)
     fprintf(stdout, "UDP         : %u\n", c->udp);
     fprintf(stdout, "ICMP        : %u\n", c->icmp);
     fprintf(stdout, "Other       : %u\n", c->other_proto);
+
+    fprintf(stdout, "\nLost:\n");
+    fprintf(stdout, "NFLOG       : %u (overruns: %u)\n", c->nflog_lost,
+            c->nflog_overruns);
+    fprintf(stdout, "Conntrack   : overruns: %u\n", c->conntrack_overruns);
+
+    uint64_t lookups = nc->hits + nc->misses;
+    fprintf(stdout, "\nName cache:\n");
+    fprintf(stdout, "Lookups     : %" PRIu64 " (hits: %" PRIu64 ", %u%%)\n",
+            lookups, nc->hits,
+            lookups ? (unsigned int)((nc->hits * 100) / lookups) : 0);
+    fprintf(stdout, "Evictions   : %" PRIu64 " (flushes: %" PRIu64 ")\n",
+            nc->evictions, nc->flushes);
     return;
 }
 
+void show_pipeline_stats(const struct pipeline_stats *ps)
+{
+    fprintf(stdout, "\nPipeline:\n");
+    fprintf(stdout, "Received    : %" PRIu64 " (dropped: %" PRIu64 ")\n",
+            ps->received, ps->dropped);
+    fprintf(stdout, "Annotated   : %" PRIu64 " (queue max: %u)\n",
+            ps->annotated, ps->annotate_max_depth);
+    fprintf(stdout, "Written     : %" PRIu64 " (queue max: %u, stalls: %" PRIu64
+                    ")\n",
+            ps->written, ps->write_max_depth, ps->write_stalls);
+}
+
+void show_aggregate_stats(const struct aggregate *agg)
+{
+    fprintf(stdout, "\nAggregation:\n");
+    fprintf(stdout, "Suppressed  : %" PRIu64 " (summaries: %" PRIu64
+                    ", evictions: %" PRIu64 ")\n",
+            agg->suppressed, agg->summaries, agg->evictions);
+}
+
+/* for the counters of the annotate thread */
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+/** \brief copy the counters the metrics are written from
+ *
+ *  Called by the main thread, while the annotate thread keeps updating
+ *  some of the counters.
+ */
+void take_metrics_snapshot(struct metrics_snapshot *snap,
+        const struct logcounters *c, const struct vrmr_name_cache *nc,
+        const struct aggregate *agg)
+{
+    snap->nflog_records = c->nflog_records;
+    snap->conntrack_new = c->conntrack_new;
+    snap->conntrack_destroy = c->conntrack_destroy;
+    snap->nflog_lost = c->nflog_lost;
+    snap->nflog_overruns = c->nflog_overruns;
+    snap->conntrack_overruns = c->conntrack_overruns;
+
+    snap->accept = LOAD(c->accept);
+    snap->drop = LOAD(c->drop);
+    snap->reject = LOAD(c->reject);
+    snap->queue = LOAD(c->queue);
+    snap->other_match = LOAD(c->other_match);
+    snap->invalid_loglines = LOAD(c->invalid_loglines);
+    snap->name_cache_hits = LOAD(nc->hits);
+    snap->name_cache_misses = LOAD(nc->misses);
+    snap->name_cache_evictions = LOAD(nc->evictions);
+    snap->aggregate_suppressed = LOAD(agg->suppressed);
+    snap->aggregate_summaries = LOAD(agg->summaries);
+
+    pipeline_get_stats(&snap->pipeline);
+}
+
+/** \brief write the metrics of vuurmuur_log from a snapshot */
+void write_metrics(struct vrmr_metrics *m, const struct metrics_snapshot *s)
+{
+    const struct pipeline_stats *ps = &s->pipeline;
+
+    vrmr_metrics_help(m, "vuurmuur_log_records_total", "counter",
+            "Records received from the kernel.");
+    vrmr_metrics_u64(m, "vuurmuur_log_records_total", "source=\"nflog\"",
+            s->nflog_records);
+    vrmr_metrics_u64(m, "vuurmuur_log_records_total",
+            "source=\"conntrack\",event=\"new\"", s->conntrack_new);
+    vrmr_metrics_u64(m, "vuurmuur_log_records_total",
+            "source=\"conntrack\",event=\"destroy\"", s->conntrack_destroy);
+
+    vrmr_metrics_help(m, "vuurmuur_log_actions_total", "counter",
+            "Logged packets by action.");
+    vrmr_metrics_u64(
+            m, "vuurmuur_log_actions_total", "action=\"accept\"", s->accept);
+    vrmr_metrics_u64(
+            m, "vuurmuur_log_actions_total", "action=\"drop\"", s->drop);
+    vrmr_metrics_u64(
+            m, "vuurmuur_log_actions_total", "action=\"reject\"", s->reject);
+    vrmr_metrics_u64(
+            m, "vuurmuur_log_actions_total", "action=\"nfqueue\"", s->queue);
+    vrmr_metrics_u64(m, "vuurmuur_log_actions_total", "action=\"other\"",
+            s->other_match);
+
+    vrmr_metrics_help(m, "vuurmuur_log_invalid_records_total", "counter",
+            "Records that could not be annotated.");
+    vrmr_metrics_u64(m, "vuurmuur_log_invalid_records_total", NULL,
+            s->invalid_loglines);
+
+    vrmr_metrics_help(m, "vuurmuur_log_netlink_lost_total", "counter",
+            "Messages the kernel could not deliver to us.");
+    vrmr_metrics_u64(m, "vuurmuur_log_netlink_lost_total", "source=\"nflog\"",
+            s->nflog_lost);
+    vrmr_metrics_help(m, "vuurmuur_log_netlink_overruns_total", "counter",
+            "Receive buffer overruns of the netlink sockets.");
+    vrmr_metrics_u64(m, "vuurmuur_log_netlink_overruns_total",
+            "source=\"nflog\"", s->nflog_overruns);
+    vrmr_metrics_u64(m, "vuurmuur_log_netlink_overruns_total",
+            "source=\"conntrack\"", s->conntrack_overruns);
+
+    vrmr_metrics_help(m, "vuurmuur_log_pipeline_dropped_total", "counter",
+            "Records dropped because the pipeline was full.");
+    vrmr_metrics_u64(
+            m, "vuurmuur_log_pipeline_dropped_total", NULL, ps->dropped);
+    vrmr_metrics_help(m, "vuurmuur_log_pipeline_records_total", "counter",
+            "Records passed by each pipeline stage.");
+    vrmr_metrics_u64(m, "vuurmuur_log_pipeline_records_total",
+            "stage=\"receive\"", ps->received);
+    vrmr_metrics_u64(m, "vuurmuur_log_pipeline_records_total",
+            "stage=\"annotate\"", ps->annotated);
+    vrmr_metrics_u64(m, "vuurmuur_log_pipeline_records_total",
+            "stage=\"write\"", ps->written);
+    vrmr_metrics_help(m, "vuurmuur_log_queue_depth", "gauge",
+            "Entries waiting in the pipeline queues.");
+    vrmr_metrics_u64(m, "vuurmuur_log_queue_depth", "queue=\"annotate\"",
+            ps->annotate_depth);
+    vrmr_metrics_u64(m, "vuurmuur_log_queue_depth", "queue=\"write\"",
+            ps->write_depth);
+    vrmr_metrics_help(m, "vuurmuur_log_queue_max_depth", "gauge",
+            "Highest number of entries seen in the pipeline queues.");
+    vrmr_metrics_u64(m, "vuurmuur_log_queue_max_depth", "queue=\"annotate\"",
+            ps->annotate_max_depth);
+    vrmr_metrics_u64(m, "vuurmuur_log_queue_max_depth", "queue=\"write\"",
+            ps->write_max_depth);
+    vrmr_metrics_help(m, "vuurmuur_log_write_stalls_total", "counter",
+            "Times the annotate stage waited for the write stage.");
+    vrmr_metrics_u64(m, "vuurmuur_log_write_stalls_total", NULL,
+            ps->write_stalls);
+
+    vrmr_metrics_help(m, "vuurmuur_log_name_cache_lookups_total", "counter",
+            "Zone and service name lookups by result.");
+    vrmr_metrics_u64(m, "vuurmuur_log_name_cache_lookups_total",
+            "result=\"hit\"", s->name_cache_hits);
+    vrmr_metrics_u64(m, "vuurmuur_log_name_cache_lookups_total",
+            "result=\"miss\"", s->name_cache_misses);
+    vrmr_metrics_help(m, "vuurmuur_log_name_cache_evictions_total", "counter",
+            "Entries evicted from the name cache.");
+    vrmr_metrics_u64(m, "vuurmuur_log_name_cache_evictions_total", NULL,
+            s->name_cache_evictions);
+
+    vrmr_metrics_help(m, "vuurmuur_log_aggregate_suppressed_total", "counter",
+            "Repeated log lines that were not written.");
+    vrmr_metrics_u64(m, "vuurmuur_log_aggregate_suppressed_total", NULL,
+            s->aggregate_suppressed);
+    vrmr_metrics_help(m, "vuurmuur_log_aggregate_summaries_total", "counter",
+            "Summary lines written for repeated log lines.");
+    vrmr_metrics_u64(m, "vuurmuur_log_aggregate_summaries_total", NULL,
+            s->aggregate_summaries);
+}
+
+/* for the counters the main thread reads while we update them */
+#define INC(x) __atomic_fetch_add(&(x), 1, __ATOMIC_RELAXED)
+
 void upd_action_ctrs(char *action, struct logcounters *c)
 {
     /* ACTION counters */
     if (strcmp(action, "DROP") == 0)
-        c->drop++;
+        INC(c->drop);
     else if (strcmp(action, "ACCEPT") == 0)
-        c->accept++;
+        INC(c->accept);
     else if (strcmp(action, "REJECT") == 0)
-        c->reject++;
+        INC(c->reject);
     else if (strcmp(action, "NFQUEUE") == 0)
-        c->queue++;
+        INC(c->queue);
     else
-        c->other_match++;
+        INC(c->other_match);
 }
@@ -39,9 +39,56 @@ struct logcounters {
     uint32_t invalid_loglines;
 
     uint32_t total;
+
+    /* netlink intake */
+    uint32_t nflog_overruns;     /* ENOBUFS on the nflog socket */
+    uint32_t nflog_lost;         /* packets missing from the sequence */
+    uint32_t conntrack_overruns; /* ENOBUFS on the conntrack socket */
+
+    /* records received, updated by the main thread */
+    uint64_t nflog_records;
+    uint64_t conntrack_new;
+    uint64_t conntrack_destroy;
+};
+
+#include "pipeline.h"
+
+/* the counters the metrics are written from. The main thread takes it,
+ * the metrics thread writes it out, see metrics.c */
+struct metrics_snapshot {
+    /* main thread */
+    uint64_t nflog_records;
+    uint64_t conntrack_new;
+    uint64_t conntrack_destroy;
+    uint32_t nflog_lost;
+    uint32_t nflog_overruns;
+    uint32_t conntrack_overruns;
+
+    /* annotate thread */
+    uint32_t accept;
+    uint32_t drop;
+    uint32_t reject;
+    uint32_t queue;
+    uint32_t other_match;
+    uint32_t invalid_loglines;
+    uint64_t name_cache_hits;
+    uint64_t name_cache_misses;
+    uint64_t name_cache_evictions;
+    uint64_t aggregate_suppressed;
+    uint64_t aggregate_summaries;
+
+    struct pipeline_stats pipeline;
 };
 
-void show_stats(struct logcounters *);
+struct aggregate;
+
+void show_stats(struct logcounters *, const struct vrmr_name_cache *);
+void show_pipeline_stats(const struct pipeline_stats *);
+void show_aggregate_stats(const struct aggregate *);
+void take_metrics_snapshot(struct metrics_snapshot *,
+        const struct logcounters *, const struct vrmr_name_cache *,
+        const struct aggregate *);
+void write_metrics(struct vrmr_metrics *, const struct metrics_snapshot *);
 void upd_action_ctrs(char *action, struct logcounters *c);
 
 #endif /* __STATS_H__ */
@@ -103,6 +103,7 @@ int ipc_setup(int *shm_id, struct vrmr_shm_table **shm_table)
                 (*shm_table)->sem_id = sem_id;
                 (*shm_table)->backend_changed = 0;
                 (*shm_table)->reload_result = VRMR_RR_READY;
+                (*shm_table)->event_ring_shm_id = -1;
 
                 vrmr_unlock(sem_id);
             }
@@ -133,6 +134,41 @@ int ipc_destroy(int shm_id)
     return (0);
 }
 
+/** \brief create the live event ring and announce it in the shm table
+ *
+ *  Not fatal: without the ring vuurmuur_conf falls back to reading the
+ *  logfiles.
+ *
+ *  \retval 0 ok
+ *  \retval -1 error
+ */
+int ipc_event_ring_setup(struct vrmr_shm_table *shm_table, int *ring_id,
+        struct vrmr_event_ring **ring)
+{
+    if (vrmr_event_ring_create(ring_id, ring) < 0) {
+        *ring_id = -1;
+        *ring = NULL;
+        return (-1);
+    }
+    vrmr_debug(LOW, "event ring created: shm_id %d.", *ring_id);
+
+    if (vrmr_lock(sem_id)) {
+        shm_table->event_ring_shm_id = *ring_id;
+        vrmr_unlock(sem_id);
+    }
+    return (0);
+}
+
+int ipc_event_ring_destroy(struct vrmr_shm_table *shm_table, int ring_id,
+        struct vrmr_event_ring *ring)
+{
+    if (vrmr_lock(sem_id)) {
+        shm_table->event_ring_shm_id = -1;
+        vrmr_unlock(sem_id);
+    }
+    return (vrmr_event_ring_destroy(ring_id, ring));
+}
+
 /**
  *  \retval 1 reload
  *  \retval 0 don't reload
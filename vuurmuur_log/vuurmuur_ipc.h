@@ -24,5 +24,9 @@ int ipc_setup(int *, struct vrmr_shm_table **);
 int ipc_destroy(int);
 int ipc_check_reload(struct vrmr_shm_table *);
 int ipc_sync(int, int *, struct vrmr_shm_table *, int *);
+int ipc_event_ring_setup(
+        struct vrmr_shm_table *, int *, struct vrmr_event_ring **);
+int ipc_event_ring_destroy(
+        struct vrmr_shm_table *, int, struct vrmr_event_ring *);
 
 #endif
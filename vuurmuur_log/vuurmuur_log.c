@@ -24,16 +24,54 @@
 #include "logfile.h"
 #include "vuurmuur_ipc.h"
 #include "conntrack.h"
+#include "logwriter.h"
+#include "pipeline.h"
+#include "query.h"
+#include "aggregate.h"
+#include "metrics.h"
 
 #include <libnfnetlink/libnfnetlink.h>
 #include <libnetfilter_log/libnetfilter_log.h>
 
+#include <inttypes.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+/* interval of the IPC/shm checks in milliseconds */
+#define IPC_CHECK_INTERVAL_MS 250
+
+/* max number of recvmmsg() calls on one nflog socket per loop iteration */
+#define NFLOG_READ_BATCHES 64
+
+/* epoll event sources. For EV_NFLOG the nflog worker is stored above
+ * EV_SOURCE_BITS */
+#define EV_SOURCE_BITS 8
+#define EV_SOURCE_MASK ((1U << EV_SOURCE_BITS) - 1)
+enum event_source {
+    EV_NFLOG = 1,
+    EV_CONNTRACK,
+    EV_SIGNAL,
+    EV_TIMER,
+    EV_FLUSH,
+};
+
 char version_string[128];
 
 /*@null@*/
 struct vrmr_shm_table *shm_table = 0;
-struct vrmr_hash_table zone_htbl;
-struct vrmr_hash_table service_htbl;
+struct vrmr_zone_index zone_idx;
+struct vrmr_service_classifier service_sc;
+/* only used by the annotate thread. Flushes itself after a reload. */
+struct vrmr_name_cache name_cache;
+/* live event ring for vuurmuur_conf, NULL if it could not be created. Only
+ * written to by the annotate thread. */
+static struct vrmr_event_ring *event_ring = NULL;
+static int event_ring_id = -1;
+/* traffic archive, written by the write thread */
+static struct vrmr_archive *archive = NULL;
+/* repeated line suppression, used by the annotate thread */
+static struct aggregate aggregate;
 static struct logcounters counters = {
         0,
         0,
@@ -51,40 +89,244 @@ static struct logcounters counters = {
         0,
 };
 static FILE *g_traffic_log = NULL;
-FILE *g_conn_new_log_fp = NULL;
-FILE *g_connections_log_fp = NULL;
+static FILE *g_conn_new_log_fp = NULL;
+static FILE *g_connections_log_fp = NULL;
+static struct logwriter traffic_log_writer;
+struct logwriter g_conn_new_log_writer;
+struct logwriter g_connections_log_writer;
 
 /*
     we put this here, because we only use it here in main.
 */
-static int sigint_count = 0;
 static int sighup_count = 0;
-static int sigterm_count = 0;
 
-static void handle_sigint(int sig ATTR_UNUSED)
+/*  block the signals we handle, so they are only delivered through the
+    signalfd. Done first thing in main, so no signal is lost between
+    startup and entering the main loop. */
+static int block_signals(sigset_t *mask)
+{
+    sigemptyset(mask);
+    sigaddset(mask, SIGINT);
+    sigaddset(mask, SIGTERM);
+    sigaddset(mask, SIGHUP);
+
+    if (sigprocmask(SIG_BLOCK, mask, NULL) == -1) {
+        vrmr_error(-1, "Error", "sigprocmask failed: %s", strerror(errno));
+        return (-1);
+    }
+    return (0);
+}
+
+static int event_add(
+        int epfd, int fd, enum event_source source, unsigned int index)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = (uint32_t)source | (index << EV_SOURCE_BITS);
+
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        vrmr_error(-1, "Error", "epoll_ctl failed: %s", strerror(errno));
+        return (-1);
+    }
+    return (0);
+}
+
+/** \brief set the receive buffer size of a socket
+ *
+ *  SO_RCVBUFFORCE is not limited by net.core.rmem_max but needs
+ *  CAP_NET_ADMIN, so fall back to SO_RCVBUF if it fails.
+ *
+ *  \retval 0 ok
+ *  \retval -1 error
+ */
+int socket_set_rcvbuf(int fd, int size)
+{
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) == 0)
+        return (0);
+
+    vrmr_debug(LOW, "SO_RCVBUFFORCE failed: %s, trying SO_RCVBUF",
+            strerror(errno));
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) == -1) {
+        vrmr_warning("Warning",
+                "setting socket receive buffer to %d failed: %s", size,
+                strerror(errno));
+        return (-1);
+    }
+    return (0);
+}
+
+/** \brief double the receive buffer of a socket after an overrun
+ *
+ *  \param[in,out] size current size, updated if the buffer was grown
+ */
+void socket_grow_rcvbuf(int fd, int *size, const char *name)
+{
+    if (*size >= NETLINK_RCVBUF_MAX)
+        return;
+
+    int new_size = *size * 2;
+    if (socket_set_rcvbuf(fd, new_size) == 0) {
+        vrmr_info("Info", "%s socket overrun, receive buffer grown to %d bytes",
+                name, new_size);
+        *size = new_size;
+    }
+}
+
+/* the time fields and the line prefix of the last second we converted.
+ * Records arrive in bursts within the same second, so most of them can skip
+ * localtime_r() and strftime(). */
+static struct {
+    time_t sec;
+    char month[4];
+    int day;
+    int hour;
+    int minute;
+    int second;
+    char prefix[24]; /* "Mmm dd hh:mm:ss:" */
+} time_cache = {.sec = -1};
+
+/** \brief set the time fields of a record to 'when'
+ *
+ *  \return the formatted "Mmm dd hh:mm:ss:" line prefix for 'when'
+ */
+const char *log_record_set_time(struct vrmr_log_record *lr, time_t when)
 {
-    sigint_count = 1;
+    if (when != time_cache.sec) {
+        struct tm tm;
+        if (localtime_r(&when, &tm) == NULL)
+            memset(&tm, 0, sizeof(tm));
+
+        strftime(time_cache.month, sizeof(time_cache.month), "%b", &tm);
+        time_cache.day = tm.tm_mday;
+        time_cache.hour = tm.tm_hour;
+        time_cache.minute = tm.tm_min;
+        time_cache.second = tm.tm_sec;
+        snprintf(time_cache.prefix, sizeof(time_cache.prefix),
+                "%s %2d %02d:%02d:%02d:", time_cache.month, tm.tm_mday,
+                tm.tm_hour, tm.tm_min, tm.tm_sec);
+        time_cache.sec = when;
+    }
+
+    lr->timestamp = when;
+    memcpy(lr->month, time_cache.month, sizeof(lr->month));
+    lr->day = time_cache.day;
+    lr->hour = time_cache.hour;
+    lr->minute = time_cache.minute;
+    lr->second = time_cache.second;
+    return (time_cache.prefix);
 }
 
-static void handle_sigterm(int sig ATTR_UNUSED)
+/*  set_flush_timer
+
+    Arms the log flush timer to fire every 'interval_ms'. An interval of 0
+    disarms it: the log writers then write every line right away.
+
+    Returncodes:
+         0: ok
+        -1: error
+*/
+static int set_flush_timer(int flushfd, unsigned int interval_ms)
 {
-    sigterm_count = 1;
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_interval.tv_sec = interval_ms / 1000;
+    its.it_interval.tv_nsec = (long)(interval_ms % 1000) * 1000000L;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(flushfd, 0, &its, NULL) == -1) {
+        vrmr_error(-1, "Error", "timerfd_settime failed: %s", strerror(errno));
+        return (-1);
+    }
+    return (0);
 }
 
-static void handle_sighup(int sig ATTR_UNUSED)
+/*  setup_event_loop
+
+    Creates the epoll instance with the NFLOG sockets of all the nflog
+    workers and the conntrack socket, a
+    signalfd for the blocked signals in 'mask', a timerfd for the IPC
+    checks and a timerfd to flush the logs.
+
+    Returncodes:
+         0: ok
+        -1: error
+*/
+static int setup_event_loop(const struct vrmr_config *cnf,
+        const sigset_t *mask, int *epfd, int *sigfd, int *timerfd,
+        int *flushfd)
 {
-    sighup_count = 1;
+    struct itimerspec its;
+
+    if ((*epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        vrmr_error(-1, "Error", "epoll_create1 failed: %s", strerror(errno));
+        return (-1);
+    }
+
+    if ((*sigfd = signalfd(-1, mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1) {
+        vrmr_error(-1, "Error", "signalfd failed: %s", strerror(errno));
+        return (-1);
+    }
+
+    *timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (*timerfd == -1) {
+        vrmr_error(-1, "Error", "timerfd_create failed: %s", strerror(errno));
+        return (-1);
+    }
+    memset(&its, 0, sizeof(its));
+    its.it_interval.tv_sec = IPC_CHECK_INTERVAL_MS / 1000;
+    its.it_interval.tv_nsec = (IPC_CHECK_INTERVAL_MS % 1000) * 1000000L;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(*timerfd, 0, &its, NULL) == -1) {
+        vrmr_error(-1, "Error", "timerfd_settime failed: %s", strerror(errno));
+        return (-1);
+    }
+
+    *flushfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (*flushfd == -1) {
+        vrmr_error(-1, "Error", "timerfd_create failed: %s", strerror(errno));
+        return (-1);
+    }
+    if (set_flush_timer(*flushfd, cnf->log_flush_interval) < 0)
+        return (-1);
+
+    for (unsigned int i = 0; i < get_nflog_workers(); i++) {
+        if (event_add(*epfd, get_nflog_fd(i), EV_NFLOG, i) < 0)
+            return (-1);
+    }
+    if (event_add(*epfd, conntrack_get_fd(), EV_CONNTRACK, 0) < 0 ||
+            event_add(*epfd, *sigfd, EV_SIGNAL, 0) < 0 ||
+            event_add(*epfd, *timerfd, EV_TIMER, 0) < 0 ||
+            event_add(*epfd, *flushfd, EV_FLUSH, 0) < 0)
+        return (-1);
+
+    return (0);
 }
 
-static void setup_signal_handler(int sig, void (*handler)(int))
+/*  read all pending signals from the signalfd
+
+    Returncodes:
+         1: quit requested
+         0: ok
+*/
+static int handle_signals(int sigfd)
 {
-    struct sigaction action;
+    struct signalfd_siginfo si;
+    int quit = 0;
 
-    action.sa_handler = handler;
-    sigemptyset(&(action.sa_mask));
-    sigaddset(&(action.sa_mask), sig);
-    action.sa_flags = 0;
-    sigaction(sig, &action, 0);
+    while (read(sigfd, &si, sizeof(si)) == (ssize_t)sizeof(si)) {
+        switch (si.ssi_signo) {
+            case SIGHUP:
+                sighup_count = 1;
+                break;
+            case SIGINT:
+            case SIGTERM:
+                quit = 1;
+                break;
+        }
+    }
+    return (quit);
 }
 
 static void print_help(void)
@@ -98,40 +340,185 @@ static void print_help(void)
     fprintf(stdout, " -c, --configfile\t\tuse the given configfile\n");
     fprintf(stdout, " -d, --debug\t\t\tenable debugging (1 = low, 3 = high)\n");
     fprintf(stdout, " -K, --killme\t\t\tkill running daemon\n");
+    fprintf(stdout, " -q, --query <terms>\t\tsearch the traffic archive\n");
+    fprintf(stdout, "     --searchlog\t\tquery output for vuurmuur_conf\n");
     fprintf(stdout, " -V, --version\t\t\tgives the version\n");
     fprintf(stdout, "\n");
     exit(EXIT_SUCCESS);
 }
 
-/* process one line/record */
+/* process one line/record: queue it for the annotate thread */
 int process_logrecord(struct vrmr_log_record *log_record)
 {
-    char line_out[1024] = "";
+    /* a full pipeline is counted there */
+    (void)pipeline_submit(PIPELINE_TRAFFIC, log_record);
+    return 0;
+}
 
-    int result =
-            vrmr_log_record_get_names(log_record, &zone_htbl, &service_htbl);
-    switch (result) {
-        case -1:
-            vrmr_debug(NONE, "vrmr_log_record_get_names returned -1");
-            exit(EXIT_FAILURE);
-            break;
-        case 0:
-            counters.invalid_loglines++;
-            break;
-        default:
-            if (vrmr_log_record_build_line(
-                        log_record, line_out, sizeof(line_out)) < 0) {
-                vrmr_debug(NONE, "Could not build output line");
-            } else {
-                upd_action_ctrs(log_record->action, &counters);
-
-                fprintf(g_traffic_log, "%s", line_out);
-                fflush(g_traffic_log);
-            }
-            break;
+/** \internal
+ *
+ *  \brief build the log line for a record, in the annotate thread
+ *
+ *  The counters updated here are only touched by the annotate thread.
+ */
+static struct logwriter *annotate_record(enum pipeline_source source,
+        struct vrmr_log_record *log_record, char *line_out, size_t size)
+{
+    struct logwriter *lw = NULL;
+    enum vrmr_event_type type = VRMR_EVENT_TRAFFIC;
+
+    if (source == PIPELINE_CONN) {
+        lw = conntrack_annotate(log_record, line_out, size);
+        type = log_record->conn_rec.type == VRMR_LOG_CONN_COMPLETED
+                       ? VRMR_EVENT_CONN_COMPLETED
+                       : VRMR_EVENT_CONN_NEW;
+    } else {
+        int result = vrmr_log_record_get_names(
+                log_record, &zone_idx, &service_sc, &name_cache);
+        switch (result) {
+            case -1:
+                vrmr_debug(NONE, "vrmr_log_record_get_names returned -1");
+                exit(EXIT_FAILURE);
+                break;
+            case 0:
+                __atomic_fetch_add(
+                        &counters.invalid_loglines, 1, __ATOMIC_RELAXED);
+                break;
+            default:
+                if (vrmr_log_record_build_line(log_record, line_out, size) <
+                        0) {
+                    vrmr_debug(NONE, "Could not build output line");
+                } else {
+                    upd_action_ctrs(log_record->action, &counters);
+                    lw = &traffic_log_writer;
+                }
+                break;
+        }
     }
 
-    return 0;
+    if (lw != NULL && (event_ring != NULL || archive != NULL)) {
+        struct vrmr_event ev;
+        vrmr_event_from_log_record(log_record, type, &ev);
+        if (event_ring != NULL)
+            vrmr_event_ring_publish(event_ring, &ev);
+        if (archive != NULL)
+            pipeline_archive(&ev);
+    }
+    /* the ring and the archive get every record, only the logs are
+     * aggregated */
+    if (lw != NULL && aggregate_record(&aggregate, source, lw, log_record,
+                              pipeline_emit) == 1)
+        lw = NULL;
+    return (lw);
+}
+
+/** \internal
+ *
+ *  \brief add an event to the archive, in the write thread
+ */
+static void archive_write(const struct vrmr_event *ev)
+{
+    /* errors are reported once per segment by the archive */
+    if (archive != NULL)
+        (void)vrmr_archive_append(archive, ev);
+}
+
+/** \internal
+ *
+ *  \brief periodic work in the annotate thread
+ */
+static void annotate_tick(void)
+{
+    aggregate_expire(&aggregate, time(NULL), pipeline_emit);
+}
+
+/** \internal
+ *
+ *  \brief write a summary line straight to the log
+ *
+ *  Only when the pipeline is paused or stopped.
+ */
+static void aggregate_write(struct logwriter *lw, const char *line)
+{
+    (void)logwriter_write(lw, line, strlen(line));
+}
+
+/** \internal
+ *
+ *  \brief setup aggregation if it is enabled
+ *
+ *  Only call this when the annotate thread is not running or paused.
+ */
+static void aggregate_setup(const struct vrmr_config *cnf)
+{
+    if (aggregate_init(&aggregate, cnf->log_aggregate_window) < 0)
+        vrmr_warning("Warning", "log lines are not aggregated");
+}
+
+/** \internal
+ *
+ *  \brief open the traffic archive if it is enabled
+ *
+ *  Not having an archive is not fatal, the logfiles are still written. Only
+ *  call this when the annotate thread is not running or paused.
+ */
+static void archive_setup(const struct vrmr_config *cnf)
+{
+    char dir[PATH_MAX];
+
+    if (!cnf->log_archive)
+        return;
+
+    if (query_archive_dir(cnf, dir, sizeof(dir)) < 0)
+        return;
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+        vrmr_warning("Warning",
+                "creating '%s' failed: %s, the traffic log is not archived",
+                dir, strerror(errno));
+        return;
+    }
+    (void)vrmr_archive_open(&archive, dir, cnf->log_archive_days);
+}
+
+/** \internal
+ *
+ *  \brief give the metrics thread the current counters
+ *
+ *  Done at every IPC check, so the metrics are at most
+ *  IPC_CHECK_INTERVAL_MS old.
+ */
+static void metrics_refresh(void)
+{
+    struct metrics_snapshot snap;
+
+    if (!metrics_running())
+        return;
+
+    take_metrics_snapshot(&snap, &counters, &name_cache, &aggregate);
+    metrics_update(&snap);
+}
+
+/** \internal
+ *
+ *  \brief start or stop serving the metrics as the config says
+ *
+ *  The metrics are not essential, so failing to open the socket is only
+ *  reported.
+ */
+static void metrics_setup(const struct vrmr_config *cnf)
+{
+    if (!cnf->metrics) {
+        metrics_stop();
+        return;
+    }
+    if (metrics_running())
+        return;
+
+    if (metrics_start(METRICS_SOCKET) < 0) {
+        vrmr_warning("Warning", "metrics are not available");
+        return;
+    }
+    metrics_refresh();
 }
 
 /** \internal
@@ -140,6 +527,10 @@ int process_logrecord(struct vrmr_log_record *log_record)
  */
 static int conntrack_open_logs(struct vrmr_config *cnf)
 {
+    /* don't let buffered lines end up in the new files */
+    (void)logwriter_flush(&g_conn_new_log_writer);
+    (void)logwriter_flush(&g_connections_log_writer);
+
     if (g_conn_new_log_fp != NULL)
         fclose(g_conn_new_log_fp);
     g_conn_new_log_fp = fopen(cnf->connnewlog_location, "a");
@@ -158,6 +549,10 @@ static int conntrack_open_logs(struct vrmr_config *cnf)
         return (-1);
     }
 
+    logwriter_attach(&g_conn_new_log_writer, g_conn_new_log_fp,
+            cnf->log_flush_interval == 0);
+    logwriter_attach(&g_connections_log_writer, g_connections_log_fp,
+            cnf->log_flush_interval == 0);
     return (0);
 }
 
@@ -168,8 +563,9 @@ int main(int argc, char *argv[])
     int result;
     pid_t pid;
     int optch;
-    static char optstring[] = "hc:vnd:VsKN";
-    int verbose = 0, nodaemon = 0;
+    static char optstring[] = "hc:vnd:VsKNq:";
+    int verbose = 0, nodaemon = 0, searchlog = 0;
+    const char *query = NULL;
     struct option prog_opts[] = {
             {"help", no_argument, NULL, 'h'},
             {"verbose", no_argument, &verbose, 1},
@@ -178,30 +574,38 @@ int main(int argc, char *argv[])
             {"debug", required_argument, NULL, 'd'},
             {"killme", required_argument, NULL, 'K'},
             {"version", no_argument, NULL, 'V'},
+            {"query", required_argument, NULL, 'q'},
+            {"searchlog", no_argument, &searchlog, 1},
             {0, 0, 0, 0},
     };
     int option_index = 0;
     char *sscanf_str = NULL;
 
-    struct vrmr_log_record logrule;
     struct vrmr_log_record logconn;
     int debug_level = NONE;
 
+    /* flushed by the write thread of the pipeline */
+    struct logwriter *log_writers[] = {&traffic_log_writer,
+            &g_conn_new_log_writer, &g_connections_log_writer, NULL};
+
     /* shm, sem stuff */
     int shm_id;
     int reload = 0;
     char quit = 0;
 
+    /* event loop */
+    sigset_t sigmask;
+    int epfd = -1, sigfd = -1, timerfd = -1, flushfd = -1;
+
     snprintf(version_string, sizeof(version_string),
             "%s (using libvuurmuur %s)", VUURMUUR_VERSION,
             libvuurmuur_get_version());
 
     vrmr_init(&vctx, "vuurmuur_log");
 
-    /* init signals */
-    setup_signal_handler(SIGINT, handle_sigint);
-    setup_signal_handler(SIGTERM, handle_sigterm);
-    setup_signal_handler(SIGHUP, handle_sighup);
+    /* init signals: they are handled in the main loop */
+    if (block_signals(&sigmask) < 0)
+        exit(EXIT_FAILURE);
 
     /* process the options */
     while ((optch = getopt_long(
@@ -270,7 +674,28 @@ int main(int argc, char *argv[])
                 fprintf(stdout, "Vuurmuur_log %s\n", version_string);
                 fprintf(stdout, "%s\n", VUURMUUR_COPYRIGHT);
                 exit(EXIT_SUCCESS);
+
+            case 'q':
+                query = optarg;
+                break;
+        }
+    }
+
+    /* a query only reads the archive, so it can run next to the daemon */
+    if (query != NULL) {
+        if (vrmr_init_config(&vctx.conf) < VRMR_CNF_OK) {
+            vrmr_error(-1, "Error", "initializing the config failed.");
+            exit(EXIT_FAILURE);
         }
+        /* keep stdout for the results */
+        vrprint.error = vrmr_logprint_error;
+        vrprint.warning = vrmr_logprint_warning;
+        vrprint.info = vrmr_logprint_info;
+        vrprint.debug = vrmr_logprint_debug;
+
+        if (query_archive(&vctx.conf, query, searchlog) < 0)
+            exit(EXIT_FAILURE);
+        exit(EXIT_SUCCESS);
     }
 
     /* check if the pidfile already exists */
@@ -301,14 +726,28 @@ int main(int argc, char *argv[])
     vrmr_audit("Vuurmuur_log %s started by user %s.", version_string,
             vctx.user_data.realusername);
 
+    /* the record is cleared once here, after this only the fields that
+     * change per connection are reset */
+    memset(&logconn, 0, sizeof(logconn));
+
+    /* the writers have to be set up before any log file is attached to
+     * them */
+    if (logwriter_init(&traffic_log_writer, "traffic log",
+                LOGWRITER_BUFSIZE) < 0 ||
+            logwriter_init(&g_conn_new_log_writer, "new connections log",
+                    LOGWRITER_BUFSIZE) < 0 ||
+            logwriter_init(&g_connections_log_writer, "connections log",
+                    LOGWRITER_BUFSIZE) < 0)
+        exit(EXIT_FAILURE);
+
     /* Setup nflog after vrmr_init_config as and logging as we need &conf in
      * subscribe_nflog() */
     vrmr_debug(NONE, "Setting up nflog");
-    if (subscribe_nflog(&vctx.conf, &logrule) < 0) {
+    if (subscribe_nflog(&vctx.conf, &counters) < 0) {
         vrmr_error(-1, "Error", "could not set up nflog subscription");
         exit(EXIT_FAILURE);
     }
-    if (conntrack_subscribe(&logconn) < 0) {
+    if (conntrack_subscribe(&logconn, &counters, &vctx.conf) < 0) {
         vrmr_error(-1, "Error", "could not set up conntrack subscription");
         exit(EXIT_FAILURE);
     }
@@ -326,6 +765,8 @@ int main(int argc, char *argv[])
         vrmr_error(-1, "Error", "opening logfiles failed.");
         exit(EXIT_FAILURE);
     }
+    logwriter_attach(&traffic_log_writer, g_traffic_log,
+            vctx.conf.log_flush_interval == 0);
 
     /* load the services into memory */
     if (vrmr_services_load(&vctx, &vctx.services, &vctx.reg) == -1)
@@ -353,21 +794,22 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    vrmr_info("Info", "Creating hash-table for the zones...");
-    if (vrmr_init_zonedata_hashtable(vctx.zones.list.len * 3, &vctx.zones.list,
-                vrmr_hash_ipaddress, vrmr_compare_ipaddress, &zone_htbl) < 0) {
-        vrmr_error(-1, "Error", "vrmr_init_zonedata_hashtable failed.");
+    vrmr_info("Info", "Creating index for the zones...");
+    if (vrmr_zone_index_build(&zone_idx, &vctx.zones.list) < 0) {
+        vrmr_error(-1, "Error", "vrmr_zone_index_build failed.");
         exit(EXIT_FAILURE);
     }
 
-    vrmr_info("Info", "Creating hash-table for the services...");
-    if (vrmr_init_services_hashtable(vctx.services.list.len * 500,
-                &vctx.services.list, vrmr_hash_port, vrmr_compare_ports,
-                &service_htbl) < 0) {
-        vrmr_error(-1, "Error", "vrmr_init_services_hashtable failed.");
+    vrmr_info("Info", "Creating classifier for the services...");
+    if (vrmr_service_classifier_build(&service_sc, &vctx.services.list) < 0) {
+        vrmr_error(-1, "Error", "vrmr_service_classifier_build failed.");
         exit(EXIT_FAILURE);
     }
 
+    /* without the cache every record is looked up */
+    if (vrmr_name_cache_init(&name_cache, VRMR_NAME_CACHE_SIZE) < 0)
+        vrmr_warning("Warning", "no name cache, annotating will be slower");
+
     if (nodaemon == 0) {
         if (daemon(1, 1) != 0) {
             vrmr_error(-1, "Error", "daemon() failed: %s", strerror(errno));
@@ -381,29 +823,85 @@ int main(int argc, char *argv[])
     if (vrmr_create_pidfile(PIDFILE, shm_id) < 0)
         exit(EXIT_FAILURE);
 
-    if (sigint_count || sigterm_count)
-        quit = 1;
+    if (ipc_event_ring_setup(shm_table, &event_ring_id, &event_ring) < 0)
+        vrmr_warning("Warning", "no live event ring, vuurmuur_conf will "
+                                "read the logfiles instead");
+
+    archive_setup(&vctx.conf);
+    aggregate_setup(&vctx.conf);
+
+    /* start the threads after daemon(), they would not survive the fork. The
+     * signals are blocked already, so they are only delivered here. */
+    if (pipeline_start(
+                annotate_record, annotate_tick, archive_write, log_writers) < 0)
+        exit(EXIT_FAILURE);
+
+    if (setup_event_loop(
+                &vctx.conf, &sigmask, &epfd, &sigfd, &timerfd, &flushfd) < 0)
+        exit(EXIT_FAILURE);
+    metrics_setup(&vctx.conf);
 
     /* enter the main loop */
     while (quit == 0) {
-        reload = ipc_check_reload(shm_table);
-        if (reload == 0) {
-            switch (conntrack_read(&logconn)) {
-                case 0:
+        struct epoll_event events[8];
+
+        int n = epoll_wait(epfd, events, 8, -1);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            vrmr_error(-1, "Error", "epoll_wait failed: %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < n; i++) {
+            unsigned int index = events[i].data.u32 >> EV_SOURCE_BITS;
+
+            switch (events[i].data.u32 & EV_SOURCE_MASK) {
+                case EV_NFLOG: {
+                    /* read a limited number of batches, so a busy group
+                     * can't starve the others. What is left is reported
+                     * again by the next epoll_wait(). */
+                    int batches = 0;
+                    while ((result = readnflog(index)) > 0 &&
+                            ++batches < NFLOG_READ_BATCHES)
+                        ;
+                    if (result == -1) {
+                        vrmr_error(-1, "Error", "could not read from nflog");
+                        exit(EXIT_FAILURE);
+                    }
                     break;
-                case -1:
+                }
+                case EV_CONNTRACK:
+                    while (conntrack_read(&logconn) > 0)
+                        ;
                     break;
-            }
-            switch (readnflog()) {
-                case -1:
-                    vrmr_error(-1, "Error", "could not read from nflog");
-                    exit(EXIT_FAILURE);
+                case EV_SIGNAL:
+                    if (handle_signals(sigfd) == 1)
+                        quit = 1;
                     break;
-                case 0:
-                    usleep(100000);
+                case EV_TIMER: {
+                    uint64_t expirations;
+                    if (read(timerfd, &expirations, sizeof(expirations)) ==
+                            (ssize_t)sizeof(expirations))
+                        reload = ipc_check_reload(shm_table);
+                    pipeline_request_tick();
+                    metrics_refresh();
                     break;
+                }
+                case EV_FLUSH: {
+                    uint64_t expirations;
+                    if (read(flushfd, &expirations, sizeof(expirations)) ==
+                            (ssize_t)sizeof(expirations))
+                        pipeline_request_flush();
+                    break;
+                }
             }
         }
+        /* wake the annotate thread once per batch of events */
+        pipeline_kick();
+
+        if (quit == 1)
+            break;
 
         /*
             hey! we received a sighup. We will reload the data.
@@ -411,13 +909,27 @@ int main(int argc, char *argv[])
         if (sighup_count || reload) {
             sighup_count = 0;
 
+            /* the annotate and write threads use the data and the logs we
+             * are about to replace. We don't read the sockets until the
+             * reload is done, so the records that arrive meanwhile wait in
+             * the socket buffers and are lost once those are full. */
+            pipeline_pause();
+
             /*
                 clean up data
             */
 
+            /* finish the archive segment, the config may change */
+            vrmr_archive_close(archive);
+            archive = NULL;
+
+            /* the names may change, so summarize what we have */
+            aggregate_flush(&aggregate, aggregate_write);
+            aggregate_cleanup(&aggregate);
+
             /* destroy hashtables */
-            vrmr_hash_cleanup(&zone_htbl);
-            vrmr_hash_cleanup(&service_htbl);
+            vrmr_zone_index_cleanup(&zone_idx);
+            vrmr_service_classifier_cleanup(&service_sc);
 
             /* destroy the ServicesList */
             vrmr_destroy_serviceslist(&vctx.services);
@@ -498,37 +1010,45 @@ int main(int argc, char *argv[])
             }
             vrmr_shm_update_progress(sem_id, &shm_table->reload_progress, 70);
 
-            vrmr_info("Info", "Creating hash-table for the zones...");
-            if (vrmr_init_zonedata_hashtable(vctx.zones.list.len * 3,
-                        &vctx.zones.list, vrmr_hash_ipaddress,
-                        vrmr_compare_ipaddress, &zone_htbl) < 0) {
-                vrmr_error(result, "Error",
-                        "vrmr_init_zonedata_hashtable failed.");
+            vrmr_info("Info", "Creating index for the zones...");
+            if (vrmr_zone_index_build(&zone_idx, &vctx.zones.list) < 0) {
+                vrmr_error(result, "Error", "vrmr_zone_index_build failed.");
                 exit(EXIT_FAILURE);
             }
             vrmr_shm_update_progress(sem_id, &shm_table->reload_progress, 80);
 
-            vrmr_info("Info", "Creating hash-table for the services...");
-            if (vrmr_init_services_hashtable(vctx.services.list.len * 500,
-                        &vctx.services.list, vrmr_hash_port, vrmr_compare_ports,
-                        &service_htbl) < 0) {
+            vrmr_info("Info", "Creating classifier for the services...");
+            if (vrmr_service_classifier_build(
+                        &service_sc, &vctx.services.list) < 0) {
                 vrmr_error(result, "Error",
-                        "vrmr_init_services_hashtable failed.");
+                        "vrmr_service_classifier_build failed.");
                 exit(EXIT_FAILURE);
             }
             vrmr_shm_update_progress(sem_id, &shm_table->reload_progress, 90);
 
+            (void)logwriter_flush(&traffic_log_writer);
             if (reopen_vuurmuurlog(&vctx.conf, &g_traffic_log) < 0) {
                 vrmr_error(-1, "Error", "re-opening logfiles failed.");
                 exit(EXIT_FAILURE);
             }
+            logwriter_attach(&traffic_log_writer, g_traffic_log,
+                    vctx.conf.log_flush_interval == 0);
             vrmr_shm_update_progress(sem_id, &shm_table->reload_progress, 92);
+            nflog_update_hostname();
             if (conntrack_open_logs(&vctx.conf) != 0) {
                 vrmr_error(
                         -1, "Error", "could not re-open connection log files");
                 exit(EXIT_FAILURE);
             }
+            /* keep the old filter if the new one can't be set */
+            (void)conntrack_setup_filter(&vctx.conf);
+            metrics_setup(&vctx.conf);
+            if (set_flush_timer(flushfd, vctx.conf.log_flush_interval) < 0)
+                exit(EXIT_FAILURE);
+            archive_setup(&vctx.conf);
+            aggregate_setup(&vctx.conf);
             vrmr_shm_update_progress(sem_id, &shm_table->reload_progress, 95);
+            pipeline_resume();
 
             /* only ok now */
             result = 0;
@@ -538,12 +1058,28 @@ int main(int argc, char *argv[])
             if (reload == 1)
                 ipc_sync(30, &result, shm_table, &reload);
         }
+    }
+
+    /* write out what is queued before the logs are closed */
+    pipeline_stop();
 
-        /* check for a signal */
-        if (sigint_count || sigterm_count)
-            quit = 1;
+    vrmr_archive_close(archive);
+    archive = NULL;
+    aggregate_flush(&aggregate, aggregate_write);
+
+    /* the annotate thread is gone, so nothing publishes anymore */
+    if (event_ring != NULL) {
+        (void)ipc_event_ring_destroy(shm_table, event_ring_id, event_ring);
+        event_ring = NULL;
     }
 
+    metrics_stop();
+    close(flushfd);
+    close(timerfd);
+    close(sigfd);
+    close(epfd);
+    unsubscribe_nflog();
+
     /*
         cleanup
     */
@@ -555,7 +1091,10 @@ int main(int argc, char *argv[])
     /* free the sscanf parser string */
     free(sscanf_str);
 
-    /* close the logfiles */
+    /* write out what is still buffered and close the logfiles */
+    logwriter_cleanup(&traffic_log_writer);
+    logwriter_cleanup(&g_conn_new_log_writer);
+    logwriter_cleanup(&g_connections_log_writer);
     if (g_traffic_log != NULL)
         fclose(g_traffic_log);
     if (g_connections_log_fp != NULL)
@@ -568,8 +1107,8 @@ int main(int argc, char *argv[])
     conntrack_disconnect();
 
     /* destroy hashtables */
-    vrmr_hash_cleanup(&zone_htbl);
-    vrmr_hash_cleanup(&service_htbl);
+    vrmr_zone_index_cleanup(&zone_idx);
+    vrmr_service_classifier_cleanup(&service_sc);
 
     /* destroy the ServicesList */
     vrmr_destroy_serviceslist(&vctx.services);
@@ -578,8 +1117,27 @@ int main(int argc, char *argv[])
     /* destroy the InterfacesList */
     vrmr_destroy_interfaceslist(&vctx.interfaces);
 
-    if (nodaemon)
-        show_stats(&counters);
+    if (counters.nflog_lost > 0 || counters.nflog_overruns > 0 ||
+            counters.conntrack_overruns > 0) {
+        vrmr_warning("Warning",
+                "lost %u nflog messages (%u overruns), %u conntrack overruns",
+                counters.nflog_lost, counters.nflog_overruns,
+                counters.conntrack_overruns);
+    }
+    struct pipeline_stats pstats;
+    pipeline_get_stats(&pstats);
+    if (pstats.dropped > 0) {
+        vrmr_warning("Warning",
+                "dropped %" PRIu64 " records, the pipeline was full",
+                pstats.dropped);
+    }
+    if (nodaemon) {
+        show_stats(&counters, &name_cache);
+        show_pipeline_stats(&pstats);
+        show_aggregate_stats(&aggregate);
+    }
+    vrmr_name_cache_cleanup(&name_cache);
+    aggregate_cleanup(&aggregate);
 
     if (vrmr_backends_unload(&vctx.conf, &vctx) < 0) {
         vrmr_error(-1, "Error", "unloading backends failed.");
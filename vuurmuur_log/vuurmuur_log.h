@@ -39,6 +39,7 @@
 #include <getopt.h>
 
 #define PIDFILE "/var/run/vuurmuur_log.pid"
+#define METRICS_SOCKET "/var/run/vuurmuur_log.metrics"
 #define SVCNAME "vuurmuur_log"
 
 /* the line starts at position 0 */
@@ -61,7 +62,15 @@
 int reopen_logfiles(FILE **, FILE **);
 int open_logfiles(const struct vrmr_config *cnf, FILE **, FILE **);
 
+/* netlink socket receive buffer: start size and the maximum it is grown to
+ * after overruns */
+#define NETLINK_RCVBUF_MIN (1 << 20)
+#define NETLINK_RCVBUF_MAX (64 << 20)
+
 int process_logrecord(struct vrmr_log_record *log_record);
+const char *log_record_set_time(struct vrmr_log_record *lr, time_t when);
+int socket_set_rcvbuf(int fd, int size);
+void socket_grow_rcvbuf(int fd, int *size, const char *name);
 
 extern char version_string[128];
 extern int sem_id;